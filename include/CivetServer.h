@@ -14,6 +14,48 @@
 #include <string>
 #include <vector>
 
+// The std::string_view based accessors require C++17.
+#if !defined(CIVETWEB_CXX_NO_STRING_VIEW) && !defined(CIVETWEB_CXX_STRING_VIEW)
+#if (__cplusplus >= 201703L)                                                   \
+    || (defined(_MSVC_LANG) && (_MSVC_LANG >= 201703L))
+#define CIVETWEB_CXX_STRING_VIEW
+#endif
+#endif
+#if defined(CIVETWEB_CXX_STRING_VIEW)
+#include <string_view>
+#endif
+
+// Registering callables (lambdas, functors) as handlers requires C++11.
+#if !defined(CIVETWEB_CXX_NO_CALLABLE_HANDLERS)                                \
+    && !defined(CIVETWEB_CXX_CALLABLE_HANDLERS)
+#if (__cplusplus >= 201103L) || (defined(_MSC_VER) && (_MSC_VER >= 1900))
+#define CIVETWEB_CXX_CALLABLE_HANDLERS
+#endif
+#endif
+#if defined(CIVETWEB_CXX_CALLABLE_HANDLERS)
+#include <cstddef>
+#include <type_traits>
+#include <utility>
+#endif
+
+// Coroutine request handlers (addAsyncRequestHandler) require C++20.
+#if !defined(CIVETWEB_CXX_NO_COROUTINES) && !defined(CIVETWEB_CXX_COROUTINES)
+#if defined(CIVETWEB_CXX_CALLABLE_HANDLERS) && defined(__cpp_impl_coroutine)
+#if defined(__has_include)
+#if __has_include(<coroutine>)
+#define CIVETWEB_CXX_COROUTINES
+#endif
+#endif
+#endif
+#endif
+#if defined(CIVETWEB_CXX_COROUTINES)
+#include <atomic>
+#include <condition_variable>
+#include <coroutine>
+#include <memory>
+#include <mutex>
+#endif
+
 #ifndef CIVETWEB_CXX_API
 #if defined(_WIN32)
 #if defined(CIVETWEB_CXX_DLL_EXPORTS)
@@ -47,6 +89,11 @@ class CIVETWEB_CXX_API CivetException : public std::runtime_error
 /**
  * Basic interface for a URI request handler.  Handlers implementations
  * must be reentrant.
+ *
+ * A handler runs on a worker thread and keeps it for its whole duration,
+ * including all time spent waiting. Handlers that wait for external
+ * events (long polling) should be coroutines instead, see
+ * CivetServer::addAsyncRequestHandler.
  */
 class CIVETWEB_CXX_API CivetHandler
 {
@@ -301,6 +348,271 @@ struct CIVETWEB_CXX_API CivetCallbacks : public mg_callbacks {
 	CivetCallbacks();
 };
 
+#if defined(CIVETWEB_CXX_COROUTINES)
+/**
+ * CivetTask
+ *
+ * Return type of coroutine request handlers, see
+ * CivetServer::addAsyncRequestHandler. The handler ends with
+ *   co_return status_code;
+ * where status_code is the return value of a request handler.
+ */
+class CivetTask
+{
+  public:
+	// Request that could not be detached: the worker thread waits
+	struct SyncState {
+		SyncState() : done(false), status(0)
+		{
+		}
+		std::mutex mutex;
+		std::condition_variable cond;
+		bool done;
+		int status;
+	};
+
+	struct promise_type {
+		promise_type() : conn(0), sync(0), request(0), status(0)
+		{
+		}
+
+		// The coroutine frame is destroyed after the final co_return
+		~promise_type()
+		{
+			if (conn != 0) {
+				mg_finish_detached_request(conn);
+			} else if (sync != 0) {
+				std::lock_guard<std::mutex> lock(sync->mutex);
+				sync->status = status;
+				sync->done = true;
+				sync->cond.notify_one();
+			}
+		}
+
+		CivetTask
+		get_return_object()
+		{
+			return CivetTask(
+			    std::coroutine_handle<promise_type>::from_promise(*this));
+		}
+
+		std::suspend_always
+		initial_suspend() noexcept
+		{
+			return std::suspend_always();
+		}
+
+		std::suspend_never
+		final_suspend() noexcept
+		{
+			return std::suspend_never();
+		}
+
+		void
+		return_value(int status_code)
+		{
+			status = status_code;
+		}
+
+		// An exception leaving the handler closes the connection
+		void
+		unhandled_exception()
+		{
+			status = 500;
+		}
+
+		struct mg_connection *conn; // Detached request (mg_detach_request)
+		SyncState *sync;
+		struct mg_connection *request;
+		std::shared_ptr<void> state; // CivetServer state of the request
+		int status;
+	};
+
+	CivetTask(CivetTask &&other) noexcept : handle(other.handle)
+	{
+		other.handle = nullptr;
+	}
+
+	~CivetTask()
+	{
+		if (handle) {
+			// Never started
+			handle.destroy();
+		}
+	}
+
+	/**
+	 * start(struct mg_connection *, SyncState *,
+	 *       const std::shared_ptr<void> &)
+	 *
+	 * Runs the coroutine until it is suspended for the first time. At the
+	 * end, either sync is signalled, or if there is none, the detached
+	 * request conn is finished. The state of the request is kept until
+	 * the end (internal helper).
+	 */
+	void
+	start(struct mg_connection *conn,
+	      SyncState *sync,
+	      const std::shared_ptr<void> &state)
+	{
+		std::coroutine_handle<promise_type> h = handle;
+		handle = nullptr;
+		h.promise().conn = (sync == 0) ? conn : 0;
+		h.promise().sync = sync;
+		h.promise().request = conn;
+		h.promise().state = state;
+		h.resume();
+	}
+
+  private:
+	explicit CivetTask(std::coroutine_handle<promise_type> h) : handle(h)
+	{
+	}
+
+	CivetTask(const CivetTask &) = delete;
+	CivetTask &operator=(const CivetTask &) = delete;
+
+	std::coroutine_handle<promise_type> handle;
+};
+
+/**
+ * CivetEvent
+ *
+ * Change of application state, which coroutine handlers wait for with
+ * CivetServer::waitFor (long polling). Any thread may call notify, e.g.
+ * the thread of a Pd patch; the waiting handlers are resumed on worker
+ * threads. The event must not be destroyed while handlers wait for it.
+ */
+class CivetEvent
+{
+  public:
+	explicit CivetEvent(CivetServer &server);
+
+	explicit CivetEvent(struct mg_context *ctx) : ctx(ctx), version(0)
+	{
+	}
+
+	/**
+	 * current()
+	 *
+	 * @returns the number of notify calls so far, to pass to waitFor
+	 */
+	unsigned long long
+	current() const
+	{
+		return version.load();
+	}
+
+	/**
+	 * notify()
+	 *
+	 * Resumes all handlers waiting for the event.
+	 *
+	 * @returns the new value of current()
+	 */
+	unsigned long long
+	notify()
+	{
+		unsigned long long v = ++version;
+		mg_async_notify(ctx, this);
+		return v;
+	}
+
+  private:
+	friend class CivetAwait;
+
+	CivetEvent(const CivetEvent &) = delete;
+	CivetEvent &operator=(const CivetEvent &) = delete;
+
+	struct mg_context *ctx;
+	std::atomic<unsigned long long> version;
+};
+
+/**
+ * CivetAwait
+ *
+ * Awaitable returned by CivetServer::sleepFor, CivetServer::readable,
+ * CivetServer::writable and CivetServer::waitFor. co_await returns 1 if
+ * the connection is ready or the event has been notified, 0 on timeout
+ * and -1 if the server is stopping.
+ */
+class CivetAwait
+{
+  public:
+	CivetAwait(struct mg_connection *conn, int events, int timeout_ms)
+	    : conn(conn), event(0), seen(0), events(events), timeout(timeout_ms),
+	      result(-1)
+	{
+	}
+
+	CivetAwait(struct mg_connection *conn,
+	           CivetEvent *event,
+	           unsigned long long seen,
+	           int timeout_ms)
+	    : conn(conn), event(event), seen(seen), events(0),
+	      timeout(timeout_ms), result(-1)
+	{
+	}
+
+	bool
+	await_ready() noexcept
+	{
+		if ((event != 0) && (event->current() != seen)) {
+			// Notified already
+			result = 1;
+			return true;
+		}
+		return false;
+	}
+
+	bool
+	await_suspend(std::coroutine_handle<CivetTask::promise_type> h)
+	{
+		handle = h;
+		result = -1;
+		// The coroutine may be resumed by another thread before
+		// mg_async_wait returns: do not use any member afterwards.
+		if (event != 0) {
+			CivetEvent *ev = event;
+			unsigned long long v = seen;
+			if (mg_async_wait_event(ev->ctx, ev, timeout, &resume, this)
+			    != 0) {
+				return false;
+			}
+			if (ev->current() != v) {
+				// Notified before the wait was added
+				mg_async_notify(ev->ctx, ev);
+			}
+			return true;
+		}
+		return mg_async_wait(mg_get_context(conn),
+		                     (events != 0) ? conn : 0,
+		                     events,
+		                     timeout,
+		                     &resume,
+		                     this)
+		       == 0;
+	}
+
+	int
+	await_resume() const noexcept
+	{
+		return result;
+	}
+
+  private:
+	static void resume(void *cbdata, int res);
+
+	struct mg_connection *conn;
+	CivetEvent *event;
+	unsigned long long seen;
+	int events;
+	int timeout;
+	int result;
+	std::coroutine_handle<CivetTask::promise_type> handle;
+};
+#endif
+
 /**
  * CivetServer
  *
@@ -375,6 +687,186 @@ class CIVETWEB_CXX_API CivetServer
 		addHandler(uri, &handler);
 	}
 
+#if defined(CIVETWEB_CXX_CALLABLE_HANDLERS)
+	/**
+	 * addRequestHandler(const std::string &, const char *, F)
+	 *
+	 * Adds a callable (function, lambda or functor) as URI handler for one
+	 * request method. Handlers for different methods of the same URI can
+	 * be added one after the other, the URI is registered only once.
+	 * A CivetHandler added for the same URI with addHandler is replaced.
+	 *
+	 * The callable is called as
+	 *   int handler(CivetServer *server, struct mg_connection *conn)
+	 * and returns 0 if the request was not handled, or the HTTP status
+	 * code of the response (see mg_request_handler).
+	 * Functions and captureless lambdas are stored as plain function
+	 * pointers. Other callables are moved (or copied, if passed as an
+	 * lvalue) into a small holder object, which is freed when the server
+	 * is closed. Move-only callables are supported.
+	 *
+	 *  @param uri - URI to match.
+	 *  @param method - "GET", "POST", "HEAD", "PUT", "DELETE", "OPTIONS"
+	 *                  or "PATCH"; NULL for all methods without a handler
+	 *                  of their own.
+	 *  @param handler - callable to use.
+	 *
+	 * @throws CivetException for an unsupported method
+	 */
+	template <typename F>
+	void
+	addRequestHandler(const std::string &uri, const char *method, F &&handler)
+	{
+		typedef typename std::decay<F>::type Func;
+		RouteSlot slot;
+		makeRouteSlot(slot,
+		              std::forward<F>(handler),
+		              typename std::is_convertible<Func, RouteFunc>::type());
+		setRouteSlot(uri, method, slot);
+	}
+
+	/**
+	 * addRequestHandler(const std::string &, F)
+	 *
+	 * Adds a callable as URI handler for all request methods.
+	 * See addRequestHandler(const std::string &, const char *, F).
+	 */
+	template <typename F>
+	void
+	addRequestHandler(const std::string &uri, F &&handler)
+	{
+		addRequestHandler(uri, (const char *)0, std::forward<F>(handler));
+	}
+#endif
+
+#if defined(CIVETWEB_CXX_COROUTINES)
+	/**
+	 * addAsyncRequestHandler(const std::string &, const char *, F)
+	 *
+	 * Adds a coroutine as URI handler for one request method, like
+	 * addRequestHandler. The callable is called as
+	 *   CivetTask handler(CivetServer *server, struct mg_connection *conn)
+	 * and may co_await sleepFor, readable and writable. While it is
+	 * suspended, the request is detached from the worker thread (see
+	 * mg_detach_request), so the thread serves other connections. The
+	 * handler is resumed by an idle worker thread, or by the thread
+	 * polling the sockets if there is none, so it should not block.
+	 *
+	 * conn is the connection to use for the whole request, it is closed
+	 * once the handler is done. Read the request body and form parameters
+	 * before the first co_await. The string views returned by getParam
+	 * and getPostDataView are valid until the handler is done, also after
+	 * a co_await. Requests that cannot be
+	 * detached (e.g. HTTP/2) keep their worker thread until the handler is
+	 * done. mg_stop, and close(), wait for all handlers to finish.
+	 *
+	 *  @param uri - URI to match.
+	 *  @param method - request method, see addRequestHandler.
+	 *  @param handler - coroutine to use.
+	 *
+	 * @throws CivetException for an unsupported method
+	 */
+	template <typename F>
+	void
+	addAsyncRequestHandler(const std::string &uri,
+	                       const char *method,
+	                       F &&handler)
+	{
+		typedef AsyncHolder<typename std::decay<F>::type> Holder;
+		RouteSlot slot;
+		callables.reserve(callables.size() + 1);
+		slot.func = 0;
+		slot.callable = new Holder(std::forward<F>(handler));
+		callables.push_back(slot.callable);
+		setRouteSlot(uri, method, slot);
+	}
+
+	/**
+	 * addAsyncRequestHandler(const std::string &, F)
+	 *
+	 * Adds a coroutine as URI handler for all request methods.
+	 * See addAsyncRequestHandler(const std::string &, const char *, F).
+	 */
+	template <typename F>
+	void
+	addAsyncRequestHandler(const std::string &uri, F &&handler)
+	{
+		addAsyncRequestHandler(uri, (const char *)0, std::forward<F>(handler));
+	}
+
+	/**
+	 * sleepFor(struct mg_connection *, int)
+	 *
+	 * co_await in a coroutine handler: resume after the given time.
+	 *
+	 * @param conn - the connection of the handler
+	 * @param milliseconds - time to wait
+	 * @returns awaitable, co_await returns 0, or -1 if stopping
+	 */
+	static CivetAwait
+	sleepFor(struct mg_connection *conn, int milliseconds)
+	{
+		return CivetAwait(conn, 0, milliseconds);
+	}
+
+	/**
+	 * readable(struct mg_connection *, int)
+	 *
+	 * co_await in a coroutine handler: resume when data can be read from
+	 * the client (or the client closed the connection).
+	 *
+	 * @param conn - the connection of the handler
+	 * @param timeout_ms - timeout in milliseconds, -1 for none
+	 * @returns awaitable, co_await returns 1, 0 on timeout, or -1
+	 */
+	static CivetAwait
+	readable(struct mg_connection *conn, int timeout_ms = -1)
+	{
+		return CivetAwait(conn, MG_ASYNC_READABLE, timeout_ms);
+	}
+
+	/**
+	 * writable(struct mg_connection *, int)
+	 *
+	 * co_await in a coroutine handler: resume when data can be written to
+	 * the client.
+	 *
+	 * @param conn - the connection of the handler
+	 * @param timeout_ms - timeout in milliseconds, -1 for none
+	 * @returns awaitable, co_await returns 1, 0 on timeout, or -1
+	 */
+	static CivetAwait
+	writable(struct mg_connection *conn, int timeout_ms = -1)
+	{
+		return CivetAwait(conn, MG_ASYNC_WRITABLE, timeout_ms);
+	}
+
+	/**
+	 * waitFor(struct mg_connection *, CivetEvent &, unsigned long long, int)
+	 *
+	 * co_await in a coroutine handler: resume when the event is notified,
+	 * e.g. to answer a long polling request once the state changed:
+	 *   unsigned long long seen = event.current();
+	 *   // ... compare the state with the one the client has ...
+	 *   int r = co_await CivetServer::waitFor(conn, event, seen, 30000);
+	 * Notifications since current() returned seen are not missed.
+	 *
+	 * @param conn - the connection of the handler
+	 * @param event - the event to wait for
+	 * @param seen - value of event.current() before checking the state
+	 * @param timeout_ms - timeout in milliseconds, -1 for none
+	 * @returns awaitable, co_await returns 1, 0 on timeout, or -1
+	 */
+	static CivetAwait
+	waitFor(struct mg_connection *conn,
+	        CivetEvent &event,
+	        unsigned long long seen,
+	        int timeout_ms = -1)
+	{
+		return CivetAwait(conn, &event, seen, timeout_ms);
+	}
+#endif
+
 	/**
 	 * addWebSocketHandler
 	 *
@@ -396,6 +888,73 @@ class CIVETWEB_CXX_API CivetServer
 		addWebSocketHandler(uri, &handler);
 	}
 
+#if defined(CIVETWEB_CXX_CALLABLE_HANDLERS)
+	/**
+	 * addWebSocketHandler(const std::string &, FConnect, FReady, FData,
+	 * FClose)
+	 *
+	 * Adds callables as WebSocket handler for a specific URI, instead of a
+	 * CivetWebSocketHandler. Each callable has the signature of the
+	 * corresponding CivetWebSocketHandler method:
+	 *   bool onConnect(CivetServer *, const struct mg_connection *)
+	 *   void onReady(CivetServer *, struct mg_connection *)
+	 *   bool onData(CivetServer *, struct mg_connection *, int bits,
+	 *               char *data, size_t data_len)
+	 *   void onClose(CivetServer *, const struct mg_connection *)
+	 * Pass nullptr for a callable that is not needed, it behaves like the
+	 * default implementation of the CivetWebSocketHandler method.
+	 * The callables are moved (or copied, if passed as lvalues) into a
+	 * holder object, which is freed when the server is closed.
+	 *
+	 *  @param uri - URI to match.
+	 */
+	template <typename FConnect,
+	          typename FReady,
+	          typename FData,
+	          typename FClose>
+	void
+	addWebSocketHandler(const std::string &uri,
+	                    FConnect &&onConnect,
+	                    FReady &&onReady,
+	                    FData &&onData,
+	                    FClose &&onClose)
+	{
+		typedef WebSocketCallables<typename std::decay<FConnect>::type,
+		                           typename std::decay<FReady>::type,
+		                           typename std::decay<FData>::type,
+		                           typename std::decay<FClose>::type>
+		    Holder;
+		callables.reserve(callables.size() + 1);
+		Holder *holder = new Holder(std::forward<FConnect>(onConnect),
+		                            std::forward<FReady>(onReady),
+		                            std::forward<FData>(onData),
+		                            std::forward<FClose>(onClose));
+		callables.push_back(holder);
+		addWebSocketHandler(uri, static_cast<CivetWebSocketHandler *>(holder));
+	}
+
+	/**
+	 * addWebSocketHandler(const std::string &, FData)
+	 *
+	 * Adds a callable for received data frames as WebSocket handler. See
+	 * addWebSocketHandler(const std::string &, FConnect, FReady, FData,
+	 * FClose).
+	 */
+	template <typename FData>
+	auto
+	addWebSocketHandler(const std::string &uri, FData &&onData)
+	    -> decltype((void)std::declval<typename std::decay<FData>::type &>()(
+	        (CivetServer *)0,
+	        (struct mg_connection *)0,
+	        0,
+	        (char *)0,
+	        size_t()))
+	{
+		addWebSocketHandler(
+		    uri, nullptr, nullptr, std::forward<FData>(onData), nullptr);
+	}
+#endif
+
 	/**
 	 * removeHandler(const std::string &)
 	 *
@@ -562,8 +1121,7 @@ class CIVETWEB_CXX_API CivetServer
 	/**
 	 * getPostData(struct mg_connection *)
 	 *
-	 * Returns response body from a request made as POST. Since the
-	 * connections map is protected, it can't be directly accessed.
+	 * Returns response body from a request made as POST.
 	 * This uses string to store post data to handle big posts.
 	 *
 	 * @param conn - connection from which post data will be read
@@ -571,6 +1129,81 @@ class CIVETWEB_CXX_API CivetServer
 	 */
 	static std::string getPostData(struct mg_connection *conn);
 
+#if defined(CIVETWEB_CXX_STRING_VIEW)
+	/**
+	 * getHeaderView(const struct mg_connection *, const char *)
+	 *
+	 * Returns a header value without copying it. The view points into the
+	 * request buffer and is valid until the end of the request.
+	 *
+	 * @param conn - the connection information
+	 * @param headerName - header name to get the value from
+	 * @returns the header value, a view with data() == nullptr if the
+	 *          header is not present
+	 */
+	static std::string_view getHeaderView(const struct mg_connection *conn,
+	                                      const char *headerName);
+
+	/**
+	 * getQueryString(const struct mg_connection *)
+	 *
+	 * @param conn - the connection information
+	 * @returns the query string of the request, or an empty view
+	 */
+	static std::string_view getQueryString(const struct mg_connection *conn);
+
+	/**
+	 * getCookie(struct mg_connection *, const char *, std::string_view &)
+	 *
+	 * Same as getCookie with a std::string destination, but the value is a
+	 * view into the request buffer, valid until the end of the request.
+	 *
+	 * @param conn - the connection information
+	 * @param cookieName - cookie name to get the value from
+	 * @param cookieValue - cookie value is returned using this reference
+	 * @returns true if the cookie was found
+	 */
+	static bool getCookie(struct mg_connection *conn,
+	                      const char *cookieName,
+	                      std::string_view &cookieValue);
+
+	/**
+	 * getParam(struct mg_connection *, const char *, std::string_view &,
+	 *          size_t)
+	 *
+	 * Same as getParam with a std::string destination. On the first call
+	 * for a request, the form body and the query string are decoded once
+	 * into a per request parameter index. All further lookups return views
+	 * into this index, which are valid until the end of the request.
+	 * The name is compared case insensitive with the undecoded key.
+	 *
+	 * @param conn - parameters are read from the data sent through this
+	 *connection
+	 * @param name - the key to search for
+	 * @param dst - the destination view
+	 * @param occurrence - the occurrence of the selected name in the query (0
+	 *based).
+	 * @return true if key was found
+	 */
+	static bool getParam(struct mg_connection *conn,
+	                     const char *name,
+	                     std::string_view &dst,
+	                     size_t occurrence = 0);
+
+	/**
+	 * getPostDataView(struct mg_connection *)
+	 *
+	 * Returns the request body, read once and shared with getParam.
+	 * Bodies larger than MAX_PARAM_BODY_LENGTH are not stored, use mg_read
+	 * to stream them instead.
+	 *
+	 * @param conn - connection from which post data will be read
+	 * @return view of the post data (empty if not available), valid until
+	 *         the end of the request
+	 */
+	static std::string_view getPostDataView(struct mg_connection *conn);
+#endif
+
 	/**
 	 * urlDecode(const std::string &, std::string &, bool)
 	 *
@@ -667,11 +1300,104 @@ class CIVETWEB_CXX_API CivetServer
 	class CivetConnection
 	{
 	  public:
+		CivetConnection() : paramsIndexed(false)
+		{
+		}
+
+		// Start with an empty state for a new request
+		void clear();
+
+		// Read the request body into postData, if not done yet
+		void readPostData(struct mg_connection *conn);
+
+		// Decode all "key=value" pairs of data into the parameter index
+		void addParams(const char *data, size_t data_len, bool inQuery);
+
 		std::vector<char> postData;
+
+		// Parameter index: offsets into paramData, which holds the raw keys
+		// and the decoded values of all form and query parameters
+		struct Param {
+			size_t name;
+			size_t nameLen;
+			size_t value;
+			size_t valueLen;
+			bool inQuery;
+		};
+		bool paramsIndexed;
+		std::string paramData;
+		std::vector<Param> params;
+	};
+
+	// The request served by the calling thread and its state
+	struct WorkerState {
+		const struct mg_connection *conn;
+		CivetConnection *state;
+	};
+
+	// Makes state the state of conn for getConnection, until the scope
+	// ends. Each handler called by the server has its own scope.
+	class ConnectionScope
+	{
+	  public:
+		ConnectionScope(const struct mg_connection *conn,
+		                CivetConnection *state)
+		{
+			prev.conn = conn;
+			prev.state = state;
+			swapWorkerState(prev);
+		}
+
+		~ConnectionScope()
+		{
+			swapWorkerState(prev);
+		}
+
+	  private:
+		ConnectionScope(const ConnectionScope &);
+		ConnectionScope &operator=(const ConnectionScope &);
+
+		WorkerState prev;
+	};
+
+	// Request methods dispatched to handlers
+	enum Method {
+		METHOD_OTHER,
+		METHOD_GET,
+		METHOD_POST,
+		METHOD_HEAD,
+		METHOD_PUT,
+		METHOD_DELETE,
+		METHOD_OPTIONS,
+		METHOD_PATCH,
+		METHOD_COUNT
+	};
+
+	// Callables registered with addRequestHandler
+	typedef int (*RouteFunc)(CivetServer *server, struct mg_connection *conn);
+	struct Callable {
+		int (*call)(Callable *self,
+		            CivetServer *server,
+		            struct mg_connection *conn);
+		void (*destroy)(Callable *self);
+	};
+	struct RouteSlot {
+		RouteFunc func;
+		Callable *callable;
+	};
+	struct Route {
+		RouteSlot any;
+		RouteSlot method[METHOD_COUNT];
 	};
 
 	struct mg_context *context;
-	std::map<const struct mg_connection *, CivetConnection> connections;
+
+	// Routes by URI. Routes are never modified while registered, an update
+	// registers a copy. Replaced routes and all callables are kept until
+	// the server is closed, since a worker may still be using them.
+	std::map<std::string, Route *> routes;
+	std::vector<Route *> retiredRoutes;
+	std::vector<Callable *> callables;
 
 	// generic user context which can be set/read,
 	// the server does nothing with this apart from keep it.
@@ -719,11 +1445,309 @@ class CIVETWEB_CXX_API CivetServer
 	 */
 	static void closeHandler(const struct mg_connection *conn);
 
+	/**
+	 * getConnection(const struct mg_connection *)
+	 *
+	 * Returns the state of the request served by the calling thread
+	 * (internal helper). The state belongs to the ConnectionScope of the
+	 * running handler and is found in thread local storage, so no lock is
+	 * required to access it. Outside of a request or auth handler, e.g.
+	 * in a websocket handler or a plain mg_request_handler, a state of
+	 * the thread is used, which is freed when the connection is closed.
+	 *
+	 * @param conn - the connection information
+	 * @returns the connection state
+	 */
+	static CivetConnection &getConnection(const struct mg_connection *conn);
+
+	/**
+	 * swapWorkerState(WorkerState &)
+	 *
+	 * Exchanges the request served by the calling thread and its state
+	 * with ws (internal helper for ConnectionScope).
+	 */
+	static void swapWorkerState(WorkerState &ws);
+
+	/**
+	 * getMethod(const char *)
+	 *
+	 * @param method - the request method
+	 * @returns the Method to dispatch the request to
+	 */
+	static Method getMethod(const char *method);
+
+	/**
+	 * routeHandler(struct mg_connection *, void *cbdata)
+	 *
+	 * Handles a request for a URI added with addRequestHandler.
+	 *
+	 * @param conn - the connection information
+	 * @param cbdata - pointer to the Route of the URI.
+	 * @returns 0 if not handled, the HTTP status code otherwise
+	 */
+	static int routeHandler(struct mg_connection *conn, void *cbdata);
+
+	/**
+	 * setRouteSlot(const std::string &, const char *, const RouteSlot &)
+	 *
+	 * Registers a copy of the route of uri, with the slot for method set.
+	 */
+	void setRouteSlot(const std::string &uri,
+	                  const char *method,
+	                  const RouteSlot &slot);
+
+	/**
+	 * retireRoute(const std::string &)
+	 *
+	 * Drops the route of uri, if any. The memory is released in close().
+	 */
+	void retireRoute(const std::string &uri);
+
+#if defined(CIVETWEB_CXX_CALLABLE_HANDLERS)
+	template <typename F> struct CallableHolder : public Callable {
+		F f;
+
+		template <typename G>
+		explicit CallableHolder(G &&fn) : f(std::forward<G>(fn))
+		{
+			call = &invoke;
+			destroy = &release;
+		}
+
+		static int
+		invoke(Callable *self, CivetServer *server, struct mg_connection *conn)
+		{
+			return static_cast<CallableHolder *>(self)->f(server, conn);
+		}
+
+		static void
+		release(Callable *self)
+		{
+			delete static_cast<CallableHolder *>(self);
+		}
+	};
+
+	// Functions and captureless lambdas: keep the function pointer
+	template <typename F>
+	void
+	makeRouteSlot(RouteSlot &slot, F &&handler, std::true_type)
+	{
+		slot.func = handler;
+		slot.callable = 0;
+	}
+
+	// Any other callable: move or copy it into a holder
+	template <typename F>
+	void
+	makeRouteSlot(RouteSlot &slot, F &&handler, std::false_type)
+	{
+		typedef CallableHolder<typename std::decay<F>::type> Holder;
+		callables.reserve(callables.size() + 1);
+		slot.func = 0;
+		slot.callable = new Holder(std::forward<F>(handler));
+		callables.push_back(slot.callable);
+	}
+
+#if defined(CIVETWEB_CXX_COROUTINES)
+	friend class CivetAwait;
+
+	// Coroutines registered with addAsyncRequestHandler
+	template <typename F> struct AsyncHolder : public Callable {
+		F f;
+
+		template <typename G>
+		explicit AsyncHolder(G &&fn) : f(std::forward<G>(fn))
+		{
+			call = &invoke;
+			destroy = &release;
+		}
+
+		static int
+		invoke(Callable *self, CivetServer *server, struct mg_connection *conn)
+		{
+			F &fn = static_cast<AsyncHolder *>(self)->f;
+			struct mg_connection *detached = mg_detach_request(conn);
+
+			if (detached != 0) {
+				try {
+					CivetTask task = fn(server, detached);
+					std::shared_ptr<CivetConnection> state =
+					    std::make_shared<CivetConnection>();
+					ConnectionScope scope(detached, state.get());
+					task.start(detached, 0, state);
+				} catch (...) {
+					// The coroutine could not be created
+					mg_send_http_error(detached, 500, "%s", "Server error");
+					mg_finish_detached_request(detached);
+				}
+				return 1;
+			}
+
+			// Keep the worker thread until the coroutine is done
+			CivetTask::SyncState sync;
+			try {
+				CivetTask task = fn(server, conn);
+				std::shared_ptr<CivetConnection> state =
+				    std::make_shared<CivetConnection>();
+				ConnectionScope scope(conn, state.get());
+				task.start(conn, &sync, state);
+			} catch (...) {
+				mg_send_http_error(conn, 500, "%s", "Server error");
+				return 500;
+			}
+			std::unique_lock<std::mutex> lock(sync.mutex);
+			while (!sync.done) {
+				sync.cond.wait(lock);
+			}
+			return sync.status;
+		}
+
+		static void
+		release(Callable *self)
+		{
+			delete static_cast<AsyncHolder *>(self);
+		}
+	};
+#endif
+
+	// Callables registered with addWebSocketHandler. A nullptr instead of a
+	// callable selects the default behaviour of CivetWebSocketHandler.
+	template <typename FConnect,
+	          typename FReady,
+	          typename FData,
+	          typename FClose>
+	struct WebSocketCallables : public CivetWebSocketHandler, public Callable {
+		FConnect onConnect;
+		FReady onReady;
+		FData onData;
+		FClose onClose;
+
+		template <typename C, typename R, typename D, typename X>
+		WebSocketCallables(C &&c, R &&r, D &&d, X &&x)
+		    : onConnect(std::forward<C>(c)), onReady(std::forward<R>(r)),
+		      onData(std::forward<D>(d)), onClose(std::forward<X>(x))
+		{
+			call = 0;
+			destroy = &release;
+		}
+
+		bool
+		handleConnection(CivetServer *server, const struct mg_connection *conn)
+		{
+			return callConnect(onConnect, server, conn);
+		}
+
+		void
+		handleReadyState(CivetServer *server, struct mg_connection *conn)
+		{
+			callReady(onReady, server, conn);
+		}
+
+		bool
+		handleData(CivetServer *server,
+		           struct mg_connection *conn,
+		           int bits,
+		           char *data,
+		           size_t data_len)
+		{
+			return callData(onData, server, conn, bits, data, data_len);
+		}
+
+		void
+		handleClose(CivetServer *server, const struct mg_connection *conn)
+		{
+			callClose(onClose, server, conn);
+		}
+
+		static void
+		release(Callable *self)
+		{
+			delete static_cast<WebSocketCallables *>(self);
+		}
+
+		template <typename G>
+		static bool
+		callConnect(G &g, CivetServer *server, const struct mg_connection *conn)
+		{
+			return g(server, conn);
+		}
+		static bool
+		callConnect(std::nullptr_t, CivetServer *, const struct mg_connection *)
+		{
+			return true;
+		}
+
+		template <typename G>
+		static void
+		callReady(G &g, CivetServer *server, struct mg_connection *conn)
+		{
+			g(server, conn);
+		}
+		static void
+		callReady(std::nullptr_t, CivetServer *, struct mg_connection *)
+		{
+		}
+
+		template <typename G>
+		static bool
+		callData(G &g,
+		        CivetServer *server,
+		        struct mg_connection *conn,
+		        int bits,
+		        char *data,
+		        size_t data_len)
+		{
+			return g(server, conn, bits, data, data_len);
+		}
+		static bool
+		callData(std::nullptr_t,
+		        CivetServer *,
+		        struct mg_connection *,
+		        int,
+		        char *,
+		        size_t)
+		{
+			return true;
+		}
+
+		template <typename G>
+		static void
+		callClose(G &g, CivetServer *server, const struct mg_connection *conn)
+		{
+			g(server, conn);
+		}
+		static void
+		callClose(std::nullptr_t, CivetServer *, const struct mg_connection *)
+		{
+		}
+	};
+#endif
+
 	/**
 	 * Stores the user provided close handler
 	 */
 	void (*userCloseHandler)(const struct mg_connection *conn);
 };
 
+#if defined(CIVETWEB_CXX_COROUTINES)
+inline CivetEvent::CivetEvent(CivetServer &server)
+    : ctx(const_cast<struct mg_context *>(server.getContext())), version(0)
+{
+}
+
+inline void
+CivetAwait::resume(void *cbdata, int res)
+{
+	CivetAwait *self = static_cast<CivetAwait *>(cbdata);
+	CivetTask::promise_type &p = self->handle.promise();
+	CivetServer::CivetConnection *state =
+	    static_cast<CivetServer::CivetConnection *>(p.state.get());
+	// The coroutine and self may be gone when resume returns
+	CivetServer::ConnectionScope scope(p.request, state);
+	self->result = res;
+	self->handle.resume();
+}
+#endif
+
 #endif /*  __cplusplus */
 #endif /* CIVETSERVER_HEADER_INCLUDED */
@@ -429,6 +429,19 @@ struct mg_callbacks {
 	 *   Otherwise, the result is undefined
 	 */
 	int (*init_connection)(const struct mg_connection *conn, void **conn_data);
+
+	/* Called when the outbound queue of a websocket client (see
+	 * mg_websocket_broadcast and mg_websocket_queue_write) grows above
+	 * websocket_queue_high_watermark, and when it has drained below
+	 * websocket_queue_low_watermark again.
+	 * Parameters:
+	 *   conn: websocket client connection
+	 *   above: 1 if the queue is above the high watermark, 0 if it is
+	 *          below the low watermark
+	 * The callback is called while an internal lock is held. It must not
+	 * write to any websocket connection.
+	 */
+	void (*websocket_queue_state)(const struct mg_connection *conn, int above);
 };
 
 
@@ -535,6 +548,120 @@ CIVETWEB_API void mg_set_request_handler(struct mg_context *ctx,
                                          void *cbdata);
 
 
+/* mg_detach_request
+
+   Continues a request without holding the worker thread. A request
+   handler calls this function, and returns immediately afterwards with a
+   value > 0. The worker thread is then free to handle other connections,
+   while the request is completed later using the returned connection,
+   e.g., from a callback of mg_async_wait.
+   The connection is closed when the request is finished, so the response
+   is sent with "Connection: close". Client certificate information is
+   not available for a detached request.
+   Parameters:
+      conn: the connection passed to the request handler
+   Return:
+      the connection of the detached request, to be used instead of conn
+      NULL if the request can not be detached (e.g., a HTTP/2 stream or a
+           websocket connection, or out of memory). The request handler
+           has to complete the request itself then. */
+CIVETWEB_API struct mg_connection *
+mg_detach_request(struct mg_connection *conn);
+
+
+/* mg_finish_detached_request
+
+   Completes a request detached by mg_detach_request: the request is
+   logged, the connection is closed and conn is freed. It may be called
+   from any thread, but not while mg_async_wait waits for conn.
+   mg_stop waits until all detached requests are finished. */
+CIVETWEB_API void mg_finish_detached_request(struct mg_connection *conn);
+
+
+/* Events for mg_async_wait */
+enum {
+	MG_ASYNC_READABLE = 1, /* Data can be read from the connection */
+	MG_ASYNC_WRITABLE = 2  /* Data can be written to the connection */
+};
+
+
+/* Callback of mg_async_wait
+   Parameters:
+      cbdata: the callback data given to mg_async_wait.
+      result:
+         1: the connection is ready for the events waited for
+         0: timeout
+        -1: the wait has been cancelled, since the server is stopping */
+typedef void (*mg_async_callback)(void *cbdata, int result);
+
+
+/* mg_async_wait
+
+   Waits for the socket of a connection, or for a timeout, without blocking
+   a thread. The callback is called once, on an idle worker thread, or on
+   the thread waiting for all sockets if no worker thread is idle. It
+   should not block, but wait again instead.
+   Waiting for the connection of a request, which has not been detached,
+   blocks the worker thread - use mg_detach_request first.
+   Parameters:
+      ctx: server context
+      conn: connection to wait for, or NULL to wait for the timeout only
+      events: MG_ASYNC_READABLE and/or MG_ASYNC_WRITABLE, 0 with conn NULL
+      timeout_ms: timeout in milliseconds, or -1 to wait for the events
+                  without timeout
+      callback, cbdata: callback to call once
+   Return:
+      0: ok, the callback will be called
+     -1: parameter error
+     -2: the server is stopping or out of memory, the callback will not be
+         called */
+CIVETWEB_API int mg_async_wait(struct mg_context *ctx,
+                               const struct mg_connection *conn,
+                               int events,
+                               int timeout_ms,
+                               mg_async_callback callback,
+                               void *cbdata);
+
+
+/* mg_async_wait_event
+
+   Waits until mg_async_notify is called for an event, or for a timeout,
+   without blocking a thread, e.g., to answer a long polling request once
+   the state of the application changed. The callback is called once, like
+   the one of mg_async_wait.
+   Parameters:
+      ctx: server context
+      event: any address identifying the event, e.g. of the object whose
+             state is watched. It is not dereferenced.
+      timeout_ms: timeout in milliseconds, or -1 for none
+      callback, cbdata: callback to call once, with the result
+         1: notified, 0: timeout, -1: the server is stopping
+   Return:
+      0: ok, the callback will be called
+     -1: parameter error
+     -2: the server is stopping or out of memory, the callback will not be
+         called */
+CIVETWEB_API int mg_async_wait_event(struct mg_context *ctx,
+                                     const void *event,
+                                     int timeout_ms,
+                                     mg_async_callback callback,
+                                     void *cbdata);
+
+
+/* mg_async_notify
+
+   Calls back all waits of mg_async_wait_event for the event, on worker
+   threads. It may be called from any thread. Waits added later are not
+   affected: to not miss a change, check the state after adding the wait,
+   or before, while holding the lock that protects the state.
+   Parameters:
+      ctx: server context
+      event: the address given to mg_async_wait_event
+   Return:
+      number of waits called back, -1 for a parameter error */
+CIVETWEB_API int mg_async_notify(struct mg_context *ctx, const void *event);
+
+
 /* Callback types for websocket handlers in C/C++.
 
    mg_websocket_connect_handler
@@ -860,6 +987,107 @@ CIVETWEB_API int mg_websocket_client_write(struct mg_connection *conn,
                                            size_t data_len);
 
 
+/* Message for mg_websocket_write_batch and
+   mg_websocket_client_write_batch. */
+struct mg_websocket_message {
+	int opcode; /* MG_WEBSOCKET_OPCODE_* */
+	const char *data;
+	size_t data_len;
+};
+
+
+/* Send several messages to a websocket client, each wrapped in its own
+   websocket frame. Works like calling mg_websocket_write for every message,
+   but the connection is locked only once, and the frame headers and the
+   (uncopied) data of all messages are passed to the kernel in as few
+   system calls as possible.
+   This function is available when civetweb is compiled with -DUSE_WEBSOCKET
+
+   Return:
+    0   if num_msgs is 0
+    -1  on error (some messages may have been sent)
+    >0  number of bytes written on success, including the frame headers */
+CIVETWEB_API int
+mg_websocket_write_batch(struct mg_connection *conn,
+                         const struct mg_websocket_message *msgs,
+                         size_t num_msgs);
+
+
+/* Send several messages to a websocket server, each wrapped in its own
+   masked websocket frame, like mg_websocket_write_batch.
+   This function is available when civetweb is compiled with -DUSE_WEBSOCKET
+
+   Return:
+    0   if num_msgs is 0
+    -1  on error (some messages may have been sent)
+    >0  number of bytes written on success, including the frame headers */
+CIVETWEB_API int
+mg_websocket_client_write_batch(struct mg_connection *conn,
+                                const struct mg_websocket_message *msgs,
+                                size_t num_msgs);
+
+
+/* Send a message to all clients of a websocket handler.
+   The websocket frame is built only once and queued for every client
+   connected to the handler registered for uri (the same string as used
+   for mg_set_websocket_handler). The function does not wait for slow
+   clients: data which cannot be sent immediately is sent by a background
+   thread. Messages written by mg_websocket_write are sent after all
+   messages queued for the client.
+   If the queue of a client is above websocket_queue_high_watermark, the
+   websocket_queue_policy option decides what happens: "drop_oldest" (the
+   default) drops unsent messages from the queue, "coalesce" drops the
+   oldest ones as well, and "disconnect" closes the connection of the
+   client. "block" makes mg_websocket_queue_write wait until the queue
+   drained below websocket_queue_low_watermark (and disconnects the client
+   after request_timeout_ms). A broadcast never waits for a slow client,
+   it drops the oldest messages of that client with "block".
+   With the "coalesce" policy, a message with a key (see
+   mg_websocket_broadcast_keyed) replaces an unsent message with the same
+   key in the queue, at any time. The websocket_max_flush_rate option
+   limits how often the queue of a client is sent per second, so fast
+   changing values are sent at that rate at most.
+   Parameters:
+      ctx: server context
+      uri: URI of the websocket handler
+      opcode, data, data_len: as for mg_websocket_write
+   Return:
+    -1  on error
+    >=0 number of clients the message was queued for */
+CIVETWEB_API int mg_websocket_broadcast(struct mg_context *ctx,
+                                        const char *uri,
+                                        int opcode,
+                                        const char *data,
+                                        size_t data_len);
+
+
+/* Like mg_websocket_broadcast, for messages with a key.
+   The key identifies messages which replace each other, e.g., the latest
+   value of some parameter, if websocket_queue_policy is "coalesce". */
+CIVETWEB_API int mg_websocket_broadcast_keyed(struct mg_context *ctx,
+                                              const char *uri,
+                                              const char *key,
+                                              int opcode,
+                                              const char *data,
+                                              size_t data_len);
+
+
+/* Queue a message for one client of a websocket handler.
+   Like mg_websocket_broadcast, but for a single connection. The key may
+   be NULL. Otherwise, it identifies messages which may replace each other
+   (e.g., the latest value of some parameter), if the queue policy is
+   "coalesce".
+   Return:
+    -1  on error (e.g., conn is not a client of a websocket handler)
+     0  the message has been dropped by the queue policy
+     1  the message has been queued */
+CIVETWEB_API int mg_websocket_queue_write(struct mg_connection *conn,
+                                          const char *key,
+                                          int opcode,
+                                          const char *data,
+                                          size_t data_len);
+
+
 /* Blocks until unique access is obtained to this connection. Intended for use
    with websockets only.
    Invoke this before mg_write or mg_printf when communicating with a
@@ -1540,6 +1768,67 @@ CIVETWEB_API int mg_get_response(struct mg_connection *conn,
                                  int timeout);
 
 
+/* Pool of HTTP client connections, to reuse keep-alive connections for
+   several requests to the same server. */
+struct mg_client_pool;
+
+
+/* Create a client connection pool.
+   Parameters:
+     max_conns_per_host: maximum number of connections (in use and idle)
+       to one host/port, 0 for no limit
+     idle_timeout_ms: unused connections are closed after this time
+
+   Return:
+     On success, a new pool.
+     On error, NULL.
+*/
+CIVETWEB_API struct mg_client_pool *
+mg_client_pool_create(unsigned max_conns_per_host, int idle_timeout_ms);
+
+
+/* Get a connection from the pool: an idle connection to the same host,
+   port and SSL setting if there is one, otherwise a new connection.
+   If max_conns_per_host connections are in use, wait until one is
+   released.
+   Use the connection like one returned by mg_connect_client (mg_printf
+   the request, then mg_get_response and mg_read), then give it back using
+   mg_client_pool_release. A reused connection may have been closed by the
+   server in the meantime, so a failing request should be repeated on a
+   new connection.
+   Parameters:
+     pool: pool created by mg_client_pool_create
+     host, port, use_ssl: see mg_connect_client
+     timeout_ms: maximum time to wait for a free connection (if < 0 then
+       wait forever)
+     error_buffer, error_buffer_size: buffer for an error message
+
+   Return:
+     On success, valid mg_connection object.
+     On error, NULL. See error_buffer for details.
+*/
+CIVETWEB_API struct mg_connection *
+mg_client_pool_get(struct mg_client_pool *pool,
+                   const char *host,
+                   int port,
+                   int use_ssl,
+                   int timeout_ms,
+                   char *error_buffer,
+                   size_t error_buffer_size);
+
+
+/* Return a connection to its pool. It is kept for the next request if
+   the response has been read completely and the server allows
+   keep-alive, otherwise it is closed. Calling mg_close_connection
+   instead is allowed as well. */
+CIVETWEB_API void mg_client_pool_release(struct mg_connection *conn);
+
+
+/* Close all idle connections and free the pool. All connections taken
+   from the pool must be released before. */
+CIVETWEB_API void mg_client_pool_destroy(struct mg_client_pool *pool);
+
+
 /* mg_response_header_* functions can be used from server callbacks
  * to prepare HTTP server response headers. Using this function will
  * allow a callback to work with HTTP/1.x and HTTP/2.
@@ -0,0 +1,215 @@
+/*
+ * Copyright (c) 2026 the CivetWeb developers
+ * License http://opensource.org/licenses/mit-license.php MIT License
+ */
+
+/* Check and benchmark the HPACK string decoder of the HTTP/2 module.
+ *
+ * hpack_decode() decodes Huffman strings with a nibble state machine. It
+ * is compared with a copy of the bit by bit decoder it replaced, on
+ * typical header values and on random strings, both encoded by
+ * hpack_putstr(). Then both decoders are timed on the typical values.
+ * The exit code is not 0 if a check failed.
+ *
+ * Build:  make hpack_bench
+ * Usage:  ./hpack_bench [seconds per decoder]
+ */
+
+/* The decoder is static: include the server source */
+#include "civetweb.c"
+
+
+/* hpack_decode() before the state machine was added. The input must be
+ * a valid Huffman string of at most 1024 bytes. */
+static char *
+reference_decode(const uint8_t *buf, int *i)
+{
+	int byte_len = (int)hpack_getnum(buf, i, 0x7f, NULL);
+	int bit_len = byte_len * 8;
+	const uint8_t *pData = buf + (*i);
+	int bitRead = 0;
+	uint32_t bytesStored = 0;
+	uint8_t str[2048];
+
+	for (;;) {
+		uint32_t accu = 0;
+		uint8_t bc = 0;
+		int n;
+
+		do {
+			accu <<= 1;
+			accu |= (pData[bitRead / 8] >> (7 - (bitRead & 7))) & 1;
+			bitRead++;
+			bc++;
+			if (bitRead > bit_len) {
+				str[bytesStored] = 0;
+				(*i) += byte_len;
+				return mg_strdup((char *)str);
+			}
+		} while ((bc < 5) || (accu > hpack_huff_end_code[bc - 5]));
+
+		for (n = hpack_huff_start_index[bc - 5]; n < 256; n++) {
+			if (accu == hpack_huff_dec[n].encoded) {
+				str[bytesStored] = hpack_huff_dec[n].decoded;
+				bytesStored++;
+				break;
+			}
+		}
+	}
+}
+
+
+static const char *values[] = {
+    "https",
+    "/pictures/2026/holidays/index.html?view=grid&sort=date",
+    "www.example.com",
+    "Mozilla/5.0 (X11; Linux x86_64; rv:128.0) Gecko/20100101 Firefox/128.0",
+    "text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,"
+    "image/webp,*/*;q=0.8",
+    "de-DE,de;q=0.8,en-US;q=0.5,en;q=0.3",
+    "gzip, deflate, br, zstd",
+    "session=4f2a9c1e7b3d5a6f8e0c2b4d6a8f0e1c3b5d7f9a; theme=dark; "
+    "consent=necessary,statistics; _ga=GA1.2.1234567890.1767225600",
+    "Thu, 01 Jan 2026 12:00:00 GMT",
+    "\"5f3a-61c2b8e4d7a00\"",
+    "no-cache",
+    "7c9e6679-7425-40de-944b-e07fc1f90ae7",
+};
+#define NUM_VALUES (sizeof(values) / sizeof(values[0]))
+
+static uint8_t encoded[NUM_VALUES][1100];
+static int failures = 0;
+static uint64_t rnd_state = 0x9e3779b97f4a7c15;
+
+
+static uint64_t
+rnd(void)
+{
+	/* xorshift64 */
+	rnd_state ^= rnd_state << 13;
+	rnd_state ^= rnd_state >> 7;
+	rnd_state ^= rnd_state << 17;
+	return rnd_state;
+}
+
+
+static void
+check(int ok, const char *what, const char *value)
+{
+	if (!ok) {
+		fprintf(stderr, "FAILED: %s (%.40s)\n", what, value);
+		failures++;
+	}
+}
+
+
+/* Encode str and decode it with both decoders */
+static void
+check_string(const char *str)
+{
+	uint8_t buf[1100];
+	size_t len = hpack_putstr(buf, str, 0);
+	int i = 0, j = 0;
+	char *s1, *s2;
+
+	if (!(buf[0] & 0x80)) {
+		/* Not Huffman encoded */
+		return;
+	}
+	s1 = hpack_decode(buf, &i, (int)len, NULL);
+	s2 = reference_decode(buf, &j);
+	check((s1 != NULL) && !strcmp(s1, str), "decode", str);
+	check((s2 != NULL) && !strcmp(s2, str), "reference decode", str);
+	check((i == (int)len) && (j == (int)len), "parse index", str);
+	mg_free(s1);
+	mg_free(s2);
+}
+
+
+static void
+check_random(int count)
+{
+	char str[1001];
+	int n, k, len;
+
+	for (n = 0; n < count; n++) {
+		len = (int)(rnd() % sizeof(str));
+		for (k = 0; k < len; k++) {
+			uint64_t r = rnd();
+			/* Mostly printable ASCII, sometimes any other byte */
+			str[k] = (r & 7) ? (char)(0x20 + (r >> 8) % 95)
+			                 : (char)(1 + (r >> 8) % 255);
+		}
+		str[len] = 0;
+		check_string(str);
+	}
+}
+
+
+static double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1.0e9;
+}
+
+
+/* Decode all values repeatedly for the given time, return MB/s of
+ * decoded text */
+static double
+bench(int reference, double seconds)
+{
+	double start = now(), elapsed;
+	uint64_t bytes = 0;
+	size_t v;
+	long n;
+	int i;
+	char *s;
+
+	do {
+		for (n = 0; n < 1000; n++) {
+			for (v = 0; v < NUM_VALUES; v++) {
+				i = 0;
+				s = reference ? reference_decode(encoded[v], &i)
+				              : hpack_decode(encoded[v], &i, 1100, NULL);
+				bytes += strlen(s);
+				mg_free(s);
+			}
+		}
+		elapsed = now() - start;
+	} while (elapsed < seconds);
+
+	return (double)bytes / elapsed / 1.0e6;
+}
+
+
+int
+main(int argc, char *argv[])
+{
+	double seconds = (argc > 1) ? atof(argv[1]) : 2.0;
+	double fsm, ref;
+	size_t v;
+
+	hpack_huff_fsm_init();
+
+	for (v = 0; v < NUM_VALUES; v++) {
+		hpack_putstr(encoded[v], values[v], 0);
+		check((encoded[v][0] & 0x80) != 0, "Huffman encoded", values[v]);
+		check_string(values[v]);
+	}
+	check_random(100000);
+
+	fsm = bench(0, seconds);
+	ref = bench(1, seconds);
+	printf("state machine %7.1f MB/s, bit by bit %7.1f MB/s (%.1fx)\n",
+	       fsm,
+	       ref,
+	       fsm / ref);
+
+	if (failures > 0) {
+		fprintf(stderr, "%d checks failed\n", failures);
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,147 @@
+/*
+ * Copyright (c) 2026 the CivetWeb developers
+ * License http://opensource.org/licenses/mit-license.php MIT License
+ */
+
+/* Check and benchmark mg_get_builtin_mime_type.
+ *
+ * After mg_init_library, the extension of the path is looked up in a hash
+ * index of builtin_mime_types. Before, the table is searched linearly, as
+ * it always was before the index was added. For every builtin extension
+ * (also in upper case and after a directory with a dot) and for unknown
+ * extensions, both must return the same type. Then both are timed on
+ * typical paths of a web UI. The exit code is not 0 if a check failed.
+ *
+ * Build:  make mime_bench
+ * Usage:  ./mime_bench [seconds per lookup method]
+ */
+
+/* The lookup methods are switched by builtin_mime_hash_ready: include
+ * the server source */
+#include "civetweb.c"
+
+
+static const char *paths[] = {
+    "/index.html",
+    "/css/style.css",
+    "/js/app.bundle.js",
+    "/js/app.bundle.js.map",
+    "/img/logo.svg",
+    "/img/photo.JPG",
+    "/img/icons/favicon.ico",
+    "/fonts/roboto.woff2",
+    "/api/data.json",
+    "/download/archive.tar.gz",
+    "/README",
+    "/docs/manual.pdf",
+};
+#define NUM_PATHS (sizeof(paths) / sizeof(paths[0]))
+
+static int failures = 0;
+
+
+/* Compare the hash lookup with the linear search */
+static void
+check(const char *path)
+{
+	const char *hashed, *linear;
+
+	builtin_mime_hash_ready = 1;
+	hashed = mg_get_builtin_mime_type(path);
+	builtin_mime_hash_ready = 0;
+	linear = mg_get_builtin_mime_type(path);
+	builtin_mime_hash_ready = 1;
+
+	if (strcmp(hashed, linear) != 0) {
+		fprintf(stderr, "FAILED: %s: %s instead of %s\n", path, hashed, linear);
+		failures++;
+	}
+}
+
+
+static double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1.0e9;
+}
+
+
+/* Look up all paths repeatedly for the given time, return ns per lookup */
+static double
+bench(int hashed, double seconds)
+{
+	double start = now(), elapsed;
+	volatile size_t sink = 0;
+	uint64_t lookups = 0;
+	size_t p;
+	long n;
+
+	builtin_mime_hash_ready = hashed;
+	do {
+		for (n = 0; n < 10000; n++) {
+			for (p = 0; p < NUM_PATHS; p++) {
+				sink += strlen(mg_get_builtin_mime_type(paths[p]));
+			}
+		}
+		lookups += 10000 * NUM_PATHS;
+		elapsed = now() - start;
+	} while (elapsed < seconds);
+	builtin_mime_hash_ready = 1;
+	(void)sink;
+
+	return elapsed * 1.0e9 / (double)lookups;
+}
+
+
+int
+main(int argc, char *argv[])
+{
+	double seconds = (argc > 1) ? atof(argv[1]) : 2.0;
+	double hashed, linear;
+	char path[64];
+	size_t i, j;
+
+	mg_init_library(0);
+	if (!builtin_mime_hash_ready) {
+		fprintf(stderr, "FAILED: no hash index\n");
+		return EXIT_FAILURE;
+	}
+
+	for (i = 0; builtin_mime_types[i].extension != NULL; i++) {
+		const char *ext = builtin_mime_types[i].extension;
+		mg_snprintf(NULL, NULL, path, sizeof(path), "/dir.d/file%s", ext);
+		check(path);
+		for (j = 0; path[j] != 0; j++) {
+			path[j] = (char)toupper((unsigned char)path[j]);
+		}
+		check(path);
+		/* The extension alone is not a file name with this extension */
+		check(ext);
+		mg_snprintf(NULL, NULL, path, sizeof(path), "/file%sx", ext);
+		check(path);
+	}
+	for (i = 0; i < NUM_PATHS; i++) {
+		check(paths[i]);
+	}
+	check("");
+	check(".");
+	check("/dir.html/file");
+
+	hashed = bench(1, seconds);
+	linear = bench(0, seconds);
+	printf("hash index %6.1f ns/lookup, linear search %6.1f ns/lookup "
+	       "(%.1fx)\n",
+	       hashed,
+	       linear,
+	       linear / hashed);
+
+	mg_exit_library();
+
+	if (failures > 0) {
+		fprintf(stderr, "%d checks failed\n", failures);
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,373 @@
+/*
+ * Copyright (c) 2026 the CivetWeb developers
+ * License http://opensource.org/licenses/mit-license.php MIT License
+ */
+
+/* Exercise and benchmark server side scripts.
+ *
+ * For every script type compiled in (USE_LUA, USE_DUKTAPE), a server is
+ * started with the state or heap reuse option set to "no" and to "yes".
+ * The program checks the responses (globals of one request must not be
+ * visible in the next one, a changed script file must be reloaded), then
+ * measures requests per second for a trivial script. The exit code is not
+ * 0 if a check failed.
+ *
+ * Build:  make scripting_bench LUA_DIR=<lua>/src DUKTAPE_DIR=<duktape>/src
+ * Usage:  ./scripting_bench [seconds [client threads [server threads]]]
+ */
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+#include <utime.h>
+
+#include "civetweb.h"
+
+#if !defined(USE_LUA) && !defined(USE_DUKTAPE)
+#error "Build with USE_LUA and/or USE_DUKTAPE"
+#endif
+
+
+struct script_type {
+	const char *name;    /* file name of the script */
+	const char *option;  /* option to reuse interpreter states */
+	const char *stats;   /* object in mg_get_context_info */
+	const char *source;  /* %s: text written after the HTTP header */
+	const char *clobber; /* replaces and adds globals */
+};
+
+
+#define DUKTAPE_HELLO                                                          \
+	"counter = (typeof counter === 'undefined') ? 1 : counter + 1;\n"          \
+	"conn.write('HTTP/1.0 200 OK\\r\\n');\n"                                   \
+	"conn.write('Content-Type: text/plain\\r\\n\\r\\n');\n"                    \
+	"conn.write('%s ' + String(counter) + '\\n');\n"
+
+
+static const struct script_type script_types[] = {
+#if defined(USE_LUA)
+    {"hello.lua",
+     "lua_reuse_states",
+     "lua_states",
+     "counter = (counter or 0) + 1\n"
+     "mg.write(\"HTTP/1.0 200 OK\\r\\nContent-Type: text/plain\\r\\n\\r\\n\")\n"
+     "mg.write(\"%s \" .. tostring(counter) .. \"\\n\")\n",
+     "tostring = nil\n"
+     "counter = 100\n"
+     "mg.write(\"HTTP/1.0 200 OK\\r\\n\\r\\nclobbered\\n\")\n"},
+    {"hello.lp",
+     "lua_reuse_states",
+     "lua_states",
+     "HTTP/1.0 200 OK\r\nContent-Type: text/plain\r\n\r\n"
+     "<? counter = (counter or 0) + 1 ?>%s <?= tostring(counter) ?>\n",
+     "HTTP/1.0 200 OK\r\n\r\n"
+     "<? tostring = nil; counter = 100 ?>clobbered\n"},
+#endif
+#if defined(USE_DUKTAPE)
+    {"hello.ssjs",
+     "duktape_reuse_heaps",
+     "duktape_heaps",
+     DUKTAPE_HELLO,
+     "String = null;\n"
+     "counter = 100;\n"
+     "conn.write('HTTP/1.0 200 OK\\r\\n\\r\\nclobbered\\n');\n"},
+    {"locked.ssjs",
+     "duktape_reuse_heaps",
+     "duktape_heaps",
+     DUKTAPE_HELLO,
+     /* Globals that can not be removed: the heap is not reused */
+     "Object.defineProperty(this, 'locked', {value: 1});\n"
+     "conn.write('HTTP/1.0 200 OK\\r\\n\\r\\nclobbered\\n');\n"},
+#endif
+};
+
+
+static char document_root[] = "/tmp/scripting_bench.XXXXXX";
+static int failures = 0;
+
+
+static void
+check(int ok, const char *what, const char *name, const char *reuse)
+{
+	if (!ok) {
+		fprintf(stderr, "FAILED: %s (%s, reuse %s)\n", what, name, reuse);
+		failures++;
+	}
+}
+
+
+/* Write a file into the document root, modified "age" seconds ago */
+static void
+write_file(const char *name, const char *content, const char *arg, int age)
+{
+	char path[256];
+	struct utimbuf t;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "%s/%s", document_root, name);
+	f = fopen(path, "w");
+	if (f == NULL) {
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+	fprintf(f, content, arg);
+	fclose(f);
+
+	/* Script caches only use files older than the current second */
+	t.actime = t.modtime = time(NULL) - age;
+	utime(path, &t);
+}
+
+
+static void
+remove_file(const char *name)
+{
+	char path[256];
+	snprintf(path, sizeof(path), "%s/%s", document_root, name);
+	remove(path);
+}
+
+
+/* Send a GET request, return the response body or NULL */
+static char *
+get(int port, const char *name, char *buf, size_t buflen)
+{
+	struct sockaddr_in sa;
+	char req[256];
+	size_t got = 0;
+	ssize_t n;
+	int reqlen, sock;
+	char *body;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_port = htons((unsigned short)port);
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	sock = socket(AF_INET, SOCK_STREAM, 0);
+	if (sock < 0) {
+		return NULL;
+	}
+	if (connect(sock, (struct sockaddr *)&sa, sizeof(sa)) != 0) {
+		close(sock);
+		return NULL;
+	}
+	reqlen = snprintf(req,
+	                  sizeof(req),
+	                  "GET /%s HTTP/1.1\r\nHost: localhost\r\n"
+	                  "Connection: close\r\n\r\n",
+	                  name);
+	if (send(sock, req, (size_t)reqlen, 0) != reqlen) {
+		close(sock);
+		return NULL;
+	}
+	while ((got < buflen - 1)
+	       && ((n = recv(sock, buf + got, buflen - 1 - got, 0)) > 0)) {
+		got += (size_t)n;
+	}
+	close(sock);
+	buf[got] = 0;
+
+	if (strncmp(buf, "HTTP/1.", 7) || strncmp(buf + 9, "200", 3)) {
+		return NULL;
+	}
+	body = strstr(buf, "\r\n\r\n");
+	return (body != NULL) ? (body + 4) : NULL;
+}
+
+
+static int
+get_text(int port, const char *name, const char *expected)
+{
+	char buf[1024];
+	const char *body = get(port, name, buf, sizeof(buf));
+	return (body != NULL) && !strcmp(body, expected);
+}
+
+
+struct client {
+	pthread_t thread;
+	int port;
+	const char *name;
+	const char *expected;
+	double end;
+	long ok;
+	long failed;
+};
+
+
+static double
+now(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (double)tv.tv_sec + (double)tv.tv_usec / 1.0e6;
+}
+
+
+static void *
+client_thread(void *arg)
+{
+	struct client *c = (struct client *)arg;
+
+	while (now() < c->end) {
+		if (get_text(c->port, c->name, c->expected)) {
+			c->ok++;
+		} else {
+			c->failed++;
+		}
+	}
+	return NULL;
+}
+
+
+/* Get the "created" or "reused" counter of the interpreter states */
+static long
+get_stats(struct mg_context *ctx, const char *object, const char *counter)
+{
+	char buf[8192], key[64];
+	const char *p;
+
+	if (mg_get_context_info(ctx, buf, sizeof(buf)) <= 0) {
+		return -1;
+	}
+	snprintf(key, sizeof(key), "\"%s\" : ", counter);
+	if (((p = strstr(buf, object)) == NULL) || ((p = strstr(p, key)) == NULL)) {
+		return -1;
+	}
+	return atol(p + strlen(key));
+}
+
+
+static void
+run(const struct script_type *st,
+    const char *reuse,
+    double seconds,
+    int num_clients,
+    const char *num_threads)
+{
+	const char *options[] = {"listening_ports",
+	                         "127.0.0.1:0",
+	                         "document_root",
+	                         document_root,
+	                         "num_threads",
+	                         num_threads,
+	                         st->option,
+	                         reuse,
+	                         NULL};
+	struct client clients[64];
+	struct mg_server_port port_info;
+	struct mg_context *ctx;
+	char clobber[64];
+	long ok = 0, failed = 0;
+	int i, port;
+
+	snprintf(clobber, sizeof(clobber), "clobber.%s", strchr(st->name, '.') + 1);
+	write_file(st->name, st->source, "first", 10);
+	write_file(clobber, st->clobber, "", 10);
+
+	ctx = mg_start(NULL, NULL, options);
+	if (ctx == NULL) {
+		check(0, "start server", st->name, reuse);
+		return;
+	}
+	if (mg_get_server_ports(ctx, 1, &port_info) != 1) {
+		check(0, "get server port", st->name, reuse);
+		mg_stop(ctx);
+		return;
+	}
+	port = port_info.port;
+
+	/* Requests see neither globals nor replaced globals of earlier ones */
+	for (i = 0; i < 3; i++) {
+		check(get_text(port, st->name, "first 1\n"),
+		      "run script",
+		      st->name,
+		      reuse);
+		check(get_text(port, clobber, "clobbered\n"),
+		      "run clobber",
+		      st->name,
+		      reuse);
+	}
+
+	/* Changed scripts are loaded again */
+	write_file(st->name, st->source, "changed script", 5);
+	check(get_text(port, st->name, "changed script 1\n"),
+	      "reload changed script",
+	      st->name,
+	      reuse);
+
+	if (num_clients > (int)(sizeof(clients) / sizeof(clients[0]))) {
+		num_clients = (int)(sizeof(clients) / sizeof(clients[0]));
+	}
+	for (i = 0; i < num_clients; i++) {
+		clients[i].port = port;
+		clients[i].name = st->name;
+		clients[i].expected = "changed script 1\n";
+		clients[i].end = now() + seconds;
+		clients[i].ok = clients[i].failed = 0;
+		pthread_create(&clients[i].thread, NULL, client_thread, &clients[i]);
+	}
+	for (i = 0; i < num_clients; i++) {
+		pthread_join(clients[i].thread, NULL);
+		ok += clients[i].ok;
+		failed += clients[i].failed;
+	}
+	check(failed == 0, "benchmark responses", st->name, reuse);
+	if (!strcmp(reuse, "yes")) {
+		check(get_stats(ctx, st->stats, "reused") > 0,
+		      "reuse states",
+		      st->name,
+		      reuse);
+	}
+
+	printf("%-11s reuse %-3s %8.0f requests/s (%ld created, %ld reused)\n",
+	       st->name,
+	       reuse,
+	       (double)ok / seconds,
+	       get_stats(ctx, st->stats, "created"),
+	       get_stats(ctx, st->stats, "reused"));
+
+	mg_stop(ctx);
+	remove_file(st->name);
+	remove_file(clobber);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+	double seconds = (argc > 1) ? atof(argv[1]) : 5.0;
+	int num_clients = (argc > 2) ? atoi(argv[2]) : 4;
+	const char *num_threads = (argc > 3) ? argv[3] : "4";
+	size_t i;
+
+	signal(SIGPIPE, SIG_IGN);
+	if (mkdtemp(document_root) == NULL) {
+		perror(document_root);
+		return EXIT_FAILURE;
+	}
+	mg_init_library(0);
+
+	for (i = 0; i < sizeof(script_types) / sizeof(script_types[0]); i++) {
+		run(&script_types[i], "no", seconds, num_clients, num_threads);
+		run(&script_types[i], "yes", seconds, num_clients, num_threads);
+	}
+
+	mg_exit_library();
+	rmdir(document_root);
+
+	if (failures > 0) {
+		fprintf(stderr, "%d checks failed\n", failures);
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
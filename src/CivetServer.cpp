@@ -19,6 +19,25 @@
 #define MAX_PARAM_BODY_LENGTH (1024 * 1024 * 2)
 #endif
 
+#if (__cplusplus >= 201103L) || (defined(_MSC_VER) && (_MSC_VER >= 1900))
+#define CIVET_THREAD_LOCAL thread_local
+#elif defined(_MSC_VER)
+#define CIVET_THREAD_LOCAL __declspec(thread)
+#else
+#define CIVET_THREAD_LOCAL __thread
+#endif
+
+// A thread runs one handler at a time. The state of its request is owned
+// by the ConnectionScope of the handler and found through these thread
+// local pointers instead of a map shared by all workers.
+static CIVET_THREAD_LOCAL const struct mg_connection *workerConn = NULL;
+static CIVET_THREAD_LOCAL void *workerConnState = NULL;
+
+// State used by getParam outside of a handler, until the connection is
+// closed
+static CIVET_THREAD_LOCAL const struct mg_connection *otherConn = NULL;
+static CIVET_THREAD_LOCAL void *otherConnState = NULL;
+
 bool
 CivetHandler::handleGet(CivetServer *server, struct mg_connection *conn)
 {
@@ -208,6 +227,33 @@ CivetWebSocketHandler::handleClose(CivetServer *server,
 	return;
 }
 
+// Map the request method to a Method, using the first character to
+// select the only candidate(s) to compare with.
+CivetServer::Method
+CivetServer::getMethod(const char *method)
+{
+	switch (method[0]) {
+	case 'G':
+		return strcmp(method, "GET") ? METHOD_OTHER : METHOD_GET;
+	case 'P':
+		if (!strcmp(method, "POST")) {
+			return METHOD_POST;
+		}
+		if (!strcmp(method, "PUT")) {
+			return METHOD_PUT;
+		}
+		return strcmp(method, "PATCH") ? METHOD_OTHER : METHOD_PATCH;
+	case 'H':
+		return strcmp(method, "HEAD") ? METHOD_OTHER : METHOD_HEAD;
+	case 'D':
+		return strcmp(method, "DELETE") ? METHOD_OTHER : METHOD_DELETE;
+	case 'O':
+		return strcmp(method, "OPTIONS") ? METHOD_OTHER : METHOD_OPTIONS;
+	default:
+		return METHOD_OTHER;
+	}
+}
+
 int
 CivetServer::requestHandler(struct mg_connection *conn, void *cbdata)
 {
@@ -222,48 +268,57 @@ CivetServer::requestHandler(struct mg_connection *conn, void *cbdata)
 	if (me->context == NULL)
 		return 0;
 
-	mg_lock_context(me->context);
-	me->connections[conn] = CivetConnection();
-	mg_unlock_context(me->context);
+	CivetConnection state;
+	ConnectionScope scope(conn, &state);
 
 	CivetHandler *handler = (CivetHandler *)cbdata;
 
 	if (handler) {
-		if (strcmp(request_info->request_method, "GET") == 0) {
+		switch (getMethod(request_info->request_method)) {
+		case METHOD_GET:
 			status_ok = handler->handleGet(me, conn, &http_status_code);
 			if (http_status_code < 0) {
 				status_ok = handler->handleGet(me, conn);
 			}
-		} else if (strcmp(request_info->request_method, "POST") == 0) {
+			break;
+		case METHOD_POST:
 			status_ok = handler->handlePost(me, conn, &http_status_code);
 			if (http_status_code < 0) {
 				status_ok = handler->handlePost(me, conn);
 			}
-		} else if (strcmp(request_info->request_method, "HEAD") == 0) {
+			break;
+		case METHOD_HEAD:
 			status_ok = handler->handleHead(me, conn, &http_status_code);
 			if (http_status_code < 0) {
 				status_ok = handler->handleHead(me, conn);
 			}
-		} else if (strcmp(request_info->request_method, "PUT") == 0) {
+			break;
+		case METHOD_PUT:
 			status_ok = handler->handlePut(me, conn, &http_status_code);
 			if (http_status_code < 0) {
 				status_ok = handler->handlePut(me, conn);
 			}
-		} else if (strcmp(request_info->request_method, "DELETE") == 0) {
+			break;
+		case METHOD_DELETE:
 			status_ok = handler->handleDelete(me, conn, &http_status_code);
 			if (http_status_code < 0) {
 				status_ok = handler->handleDelete(me, conn);
 			}
-		} else if (strcmp(request_info->request_method, "OPTIONS") == 0) {
+			break;
+		case METHOD_OPTIONS:
 			status_ok = handler->handleOptions(me, conn, &http_status_code);
 			if (http_status_code < 0) {
 				status_ok = handler->handleOptions(me, conn);
 			}
-		} else if (strcmp(request_info->request_method, "PATCH") == 0) {
+			break;
+		case METHOD_PATCH:
 			status_ok = handler->handlePatch(me, conn, &http_status_code);
 			if (http_status_code < 0) {
 				status_ok = handler->handlePatch(me, conn);
 			}
+			break;
+		default:
+			break;
 		}
 	}
 
@@ -274,6 +329,37 @@ CivetServer::requestHandler(struct mg_connection *conn, void *cbdata)
 	return http_status_code;
 }
 
+int
+CivetServer::routeHandler(struct mg_connection *conn, void *cbdata)
+{
+	const struct mg_request_info *request_info = mg_get_request_info(conn);
+	assert(request_info != NULL);
+	CivetServer *me = (CivetServer *)(request_info->user_data);
+	assert(me != NULL);
+
+	// Happens when a request hits the server before the context is saved
+	if (me->context == NULL)
+		return 0;
+
+	CivetConnection state;
+	ConnectionScope scope(conn, &state);
+
+	const Route *route = (const Route *)cbdata;
+	const RouteSlot *slot =
+	    &route->method[getMethod(request_info->request_method)];
+	if ((slot->func == NULL) && (slot->callable == NULL)) {
+		slot = &route->any;
+	}
+
+	if (slot->callable != NULL) {
+		return slot->callable->call(slot->callable, me, conn);
+	}
+	if (slot->func != NULL) {
+		return slot->func(me, conn);
+	}
+	return 0;
+}
+
 int
 CivetServer::authHandler(struct mg_connection *conn, void *cbdata)
 {
@@ -286,9 +372,8 @@ CivetServer::authHandler(struct mg_connection *conn, void *cbdata)
 	if (me->context == NULL)
 		return 0;
 
-	mg_lock_context(me->context);
-	me->connections[conn] = CivetConnection();
-	mg_unlock_context(me->context);
+	CivetConnection state;
+	ConnectionScope scope(conn, &state);
 
 	CivetAuthHandler *handler = (CivetAuthHandler *)cbdata;
 
@@ -462,15 +547,169 @@ CivetServer::closeHandler(const struct mg_connection *conn)
 	if (me->userCloseHandler) {
 		me->userCloseHandler(conn);
 	}
-	mg_lock_context(me->context);
-	me->connections.erase(conn);
-	mg_unlock_context(me->context);
+	if (otherConn == conn) {
+		delete (CivetConnection *)otherConnState;
+		otherConnState = NULL;
+		otherConn = NULL;
+	}
+}
+
+CivetServer::CivetConnection &
+CivetServer::getConnection(const struct mg_connection *conn)
+{
+	if ((workerConn == conn) && (workerConnState != NULL)) {
+		return *(CivetConnection *)workerConnState;
+	}
+
+	// Not called by a handler of this request
+	CivetConnection *conobj = (CivetConnection *)otherConnState;
+	if (conobj == NULL) {
+		conobj = new CivetConnection();
+		otherConnState = conobj;
+	} else if (otherConn != conn) {
+		conobj->clear();
+	}
+	otherConn = conn;
+	return *conobj;
+}
+
+void
+CivetServer::swapWorkerState(WorkerState &ws)
+{
+	WorkerState cur;
+	cur.conn = workerConn;
+	cur.state = (CivetConnection *)workerConnState;
+	workerConn = ws.conn;
+	workerConnState = ws.state;
+	ws = cur;
+}
+
+void
+CivetServer::CivetConnection::clear()
+{
+	postData.clear();
+	paramsIndexed = false;
+	paramData.clear();
+	params.clear();
+}
+
+void
+CivetServer::CivetConnection::readPostData(struct mg_connection *conn)
+{
+	if (!postData.empty()) {
+		return;
+	}
+	// check if there is a request body
+	for (;;) {
+		char buf[2048];
+		int r = mg_read(conn, buf, sizeof(buf));
+		try {
+			if (r == 0) {
+				postData.push_back('\0');
+				break;
+			} else if ((r < 0)
+			           || ((postData.size() + r) > MAX_PARAM_BODY_LENGTH)) {
+				postData.assign(1, '\0');
+				break;
+			}
+			postData.insert(postData.end(), buf, buf + r);
+		} catch (...) {
+			postData.clear();
+			break;
+		}
+	}
+}
+
+void
+CivetServer::CivetConnection::addParams(const char *data,
+                                        size_t data_len,
+                                        bool inQuery)
+{
+	const char *end = data + data_len;
+
+	// Decoding never makes a value longer, so one reservation is enough
+	// and the offsets stay valid.
+	paramData.reserve(paramData.size() + data_len + 1);
+
+	while (data < end) {
+		const char *amp = (const char *)memchr(data, '&', end - data);
+		const char *next = amp ? amp : end;
+		const char *eq = (const char *)memchr(data, '=', next - data);
+
+		if (eq != NULL) {
+			Param p;
+			p.name = paramData.size();
+			p.nameLen = eq - data;
+			paramData.append(data, p.nameLen);
+
+			p.value = paramData.size();
+			paramData.resize(p.value + (next - eq));
+			int r = mg_url_decode(eq + 1,
+			                      (int)(next - eq - 1),
+			                      &paramData[p.value],
+			                      (int)(next - eq),
+			                      1);
+			p.valueLen = (r < 0) ? 0 : (size_t)r;
+			paramData.resize(p.value + p.valueLen);
+			p.inQuery = inQuery;
+			params.push_back(p);
+		}
+		data = amp ? amp + 1 : end;
+	}
 }
 
 void
 CivetServer::addHandler(const std::string &uri, CivetHandler *handler)
 {
 	mg_set_request_handler(context, uri.c_str(), requestHandler, handler);
+	retireRoute(uri);
+}
+
+void
+CivetServer::setRouteSlot(const std::string &uri,
+                          const char *method,
+                          const RouteSlot &slot)
+{
+	Method m = METHOD_OTHER;
+	if (method != NULL) {
+		m = getMethod(method);
+		if (m == METHOD_OTHER) {
+			throw CivetException(std::string("unsupported request method ")
+			                     + method);
+		}
+	}
+
+	Route *route = new Route();
+	std::map<std::string, Route *>::iterator it = routes.find(uri);
+	try {
+		if (it != routes.end()) {
+			*route = *it->second;
+			retiredRoutes.push_back(it->second);
+			it->second = route;
+		} else {
+			routes[uri] = route;
+		}
+	} catch (...) {
+		delete route;
+		throw;
+	}
+
+	if (m == METHOD_OTHER) {
+		route->any = slot;
+	} else {
+		route->method[m] = slot;
+	}
+	mg_set_request_handler(context, uri.c_str(), routeHandler, route);
+}
+
+void
+CivetServer::retireRoute(const std::string &uri)
+{
+	std::map<std::string, Route *>::iterator it = routes.find(uri);
+	if (it != routes.end()) {
+		retiredRoutes.push_back(it->second);
+		routes.erase(it);
+	}
 }
 
 void
@@ -496,6 +735,7 @@ void
 CivetServer::removeHandler(const std::string &uri)
 {
 	mg_set_request_handler(context, uri.c_str(), NULL, NULL);
+	retireRoute(uri);
 }
 
 void
@@ -518,6 +758,21 @@ CivetServer::close()
 		mg_stop(context);
 		context = 0;
 	}
+
+	// All workers are stopped, no handler can use the routes any more
+	std::map<std::string, Route *>::iterator it;
+	for (it = routes.begin(); it != routes.end(); ++it) {
+		delete it->second;
+	}
+	routes.clear();
+	for (size_t i = 0; i < retiredRoutes.size(); i++) {
+		delete retiredRoutes[i];
+	}
+	retiredRoutes.clear();
+	for (size_t i = 0; i < callables.size(); i++) {
+		callables[i]->destroy(callables[i]);
+	}
+	callables.clear();
 }
 
 int
@@ -584,35 +839,10 @@ CivetServer::getParam(struct mg_connection *conn,
 	const char *queryString = NULL;
 	const struct mg_request_info *ri = mg_get_request_info(conn);
 	assert(ri != NULL);
-	CivetServer *me = (CivetServer *)(ri->user_data);
-	assert(me != NULL);
-	mg_lock_context(me->context);
-	CivetConnection &conobj = me->connections[conn];
-	mg_unlock_context(me->context);
+	CivetConnection &conobj = getConnection(conn);
 
 	mg_lock_connection(conn);
-	if (conobj.postData.empty()) {
-		// check if there is a request body
-		for (;;) {
-			char buf[2048];
-			int r = mg_read(conn, buf, sizeof(buf));
-			try {
-				if (r == 0) {
-					conobj.postData.push_back('\0');
-					break;
-				} else if ((r < 0)
-				           || ((conobj.postData.size() + r)
-				               > MAX_PARAM_BODY_LENGTH)) {
-					conobj.postData.assign(1, '\0');
-					break;
-				}
-				conobj.postData.insert(conobj.postData.end(), buf, buf + r);
-			} catch (...) {
-				conobj.postData.clear();
-				break;
-			}
-		}
-	}
+	conobj.readPostData(conn);
 	if (!conobj.postData.empty()) {
 		// check if form parameter are already stored
 		formParams = &conobj.postData[0];
@@ -672,6 +902,130 @@ CivetServer::getParam(const char *data,
 	return false;
 }
 
+#if defined(CIVETWEB_CXX_STRING_VIEW)
+std::string_view
+CivetServer::getHeaderView(const struct mg_connection *conn,
+                           const char *headerName)
+{
+	const char *value = mg_get_header(conn, headerName);
+	if (value == NULL) {
+		return std::string_view();
+	}
+	return std::string_view(value);
+}
+
+std::string_view
+CivetServer::getQueryString(const struct mg_connection *conn)
+{
+	const struct mg_request_info *ri = mg_get_request_info(conn);
+	if ((ri == NULL) || (ri->query_string == NULL)) {
+		return std::string_view();
+	}
+	return std::string_view(ri->query_string);
+}
+
+bool
+CivetServer::getCookie(struct mg_connection *conn,
+                       const char *cookieName,
+                       std::string_view &cookieValue)
+{
+	// Same rules as mg_get_cookie, without copying the value
+	std::string_view header = getHeaderView(conn, "Cookie");
+	size_t nameLen = strlen(cookieName);
+
+	cookieValue = std::string_view();
+	for (size_t pos = 0; pos + nameLen < header.size(); pos++) {
+		if ((header[pos + nameLen] != '=')
+		    || ((pos > 0) && (header[pos - 1] != ' '))
+		    || mg_strncasecmp(header.data() + pos, cookieName, nameLen)) {
+			continue;
+		}
+		size_t begin = pos + nameLen + 1;
+		size_t end = header.find(' ', begin);
+		if (end == std::string_view::npos) {
+			end = header.size();
+		}
+		if (header[end - 1] == ';') {
+			end--;
+		}
+		if ((end > begin + 1) && (header[begin] == '"')
+		    && (header[end - 1] == '"')) {
+			begin++;
+			end--;
+		}
+		cookieValue = header.substr(begin, end - begin);
+		return true;
+	}
+	return false;
+}
+
+bool
+CivetServer::getParam(struct mg_connection *conn,
+                      const char *name,
+                      std::string_view &dst,
+                      size_t occurrence)
+{
+	const struct mg_request_info *ri = mg_get_request_info(conn);
+	assert(ri != NULL);
+	CivetConnection &conobj = getConnection(conn);
+
+	if (!conobj.paramsIndexed) {
+		mg_lock_connection(conn);
+		conobj.readPostData(conn);
+		mg_unlock_connection(conn);
+		try {
+			if (!conobj.postData.empty()) {
+				const char *formParams = &conobj.postData[0];
+				conobj.addParams(formParams, strlen(formParams), false);
+			}
+			if (ri->query_string != NULL) {
+				conobj.addParams(ri->query_string,
+				                 strlen(ri->query_string),
+				                 true);
+			}
+		} catch (...) {
+			conobj.paramData.clear();
+			conobj.params.clear();
+		}
+		conobj.paramsIndexed = true;
+	}
+
+	// Form parameters first, then the query string
+	size_t nameLen = strlen(name);
+	for (int inQuery = 0; inQuery < 2; inQuery++) {
+		size_t n = occurrence;
+		for (size_t i = 0; i < conobj.params.size(); i++) {
+			const CivetConnection::Param &p = conobj.params[i];
+			if ((p.inQuery == (inQuery != 0)) && (p.nameLen == nameLen)
+			    && !mg_strncasecmp(name, &conobj.paramData[p.name], nameLen)
+			    && (n-- == 0)) {
+				dst = std::string_view(conobj.paramData.data() + p.value,
+				                       p.valueLen);
+				return true;
+			}
+		}
+	}
+	dst = std::string_view();
+	return false;
+}
+
+std::string_view
+CivetServer::getPostDataView(struct mg_connection *conn)
+{
+	CivetConnection &conobj = getConnection(conn);
+
+	mg_lock_connection(conn);
+	conobj.readPostData(conn);
+	mg_unlock_connection(conn);
+
+	if (conobj.postData.size() <= 1) {
+		return std::string_view();
+	}
+	// postData is terminated by an additional '\0'
+	return std::string_view(&conobj.postData[0], conobj.postData.size() - 1);
+}
+#endif
+
 std::string
 CivetServer::getPostData(struct mg_connection *conn)
 {
@@ -492,6 +492,17 @@ _civet_safe_clock_gettime(int clk_id, struct timespec *t)
 #define MG_BUF_LEN (1024 * 8)
 #endif
 
+/* Maximum number of ranges in a multipart/byteranges response.
+ * Requests with more ranges get the entire file. */
+#if !defined(MG_MAX_RANGES)
+#define MG_MAX_RANGES (16)
+#endif
+
+/* Buffer size for storing request bodies (PUT, mg_store_body). */
+#if !defined(MG_STORE_BUF_LEN) /* in bytes */
+#define MG_STORE_BUF_LEN (1024 * 256)
+#endif
+
 
 /********************************************************************/
 
@@ -502,6 +513,18 @@ _civet_safe_clock_gettime(int clk_id, struct timespec *t)
 
 #include <stdint.h>
 
+/* SSE2 is part of the x86-64 baseline (and of any x86 build targeting it),
+ * so it can be used without a runtime CPU check. */
+#if !defined(NO_SSE2) && !defined(USE_SSE2)
+#if defined(__SSE2__) || defined(_M_X64)                                      \
+    || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#define USE_SSE2
+#endif
+#endif
+#if defined(USE_SSE2)
+#include <emmintrin.h>
+#endif
+
 /* Standard defines */
 #if !defined(INT64_MAX)
 #define INT64_MAX (9223372036854775807)
@@ -882,7 +905,7 @@ typedef unsigned short int in_port_t;
 #include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
-#if defined(USE_X_DOM_SOCKET)
+#if defined(USE_X_DOM_SOCKET) || !defined(NO_CGI)
 #include <sys/un.h>
 #endif
 #endif
@@ -910,6 +933,7 @@ typedef unsigned short int in_port_t;
 #define closesocket(a) (close(a))
 #define mg_mkdir(conn, path, mode) (mkdir(path, mode))
 #define mg_remove(conn, x) (remove(x))
+#define mg_rename(conn, x, y) (rename(x, y))
 #define mg_sleep(x) (usleep((x)*1000))
 #define mg_opendir(conn, x) (opendir(x))
 #define mg_closedir(x) (closedir(x))
@@ -1584,6 +1608,12 @@ struct mg_workerTLS {
 #if defined(MG_ALLOW_USING_GET_REQUEST_INFO_FOR_RESPONSE)
 	char txtbuf[4];
 #endif
+	/* Last formatted HTTP dates (see gmt_time_string). Two slots, since a
+	 * response typically needs "now" and a file modification time. */
+	unsigned date_cache_valid; /* bit mask of valid slots */
+	unsigned date_cache_next;  /* slot to overwrite on the next miss */
+	time_t date_cache_time[2];
+	char date_cache_str[2][32];
 };
 
 
@@ -1637,6 +1667,7 @@ mg_current_thread_id(void)
 			 */
 			tls = (struct mg_workerTLS *)mg_malloc(sizeof(struct mg_workerTLS));
 			tls->is_master = -2; /* -2 means "3rd party thread" */
+			tls->date_cache_valid = 0;
 			tls->thread_idx = (unsigned)mg_atomic_inc(&thread_idx_max);
 			pthread_setspecific(sTlsKey, tls);
 		}
@@ -1867,6 +1898,8 @@ struct mg_file_stat {
 struct mg_file_access {
 	/* File properties filled by mg_fopen: */
 	FILE *fp;
+	/* Set if fp is shared by the file cache, see mg_fopen_cached */
+	struct file_cache_entry *cached;
 };
 
 struct mg_file {
@@ -1879,11 +1912,29 @@ struct mg_file {
 	{                                                                          \
 		{(uint64_t)0, (time_t)0, 0, 0, 0},                                     \
 		{                                                                      \
-			(FILE *)NULL                                                       \
+			(FILE *)NULL, NULL                                                 \
 		}                                                                      \
 	}
 
 
+#if !defined(NO_FILESYSTEMS)
+/* Number of slots of the stat and file cache */
+#if !defined(FILE_CACHE_SIZE)
+#define FILE_CACHE_SIZE (256)
+#endif
+
+/* Cached result of mg_stat, and maybe the file opened for reading */
+struct file_cache_entry {
+	char *path;
+	uint64_t time_ns; /* When the file status was read */
+	struct mg_file_stat stat;
+	int found;                   /* Result of mg_stat */
+	FILE *fp;                    /* Shared read-only file, or NULL */
+	volatile ptrdiff_t refcount; /* One for the cache, one for each user */
+};
+#endif
+
+
 /* Describes listening socket, or socket which was accept()-ed by the master
  * thread and queued for future handling by the worker thread. */
 struct socket {
@@ -1911,6 +1962,7 @@ enum {
 	                     * socket option typedef TCP_NODELAY. */
 	MAX_REQUEST_SIZE,
 	LINGER_TIMEOUT,
+	LINGER_MAX_SOCKETS,
 	CONNECTION_QUEUE_SIZE,
 	LISTEN_BACKLOG_SIZE,
 #if defined(__linux__)
@@ -1926,8 +1978,13 @@ enum {
 #if defined(USE_WEBSOCKET)
 	WEBSOCKET_TIMEOUT,
 	ENABLE_WEBSOCKET_PING_PONG,
+	WEBSOCKET_QUEUE_POLICY,
+	WEBSOCKET_QUEUE_HIGH_WATERMARK,
+	WEBSOCKET_QUEUE_LOW_WATERMARK,
+	WEBSOCKET_MAX_FLUSH_RATE,
 #endif
 	DECODE_URL,
+	STAT_CACHE_TTL,
 #if defined(USE_LUA)
 	LUA_BACKGROUND_SCRIPT,
 	LUA_BACKGROUND_SCRIPT_PARAMS,
@@ -1946,6 +2003,7 @@ enum {
 	CGI_ENVIRONMENT,
 	CGI_INTERPRETER,
 	CGI_INTERPRETER_ARGS,
+	CGI_FASTCGI_WORKERS,
 #if defined(USE_TIMERS)
 	CGI_TIMEOUT,
 #endif
@@ -1954,6 +2012,7 @@ enum {
 	CGI2_ENVIRONMENT,
 	CGI2_INTERPRETER,
 	CGI2_INTERPRETER_ARGS,
+	CGI2_FASTCGI_WORKERS,
 #if defined(USE_TIMERS)
 	CGI2_TIMEOUT,
 #endif
@@ -1963,6 +2022,7 @@ enum {
 	CGI3_ENVIRONMENT,
 	CGI3_INTERPRETER,
 	CGI3_INTERPRETER_ARGS,
+	CGI3_FASTCGI_WORKERS,
 #if defined(USE_TIMERS)
 	CGI3_TIMEOUT,
 #endif
@@ -1971,6 +2031,7 @@ enum {
 	CGI4_ENVIRONMENT,
 	CGI4_INTERPRETER,
 	CGI4_INTERPRETER_ARGS,
+	CGI4_FASTCGI_WORKERS,
 #if defined(USE_TIMERS)
 	CGI4_TIMEOUT,
 #endif
@@ -1982,6 +2043,8 @@ enum {
 	ENABLE_AUTH_DOMAIN_CHECK,
 	SSI_EXTENSIONS,
 	ENABLE_DIRECTORY_LISTING,
+	DIRECTORY_LISTING_CACHE_MAX_AGE,
+	DIRECTORY_LISTING_PAGE_SIZE,
 	GLOBAL_PASSWORDS_FILE,
 	INDEX_FILES,
 	ACCESS_CONTROL_LIST,
@@ -2004,12 +2067,14 @@ enum {
 	LUA_PRELOAD_FILE,
 	LUA_SCRIPT_EXTENSIONS,
 	LUA_SERVER_PAGE_EXTENSIONS,
+	LUA_REUSE_STATES,
 #if defined(MG_EXPERIMENTAL_INTERFACES)
 	LUA_DEBUG_PARAMS,
 #endif
 #endif
 #if defined(USE_DUKTAPE)
 	DUKTAPE_SCRIPT_EXTENSIONS,
+	DUKTAPE_REUSE_HEAPS,
 #endif
 
 #if defined(USE_WEBSOCKET)
@@ -2049,6 +2114,7 @@ static const struct mg_option config_options[] = {
     {"tcp_nodelay", MG_CONFIG_TYPE_NUMBER, "0"},
     {"max_request_size", MG_CONFIG_TYPE_NUMBER, "16384"},
     {"linger_timeout_ms", MG_CONFIG_TYPE_NUMBER, NULL},
+    {"linger_max_sockets", MG_CONFIG_TYPE_NUMBER, "64"},
     {"connection_queue", MG_CONFIG_TYPE_NUMBER, "20"},
     {"listen_backlog", MG_CONFIG_TYPE_NUMBER, "200"},
 #if defined(__linux__)
@@ -2064,8 +2130,13 @@ static const struct mg_option config_options[] = {
 #if defined(USE_WEBSOCKET)
     {"websocket_timeout_ms", MG_CONFIG_TYPE_NUMBER, NULL},
     {"enable_websocket_ping_pong", MG_CONFIG_TYPE_BOOLEAN, "no"},
+    {"websocket_queue_policy", MG_CONFIG_TYPE_STRING, "drop_oldest"},
+    {"websocket_queue_high_watermark", MG_CONFIG_TYPE_NUMBER, "1048576"},
+    {"websocket_queue_low_watermark", MG_CONFIG_TYPE_NUMBER, "262144"},
+    {"websocket_max_flush_rate", MG_CONFIG_TYPE_NUMBER, "0"},
 #endif
     {"decode_url", MG_CONFIG_TYPE_BOOLEAN, "yes"},
+    {"stat_cache_ttl_ms", MG_CONFIG_TYPE_NUMBER, "0"},
 #if defined(USE_LUA)
     {"lua_background_script", MG_CONFIG_TYPE_FILE, NULL},
     {"lua_background_script_params", MG_CONFIG_TYPE_STRING_LIST, NULL},
@@ -2084,6 +2155,7 @@ static const struct mg_option config_options[] = {
     {"cgi_environment", MG_CONFIG_TYPE_STRING_LIST, NULL},
     {"cgi_interpreter", MG_CONFIG_TYPE_FILE, NULL},
     {"cgi_interpreter_args", MG_CONFIG_TYPE_STRING, NULL},
+    {"cgi_fastcgi_workers", MG_CONFIG_TYPE_NUMBER, NULL},
 #if defined(USE_TIMERS)
     {"cgi_timeout_ms", MG_CONFIG_TYPE_NUMBER, NULL},
 #endif
@@ -2092,6 +2164,7 @@ static const struct mg_option config_options[] = {
     {"cgi2_environment", MG_CONFIG_TYPE_STRING_LIST, NULL},
     {"cgi2_interpreter", MG_CONFIG_TYPE_FILE, NULL},
     {"cgi2_interpreter_args", MG_CONFIG_TYPE_STRING, NULL},
+    {"cgi2_fastcgi_workers", MG_CONFIG_TYPE_NUMBER, NULL},
 #if defined(USE_TIMERS)
     {"cgi2_timeout_ms", MG_CONFIG_TYPE_NUMBER, NULL},
 #endif
@@ -2101,6 +2174,7 @@ static const struct mg_option config_options[] = {
     {"cgi3_environment", MG_CONFIG_TYPE_STRING_LIST, NULL},
     {"cgi3_interpreter", MG_CONFIG_TYPE_FILE, NULL},
     {"cgi3_interpreter_args", MG_CONFIG_TYPE_STRING, NULL},
+    {"cgi3_fastcgi_workers", MG_CONFIG_TYPE_NUMBER, NULL},
 #if defined(USE_TIMERS)
     {"cgi3_timeout_ms", MG_CONFIG_TYPE_NUMBER, NULL},
 #endif
@@ -2109,6 +2183,7 @@ static const struct mg_option config_options[] = {
     {"cgi4_environment", MG_CONFIG_TYPE_STRING_LIST, NULL},
     {"cgi4_interpreter", MG_CONFIG_TYPE_FILE, NULL},
     {"cgi4_interpreter_args", MG_CONFIG_TYPE_STRING, NULL},
+    {"cgi4_fastcgi_workers", MG_CONFIG_TYPE_NUMBER, NULL},
 #if defined(USE_TIMERS)
     {"cgi4_timeout_ms", MG_CONFIG_TYPE_NUMBER, NULL},
 #endif
@@ -2120,6 +2195,8 @@ static const struct mg_option config_options[] = {
     {"enable_auth_domain_check", MG_CONFIG_TYPE_BOOLEAN, "yes"},
     {"ssi_pattern", MG_CONFIG_TYPE_EXT_PATTERN, "**.shtml$|**.shtm$"},
     {"enable_directory_listing", MG_CONFIG_TYPE_BOOLEAN, "yes"},
+    {"directory_listing_cache_max_age", MG_CONFIG_TYPE_NUMBER, "0"},
+    {"directory_listing_page_size", MG_CONFIG_TYPE_NUMBER, "0"},
     {"global_auth_file", MG_CONFIG_TYPE_FILE, NULL},
     {"index_files",
      MG_CONFIG_TYPE_STRING_LIST,
@@ -2156,6 +2233,7 @@ static const struct mg_option config_options[] = {
     {"lua_preload_file", MG_CONFIG_TYPE_FILE, NULL},
     {"lua_script_pattern", MG_CONFIG_TYPE_EXT_PATTERN, "**.lua$"},
     {"lua_server_page_pattern", MG_CONFIG_TYPE_EXT_PATTERN, "**.lp$|**.lsp$"},
+    {"lua_reuse_states", MG_CONFIG_TYPE_BOOLEAN, "no"},
 #if defined(MG_EXPERIMENTAL_INTERFACES)
     {"lua_debug", MG_CONFIG_TYPE_STRING, NULL},
 #endif
@@ -2164,6 +2242,7 @@ static const struct mg_option config_options[] = {
     /* The support for duktape is still in alpha version state.
      * The name of this config option might change. */
     {"duktape_script_pattern", MG_CONFIG_TYPE_EXT_PATTERN, "**.ssjs$"},
+    {"duktape_reuse_heaps", MG_CONFIG_TYPE_BOOLEAN, "no"},
 #endif
 
 #if defined(USE_WEBSOCKET)
@@ -2244,6 +2323,7 @@ struct mg_domain_context {
 	SSL_CTX *ssl_ctx;                 /* SSL context */
 	char *config[NUM_OPTIONS];        /* Civetweb configuration parameters */
 	struct mg_handler_info *handlers; /* linked list of uri handlers */
+	struct mg_mime_index *extra_mime_types; /* parsed EXTRA_MIME_TYPES */
 	int64_t ssl_cert_last_mtime;
 
 	/* Server nonce */
@@ -2300,6 +2380,64 @@ typedef int volatile stop_flag_t;
 #endif /* STOP_FLAG_NEEDS_LOCK */
 
 
+#if !defined(NO_FILESYSTEMS)
+/* Number of directories kept in the directory listing cache */
+#if !defined(DIRECTORY_CACHE_SIZE)
+#define DIRECTORY_CACHE_SIZE (16)
+#endif
+
+/* Number of compiled SSI files and included fragments kept in memory */
+#if !defined(SSI_CACHE_SIZE)
+#define SSI_CACHE_SIZE (32)
+#endif
+
+/* Larger SSI files and larger plain files included by SSI files are sent
+ * while they are read from disk */
+#if !defined(SSI_CACHE_MAX_FILE_SIZE)
+#define SSI_CACHE_MAX_FILE_SIZE (1024 * 1024)
+#endif
+#endif
+
+#if defined(USE_DUKTAPE)
+/* Number of compiled server side JavaScript files kept in memory */
+#if !defined(DUKTAPE_CACHE_SIZE)
+#define DUKTAPE_CACHE_SIZE (32)
+#endif
+#endif
+
+
+#if !defined(__ZEPHYR__)
+/* A socket in lingering close state: FIN has been sent, the socket is
+ * closed once the peer closes too or the deadline is reached. */
+struct mg_linger_socket {
+	SOCKET sock;
+	uint64_t deadline_ns;
+};
+#endif
+
+
+/* A callback waiting for a socket or a timeout (see mg_async_wait) */
+struct mg_async_waiter {
+	SOCKET sock;          /* INVALID_SOCKET: wait for the deadline only */
+	short events;         /* POLLIN and/or POLLOUT */
+	int pfd_index;        /* Index in the poll array, -1 if not polled */
+	uint64_t deadline_ns; /* 0: no timeout */
+	int deadline_result;  /* Callback result at the deadline: 0 = timeout,
+	                       * 1 = data is buffered already, or notified */
+	const void *event;    /* mg_async_wait_event, NULL once notified */
+	mg_async_callback callback;
+	void *cbdata;
+};
+
+/* A callback ready to run, waiting for a worker thread */
+struct mg_async_task {
+	struct mg_async_task *next;
+	mg_async_callback callback;
+	void *cbdata;
+	int result;
+};
+
+
 struct mg_context {
 
 	/* Part 1 - Physical context:
@@ -2325,6 +2463,14 @@ struct mg_context {
 	volatile ptrdiff_t total_requests;
 	volatile int64_t total_data_read;
 	volatile int64_t total_data_written;
+#if defined(USE_LUA)
+	volatile ptrdiff_t lua_states_created;
+	volatile ptrdiff_t lua_states_reused;
+#endif
+#if defined(USE_DUKTAPE)
+	volatile ptrdiff_t duk_heaps_created;
+	volatile ptrdiff_t duk_heaps_reused;
+#endif
 #endif
 
 	/* Thread related */
@@ -2353,6 +2499,17 @@ struct mg_context {
 #if defined(USE_SERVER_STATS)
 	int sq_max_fill;
 #endif /* USE_SERVER_STATS */
+#if defined(USE_HTTP2)
+	struct mg_http2_stream *h2_queue_head; /* HTTP/2 streams waiting for a
+	                                        * worker thread */
+	struct mg_http2_stream *h2_queue_tail;
+	int h2_queue_len;
+#endif
+	struct mg_async_task *async_queue_head; /* Callbacks of mg_async_wait
+	                                         * waiting for a worker thread */
+	struct mg_async_task *async_queue_tail;
+	int async_queue_len;
+	int sq_idle; /* Worker threads waiting in consume_socket */
 #endif /* ALTERNATIVE_QUEUE */
 
 	/* Memory related */
@@ -2371,6 +2528,37 @@ struct mg_context {
 	struct ttimers *timers;
 #endif
 
+#if !defined(NO_FILESYSTEMS)
+	/* Recently listed directories */
+	pthread_mutex_t dir_cache_mutex; /* Protects dir_cache and the
+	                                  * refcount and listings of all
+	                                  * entries */
+	struct dir_cache_entry *dir_cache[DIRECTORY_CACHE_SIZE];
+
+	/* Compiled SSI files */
+	pthread_mutex_t ssi_cache_mutex; /* Protects ssi_cache and the refcount
+	                                  * of all entries */
+	struct ssi_template *ssi_cache[SSI_CACHE_SIZE];
+
+	/* Recently accessed files */
+	pthread_mutex_t file_cache_mutex; /* Protects file_cache */
+	struct file_cache_entry *file_cache[FILE_CACHE_SIZE];
+	uint64_t file_cache_ttl_ns; /* 0 = cache disabled */
+#endif
+
+#if defined(USE_DUKTAPE)
+	/* Bytecode of server side JavaScript files */
+	pthread_mutex_t duk_cache_mutex; /* Protects duk_cache and the refcount
+	                                  * of all entries */
+	struct mg_duk_bytecode *duk_cache[DUKTAPE_CACHE_SIZE];
+#endif
+
+#if !defined(NO_CGI) && !defined(_WIN32)
+	/* Persistent FastCGI worker processes */
+	pthread_mutex_t fastcgi_mutex; /* Protects fastcgi_apps and all apps */
+	struct fastcgi_app *fastcgi_apps;
+#endif
+
 	/* Lua specific: Background operations and shared websockets */
 #if defined(USE_LUA)
 	void *lua_background_state;   /* lua_State (here as void *) */
@@ -2378,6 +2566,41 @@ struct mg_context {
 	int lua_bg_log_available;     /* Use Lua background state for access log */
 #endif
 
+#if !defined(__ZEPHYR__)
+	/* Closed connections waiting for the peer to close as well
+	 * (see close_socket_gracefully) */
+	pthread_mutex_t linger_mutex; /* Protects linger_socks and linger_count */
+	pthread_cond_t linger_cond;   /* Signalled when a socket is added */
+	struct mg_linger_socket *linger_socks;
+	unsigned linger_max; /* 0 = linger in the worker thread */
+	unsigned linger_count;
+	pthread_t linger_threadid;
+#endif
+
+	/* Callbacks waiting for sockets or timeouts (see mg_async_wait) */
+	pthread_mutex_t async_mutex; /* Protects async_waits, async_count and
+	                              * detached_requests */
+	pthread_cond_t async_cond;   /* Wakes up the async thread */
+	struct mg_async_waiter *async_waits;
+	unsigned async_count;
+	unsigned async_size;
+	pthread_t async_threadid; /* 0 until the first wait */
+	int detached_requests;    /* See mg_detach_request */
+
+#if defined(USE_WEBSOCKET)
+	/* Websocket clients of handlers (see mg_websocket_broadcast) */
+	pthread_mutex_t ws_mutex; /* Protects ws_clients and the outbound
+	                           * queues of all clients */
+	pthread_cond_t ws_cond;   /* Wakes up the outbound queue thread and
+	                           * writers waiting for a queue to drain */
+	struct mg_connection *ws_clients;
+	pthread_t ws_out_threadid; /* 0 until the first broadcast */
+	int ws_queue_policy;          /* WS_QUEUE_* */
+	size_t ws_queue_high_watermark; /* 0: unlimited */
+	size_t ws_queue_low_watermark;
+	uint64_t ws_flush_interval_ns; /* websocket_max_flush_rate, 0: none */
+#endif
+
 	/* Server nonce */
 	pthread_mutex_t nonce_mutex; /* Protects ssl_ctx, handlers,
 	                              * ssl_cert_last_mtime, nonce_count, and
@@ -2429,10 +2652,22 @@ enum {
 #define HTTP2_DYN_TABLE_SIZE (256)
 #endif
 
+/* Max. number of concurrent streams of one HTTP/2 connection */
+#if !defined(HTTP2_MAX_STREAMS)
+#define HTTP2_MAX_STREAMS (32)
+#endif
+
+struct mg_http2_session;
+struct mg_http2_stream;
+
 struct mg_http2_connection {
 	uint32_t stream_id;
-	uint32_t dyn_table_size;
+	uint32_t dyn_table_size;   /* Number of entries, newest first */
+	uint32_t dyn_table_octets; /* Size according to RFC 7541, 4.1 */
+	uint32_t dyn_table_max_octets;
 	struct mg_header dyn_table[HTTP2_DYN_TABLE_SIZE];
+	struct mg_http2_session *session; /* State shared by all streams */
+	struct mg_http2_stream *stream;   /* NULL for the reading connection */
 };
 #endif
 
@@ -2522,9 +2757,39 @@ struct mg_connection {
 #if defined(USE_LUA) && defined(USE_WEBSOCKET)
 	void *lua_websocket_state; /* Lua_State for a websocket connection */
 #endif
+#if defined(USE_LUA)
+	void *lua_worker_state[2]; /* Lua_States kept by a worker thread for
+	                            * scripts and server pages (if reused) */
+#endif
+#if defined(USE_DUKTAPE)
+	void *duk_worker_heap; /* Duktape heap kept by a worker thread for
+	                        * server side JavaScript (if reused) */
+#endif
+#if defined(USE_WEBSOCKET)
+	/* Client of a websocket handler, in phys_ctx->ws_clients */
+	char *ws_handler_uri; /* URI the websocket handler was registered for */
+	int ws_listed;        /* In phys_ctx->ws_clients */
+	struct mg_connection *ws_prev, *ws_next;
+	struct ws_out_entry *ws_out_head, *ws_out_tail; /* Outbound queue */
+	size_t ws_out_ofs;   /* Bytes of the first frame already sent */
+	size_t ws_out_bytes; /* Bytes in the queue, not sent yet */
+	size_t ws_out_frames;
+	size_t ws_out_peak;      /* Maximum of ws_out_bytes */
+	uint64_t ws_out_dropped; /* Frames dropped or replaced by the policy */
+	int ws_out_high;   /* Above the high watermark, not yet below the low */
+	int ws_out_closed; /* Disconnected by the queue policy */
+	uint64_t ws_out_due_ns; /* Earliest time for the next flush */
+	volatile int ws_out_busy; /* "wsout" thread waits for the conn lock */
+#endif
+
+	int detached; /* The request has been moved to another connection
+	               * structure by mg_detach_request */
 
 	void *tls_user_ptr; /* User defined pointer in thread local storage,
 	                     * for quick access */
+
+	struct mg_client_pool_host *pool_host; /* Client connections taken from
+	                                        * a mg_client_pool, else NULL */
 };
 
 
@@ -2536,6 +2801,65 @@ struct de {
 };
 
 
+#if !defined(NO_FILESYSTEMS)
+/* Output formats of a directory listing */
+enum { DIR_LISTING_HTML, DIR_LISTING_JSON, DIR_LISTING_NUM_FORMATS };
+
+/* Sort orders of a directory listing: name, date, size - each ascending
+ * and descending. */
+#define DIR_LISTING_NUM_ORDERS (6)
+
+/* Pre-rendered rows of a sorted directory listing */
+struct dir_listing {
+	char *text;      /* All rows, concatenated */
+	size_t len;      /* Used length of text */
+	size_t size;     /* Allocated size of text */
+	size_t *row_ofs; /* Start of every row in text, plus end of last row */
+};
+
+/* Scanned directory, shared by all requests for the same directory */
+struct dir_cache_entry {
+	struct mg_domain_context *dom_ctx;
+	char *path;
+	time_t dir_mtime; /* Modification time of the directory when scanned */
+	time_t scan_time; /* Time when the scan started */
+	time_t last_used;
+	struct de *entries; /* Unsorted, with conn set to NULL */
+	size_t num_entries;
+	struct dir_listing *listings[DIR_LISTING_NUM_FORMATS]
+	                            [DIR_LISTING_NUM_ORDERS];
+	int refcount; /* One for the cache, one for each user */
+};
+
+/* Types of struct ssi_segment */
+enum { SSI_LITERAL, SSI_INCLUDE, SSI_EXEC };
+
+/* Part of a compiled SSI file */
+struct ssi_segment {
+	int type;
+	size_t ofs; /* SSI_LITERAL: Byte range in the text of the template */
+	size_t len;
+	char *arg; /* SSI_INCLUDE: Resolved path, SSI_EXEC: Command */
+};
+
+/* SSI file, or plain file included by an SSI file, split into literal
+ * text and directives. Shared by all requests for the same file. */
+struct ssi_template {
+	struct mg_domain_context *dom_ctx;
+	char *path;
+	time_t mtime;        /* Modification time of the file when compiled */
+	uint64_t size;       /* Size of the file when compiled */
+	time_t compile_time; /* Time when the file was read */
+	time_t last_used;
+	int is_ssi; /* Directives are compiled, not sent as text */
+	char *text; /* File content */
+	struct ssi_segment *segments;
+	size_t num_segments;
+	int refcount; /* One for the cache, one for each user */
+};
+#endif
+
+
 #define mg_cry_internal(conn, fmt, ...)                                        \
 	mg_cry_internal_wrap(conn, NULL, __func__, __LINE__, fmt, __VA_ARGS__)
 
@@ -2879,6 +3203,7 @@ mg_fopen(const struct mg_connection *conn,
 		return 0;
 	}
 	filep->access.fp = NULL;
+	filep->access.cached = NULL;
 
 	if (mg_path_suspicious(conn, path)) {
 		return 0;
@@ -2937,13 +3262,32 @@ mg_fopen(const struct mg_connection *conn,
 }
 
 
+/* Drop a reference to a file cache entry. The shared file is closed
+ * when the entry has been evicted and the last user is gone. */
+static void
+file_cache_entry_release(struct file_cache_entry *entry)
+{
+	if (mg_atomic_dec(&entry->refcount) == 0) {
+		if (entry->fp != NULL) {
+			(void)fclose(entry->fp);
+		}
+		mg_free(entry->path);
+		mg_free(entry);
+	}
+}
+
+
 /* return 0 on success, just like fclose */
 static int
 mg_fclose(struct mg_file_access *fileacc)
 {
 	int ret = -1;
 	if (fileacc != NULL) {
-		if (fileacc->fp != NULL) {
+		if (fileacc->cached != NULL) {
+			/* The file is owned by the file cache */
+			file_cache_entry_release(fileacc->cached);
+			ret = 0;
+		} else if (fileacc->fp != NULL) {
 			ret = fclose(fileacc->fp);
 		}
 		/* reset all members of fileacc */
@@ -3313,7 +3657,7 @@ sockaddr_to_string(char *buf, size_t len, const union usa *usa)
 /* Convert time_t to a string. According to RFC2616, Sec 14.18, this must be
  * included in all responses other than 100, 101, 5xx. */
 static void
-gmt_time_string(char *buf, size_t buf_len, time_t *t)
+gmt_time_string_uncached(char *buf, size_t buf_len, time_t *t)
 {
 #if !defined(REENTRANT_TIME)
 	struct tm *tm;
@@ -3335,6 +3679,50 @@ gmt_time_string(char *buf, size_t buf_len, time_t *t)
 }
 
 
+/* Same as gmt_time_string_uncached, but the last results are kept in the
+ * thread local storage of CivetWeb threads. Date headers change only once
+ * per second, and the same Last-Modified times are formatted again and
+ * again for static files, so most calls are served from this cache without
+ * calling gmtime and strftime. Threads not created by CivetWeb (e.g., a
+ * client in a user thread) use the uncached function. */
+static void
+gmt_time_string(char *buf, size_t buf_len, time_t *t)
+{
+	struct mg_workerTLS *tls;
+	unsigned i;
+
+	if ((t == NULL) || (buf_len == 0)) {
+		gmt_time_string_uncached(buf, buf_len, t);
+		return;
+	}
+
+	tls = (struct mg_workerTLS *)pthread_getspecific(sTlsKey);
+	if (tls == NULL) {
+		gmt_time_string_uncached(buf, buf_len, t);
+		return;
+	}
+
+	for (i = 0; i < 2; i++) {
+		if ((tls->date_cache_valid & (1u << i))
+		    && (tls->date_cache_time[i] == *t)) {
+			/* The other slot is the older one now */
+			tls->date_cache_next = 1 - i;
+			mg_strlcpy(buf, tls->date_cache_str[i], buf_len);
+			return;
+		}
+	}
+
+	i = tls->date_cache_next & 1;
+	gmt_time_string_uncached(tls->date_cache_str[i],
+	                         sizeof(tls->date_cache_str[i]),
+	                         t);
+	tls->date_cache_time[i] = *t;
+	tls->date_cache_valid |= (1u << i);
+	tls->date_cache_next = 1 - i;
+	mg_strlcpy(buf, tls->date_cache_str[i], buf_len);
+}
+
+
 /* difftime for struct timespec. Return value is in seconds. */
 static double
 mg_difftimespec(const struct timespec *ts_now, const struct timespec *ts_before)
@@ -4735,6 +5123,14 @@ pthread_mutex_unlock(pthread_mutex_t *mutex)
 }
 
 
+FUNCTION_MAY_BE_UNUSED
+static int
+pthread_mutex_trylock(pthread_mutex_t *mutex)
+{
+	return TryEnterCriticalSection(&mutex->sec) ? 0 : EBUSY;
+}
+
+
 FUNCTION_MAY_BE_UNUSED
 static int
 pthread_cond_init(pthread_cond_t *cv, const void *unused)
@@ -5066,6 +5462,19 @@ mg_remove(const struct mg_connection *conn, const char *path)
 }
 
 
+FUNCTION_MAY_BE_UNUSED
+static int
+mg_rename(const struct mg_connection *conn,
+          const char *oldpath,
+          const char *newpath)
+{
+	wchar_t wold[UTF16_PATH_MAX], wnew[UTF16_PATH_MAX];
+	path_to_unicode(conn, oldpath, wold, ARRAY_SIZE(wold));
+	path_to_unicode(conn, newpath, wnew, ARRAY_SIZE(wnew));
+	return MoveFileExW(wold, wnew, MOVEFILE_REPLACE_EXISTING) ? 0 : -1;
+}
+
+
 static int
 mg_mkdir(const struct mg_connection *conn, const char *path, int mode)
 {
@@ -6514,6 +6923,10 @@ handle_request_stat_log(struct mg_connection *conn)
 
 	handle_request(conn);
 
+	if (conn->detached) {
+		/* Statistics and log: see mg_finish_detached_request */
+		return;
+	}
 
 #if defined(USE_SERVER_STATS)
 	conn->conn_state = 5; /* processed */
@@ -6537,10 +6950,11 @@ handle_request_stat_log(struct mg_connection *conn)
 
 
 #if defined(USE_HTTP2)
-#if defined(NO_SSL)
-#error "HTTP2 requires ALPN, APLN requires SSL/TLS"
-#endif
+#if !defined(NO_SSL)
+/* HTTP/2 over TLS is negotiated using ALPN. Without TLS, only cleartext
+ * HTTP/2 with prior knowledge (h2c) is available. */
 #define USE_ALPN
+#endif
 #include "mod_http2.inl"
 /* Not supported with HTTP/2 */
 #define HTTP1_only                                                             \
@@ -6680,7 +7094,12 @@ mg_write(struct mg_connection *conn, const void *buf, size_t len)
 	conn->request_state = 10;
 #if defined(USE_HTTP2)
 	if (conn->protocol_type == PROTOCOL_TYPE_HTTP2) {
-		http2_data_frame_head(conn, len, 0);
+		/* Send DATA frames, as the flow control windows allow */
+		total = http2_write(conn, (const char *)buf, len);
+		if (total > 0) {
+			conn->num_bytes_sent += total;
+		}
+		return total;
 	}
 #endif
 
@@ -6743,6 +7162,78 @@ mg_write(struct mg_connection *conn, const void *buf, size_t len)
 }
 
 
+#if !defined(NO_FILESYSTEMS) || defined(USE_WEBSOCKET)
+/* Buffer for mg_write_vec */
+struct mg_write_buf {
+	const char *buf;
+	size_t len;
+};
+
+/* Maximum number of buffers passed to the kernel at once */
+#define MG_WRITE_VEC_MAX (32)
+
+
+/* Write several buffers, like calling mg_write for each of them. For plain
+ * HTTP/1 and websocket connections, the buffers are passed to the kernel in
+ * one system call. Returns the number of bytes written, or -1 on error. */
+static int
+mg_write_vec(struct mg_connection *conn,
+             const struct mg_write_buf *bufs,
+             int num_bufs)
+{
+	size_t skip = 0;
+	int i, n, total = 0;
+
+	if (conn == NULL) {
+		return -1;
+	}
+
+#if !defined(_WIN32) && !defined(__ZEPHYR__)
+	if ((num_bufs > 1) && (conn->protocol_type != PROTOCOL_TYPE_HTTP2)
+	    && (conn->ssl == NULL) && (conn->throttle <= 0)) {
+		struct iovec iov[MG_WRITE_VEC_MAX];
+		struct msghdr msg;
+		ssize_t sent;
+
+		memset(&msg, 0, sizeof(msg));
+		for (i = 0; (i < num_bufs) && (i < MG_WRITE_VEC_MAX); i++) {
+			iov[i].iov_base = (void *)bufs[i].buf;
+			iov[i].iov_len = bufs[i].len;
+		}
+		msg.msg_iov = iov;
+		msg.msg_iovlen = i;
+
+		/* Whatever the socket does not take now, e.g., because its send
+		 * buffer is full, is sent by mg_write below */
+		sent = sendmsg(conn->client.sock, &msg, MSG_NOSIGNAL);
+		if (sent > 0) {
+			conn->request_state = 10;
+			conn->num_bytes_sent += sent;
+			total = (int)sent;
+			skip = (size_t)sent;
+		}
+	}
+#endif
+
+	for (i = 0; i < num_bufs; i++) {
+		if (skip >= bufs[i].len) {
+			skip -= bufs[i].len;
+			continue;
+		}
+		n = mg_write(conn, bufs[i].buf + skip, bufs[i].len - skip);
+		if (n > 0) {
+			total += n;
+		}
+		if (n != (int)(bufs[i].len - skip)) {
+			return (total > 0) ? total : -1;
+		}
+		skip = 0;
+	}
+	return total;
+}
+#endif
+
+
 /* Send a chunk, if "Transfer-Encoding: chunked" is used */
 int
 mg_send_chunk(struct mg_connection *conn,
@@ -6754,6 +7245,13 @@ mg_send_chunk(struct mg_connection *conn,
 	int ret;
 	int t;
 
+#if defined(USE_HTTP2)
+	if ((conn != NULL) && (conn->protocol_type == PROTOCOL_TYPE_HTTP2)) {
+		/* HTTP/2 does not use chunked encoding, it has DATA frames */
+		return mg_write(conn, chunk, chunk_len);
+	}
+#endif
+
 	/* First store the length information in a text buffer. */
 	sprintf(lenbuf, "%x\r\n", chunk_len);
 	lenbuf_len = strlen(lenbuf);
@@ -7286,98 +7784,326 @@ is_put_or_delete_method(const struct mg_connection *conn)
 }
 
 
-#if !defined(NO_FILES)
-static int
-extention_matches_script(
-    struct mg_connection *conn, /* in: request (must be valid) */
-    const char *filename        /* in: filename  (must be valid) */
-)
+#if !defined(NO_FILESYSTEMS)
+static unsigned
+file_cache_slot(const char *path)
 {
-#if !defined(NO_CGI)
-	unsigned char cgi_config_idx, inc, max;
-#endif
-
-#if defined(USE_LUA)
-	if (match_prefix_strlen(conn->dom_ctx->config[LUA_SCRIPT_EXTENSIONS],
-	                        filename)
-	    > 0) {
-		return 1;
-	}
-#endif
-#if defined(USE_DUKTAPE)
-	if (match_prefix_strlen(conn->dom_ctx->config[DUKTAPE_SCRIPT_EXTENSIONS],
-	                        filename)
-	    > 0) {
-		return 1;
+	/* FNV-1a hash */
+	uint32_t hash = 2166136261u;
+	while (*path) {
+		hash ^= (uint8_t)*path++;
+		hash *= 16777619u;
 	}
-#endif
-#if !defined(NO_CGI)
-	inc = CGI2_EXTENSIONS - CGI_EXTENSIONS;
-	max = PUT_DELETE_PASSWORDS_FILE - CGI_EXTENSIONS;
-	for (cgi_config_idx = 0; cgi_config_idx < max; cgi_config_idx += inc) {
-		if ((conn->dom_ctx->config[CGI_EXTENSIONS + cgi_config_idx] != NULL)
-		    && (match_prefix_strlen(
-		            conn->dom_ctx->config[CGI_EXTENSIONS + cgi_config_idx],
-		            filename)
-		        > 0)) {
-			return 1;
-		}
-	}
-#endif
-	/* filename and conn could be unused, if all preocessor conditions
-	 * are false (no script language supported). */
-	(void)filename;
-	(void)conn;
-
-	return 0;
+	return (unsigned)(hash % FILE_CACHE_SIZE);
 }
 
 
-static int
-extention_matches_template_text(
-    struct mg_connection *conn, /* in: request (must be valid) */
-    const char *filename        /* in: filename  (must be valid) */
-)
+/* Get a referenced entry for path, if it is not older than
+ * stat_cache_ttl_ms. Returns NULL if there is none. */
+static struct file_cache_entry *
+file_cache_get(struct mg_context *ctx, const char *path)
 {
-#if defined(USE_LUA)
-	if (match_prefix_strlen(conn->dom_ctx->config[LUA_SERVER_PAGE_EXTENSIONS],
-	                        filename)
-	    > 0) {
-		return 1;
+	struct file_cache_entry *entry;
+	uint64_t now;
+	unsigned slot;
+
+	if ((ctx == NULL) || (ctx->file_cache_ttl_ns == 0)) {
+		return NULL;
 	}
-#endif
-	if (match_prefix_strlen(conn->dom_ctx->config[SSI_EXTENSIONS], filename)
-	    > 0) {
-		return 1;
+
+	now = mg_get_current_time_ns();
+	slot = file_cache_slot(path);
+
+	pthread_mutex_lock(&ctx->file_cache_mutex);
+	entry = ctx->file_cache[slot];
+	if ((entry != NULL) && ((now - entry->time_ns) < ctx->file_cache_ttl_ns)
+	    && !strcmp(entry->path, path)) {
+		mg_atomic_inc(&entry->refcount);
+	} else {
+		entry = NULL;
 	}
-	return 0;
+	pthread_mutex_unlock(&ctx->file_cache_mutex);
+
+	return entry;
 }
 
 
-/* For given directory path, substitute it to valid index file.
- * Return 1 if index file has been found, 0 if not found.
- * If the file is found, it's stats is returned in stp. */
-static int
-substitute_index_file(struct mg_connection *conn,
-                      char *path,
-                      size_t path_len,
-                      struct mg_file_stat *filestat)
+/* Create an entry, referenced once by the caller. */
+static struct file_cache_entry *
+file_cache_entry_new(struct mg_context *ctx, const char *path)
 {
-	const char *list = conn->dom_ctx->config[INDEX_FILES];
-	struct vec filename_vec;
-	size_t n = strlen(path);
-	int found = 0;
+	struct file_cache_entry *entry =
+	    (struct file_cache_entry *)mg_calloc_ctx(1, sizeof(*entry), ctx);
 
-	/* The 'path' given to us points to the directory. Remove all trailing
-	 * directory separator characters from the end of the path, and
-	 * then append single directory separator character. */
-	while ((n > 0) && (path[n - 1] == '/')) {
-		n--;
+	if (entry != NULL) {
+		entry->path = mg_strdup_ctx(path, ctx);
+		if (entry->path == NULL) {
+			mg_free(entry);
+			return NULL;
+		}
+		entry->time_ns = mg_get_current_time_ns();
+		entry->refcount = 1;
 	}
-	path[n] = '/';
+	return entry;
+}
 
-	/* Traverse index files list. For each entry, append it to the given
-	 * path and see if the file exists. If it exists, break the loop */
+
+/* Store an entry in its slot, replacing the previous one. The cache takes
+ * an additional reference. */
+static void
+file_cache_put(struct mg_context *ctx, struct file_cache_entry *entry)
+{
+	struct file_cache_entry *old;
+	unsigned slot = file_cache_slot(entry->path);
+
+	mg_atomic_inc(&entry->refcount);
+
+	pthread_mutex_lock(&ctx->file_cache_mutex);
+	old = ctx->file_cache[slot];
+	ctx->file_cache[slot] = entry;
+	pthread_mutex_unlock(&ctx->file_cache_mutex);
+
+	if (old != NULL) {
+		file_cache_entry_release(old);
+	}
+}
+
+
+/* Drop all entries, e.g., after a file has been modified by a request. */
+static void
+file_cache_flush(struct mg_context *ctx)
+{
+	int i;
+
+	pthread_mutex_lock(&ctx->file_cache_mutex);
+	for (i = 0; i < FILE_CACHE_SIZE; i++) {
+		if (ctx->file_cache[i] != NULL) {
+			file_cache_entry_release(ctx->file_cache[i]);
+			ctx->file_cache[i] = NULL;
+		}
+	}
+	pthread_mutex_unlock(&ctx->file_cache_mutex);
+}
+
+
+/* Drop the entry of a file, after it has been replaced. */
+static void
+file_cache_remove(struct mg_context *ctx, const char *path)
+{
+	struct file_cache_entry *entry;
+	unsigned slot = file_cache_slot(path);
+
+	pthread_mutex_lock(&ctx->file_cache_mutex);
+	entry = ctx->file_cache[slot];
+	if ((entry != NULL) && !strcmp(entry->path, path)) {
+		ctx->file_cache[slot] = NULL;
+	} else {
+		entry = NULL;
+	}
+	pthread_mutex_unlock(&ctx->file_cache_mutex);
+
+	if (entry != NULL) {
+		file_cache_entry_release(entry);
+	}
+}
+
+
+/* mg_stat for read access, using the result of a previous call for the
+ * same path if it is not older than stat_cache_ttl_ms. Also files that do
+ * not exist (like .htpasswd or *.gz files) are cached. */
+static int
+mg_stat_cached(const struct mg_connection *conn,
+               const char *path,
+               struct mg_file_stat *filep)
+{
+	struct mg_context *ctx = conn ? conn->phys_ctx : NULL;
+	struct file_cache_entry *entry;
+	int found;
+
+	if (!filep) {
+		return 0;
+	}
+
+	entry = file_cache_get(ctx, path);
+	if (entry != NULL) {
+		*filep = entry->stat;
+		found = entry->found;
+		file_cache_entry_release(entry);
+		return found;
+	}
+
+	found = mg_stat(conn, path, filep);
+
+	if ((ctx != NULL) && (ctx->file_cache_ttl_ns > 0)) {
+		entry = file_cache_entry_new(ctx, path);
+		if (entry != NULL) {
+			entry->stat = *filep;
+			entry->found = found;
+			file_cache_put(ctx, entry);
+			file_cache_entry_release(entry);
+		}
+	}
+	return found;
+}
+
+
+/* Open a regular file for reading, like mg_fopen with MG_FOPEN_MODE_READ.
+ * Within stat_cache_ttl_ms, all requests share the same open file. Since
+ * the file position is shared as well, the file must only be read at
+ * explicit offsets (sendfile, pread). Close it with mg_fclose as usual. */
+static int
+mg_fopen_cached(const struct mg_connection *conn,
+                const char *path,
+                struct mg_file *filep)
+{
+#if defined(_WIN32)
+	/* No pread on Windows */
+	return mg_fopen(conn, path, MG_FOPEN_MODE_READ, filep);
+#else
+	struct mg_context *ctx = conn ? conn->phys_ctx : NULL;
+	struct file_cache_entry *entry;
+	struct stat st;
+
+	if (!filep) {
+		return 0;
+	}
+
+	entry = file_cache_get(ctx, path);
+	if (entry != NULL) {
+		if (entry->fp != NULL) {
+			filep->stat = entry->stat;
+			filep->access.fp = entry->fp;
+			filep->access.cached = entry;
+			return 1;
+		}
+		/* Only the status is cached */
+		file_cache_entry_release(entry);
+	}
+
+	if (!mg_fopen(conn, path, MG_FOPEN_MODE_READ, filep)) {
+		return 0;
+	}
+
+	if ((ctx == NULL) || (ctx->file_cache_ttl_ns == 0)
+	    || (fstat(fileno(filep->access.fp), &st) != 0)
+	    || !S_ISREG(st.st_mode)) {
+		/* Not shared */
+		return 1;
+	}
+
+	entry = file_cache_entry_new(ctx, path);
+	if (entry == NULL) {
+		return 1;
+	}
+
+	/* Use the status of the opened file - the path may already refer to
+	 * another file */
+	filep->stat.size = (uint64_t)(st.st_size);
+	filep->stat.last_modified = st.st_mtime;
+	entry->stat = filep->stat;
+	entry->found = 1;
+	entry->fp = filep->access.fp;
+	filep->access.cached = entry;
+	file_cache_put(ctx, entry);
+
+	return 1;
+#endif
+}
+#endif /* NO_FILESYSTEMS */
+
+
+#if !defined(NO_FILES)
+static int
+extention_matches_script(
+    struct mg_connection *conn, /* in: request (must be valid) */
+    const char *filename        /* in: filename  (must be valid) */
+)
+{
+#if !defined(NO_CGI)
+	unsigned char cgi_config_idx, inc, max;
+#endif
+
+#if defined(USE_LUA)
+	if (match_prefix_strlen(conn->dom_ctx->config[LUA_SCRIPT_EXTENSIONS],
+	                        filename)
+	    > 0) {
+		return 1;
+	}
+#endif
+#if defined(USE_DUKTAPE)
+	if (match_prefix_strlen(conn->dom_ctx->config[DUKTAPE_SCRIPT_EXTENSIONS],
+	                        filename)
+	    > 0) {
+		return 1;
+	}
+#endif
+#if !defined(NO_CGI)
+	inc = CGI2_EXTENSIONS - CGI_EXTENSIONS;
+	max = PUT_DELETE_PASSWORDS_FILE - CGI_EXTENSIONS;
+	for (cgi_config_idx = 0; cgi_config_idx < max; cgi_config_idx += inc) {
+		if ((conn->dom_ctx->config[CGI_EXTENSIONS + cgi_config_idx] != NULL)
+		    && (match_prefix_strlen(
+		            conn->dom_ctx->config[CGI_EXTENSIONS + cgi_config_idx],
+		            filename)
+		        > 0)) {
+			return 1;
+		}
+	}
+#endif
+	/* filename and conn could be unused, if all preocessor conditions
+	 * are false (no script language supported). */
+	(void)filename;
+	(void)conn;
+
+	return 0;
+}
+
+
+static int
+extention_matches_template_text(
+    struct mg_connection *conn, /* in: request (must be valid) */
+    const char *filename        /* in: filename  (must be valid) */
+)
+{
+#if defined(USE_LUA)
+	if (match_prefix_strlen(conn->dom_ctx->config[LUA_SERVER_PAGE_EXTENSIONS],
+	                        filename)
+	    > 0) {
+		return 1;
+	}
+#endif
+	if (match_prefix_strlen(conn->dom_ctx->config[SSI_EXTENSIONS], filename)
+	    > 0) {
+		return 1;
+	}
+	return 0;
+}
+
+
+/* For given directory path, substitute it to valid index file.
+ * Return 1 if index file has been found, 0 if not found.
+ * If the file is found, it's stats is returned in stp. */
+static int
+substitute_index_file(struct mg_connection *conn,
+                      char *path,
+                      size_t path_len,
+                      struct mg_file_stat *filestat)
+{
+	const char *list = conn->dom_ctx->config[INDEX_FILES];
+	struct vec filename_vec;
+	size_t n = strlen(path);
+	int found = 0;
+
+	/* The 'path' given to us points to the directory. Remove all trailing
+	 * directory separator characters from the end of the path, and
+	 * then append single directory separator character. */
+	while ((n > 0) && (path[n - 1] == '/')) {
+		n--;
+	}
+	path[n] = '/';
+
+	/* Traverse index files list. For each entry, append it to the given
+	 * path and see if the file exists. If it exists, break the loop */
 	while ((list = next_option(list, &filename_vec, NULL)) != NULL) {
 		/* Ignore too long entries that may overflow path buffer */
 		if ((filename_vec.len + 1) > (path_len - (n + 1))) {
@@ -7388,7 +8114,7 @@ substitute_index_file(struct mg_connection *conn,
 		mg_strlcpy(path + n + 1, filename_vec.ptr, filename_vec.len + 1);
 
 		/* Does it exist? */
-		if (mg_stat(conn, path, filestat)) {
+		if (mg_stat_cached(conn, path, filestat)) {
 			/* Yes it does, break the loop */
 			found = 1;
 			break;
@@ -7513,7 +8239,7 @@ interpret_uri(struct mg_connection *conn, /* in/out: request (must be valid) */
 	/* Step 8: Check if the file exists at the server */
 	/* Local file path and name, corresponding to requested URI
 	 * is now stored in "filename" variable. */
-	if (mg_stat(conn, filename, filestat)) {
+	if (mg_stat_cached(conn, filename, filestat)) {
 		int uri_len = (int)strlen(uri);
 		int is_uri_end_slash = (uri_len > 0) && (uri[uri_len - 1] == '/');
 
@@ -7570,7 +8296,8 @@ interpret_uri(struct mg_connection *conn, /* in/out: request (must be valid) */
 				} else {
 					/* Substitute file is a regular file */
 					*is_script_resource = 0;
-					*is_found = (mg_stat(conn, filename, filestat) ? 1 : 0);
+					*is_found =
+					    (mg_stat_cached(conn, filename, filestat) ? 1 : 0);
 				}
 			}
 			/* If there is no substitute file, the server could return
@@ -7594,7 +8321,7 @@ interpret_uri(struct mg_connection *conn, /* in/out: request (must be valid) */
 			goto interpret_cleanup;
 		}
 
-		if (mg_stat(conn, gz_path, filestat)) {
+		if (mg_stat_cached(conn, gz_path, filestat)) {
 			if (filestat) {
 				filestat->is_gzipped = 1;
 				*is_found = 1;
@@ -7630,7 +8357,7 @@ interpret_uri(struct mg_connection *conn, /* in/out: request (must be valid) */
 			tmp_str[sep_pos] = 0;
 			if (tmp_str[0]) {
 				is_script = extention_matches_script(conn, tmp_str);
-				does_exist = mg_stat(conn, tmp_str, filestat);
+				does_exist = mg_stat_cached(conn, tmp_str, filestat);
 			}
 
 			if (does_exist && is_script) {
@@ -7719,45 +8446,109 @@ interpret_cleanup:
 }
 
 
-/* Check whether full request is buffered. Return:
+/* Return the offset of the first byte in buf[start..buflen) that needs a
+ * closer look while searching for the end of an HTTP header: a control
+ * character (including \r and \n) or DEL. Bytes >= 128 and printable
+ * ASCII are skipped in bulk. Returns buflen if there is no such byte. */
+static int
+skip_header_text(const char *buf, int start, int buflen)
+{
+	int i = start;
+
+#if defined(USE_SSE2)
+	const __m128i ctl = _mm_set1_epi8(0x1f);
+	const __m128i del = _mm_set1_epi8(0x7f);
+
+	while (i + 16 <= buflen) {
+		const __m128i v = _mm_loadu_si128((const __m128i *)(buf + i));
+		/* min_epu8 is an unsigned compare, so bytes >= 128 do not match */
+		const __m128i is_ctl = _mm_cmpeq_epi8(_mm_min_epu8(v, ctl), v);
+		const __m128i is_del = _mm_cmpeq_epi8(v, del);
+		unsigned mask =
+		    (unsigned)_mm_movemask_epi8(_mm_or_si128(is_ctl, is_del));
+		if (mask != 0) {
+			while (!(mask & 1)) {
+				mask >>= 1;
+				i++;
+			}
+			return i;
+		}
+		i += 16;
+	}
+#else
+	/* Test 8 bytes at once: a byte below 0x20 or equal to 0x7f sets the
+	 * high bit of the corresponding byte in the result. */
+	const uint64_t ones = (uint64_t)0x0101010101010101;
+	const uint64_t highs = (uint64_t)0x8080808080808080;
+
+	while (i + 8 <= buflen) {
+		uint64_t w, del;
+		memcpy(&w, buf + i, sizeof(w));
+		del = w ^ (ones * 0x7f);
+		if ((((w - ones * 0x20) & ~w) | ((del - ones) & ~del)) & highs) {
+			break;
+		}
+		i += 8;
+	}
+#endif
+
+	while (i < buflen) {
+		const unsigned char c = (unsigned char)buf[i];
+		if ((c < 0x20) || (c == 0x7f)) {
+			break;
+		}
+		i++;
+	}
+	return i;
+}
+
+
+/* Check whether full request is buffered, starting the search at offset
+ * start. Everything before start must have been checked by an earlier call
+ * on the same buffer that returned 0. Return:
  * -1  if request or response is malformed
  *  0  if request or response is not yet fully buffered
  * >0  actual request length, including last \r\n\r\n */
 static int
-get_http_header_len(const char *buf, int buflen)
+get_http_header_len_from(const char *buf, int buflen, int start)
 {
-	int i;
-	for (i = 0; i < buflen; i++) {
-		/* Do an unsigned comparison in some conditions below */
-		const unsigned char c = (unsigned char)buf[i];
-
-		if ((c < 128) && ((char)c != '\r') && ((char)c != '\n')
-		    && !isprint(c)) {
-			/* abort scan as soon as one malformed character is found */
-			return -1;
-		}
+	int i = start;
 
-		if (i < buflen - 1) {
-			if ((buf[i] == '\n') && (buf[i + 1] == '\n')) {
+	while ((i = skip_header_text(buf, i, buflen)) < buflen) {
+		if (buf[i] == '\n') {
+			if ((i < buflen - 1) && (buf[i + 1] == '\n')) {
 				/* Two newline, no carriage return - not standard compliant,
 				 * but it should be accepted */
 				return i + 2;
 			}
-		}
-
-		if (i < buflen - 3) {
-			if ((buf[i] == '\r') && (buf[i + 1] == '\n') && (buf[i + 2] == '\r')
-			    && (buf[i + 3] == '\n')) {
+		} else if (buf[i] == '\r') {
+			if ((i < buflen - 3) && (buf[i + 1] == '\n')
+			    && (buf[i + 2] == '\r') && (buf[i + 3] == '\n')) {
 				/* Two \r\n - standard compliant */
 				return i + 4;
 			}
+		} else {
+			/* abort scan as soon as one malformed character is found */
+			return -1;
 		}
+		i++;
 	}
 
 	return 0;
 }
 
 
+/* Check whether full request is buffered. Return:
+ * -1  if request or response is malformed
+ *  0  if request or response is not yet fully buffered
+ * >0  actual request length, including last \r\n\r\n */
+static int
+get_http_header_len(const char *buf, int buflen)
+{
+	return get_http_header_len_from(buf, buflen, 0);
+}
+
+
 #if !defined(NO_CACHING)
 /* Convert month to the month number. Return -1 on error, or month number */
 static int
@@ -8103,14 +8894,109 @@ static const struct {
     {NULL, 0, NULL}};
 
 
+/* Size of the hash index of builtin mime types (power of 2, at least
+ * twice the number of table entries) */
+#define BUILTIN_MIME_HASH_SIZE (256)
+
+/* Hash index into builtin_mime_types: open addressing with linear
+ * probing, every slot holds the table index + 1, or 0 if empty.
+ * Built once by mg_init_library. */
+static uint8_t builtin_mime_hash[BUILTIN_MIME_HASH_SIZE];
+static int builtin_mime_hash_ready = 0;
+
+mg_static_assert((sizeof(builtin_mime_types) / sizeof(builtin_mime_types[0]))
+                     <= (BUILTIN_MIME_HASH_SIZE / 2),
+                 "builtin_mime_hash too small");
+
+
+/* Case insensitive hash of a file name extension */
+static uint32_t
+mime_ext_hash(const char *ext, size_t ext_len)
+{
+	/* FNV-1a hash */
+	uint32_t hash = 2166136261u;
+	size_t i;
+
+	for (i = 0; i < ext_len; i++) {
+		hash ^= (uint8_t)lowercase(ext + i);
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+
+/* Find the extension of a path: the part from the last dot on, unless
+ * there is a directory separator after it. Return its length, or 0. */
+static size_t
+mime_ext_of_path(const char *path, size_t path_len, const char **ext)
+{
+	size_t i;
+
+	for (i = path_len; i > 0; i--) {
+		if (path[i - 1] == '.') {
+			*ext = path + i - 1;
+			return path_len - (i - 1);
+		}
+		if (path[i - 1] == '/') {
+			break;
+		}
+	}
+	return 0;
+}
+
+
+static void
+builtin_mime_hash_init(void)
+{
+	size_t i, slot;
+
+	if (builtin_mime_hash_ready) {
+		return;
+	}
+
+	/* Entries are inserted in table order, so for duplicate extensions
+	 * the first one is found first, as in a linear search. */
+	for (i = 0; builtin_mime_types[i].extension != NULL; i++) {
+		slot = mime_ext_hash(builtin_mime_types[i].extension,
+		                     builtin_mime_types[i].ext_len)
+		       % BUILTIN_MIME_HASH_SIZE;
+		while (builtin_mime_hash[slot] != 0) {
+			slot = (slot + 1) % BUILTIN_MIME_HASH_SIZE;
+		}
+		builtin_mime_hash[slot] = (uint8_t)(i + 1);
+	}
+	builtin_mime_hash_ready = 1;
+}
+
+
 const char *
 mg_get_builtin_mime_type(const char *path)
 {
 	const char *ext;
-	size_t i, path_len;
+	size_t i, path_len, ext_len, slot;
 
 	path_len = strlen(path);
 
+	if (builtin_mime_hash_ready) {
+		/* All builtin extensions contain exactly one dot, at the start,
+		 * so only the last extension of the path can match. */
+		ext_len = mime_ext_of_path(path, path_len, &ext);
+		if ((ext_len > 0) && (ext > path)) {
+			slot = mime_ext_hash(ext, ext_len) % BUILTIN_MIME_HASH_SIZE;
+			while ((i = builtin_mime_hash[slot]) != 0) {
+				i--;
+				if ((builtin_mime_types[i].ext_len == ext_len)
+				    && (mg_strcasecmp(ext, builtin_mime_types[i].extension)
+				        == 0)) {
+					return builtin_mime_types[i].mime_type;
+				}
+				slot = (slot + 1) % BUILTIN_MIME_HASH_SIZE;
+			}
+		}
+		return "text/plain";
+	}
+
+	/* mg_init_library has not been called yet */
 	for (i = 0; builtin_mime_types[i].extension != NULL; i++) {
 		ext = path + (path_len - builtin_mime_types[i].ext_len);
 		if ((path_len > builtin_mime_types[i].ext_len)
@@ -8123,7 +9009,101 @@ mg_get_builtin_mime_type(const char *path)
 }
 
 
-/* Look at the "path" extension and figure what mime type it has.
+/* The extra_mime_types option of a domain, parsed once at startup */
+struct mg_mime_index {
+	size_t num_entries;
+	struct vec *ext;  /* Extension of every entry, in config order */
+	struct vec *mime; /* Mime type of every entry */
+
+	/* Hash index of all entries with a simple extension (".ext"):
+	 * slots hold entry index + 1, or 0 if empty */
+	uint32_t *hash;
+	size_t hash_size; /* Power of 2 */
+
+	/* Entries that can not be hashed (".tar.gz", no dot, ...),
+	 * ascending entry indices */
+	size_t *unhashed;
+	size_t num_unhashed;
+};
+
+
+static void
+mime_index_free(struct mg_mime_index *idx)
+{
+	if (idx != NULL) {
+		mg_free(idx->ext);
+		mg_free(idx->mime);
+		mg_free(idx->hash);
+		mg_free(idx->unhashed);
+		mg_free(idx);
+	}
+}
+
+
+/* Parse the extra_mime_types option of a domain into a hash index.
+ * Returns NULL if the option is empty or out of memory - then the
+ * option is scanned for every request. */
+static struct mg_mime_index *
+mime_index_create(struct mg_context *ctx, const char *list)
+{
+	struct mg_mime_index *idx;
+	struct vec ext_vec, mime_vec;
+	const char *l;
+	size_t n = 0, i, slot;
+
+	(void)ctx; /* Only used if USE_SERVER_STATS is defined */
+
+	for (l = list; (l = next_option(l, &ext_vec, &mime_vec)) != NULL;) {
+		n++;
+	}
+	if (n == 0) {
+		return NULL;
+	}
+
+	idx = (struct mg_mime_index *)mg_calloc_ctx(1, sizeof(*idx), ctx);
+	if (idx == NULL) {
+		return NULL;
+	}
+	idx->hash_size = 16;
+	while (idx->hash_size < 2 * n) {
+		idx->hash_size *= 2;
+	}
+	idx->ext = (struct vec *)mg_calloc_ctx(n, sizeof(struct vec), ctx);
+	idx->mime = (struct vec *)mg_calloc_ctx(n, sizeof(struct vec), ctx);
+	idx->hash =
+	    (uint32_t *)mg_calloc_ctx(idx->hash_size, sizeof(uint32_t), ctx);
+	idx->unhashed = (size_t *)mg_calloc_ctx(n, sizeof(size_t), ctx);
+	if ((idx->ext == NULL) || (idx->mime == NULL) || (idx->hash == NULL)
+	    || (idx->unhashed == NULL)) {
+		mime_index_free(idx);
+		return NULL;
+	}
+
+	for (l = list; (l = next_option(l, &ext_vec, &mime_vec)) != NULL;) {
+		const char *ext;
+		i = idx->num_entries++;
+		idx->ext[i] = ext_vec;
+		idx->mime[i] = mime_vec;
+
+		/* Only ".ext" can be found by the extension of the path */
+		if ((ext_vec.len < 2)
+		    || (mime_ext_of_path(ext_vec.ptr, ext_vec.len, &ext)
+		        != ext_vec.len)) {
+			idx->unhashed[idx->num_unhashed++] = i;
+			continue;
+		}
+		slot = mime_ext_hash(ext_vec.ptr, ext_vec.len) & (idx->hash_size - 1);
+		while (idx->hash[slot] != 0) {
+			slot = (slot + 1) & (idx->hash_size - 1);
+		}
+		idx->hash[slot] = (uint32_t)(i + 1);
+	}
+
+	return idx;
+}
+
+
+/* Look at the "path" extension and figure what mime type it has.
  * Store mime type in the vector. */
 static void
 get_mime_type(struct mg_connection *conn, const char *path, struct vec *vec)
@@ -8131,6 +9111,7 @@ get_mime_type(struct mg_connection *conn, const char *path, struct vec *vec)
 	struct vec ext_vec, mime_vec;
 	const char *list, *ext;
 	size_t path_len;
+	const struct mg_mime_index *idx;
 
 	path_len = strlen(path);
 
@@ -8143,14 +9124,49 @@ get_mime_type(struct mg_connection *conn, const char *path, struct vec *vec)
 
 	/* Scan user-defined mime types first, in case user wants to
 	 * override default mime types. */
-	list = conn->dom_ctx->config[EXTRA_MIME_TYPES];
-	while ((list = next_option(list, &ext_vec, &mime_vec)) != NULL) {
-		/* ext now points to the path suffix */
-		ext = path + path_len - ext_vec.len;
-		if (mg_strncasecmp(ext, ext_vec.ptr, ext_vec.len) == 0) {
-			*vec = mime_vec;
+	idx = conn->dom_ctx->extra_mime_types;
+	if (idx != NULL) {
+		/* The first matching entry wins: an entry found in the hash
+		 * index, unless an unhashed entry before it matches as well. */
+		size_t found = idx->num_entries, ext_len, slot, i;
+
+		ext_len = mime_ext_of_path(path, path_len, &ext);
+		if (ext_len > 0) {
+			slot = mime_ext_hash(ext, ext_len) & (idx->hash_size - 1);
+			while ((i = idx->hash[slot]) != 0) {
+				i--;
+				if ((idx->ext[i].len == ext_len)
+				    && (mg_strncasecmp(ext, idx->ext[i].ptr, ext_len) == 0)) {
+					found = i;
+					break;
+				}
+				slot = (slot + 1) & (idx->hash_size - 1);
+			}
+		}
+		for (i = 0; (i < idx->num_unhashed) && (idx->unhashed[i] < found);
+		     i++) {
+			const struct vec *e = &idx->ext[idx->unhashed[i]];
+			if ((e->len <= path_len)
+			    && (mg_strncasecmp(path + path_len - e->len, e->ptr, e->len)
+			        == 0)) {
+				found = idx->unhashed[i];
+				break;
+			}
+		}
+		if (found < idx->num_entries) {
+			*vec = idx->mime[found];
 			return;
 		}
+	} else {
+		list = conn->dom_ctx->config[EXTRA_MIME_TYPES];
+		while ((list = next_option(list, &ext_vec, &mime_vec)) != NULL) {
+			/* ext now points to the path suffix */
+			ext = path + path_len - ext_vec.len;
+			if (mg_strncasecmp(ext, ext_vec.ptr, ext_vec.len) == 0) {
+				*vec = mime_vec;
+				return;
+			}
+		}
 	}
 
 	vec->ptr = mg_get_builtin_mime_type(path);
@@ -8268,7 +9284,7 @@ open_auth_file(struct mg_connection *conn,
 			 * appear as if auth file was opened.
 			 * TODO(mid): Check if this is still required after rewriting
 			 * mg_stat */
-		} else if (mg_stat(conn, path, &filep->stat)
+		} else if (mg_stat_cached(conn, path, &filep->stat)
 		           && filep->stat.is_directory) {
 			mg_snprintf(conn,
 			            &truncated,
@@ -8278,7 +9294,10 @@ open_auth_file(struct mg_connection *conn,
 			            path,
 			            PASSWORDS_FILE_NAME);
 
-			if (truncated || !mg_fopen(conn, name, MG_FOPEN_MODE_READ, filep)) {
+			/* Most directories do not have a passwords file, the cached
+			 * status avoids trying to open it for every request. */
+			if (truncated || !mg_stat_cached(conn, name, &filep->stat)
+			    || !mg_fopen(conn, name, MG_FOPEN_MODE_READ, filep)) {
 #if defined(DEBUG)
 				/* Don't use mg_cry_internal here, but only a trace, since
 				 * this is a typical case. It will occur for every directory
@@ -8302,7 +9321,10 @@ open_auth_file(struct mg_connection *conn,
 			            p,
 			            PASSWORDS_FILE_NAME);
 
-			if (truncated || !mg_fopen(conn, name, MG_FOPEN_MODE_READ, filep)) {
+			/* Most directories do not have a passwords file, the cached
+			 * status avoids trying to open it for every request. */
+			if (truncated || !mg_stat_cached(conn, name, &filep->stat)
+			    || !mg_fopen(conn, name, MG_FOPEN_MODE_READ, filep)) {
 #if defined(DEBUG)
 				/* Don't use mg_cry_internal here, but only a trace, since
 				 * this is a typical case. It will occur for every directory
@@ -9227,14 +10249,111 @@ mg_url_encode(const char *src, char *dst, size_t dst_len)
 	return (*src == '\0') ? (int)(pos - dst) : -1;
 }
 
-/* Return 0 on success, non-zero if an error occurs. */
+#if !defined(NO_FILESYSTEMS)
+/* Append len bytes to a directory listing.
+ * Return 0 on success, non-zero if an error occurs. */
+static int
+dir_listing_append(struct dir_listing *dl, const char *s, size_t len)
+{
+	if (dl->len + len + 1 > dl->size) {
+		size_t new_size = (dl->size > 0) ? dl->size : MG_BUF_LEN;
+		char *new_text;
+
+		while (dl->len + len + 1 > new_size) {
+			new_size *= 2;
+		}
+		new_text = (char *)mg_realloc(dl->text, new_size);
+		if (new_text == NULL) {
+			return -1;
+		}
+		dl->text = new_text;
+		dl->size = new_size;
+	}
+	memcpy(dl->text + dl->len, s, len);
+	dl->len += len;
+	dl->text[dl->len] = '\0';
+	return 0;
+}
+
+
+static int dir_listing_printf(struct dir_listing *dl,
+                              PRINTF_FORMAT_STRING(const char *fmt),
+                              ...) PRINTF_ARGS(2, 3);
+
+
+/* Append formatted text to a directory listing.
+ * Return 0 on success, non-zero if an error occurs. */
+static int
+dir_listing_printf(struct dir_listing *dl, const char *fmt, ...)
+{
+	char mem[MG_BUF_LEN];
+	char *buf = NULL;
+	va_list ap;
+	int len, ret = -1;
+
+	va_start(ap, fmt);
+	len = alloc_vprintf(&buf, mem, sizeof(mem), fmt, ap);
+	va_end(ap);
+
+	if (len >= 0) {
+		ret = dir_listing_append(dl, buf, (size_t)len);
+	}
+	if (buf != mem) {
+		mg_free(buf);
+	}
+	return ret;
+}
+
+
+static void
+dir_listing_free(struct dir_listing *dl)
+{
+	if (dl != NULL) {
+		mg_free(dl->text);
+		mg_free(dl->row_ofs);
+		mg_free(dl);
+	}
+}
+
+
+/* Escape a string for a JSON string literal. The destination buffer must
+ * hold at least 6 * strlen(src) + 1 bytes. */
+static void
+json_escape_string(const char *src, char *dst)
+{
+	static const char hex[] = "0123456789abcdef";
+
+	for (; *src; src++) {
+		unsigned char c = (unsigned char)*src;
+		if ((c == '"') || (c == '\\')) {
+			*dst++ = '\\';
+			*dst++ = (char)c;
+		} else if (c < 0x20) {
+			*dst++ = '\\';
+			*dst++ = 'u';
+			*dst++ = '0';
+			*dst++ = '0';
+			*dst++ = hex[c >> 4];
+			*dst++ = hex[c & 15];
+		} else {
+			*dst++ = (char)c;
+		}
+	}
+	*dst = '\0';
+}
+
 
+/* Append one row of a HTML directory listing.
+ * Return 0 on success, non-zero if an error occurs. */
 static int
-print_dir_entry(struct de *de)
+render_dir_entry(struct mg_connection *conn,
+                 const struct de *de,
+                 struct dir_listing *dl)
 {
 	size_t namesize, escsize, i;
 	char *href, *esc, *p;
 	char size[64], mod[64];
+	int ret;
 #if defined(REENTRANT_TIME)
 	struct tm _tm;
 	struct tm *tm = &_tm;
@@ -9267,7 +10386,7 @@ print_dir_entry(struct de *de)
 	}
 
 	if (de->file.is_directory) {
-		mg_snprintf(de->conn,
+		mg_snprintf(conn,
 		            NULL, /* Buffer is big enough */
 		            size,
 		            sizeof(size),
@@ -9277,28 +10396,28 @@ print_dir_entry(struct de *de)
 		/* We use (signed) cast below because MSVC 6 compiler cannot
 		 * convert unsigned __int64 to double. Sigh. */
 		if (de->file.size < 1024) {
-			mg_snprintf(de->conn,
+			mg_snprintf(conn,
 			            NULL, /* Buffer is big enough */
 			            size,
 			            sizeof(size),
 			            "%d",
 			            (int)de->file.size);
 		} else if (de->file.size < 0x100000) {
-			mg_snprintf(de->conn,
+			mg_snprintf(conn,
 			            NULL, /* Buffer is big enough */
 			            size,
 			            sizeof(size),
 			            "%.1fk",
 			            (double)de->file.size / 1024.0);
 		} else if (de->file.size < 0x40000000) {
-			mg_snprintf(de->conn,
+			mg_snprintf(conn,
 			            NULL, /* Buffer is big enough */
 			            size,
 			            sizeof(size),
 			            "%.1fM",
 			            (double)de->file.size / 1048576);
 		} else {
-			mg_snprintf(de->conn,
+			mg_snprintf(conn,
 			            NULL, /* Buffer is big enough */
 			            size,
 			            sizeof(size),
@@ -9321,47 +10440,71 @@ print_dir_entry(struct de *de)
 		mg_strlcpy(mod, "01-Jan-1970 00:00", sizeof(mod));
 		mod[sizeof(mod) - 1] = '\0';
 	}
-	mg_printf(de->conn,
-	          "<tr><td><a href=\"%s%s\">%s%s</a></td>"
-	          "<td>&nbsp;%s</td><td>&nbsp;&nbsp;%s</td></tr>\n",
-	          href,
-	          de->file.is_directory ? "/" : "",
-	          esc ? esc : de->file_name,
-	          de->file.is_directory ? "/" : "",
-	          mod,
-	          size);
+	ret = dir_listing_printf(dl,
+	                         "<tr><td><a href=\"%s%s\">%s%s</a></td>"
+	                         "<td>&nbsp;%s</td><td>&nbsp;&nbsp;%s</td></tr>\n",
+	                         href,
+	                         de->file.is_directory ? "/" : "",
+	                         esc ? esc : de->file_name,
+	                         de->file.is_directory ? "/" : "",
+	                         mod,
+	                         size);
 	mg_free(href);
-	return 0;
+	return ret;
 }
 
 
-/* This function is called from send_directory() and used for
- * sorting directory entries by size, or name, or modification time.
- * On windows, __cdecl specification is needed in case if project is built
- * with __stdcall convention. qsort always requires __cdels callback. */
-static int WINCDECL
-compare_dir_entries(const void *p1, const void *p2)
+/* Append one element of a JSON directory listing. Every element starts
+ * with a comma, the first one of a page must be skipped when sending.
+ * Return 0 on success, non-zero if an error occurs. */
+static int
+render_dir_entry_json(const struct de *de, struct dir_listing *dl)
+{
+	char *esc;
+	int ret;
+
+	esc = (char *)mg_malloc(strlen(de->file_name) * 6 + 1);
+	if (esc == NULL) {
+		return -1;
+	}
+	json_escape_string(de->file_name, esc);
+	ret = dir_listing_printf(dl,
+	                         ",{\"name\":\"%s\",\"directory\":%s,"
+	                         "\"size\":%" INT64_FMT ",\"modified\":%" INT64_FMT
+	                         "}",
+	                         esc,
+	                         de->file.is_directory ? "true" : "false",
+	                         (int64_t)de->file.size,
+	                         (int64_t)de->file.last_modified);
+	mg_free(esc);
+	return ret;
+}
+
+
+/* Sort keys of a directory listing, see dir_sort_order() */
+static const char dir_sort_keys[] = "nds";
+
+
+/* This function is used for sorting directory entries by size, or name,
+ * or modification time. */
+static int
+compare_dir_entries(const void *p1, const void *p2, char key, int descending)
 {
 	if (p1 && p2) {
 		const struct de *a = (const struct de *)p1, *b = (const struct de *)p2;
-		const char *query_string = a->conn->request_info.query_string;
 		int cmp_result = 0;
 
-		if ((query_string == NULL) || (query_string[0] == '\0')) {
-			query_string = "n";
-		}
-
 		if (a->file.is_directory && !b->file.is_directory) {
 			return -1; /* Always put directories on top */
 		} else if (!a->file.is_directory && b->file.is_directory) {
 			return 1; /* Always put directories on top */
-		} else if (*query_string == 'n') {
+		} else if (key == 'n') {
 			cmp_result = strcmp(a->file_name, b->file_name);
-		} else if (*query_string == 's') {
+		} else if (key == 's') {
 			cmp_result = (a->file.size == b->file.size)
 			                 ? 0
 			                 : ((a->file.size > b->file.size) ? 1 : -1);
-		} else if (*query_string == 'd') {
+		} else if (key == 'd') {
 			cmp_result =
 			    (a->file.last_modified == b->file.last_modified)
 			        ? 0
@@ -9369,19 +10512,98 @@ compare_dir_entries(const void *p1, const void *p2)
 			                                                           : -1);
 		}
 
-		return (query_string[1] == 'd') ? -cmp_result : cmp_result;
+		return descending ? -cmp_result : cmp_result;
 	}
 	return 0;
 }
 
 
+/* qsort callbacks for all sort orders, indexed by dir_sort_order().
+ * On windows, __cdecl specification is needed in case if project is built
+ * with __stdcall convention. qsort always requires __cdels callback. */
+static int WINCDECL
+compare_dir_entries_na(const void *p1, const void *p2)
+{
+	return compare_dir_entries(p1, p2, 'n', 0);
+}
+
+static int WINCDECL
+compare_dir_entries_nd(const void *p1, const void *p2)
+{
+	return compare_dir_entries(p1, p2, 'n', 1);
+}
+
+static int WINCDECL
+compare_dir_entries_da(const void *p1, const void *p2)
+{
+	return compare_dir_entries(p1, p2, 'd', 0);
+}
+
+static int WINCDECL
+compare_dir_entries_dd(const void *p1, const void *p2)
+{
+	return compare_dir_entries(p1, p2, 'd', 1);
+}
+
+static int WINCDECL
+compare_dir_entries_sa(const void *p1, const void *p2)
+{
+	return compare_dir_entries(p1, p2, 's', 0);
+}
+
+static int WINCDECL
+compare_dir_entries_sd(const void *p1, const void *p2)
+{
+	return compare_dir_entries(p1, p2, 's', 1);
+}
+
+static int(WINCDECL *const dir_compare_funcs[])(const void *, const void *) = {
+    compare_dir_entries_na,
+    compare_dir_entries_nd,
+    compare_dir_entries_da,
+    compare_dir_entries_dd,
+    compare_dir_entries_sa,
+    compare_dir_entries_sd};
+
+
+/* Get the sort order requested by the query string: the first character
+ * selects the key (n = name, d = date, s = size), the second character the
+ * direction (a = ascending, d = descending). Default is by name ascending.
+ */
+static int
+dir_sort_order(const char *query_string)
+{
+	const char *key;
+	int order = 0;
+
+	if ((query_string != NULL) && (query_string[0] != '\0')) {
+		key = strchr(dir_sort_keys, query_string[0]);
+		if (key != NULL) {
+			order = (int)(key - dir_sort_keys) * 2;
+		}
+		if (query_string[1] == 'd') {
+			order++;
+		}
+	}
+	return order;
+}
+#endif /* NO_FILESYSTEMS */
+
+
+/* Name prefix of the temporary files of uploads in progress */
+#define UPLOAD_TMP_PREFIX ".upload-"
+
+
 static int
 must_hide_file(struct mg_connection *conn, const char *path)
 {
 	if (conn && conn->dom_ctx) {
 		const char *pw_pattern = "**" PASSWORDS_FILE_NAME "$";
+		const char *tmp_pattern =
+		    "**/" UPLOAD_TMP_PREFIX "*$|" UPLOAD_TMP_PREFIX "*$";
 		const char *pattern = conn->dom_ctx->config[HIDE_FILES];
 		return (match_prefix_strlen(pw_pattern, path) > 0)
+		       || (match_prefix_strlen(tmp_pattern, path) > 0)
 		       || (match_prefix_strlen(pattern, path) > 0);
 	}
 	return 0;
@@ -9418,7 +10640,7 @@ scan_directory(struct mg_connection *conn,
 
 			/* If we don't memset stat structure to zero, mtime will have
 			 * garbage and strftime() will segfault later on in
-			 * print_dir_entry(). memset is required only if mg_stat()
+			 * render_dir_entry(). memset is required only if mg_stat()
 			 * fails. For more details, see
 			 * http://code.google.com/p/mongoose/issues/detail?id=79 */
 			memset(&de.file, 0, sizeof(de.file));
@@ -9476,7 +10698,7 @@ remove_directory(struct mg_connection *conn, const char *dir)
 
 			/* If we don't memset stat structure to zero, mtime will have
 			 * garbage and strftime() will segfault later on in
-			 * print_dir_entry(). memset is required only if mg_stat()
+			 * render_dir_entry(). memset is required only if mg_stat()
 			 * fails. For more details, see
 			 * http://code.google.com/p/mongoose/issues/detail?id=79 */
 			memset(&de.file, 0, sizeof(de.file));
@@ -9558,130 +10780,486 @@ dir_scan_callback(struct de *de, void *data)
 
 
 static void
-handle_directory_request(struct mg_connection *conn, const char *dir)
+dir_cache_entry_free(struct dir_cache_entry *entry)
 {
 	size_t i;
-	int sort_direction;
-	struct dir_scan_data data = {NULL, 0, 128};
-	char date[64], *esc, *p;
-	const char *title;
-	time_t curtime = time(NULL);
+	int f, o;
 
-	if (!conn) {
-		return;
+	for (f = 0; f < DIR_LISTING_NUM_FORMATS; f++) {
+		for (o = 0; o < DIR_LISTING_NUM_ORDERS; o++) {
+			dir_listing_free(entry->listings[f][o]);
+		}
 	}
-
-	if (!scan_directory(conn, dir, &data, dir_scan_callback)) {
-		mg_send_http_error(conn,
-		                   500,
-		                   "Error: Cannot open directory\nopendir(%s): %s",
-		                   dir,
-		                   strerror(ERRNO));
-		return;
+	for (i = 0; i < entry->num_entries; i++) {
+		mg_free(entry->entries[i].file_name);
 	}
+	mg_free(entry->entries);
+	mg_free(entry->path);
+	mg_free(entry);
+}
 
-	gmt_time_string(date, sizeof(date), &curtime);
-
-	esc = NULL;
-	title = conn->request_info.local_uri;
-	if (title[strcspn(title, "&<>")]) {
-		/* HTML escaping needed */
-		esc = (char *)mg_malloc(strlen(title) * 5 + 1);
-		if (esc) {
-			for (i = 0, p = esc; title[i]; i++, p += strlen(p)) {
-				mg_strlcpy(p, title + i, 2);
-				if (*p == '&') {
-					strcpy(p, "&amp;");
-				} else if (*p == '<') {
-					strcpy(p, "&lt;");
-				} else if (*p == '>') {
-					strcpy(p, "&gt;");
-				}
-			}
-		} else {
-			title = "";
-		}
-	}
 
-	sort_direction = ((conn->request_info.query_string != NULL)
-	                  && (conn->request_info.query_string[0] != '\0')
-	                  && (conn->request_info.query_string[1] == 'd'))
-	                     ? 'a'
-	                     : 'd';
+static void
+dir_cache_release(struct mg_context *ctx, struct dir_cache_entry *entry)
+{
+	int unused;
 
-	conn->must_close = 1;
+	pthread_mutex_lock(&ctx->dir_cache_mutex);
+	unused = (--entry->refcount == 0);
+	pthread_mutex_unlock(&ctx->dir_cache_mutex);
 
-	/* Create 200 OK response */
-	mg_response_header_start(conn, 200);
-	send_static_cache_header(conn);
-	send_additional_header(conn);
-	mg_response_header_add(conn,
-	                       "Content-Type",
-	                       "text/html; charset=utf-8",
-	                       -1);
+	if (unused) {
+		dir_cache_entry_free(entry);
+	}
+}
 
-	/* Send all headers */
-	mg_response_header_send(conn);
 
-	/* Body */
-	mg_printf(conn,
-	          "<html><head><title>Index of %s</title>"
-	          "<style>th {text-align: left;}</style></head>"
-	          "<body><h1>Index of %s</h1><pre><table cellpadding=\"0\">"
-	          "<tr><th><a href=\"?n%c\">Name</a></th>"
-	          "<th><a href=\"?d%c\">Modified</a></th>"
-	          "<th><a href=\"?s%c\">Size</a></th></tr>"
-	          "<tr><td colspan=\"3\"><hr></td></tr>",
-	          esc ? esc : title,
-	          esc ? esc : title,
-	          sort_direction,
-	          sort_direction,
-	          sort_direction);
-	mg_free(esc);
+/* Find a cached scan of a directory. A cached scan is valid as long as the
+ * modification time of the directory did not change (files added, removed
+ * or renamed) and it is not older than directory_listing_cache_max_age
+ * seconds (files modified in place do not touch the directory). The cache
+ * is used only if this option is set, since the default 0 disables it.
+ * The directory is stat'ed into dir_stat, is_directory is set only if
+ * this worked. Returns a referenced entry, or NULL if it must be scanned. */
+static struct dir_cache_entry *
+dir_cache_lookup(struct mg_connection *conn,
+                 const char *dir,
+                 struct mg_file_stat *dir_stat)
+{
+	struct mg_context *ctx = conn->phys_ctx;
+	struct dir_cache_entry *entry = NULL;
+	int max_age = atoi(conn->dom_ctx->config[DIRECTORY_LISTING_CACHE_MAX_AGE]);
+	time_t now = time(NULL);
+	int i;
 
-	/* Print first entry - link to a parent directory */
-	mg_printf(conn,
-	          "<tr><td><a href=\"%s\">%s</a></td>"
-	          "<td>&nbsp;%s</td><td>&nbsp;&nbsp;%s</td></tr>\n",
-	          "..",
-	          "Parent directory",
-	          "-",
-	          "-");
+	memset(dir_stat, 0, sizeof(*dir_stat));
+	if ((max_age <= 0) || !mg_stat(conn, dir, dir_stat)) {
+		dir_stat->is_directory = 0;
+		return NULL;
+	}
 
-	/* Sort and print directory entries */
-	if (data.entries != NULL) {
-		qsort(data.entries,
-		      data.num_entries,
-		      sizeof(data.entries[0]),
-		      compare_dir_entries);
-		for (i = 0; i < data.num_entries; i++) {
-			print_dir_entry(&data.entries[i]);
-			mg_free(data.entries[i].file_name);
+	pthread_mutex_lock(&ctx->dir_cache_mutex);
+	for (i = 0; i < DIRECTORY_CACHE_SIZE; i++) {
+		struct dir_cache_entry *e = ctx->dir_cache[i];
+		if ((e != NULL) && (e->dom_ctx == conn->dom_ctx)
+		    && !strcmp(e->path, dir)) {
+			/* A change in the same second as the scan can not be
+			 * detected, so such a scan is never valid. */
+			if ((e->dir_mtime == dir_stat->last_modified)
+			    && (e->scan_time > e->dir_mtime)
+			    && ((now - e->scan_time) < (time_t)max_age)) {
+				e->refcount++;
+				e->last_used = now;
+				entry = e;
+			}
+			break;
 		}
-		mg_free(data.entries);
 	}
+	pthread_mutex_unlock(&ctx->dir_cache_mutex);
 
-	mg_printf(conn, "%s", "</table></pre></body></html>");
-	conn->status_code = 200;
+	return entry;
 }
-#endif /* NO_FILESYSTEMS */
 
 
-/* Send len bytes from the opened file to the client. */
-static void
-send_file_data(struct mg_connection *conn,
-               struct mg_file *filep,
-               int64_t offset,
-               int64_t len)
+/* Create an entry from a directory scan and store it in the cache, if the
+ * directory could be stat'ed by dir_cache_lookup. Takes ownership of the
+ * scanned entries. Returns a referenced entry, or NULL if out of memory. */
+static struct dir_cache_entry *
+dir_cache_insert(struct mg_connection *conn,
+                 const char *dir,
+                 const struct mg_file_stat *dir_stat,
+                 time_t scan_time,
+                 struct dir_scan_data *data)
 {
-	char buf[MG_BUF_LEN];
-	int to_read, num_read, num_written;
-	int64_t size;
+	struct mg_context *ctx = conn->phys_ctx;
+	struct dir_cache_entry *entry, *evicted;
+	size_t i;
+	int slot;
 
-	if (!filep || !conn) {
-		return;
+	entry = (struct dir_cache_entry *)mg_calloc_ctx(1, sizeof(*entry), ctx);
+	if (entry != NULL) {
+		entry->path = mg_strdup_ctx(dir, ctx);
 	}
-
+	if ((entry == NULL) || (entry->path == NULL)) {
+		for (i = 0; i < data->num_entries; i++) {
+			mg_free(data->entries[i].file_name);
+		}
+		mg_free(data->entries);
+		mg_free(entry);
+		return NULL;
+	}
+
+	entry->dom_ctx = conn->dom_ctx;
+	entry->dir_mtime = dir_stat->last_modified;
+	entry->scan_time = scan_time;
+	entry->last_used = scan_time;
+	entry->entries = data->entries;
+	entry->num_entries = data->num_entries;
+	entry->refcount = 1;
+	for (i = 0; i < entry->num_entries; i++) {
+		entry->entries[i].conn = NULL;
+	}
+
+	if (!dir_stat->is_directory) {
+		/* Not cacheable, only used by this request */
+		return entry;
+	}
+
+	pthread_mutex_lock(&ctx->dir_cache_mutex);
+	/* Replace an older scan of the same directory, use a free slot or
+	 * evict the least recently used entry */
+	slot = -1;
+	for (i = 0; i < DIRECTORY_CACHE_SIZE; i++) {
+		struct dir_cache_entry *e = ctx->dir_cache[i];
+		if (e == NULL) {
+			if (slot < 0) {
+				slot = (int)i;
+			}
+		} else if ((e->dom_ctx == entry->dom_ctx)
+		           && !strcmp(e->path, entry->path)) {
+			slot = (int)i;
+			break;
+		}
+	}
+	if (slot < 0) {
+		slot = 0;
+		for (i = 1; i < DIRECTORY_CACHE_SIZE; i++) {
+			if (ctx->dir_cache[i]->last_used
+			    < ctx->dir_cache[slot]->last_used) {
+				slot = (int)i;
+			}
+		}
+	}
+	evicted = ctx->dir_cache[slot];
+	if ((evicted != NULL) && (--evicted->refcount > 0)) {
+		/* Still in use by another request */
+		evicted = NULL;
+	}
+	ctx->dir_cache[slot] = entry;
+	entry->refcount++;
+	pthread_mutex_unlock(&ctx->dir_cache_mutex);
+
+	if (evicted != NULL) {
+		dir_cache_entry_free(evicted);
+	}
+	return entry;
+}
+
+
+/* Get the rendered rows of a directory in the given format and sort order.
+ * The listing is rendered once and then owned by the entry.
+ * Returns NULL if out of memory. */
+static struct dir_listing *
+dir_cache_listing(struct mg_connection *conn,
+                  struct dir_cache_entry *entry,
+                  int format,
+                  int order)
+{
+	struct mg_context *ctx = conn->phys_ctx;
+	struct dir_listing *dl, *other;
+	struct de *sorted;
+	size_t i;
+	int ok = 1;
+
+	pthread_mutex_lock(&ctx->dir_cache_mutex);
+	dl = entry->listings[format][order];
+	pthread_mutex_unlock(&ctx->dir_cache_mutex);
+	if (dl != NULL) {
+		return dl;
+	}
+
+	/* Sort a copy, the same entries are shared by all sort orders */
+	dl = (struct dir_listing *)mg_calloc_ctx(1, sizeof(*dl), ctx);
+	sorted = (struct de *)mg_malloc_ctx((entry->num_entries + 1)
+	                                        * sizeof(struct de),
+	                                    ctx);
+	if (dl != NULL) {
+		dl->row_ofs = (size_t *)mg_malloc_ctx((entry->num_entries + 1)
+		                                          * sizeof(size_t),
+		                                      ctx);
+	}
+	if ((dl == NULL) || (dl->row_ofs == NULL) || (sorted == NULL)) {
+		dir_listing_free(dl);
+		mg_free(sorted);
+		return NULL;
+	}
+
+	memcpy(sorted, entry->entries, entry->num_entries * sizeof(struct de));
+	qsort(sorted,
+	      entry->num_entries,
+	      sizeof(struct de),
+	      dir_compare_funcs[order]);
+
+	for (i = 0; ok && (i < entry->num_entries); i++) {
+		dl->row_ofs[i] = dl->len;
+		if (format == DIR_LISTING_JSON) {
+			ok = (render_dir_entry_json(&sorted[i], dl) == 0);
+		} else {
+			ok = (render_dir_entry(conn, &sorted[i], dl) == 0);
+		}
+	}
+	dl->row_ofs[entry->num_entries] = dl->len;
+	mg_free(sorted);
+
+	if (!ok) {
+		dir_listing_free(dl);
+		return NULL;
+	}
+
+	/* Another request might have rendered the same listing meanwhile */
+	pthread_mutex_lock(&ctx->dir_cache_mutex);
+	other = entry->listings[format][order];
+	if (other == NULL) {
+		entry->listings[format][order] = dl;
+	}
+	pthread_mutex_unlock(&ctx->dir_cache_mutex);
+
+	if (other != NULL) {
+		dir_listing_free(dl);
+		dl = other;
+	}
+	return dl;
+}
+
+
+static void
+handle_directory_request(struct mg_connection *conn, const char *dir)
+{
+	size_t i, first, last, page_size;
+	size_t page, num_pages;
+	int order, format, sort_direction;
+	struct dir_cache_entry *entry;
+	struct dir_listing *dl;
+	struct mg_file_stat dir_stat;
+	char var[32], *esc, *p;
+	const char *title, *query;
+	time_t curtime = time(NULL);
+	int cfg_page_size;
+
+	if (!conn) {
+		return;
+	}
+
+	query = conn->request_info.query_string;
+	order = dir_sort_order(query);
+	format = DIR_LISTING_HTML;
+	page = 1;
+	if (query != NULL) {
+		if ((mg_get_var(query, strlen(query), "format", var, sizeof(var)) > 0)
+		    && !mg_strcasecmp(var, "json")) {
+			format = DIR_LISTING_JSON;
+		}
+		if ((mg_get_var(query, strlen(query), "page", var, sizeof(var)) > 0)
+		    && (atoi(var) > 1)) {
+			page = (size_t)atoi(var);
+		}
+	}
+
+	entry = dir_cache_lookup(conn, dir, &dir_stat);
+	if (entry == NULL) {
+		struct dir_scan_data data = {NULL, 0, 128};
+
+		if (!scan_directory(conn, dir, &data, dir_scan_callback)) {
+			mg_send_http_error(conn,
+			                   500,
+			                   "Error: Cannot open directory\nopendir(%s): %s",
+			                   dir,
+			                   strerror(ERRNO));
+			return;
+		}
+		entry = dir_cache_insert(conn, dir, &dir_stat, curtime, &data);
+		if (entry == NULL) {
+			mg_send_http_error(conn, 500, "%s", "Error: Out of memory");
+			return;
+		}
+	}
+
+	dl = dir_cache_listing(conn, entry, format, order);
+	if (dl == NULL) {
+		dir_cache_release(conn->phys_ctx, entry);
+		mg_send_http_error(conn, 500, "%s", "Error: Out of memory");
+		return;
+	}
+
+	/* Select the rows of the requested page */
+	first = 0;
+	last = entry->num_entries;
+	num_pages = 1;
+	cfg_page_size = atoi(conn->dom_ctx->config[DIRECTORY_LISTING_PAGE_SIZE]);
+	page_size = (cfg_page_size > 0) ? (size_t)cfg_page_size : 0;
+	if ((page_size > 0) && (last > page_size)) {
+		num_pages = (last + page_size - 1) / page_size;
+		if (page > num_pages) {
+			page = num_pages;
+		}
+		first = (page - 1) * page_size;
+		if (last - first > page_size) {
+			last = first + page_size;
+		}
+	} else {
+		page = 1;
+	}
+
+	conn->must_close = 1;
+
+	if (format == DIR_LISTING_JSON) {
+		title = conn->request_info.local_uri;
+		esc = (char *)mg_malloc(strlen(title) * 6 + 1);
+		if (esc == NULL) {
+			dir_cache_release(conn->phys_ctx, entry);
+			mg_send_http_error(conn, 500, "%s", "Error: Out of memory");
+			return;
+		}
+		json_escape_string(title, esc);
+
+		mg_response_header_start(conn, 200);
+		send_static_cache_header(conn);
+		send_additional_header(conn);
+		mg_response_header_add(conn,
+		                       "Content-Type",
+		                       "application/json; charset=utf-8",
+		                       -1);
+		mg_response_header_send(conn);
+
+		mg_printf(conn,
+		          "{\"uri\":\"%s\",\"total\":%lu,\"page\":%lu,"
+		          "\"pages\":%lu,\"entries\":[",
+		          esc,
+		          (unsigned long)entry->num_entries,
+		          (unsigned long)page,
+		          (unsigned long)num_pages);
+		mg_free(esc);
+
+		/* Skip the comma in front of the first element */
+		if (last > first) {
+			mg_write(conn,
+			         dl->text + dl->row_ofs[first] + 1,
+			         dl->row_ofs[last] - dl->row_ofs[first] - 1);
+		}
+		mg_printf(conn, "%s", "]}");
+
+		dir_cache_release(conn->phys_ctx, entry);
+		conn->status_code = 200;
+		return;
+	}
+
+	esc = NULL;
+	title = conn->request_info.local_uri;
+	if (title[strcspn(title, "&<>")]) {
+		/* HTML escaping needed */
+		esc = (char *)mg_malloc(strlen(title) * 5 + 1);
+		if (esc) {
+			for (i = 0, p = esc; title[i]; i++, p += strlen(p)) {
+				mg_strlcpy(p, title + i, 2);
+				if (*p == '&') {
+					strcpy(p, "&amp;");
+				} else if (*p == '<') {
+					strcpy(p, "&lt;");
+				} else if (*p == '>') {
+					strcpy(p, "&gt;");
+				}
+			}
+		} else {
+			title = "";
+		}
+	}
+
+	sort_direction = (order % 2) ? 'a' : 'd';
+
+	/* Create 200 OK response */
+	mg_response_header_start(conn, 200);
+	send_static_cache_header(conn);
+	send_additional_header(conn);
+	mg_response_header_add(conn,
+	                       "Content-Type",
+	                       "text/html; charset=utf-8",
+	                       -1);
+
+	/* Send all headers */
+	mg_response_header_send(conn);
+
+	/* Body */
+	mg_printf(conn,
+	          "<html><head><title>Index of %s</title>"
+	          "<style>th {text-align: left;}</style></head>"
+	          "<body><h1>Index of %s</h1><pre><table cellpadding=\"0\">"
+	          "<tr><th><a href=\"?n%c\">Name</a></th>"
+	          "<th><a href=\"?d%c\">Modified</a></th>"
+	          "<th><a href=\"?s%c\">Size</a></th></tr>"
+	          "<tr><td colspan=\"3\"><hr></td></tr>",
+	          esc ? esc : title,
+	          esc ? esc : title,
+	          sort_direction,
+	          sort_direction,
+	          sort_direction);
+	mg_free(esc);
+
+	/* Print first entry - link to a parent directory */
+	mg_printf(conn,
+	          "<tr><td><a href=\"%s\">%s</a></td>"
+	          "<td>&nbsp;%s</td><td>&nbsp;&nbsp;%s</td></tr>\n",
+	          "..",
+	          "Parent directory",
+	          "-",
+	          "-");
+
+	/* Print the sorted directory entries of this page */
+	if (last > first) {
+		mg_write(conn,
+		         dl->text + dl->row_ofs[first],
+		         dl->row_ofs[last] - dl->row_ofs[first]);
+	}
+
+	mg_printf(conn, "%s", "</table></pre>");
+
+	if (num_pages > 1) {
+		char key = dir_sort_keys[order / 2];
+		char direction = (order % 2) ? 'd' : 'a';
+
+		mg_printf(conn,
+		          "<p>Page %lu of %lu",
+		          (unsigned long)page,
+		          (unsigned long)num_pages);
+		if (page > 1) {
+			mg_printf(conn,
+			          " &nbsp;<a href=\"?%c%c&page=%lu\">Previous</a>",
+			          key,
+			          direction,
+			          (unsigned long)(page - 1));
+		}
+		if (page < num_pages) {
+			mg_printf(conn,
+			          " &nbsp;<a href=\"?%c%c&page=%lu\">Next</a>",
+			          key,
+			          direction,
+			          (unsigned long)(page + 1));
+		}
+		mg_printf(conn, "%s", "</p>");
+	}
+
+	mg_printf(conn, "%s", "</body></html>");
+
+	dir_cache_release(conn->phys_ctx, entry);
+	conn->status_code = 200;
+}
+#endif /* NO_FILESYSTEMS */
+
+
+/* Send len bytes from the opened file to the client. */
+static void
+send_file_data(struct mg_connection *conn,
+               struct mg_file *filep,
+               int64_t offset,
+               int64_t len)
+{
+	char buf[MG_BUF_LEN];
+	int to_read, num_read, num_written;
+	int64_t size;
+
+	if (!filep || !conn) {
+		return;
+	}
+
 	/* Sanity check the offset */
 	size = (filep->stat.size > INT64_MAX) ? INT64_MAX
 	                                      : (int64_t)(filep->stat.size);
@@ -9692,6 +11270,7 @@ send_file_data(struct mg_connection *conn,
 #if defined(__linux__)
 		/* sendfile is only available for Linux */
 		if ((conn->ssl == 0) && (conn->throttle == 0)
+		    && (conn->protocol_type != PROTOCOL_TYPE_HTTP2)
 		    && (!mg_strcasecmp(conn->dom_ctx->config[ALLOW_SENDFILE_CALL],
 		                       "yes"))) {
 			off_t sf_offs = (off_t)offset;
@@ -9732,6 +11311,31 @@ send_file_data(struct mg_connection *conn,
 			 * e.g., for sending data from the output of a CGI process. */
 			offset = (int64_t)sf_offs;
 		}
+#endif
+#if !defined(_WIN32)
+		if (filep->access.cached != NULL) {
+			/* Shared file: read at explicit offsets, since the file
+			 * position is used by other requests as well */
+			int sf_file = fileno(filep->access.fp);
+			while (len > 0) {
+				to_read = sizeof(buf);
+				if ((int64_t)to_read > len) {
+					to_read = (int)len;
+				}
+				num_read =
+				    (int)pread(sf_file, buf, (size_t)to_read, (off_t)offset);
+				if (num_read <= 0) {
+					break;
+				}
+				if ((num_written = mg_write(conn, buf, (size_t)num_read))
+				    != num_read) {
+					break;
+				}
+				len -= num_written;
+				offset += num_written;
+			}
+			return;
+		}
 #endif
 		if ((offset > 0) && (fseeko(filep->access.fp, offset, SEEK_SET) != 0)) {
 			mg_cry_internal(conn,
@@ -9779,69 +11383,269 @@ parse_range_header(const char *header, int64_t *a, int64_t *b)
 }
 
 
-static void
-construct_etag(char *buf, size_t buf_len, const struct mg_file_stat *filestat)
-{
-	if ((filestat != NULL) && (buf != NULL)) {
-		mg_snprintf(NULL,
-		            NULL, /* All calls to construct_etag use 64 byte buffer */
-		            buf,
-		            buf_len,
-		            "\"%lx.%" INT64_FMT "\"",
-		            (unsigned long)filestat->last_modified,
-		            filestat->size);
-	}
-}
+#if !defined(NO_FILESYSTEMS)
+struct byte_range {
+	int64_t start;
+	int64_t len;
+};
 
 
-static void
-fclose_on_exec(struct mg_file_access *filep, struct mg_connection *conn)
+static int
+parse_range_number(const char **pp, int64_t *val)
 {
-	if (filep != NULL && filep->fp != NULL) {
-#if defined(_WIN32)
-		(void)conn; /* Unused. */
-#else
-		if (fcntl(fileno(filep->fp), F_SETFD, FD_CLOEXEC) != 0) {
-			mg_cry_internal(conn,
-			                "%s: fcntl(F_SETFD FD_CLOEXEC) failed: %s",
-			                __func__,
-			                strerror(ERRNO));
+	const char *p = *pp;
+	int64_t v = 0;
+
+	if (!isdigit((unsigned char)*p)) {
+		return 0;
+	}
+	while (isdigit((unsigned char)*p)) {
+		if (v > ((INT64_MAX - 9) / 10)) {
+			return 0; /* overflow */
 		}
-#endif
+		v = (v * 10) + (*p - '0');
+		p++;
 	}
+	*pp = p;
+	*val = v;
+	return 1;
 }
 
 
-#if defined(USE_ZLIB)
-#include "mod_zlib.inl"
-#endif
-
-
-#if !defined(NO_FILESYSTEMS)
-static void
-handle_static_file_request(struct mg_connection *conn,
-                           const char *path,
-                           struct mg_file *filep,
-                           const char *mime_type,
-                           const char *additional_headers)
+/* Parse a "Range" request header (RFC 7233, section 2.1) for a file of
+ * the given size. Satisfiable ranges are stored in ranges.
+ * Overlapping and adjacent ranges are merged (RFC 7233, section 6.1), so
+ * no part of the file is sent twice.
+ * Returns the number of satisfiable ranges, 0 if no range is satisfiable
+ * (416) and -1 if the header must be ignored (invalid syntax, unknown
+ * unit or more than max_ranges ranges), so the entire file is sent. */
+static int
+parse_byte_ranges(const char *header,
+                  int64_t size,
+                  struct byte_range *ranges,
+                  int max_ranges)
 {
-	char lm[64], etag[64];
-	char range[128]; /* large enough, so there will be no overflow */
-	const char *range_hdr;
-	int64_t cl, r1, r2;
-	struct vec mime_vec;
-	int n, truncated;
-	char gz_path[UTF8_PATH_MAX];
-	const char *encoding = 0;
-	const char *origin_hdr;
-	const char *cors_orig_cfg;
-	const char *cors1, *cors2;
-	int is_head_request;
+	const char *p = header;
+	int64_t first, last;
+	struct byte_range tmp;
+	int n = 0, specs = 0, i, j;
 
-#if defined(USE_ZLIB)
-	/* Compression is allowed, unless there is a reason not to use
-	 * compression. If the file is already compressed, too small or a
-	 * "range" request was made, on the fly compression is not possible. */
+	if (mg_strncasecmp(p, "bytes=", 6) != 0) {
+		return -1;
+	}
+	p += 6;
+
+	for (;;) {
+		while ((*p == ' ') || (*p == '\t') || (*p == ',')) {
+			p++;
+		}
+		if (*p == 0) {
+			break;
+		}
+
+		if (*p == '-') {
+			/* suffix-byte-range-spec: the last bytes of the file */
+			p++;
+			if (!parse_range_number(&p, &last)) {
+				return -1;
+			}
+			if ((last > 0) && (size > 0)) {
+				first = (last < size) ? (size - last) : 0;
+				last = size - 1;
+			} else {
+				first = size; /* not satisfiable */
+			}
+		} else {
+			/* byte-range-spec: first-byte-pos "-" [ last-byte-pos ] */
+			if (!parse_range_number(&p, &first) || (*p != '-')) {
+				return -1;
+			}
+			p++;
+			if (isdigit((unsigned char)*p)) {
+				if (!parse_range_number(&p, &last) || (last < first)) {
+					return -1;
+				}
+				if (last >= size) {
+					last = size - 1;
+				}
+			} else {
+				last = size - 1;
+			}
+		}
+
+		if ((*p != 0) && (*p != ',') && (*p != ' ') && (*p != '\t')) {
+			return -1;
+		}
+		if (++specs > max_ranges) {
+			return -1;
+		}
+		if (first < size) {
+			ranges[n].start = first;
+			ranges[n].len = last - first + 1;
+			n++;
+		}
+	}
+
+	/* Sort by start (there are only a few ranges), then merge */
+	for (i = 1; i < n; i++) {
+		tmp = ranges[i];
+		for (j = i; (j > 0) && (ranges[j - 1].start > tmp.start); j--) {
+			ranges[j] = ranges[j - 1];
+		}
+		ranges[j] = tmp;
+	}
+	for (i = 1, j = 0; i < n; i++) {
+		last = ranges[j].start + ranges[j].len;
+		if (ranges[i].start <= last) {
+			if (ranges[i].start + ranges[i].len > last) {
+				ranges[j].len = ranges[i].start + ranges[i].len
+				                - ranges[j].start;
+			}
+		} else {
+			ranges[++j] = ranges[i];
+		}
+	}
+	if (n > 0) {
+		n = j + 1;
+	}
+
+	return (specs > 0) ? n : -1;
+}
+
+
+/* Header of one part in a multipart/byteranges response. Returns the
+ * length of the header written to buf. */
+static int
+byteranges_part_header(const struct mg_connection *conn,
+                       char *buf,
+                       size_t buf_len,
+                       const char *boundary,
+                       const struct vec *mime_vec,
+                       const struct byte_range *range,
+                       uint64_t size)
+{
+	int truncated = 0;
+	mg_snprintf(conn,
+	            &truncated,
+	            buf,
+	            buf_len,
+	            "\r\n--%s\r\nContent-Type: %.*s\r\n"
+	            "Content-Range: bytes %" INT64_FMT "-%" INT64_FMT
+	            "/%" UINT64_FMT "\r\n\r\n",
+	            boundary,
+	            (int)mime_vec->len,
+	            mime_vec->ptr,
+	            range->start,
+	            range->start + range->len - 1,
+	            size);
+	if (truncated) {
+		/* Content-Type too long: omit it */
+		mg_snprintf(conn,
+		            NULL, /* buffer is big enough without Content-Type */
+		            buf,
+		            buf_len,
+		            "\r\n--%s\r\n"
+		            "Content-Range: bytes %" INT64_FMT "-%" INT64_FMT
+		            "/%" UINT64_FMT "\r\n\r\n",
+		            boundary,
+		            range->start,
+		            range->start + range->len - 1,
+		            size);
+	}
+	return (int)strlen(buf);
+}
+
+
+/* A Range header is only used, if the If-Range precondition (if any)
+ * matches the current version of the file (RFC 7233, section 3.2). */
+static int
+is_if_range_ok(const struct mg_connection *conn,
+               const char *etag,
+               const char *last_modified)
+{
+	const char *if_range = mg_get_header(conn, "If-Range");
+
+	if (if_range == NULL) {
+		return 1;
+	}
+	if (*if_range == '"') {
+		/* Entity tag: strong comparison */
+		return !strcmp(if_range, etag);
+	}
+	if (!strncmp(if_range, "W/", 2)) {
+		/* Weak entity tags never match */
+		return 0;
+	}
+	return !strcmp(if_range, last_modified);
+}
+#endif
+
+
+static void
+construct_etag(char *buf, size_t buf_len, const struct mg_file_stat *filestat)
+{
+	if ((filestat != NULL) && (buf != NULL)) {
+		mg_snprintf(NULL,
+		            NULL, /* All calls to construct_etag use 64 byte buffer */
+		            buf,
+		            buf_len,
+		            "\"%lx.%" INT64_FMT "\"",
+		            (unsigned long)filestat->last_modified,
+		            filestat->size);
+	}
+}
+
+
+static void
+fclose_on_exec(struct mg_file_access *filep, struct mg_connection *conn)
+{
+	if (filep != NULL && filep->fp != NULL) {
+#if defined(_WIN32)
+		(void)conn; /* Unused. */
+#else
+		if (fcntl(fileno(filep->fp), F_SETFD, FD_CLOEXEC) != 0) {
+			mg_cry_internal(conn,
+			                "%s: fcntl(F_SETFD FD_CLOEXEC) failed: %s",
+			                __func__,
+			                strerror(ERRNO));
+		}
+#endif
+	}
+}
+
+
+#if defined(USE_ZLIB)
+#include "mod_zlib.inl"
+#endif
+
+
+#if !defined(NO_FILESYSTEMS)
+static void
+handle_static_file_request(struct mg_connection *conn,
+                           const char *path,
+                           struct mg_file *filep,
+                           const char *mime_type,
+                           const char *additional_headers)
+{
+	char lm[64], etag[64];
+	char range[128]; /* large enough, so there will be no overflow */
+	char boundary[40];
+	const char *range_hdr;
+	struct byte_range ranges[MG_MAX_RANGES];
+	int64_t cl, r1;
+	struct vec mime_vec;
+	int i, n, truncated;
+	char gz_path[UTF8_PATH_MAX];
+	const char *encoding = 0;
+	const char *origin_hdr;
+	const char *cors_orig_cfg;
+	const char *cors1, *cors2;
+	int is_head_request, opened;
+
+#if defined(USE_ZLIB)
+	/* Compression is allowed, unless there is a reason not to use
+	 * compression. If the file is already compressed, too small or a
+	 * "range" request was made, on the fly compression is not possible. */
 	int allow_on_the_fly_compression = 1;
 #endif
 
@@ -9905,7 +11709,7 @@ handle_static_file_request(struct mg_connection *conn,
 
 		mg_snprintf(conn, &truncated, gz_path, sizeof(gz_path), "%s.gz", path);
 
-		if (!truncated && mg_stat(conn, gz_path, &file_stat)
+		if (!truncated && mg_stat_cached(conn, gz_path, &file_stat)
 		    && !file_stat.is_directory) {
 			file_stat.is_gzipped = 1;
 			filep->stat = file_stat;
@@ -9920,7 +11724,19 @@ handle_static_file_request(struct mg_connection *conn,
 		}
 	}
 
-	if (!mg_fopen(conn, path, MG_FOPEN_MODE_READ, filep)) {
+#if defined(USE_ZLIB)
+	/* On the fly compression reads the file sequentially, so it can not
+	 * use a shared file. */
+	if (allow_on_the_fly_compression && (range_hdr == NULL)
+	    && (filep->stat.size >= MG_FILE_COMPRESSION_SIZE_LIMIT)) {
+		opened = mg_fopen(conn, path, MG_FOPEN_MODE_READ, filep);
+	} else
+#endif
+	{
+		opened = mg_fopen_cached(conn, path, filep);
+	}
+
+	if (!opened) {
 		mg_send_http_error(conn,
 		                   500,
 		                   "Error: Cannot open file\nfopen(%s): %s",
@@ -9931,12 +11747,19 @@ handle_static_file_request(struct mg_connection *conn,
 
 	fclose_on_exec(&filep->access, conn);
 
-	/* If "Range" request was made: parse header, send only selected part
+	/* Prepare Etag, and Last-Modified headers. */
+	gmt_time_string(lm, sizeof(lm), &filep->stat.last_modified);
+	construct_etag(etag, sizeof(etag), &filep->stat);
+
+	/* If "Range" request was made: parse header, send only selected parts
 	 * of the file. */
-	r1 = r2 = 0;
-	if ((range_hdr != NULL)
-	    && ((n = parse_range_header(range_hdr, &r1, &r2)) > 0) && (r1 >= 0)
-	    && (r2 >= 0)) {
+	r1 = 0;
+	n = -1;
+	boundary[0] = '\0';
+	if ((range_hdr != NULL) && is_if_range_ok(conn, etag, lm)) {
+		n = parse_byte_ranges(range_hdr, cl, ranges, MG_MAX_RANGES);
+	}
+	if (n >= 0) {
 		/* actually, range requests don't play well with a pre-gzipped
 		 * file (since the range is specified in the uncompressed space) */
 		if (filep->stat.is_gzipped) {
@@ -9949,17 +11772,60 @@ handle_static_file_request(struct mg_connection *conn,
 			    &filep->access); /* ignore error on read only file */
 			return;
 		}
+		if (n == 0) {
+			/* None of the ranges overlaps the file */
+			(void)mg_fclose(
+			    &filep->access); /* ignore error on read only file */
+			mg_snprintf(conn,
+			            NULL, /* range buffer is big enough */
+			            range,
+			            sizeof(range),
+			            "bytes */%" INT64_FMT,
+			            cl);
+			mg_response_header_start(conn, 416);
+			send_additional_header(conn);
+			mg_response_header_add(conn, "Content-Range", range, -1);
+			mg_response_header_add(conn, "Content-Length", "0", -1);
+			mg_response_header_send(conn);
+			return;
+		}
 		conn->status_code = 206;
-		cl = (n == 2) ? (((r2 > cl) ? cl : r2) - r1 + 1) : (cl - r1);
-		mg_snprintf(conn,
-		            NULL, /* range buffer is big enough */
-		            range,
-		            sizeof(range),
-		            "bytes "
-		            "%" INT64_FMT "-%" INT64_FMT "/%" INT64_FMT,
-		            r1,
-		            r1 + cl - 1,
-		            filep->stat.size);
+		if (n == 1) {
+			r1 = ranges[0].start;
+			cl = ranges[0].len;
+			mg_snprintf(conn,
+			            NULL, /* range buffer is big enough */
+			            range,
+			            sizeof(range),
+			            "bytes "
+			            "%" INT64_FMT "-%" INT64_FMT "/%" INT64_FMT,
+			            r1,
+			            r1 + cl - 1,
+			            filep->stat.size);
+		} else {
+			/* Several ranges: multipart/byteranges (RFC 7233, Appendix A)
+			 */
+			char part_hdr[256];
+			mg_snprintf(conn,
+			            NULL, /* boundary buffer is big enough */
+			            boundary,
+			            sizeof(boundary),
+			            "%016" UINT64_FMT "%08lx",
+			            mg_get_current_time_ns(),
+			            (unsigned long)(size_t)conn);
+			cl = 0;
+			for (i = 0; i < n; i++) {
+				cl += ranges[i].len
+				      + byteranges_part_header(conn,
+				                               part_hdr,
+				                               sizeof(part_hdr),
+				                               boundary,
+				                               &mime_vec,
+				                               &ranges[i],
+				                               filep->stat.size);
+			}
+			cl += (int64_t)strlen(boundary) + 8; /* "\r\n--" ... "--\r\n" */
+		}
 
 #if defined(USE_ZLIB)
 		/* Do not compress ranges. */
@@ -9974,6 +11840,21 @@ handle_static_file_request(struct mg_connection *conn,
 		/* File is below the size limit. */
 		allow_on_the_fly_compression = 0;
 	}
+
+	/* The Range header has been ignored, but the file has been opened as
+	 * a shared file above: compression must not move its file position. */
+	if (allow_on_the_fly_compression && (filep->access.cached != NULL)) {
+		(void)mg_fclose(&filep->access); /* ignore error on read only file */
+		if (!mg_fopen(conn, path, MG_FOPEN_MODE_READ, filep)) {
+			mg_send_http_error(conn,
+			                   500,
+			                   "Error: Cannot open file\nfopen(%s): %s",
+			                   path,
+			                   strerror(ERRNO));
+			return;
+		}
+		fclose_on_exec(&filep->access, conn);
+	}
 #endif
 
 	/* Standard CORS header */
@@ -9991,18 +11872,25 @@ handle_static_file_request(struct mg_connection *conn,
 		cors1 = cors2 = "";
 	}
 
-	/* Prepare Etag, and Last-Modified headers. */
-	gmt_time_string(lm, sizeof(lm), &filep->stat.last_modified);
-	construct_etag(etag, sizeof(etag), &filep->stat);
-
 	/* Create 2xx (200, 206) response */
 	mg_response_header_start(conn, conn->status_code);
 	send_static_cache_header(conn);
 	send_additional_header(conn);
-	mg_response_header_add(conn,
-	                       "Content-Type",
-	                       mime_vec.ptr,
-	                       (int)mime_vec.len);
+	if (boundary[0] != 0) {
+		char ctype[80];
+		mg_snprintf(conn,
+		            NULL, /* ctype buffer is big enough */
+		            ctype,
+		            sizeof(ctype),
+		            "multipart/byteranges; boundary=%s",
+		            boundary);
+		mg_response_header_add(conn, "Content-Type", ctype, -1);
+	} else {
+		mg_response_header_add(conn,
+		                       "Content-Type",
+		                       mime_vec.ptr,
+		                       (int)mime_vec.len);
+	}
 	if (cors1[0] != 0) {
 		mg_response_header_add(conn, cors1, cors2, -1);
 	}
@@ -10060,7 +11948,24 @@ handle_static_file_request(struct mg_connection *conn,
 			send_compressed_data(conn, filep);
 		} else
 #endif
-		{
+		if (boundary[0] != 0) {
+			/* Send all ranges, each with a part header */
+			char part_hdr[256];
+			for (i = 0; i < n; i++) {
+				int hlen = byteranges_part_header(conn,
+				                                  part_hdr,
+				                                  sizeof(part_hdr),
+				                                  boundary,
+				                                  &mime_vec,
+				                                  &ranges[i],
+				                                  filep->stat.size);
+				if (mg_write(conn, part_hdr, (size_t)hlen) != hlen) {
+					break;
+				}
+				send_file_data(conn, filep, ranges[i].start, ranges[i].len);
+			}
+			mg_printf(conn, "\r\n--%s--\r\n", boundary);
+		} else {
 			/* Send file directly */
 			send_file_data(conn, filep, r1, cl);
 		}
@@ -10240,99 +12145,358 @@ remove_bad_file(const struct mg_connection *conn, const char *path)
 }
 
 
-long long
-mg_store_body(struct mg_connection *conn, const char *path)
+#if defined(__linux__)
+/* Move len bytes of request body data from the socket to the file fd,
+ * using splice through a pipe, so the data is not copied to user space.
+ * The number of bytes written is added to *stored.
+ * Returns 0 on success, -1 if the body could not be read, -2 if the file
+ * could not be written and -3 if splice can not be used for this socket
+ * or file (nothing has been read then). */
+static int
+splice_body_to_file(struct mg_connection *conn,
+                    int fd,
+                    int64_t len,
+                    int64_t *stored)
 {
-	char buf[MG_BUF_LEN];
-	long long len = 0;
-	int ret, n;
-	struct mg_file fi;
+	struct mg_pollfd sfd[1];
+	int pfd[2];
+	ssize_t n, m;
+	int timeout_ms, first = 1, res = 0;
 
-	if (conn->consumed_content != 0) {
-		mg_cry_internal(conn, "%s: Contents already consumed", __func__);
-		return -11;
+	if (pipe(pfd) != 0) {
+		return -3;
 	}
+	set_close_on_exec(pfd[0], NULL, NULL);
+	set_close_on_exec(pfd[1], NULL, NULL);
+#if defined(F_SETPIPE_SZ)
+	/* A larger pipe moves more data per call. Errors can be ignored. */
+	(void)fcntl(pfd[1], F_SETPIPE_SZ, 1024 * 1024);
+#endif
 
-	ret = put_dir(conn, path);
-	if (ret < 0) {
-		/* -1 for path too long,
-		 * -2 for path can not be created. */
-		return ret;
-	}
-	if (ret != 1) {
-		/* Return 0 means, path itself is a directory. */
-		return 0;
+	timeout_ms = atoi(conn->dom_ctx->config[REQUEST_TIMEOUT]);
+	if (timeout_ms <= 0) {
+		timeout_ms = atoi(config_options[REQUEST_TIMEOUT].default_value);
 	}
 
-	if (mg_fopen(conn, path, MG_FOPEN_MODE_WRITE, &fi) == 0) {
-		return -12;
-	}
+	while (len > 0) {
+		sfd[0].fd = conn->client.sock;
+		sfd[0].events = POLLIN;
+		if (mg_poll(sfd, 1, timeout_ms, &(conn->phys_ctx->stop_flag)) <= 0) {
+			res = -1; /* timeout or server stopped */
+			break;
+		}
 
-	ret = mg_read(conn, buf, sizeof(buf));
-	while (ret > 0) {
-		n = (int)fwrite(buf, 1, (size_t)ret, fi.access.fp);
-		if (n != ret) {
-			(void)mg_fclose(
-			    &fi.access); /* File is bad and will be removed anyway. */
-			remove_bad_file(conn, path);
-			return -13;
+		n = splice(conn->client.sock,
+		           NULL,
+		           pfd[1],
+		           NULL,
+		           (size_t)((len < 0x40000000) ? len : 0x40000000),
+		           SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (n < 0) {
+			if (ERROR_TRY_AGAIN(ERRNO)) {
+				continue;
+			}
+			res = first ? -3 : -1;
+			break;
 		}
-		len += ret;
-		ret = mg_read(conn, buf, sizeof(buf));
-	}
+		if (n == 0) {
+			res = -1; /* Connection closed before the body was complete */
+			break;
+		}
+		first = 0;
+		len -= n;
+		conn->consumed_content += n;
 
-	/* File is open for writing. If fclose fails, there was probably an
-	 * error flushing the buffer to disk, so the file on disk might be
-	 * broken. Delete it and return an error to the caller. */
-	if (mg_fclose(&fi.access) != 0) {
-		remove_bad_file(conn, path);
-		return -14;
+		/* Empty the pipe into the file */
+		while (n > 0) {
+			m = splice(pfd[0], NULL, fd, NULL, (size_t)n, SPLICE_F_MOVE);
+			if (m <= 0) {
+				break;
+			}
+			n -= m;
+			*stored += m;
+		}
+		if (n > 0) {
+			res = -2;
+			break;
+		}
 	}
 
-	return len;
+	close(pfd[0]);
+	close(pfd[1]);
+	return res;
 }
-#endif /* NO_FILESYSTEMS */
+#endif
 
 
-/* Parse a buffer:
- * Forward the string pointer till the end of a word, then
- * terminate it and forward till the begin of the next word.
- */
+/* Store the remaining request body in fp, a file opened for writing.
+ * The number of bytes stored is returned in *stored.
+ * Returns 0 on success, -1 if the body could not be read completely and
+ * -2 if the file could not be written. */
 static int
-skip_to_end_of_word_and_terminate(char **ppw, int eol)
+store_body_to_file(struct mg_connection *conn, FILE *fp, int64_t *stored)
 {
-	/* Forward until a space is found - use isgraph here */
-	/* See http://www.cplusplus.com/reference/cctype/ */
-	while (isgraph((unsigned char)**ppw)) {
-		(*ppw)++;
-	}
+	char sbuf[MG_BUF_LEN];
+	char *buf;
+	size_t buf_len;
+	int n, res = 0;
 
-	/* Check end of word */
-	if (eol) {
-		/* must be a end of line */
-		if ((**ppw != '\r') && (**ppw != '\n')) {
-			return -1;
-		}
-	} else {
-		/* must be a end of a word, but not a line */
-		if (**ppw != ' ') {
-			return -1;
-		}
-	}
+	*stored = 0;
 
-	/* Terminate and forward to the next word */
-	do {
-		**ppw = 0;
-		(*ppw)++;
-	} while (isspace((unsigned char)**ppw));
+#if defined(__linux__)
+	if (!conn->is_chunked && (conn->content_len > conn->consumed_content)) {
+		int fd = fileno(fp);
+		int64_t buffered;
 
-	/* Check after term */
-	if (!eol) {
-		/* if it's not the end of line, there must be a next word */
-		if (!isgraph((unsigned char)**ppw)) {
-			return -1;
+		if (fflush(fp) != 0) {
+			return -2;
 		}
-	}
+#if defined(FALLOC_FL_KEEP_SIZE)
+		/* Reserve disk space for the entire body, to avoid fragmentation.
+		 * This is only a hint: errors are ignored, the file size is not
+		 * changed. */
+		(void)fallocate(fd,
+		                FALLOC_FL_KEEP_SIZE,
+		                (off_t)ftello(fp),
+		                (off_t)(conn->content_len - conn->consumed_content));
+#endif
+
+		if ((conn->ssl == NULL) && (conn->protocol_type == PROTOCOL_TYPE_HTTP1)
+		    && !mg_strcasecmp(conn->dom_ctx->config[ALLOW_SENDFILE_CALL],
+		                      "yes")) {
+			/* Data already read together with the request headers */
+			buffered = (int64_t)conn->data_len - (int64_t)conn->request_len
+			           - conn->consumed_content;
+			if (buffered > conn->content_len - conn->consumed_content) {
+				buffered = conn->content_len - conn->consumed_content;
+			}
+			if (buffered > 0) {
+				if ((fwrite(conn->buf + conn->request_len
+				                + conn->consumed_content,
+				            1,
+				            (size_t)buffered,
+				            fp)
+				     != (size_t)buffered)
+				    || (fflush(fp) != 0)) {
+					return -2;
+				}
+				conn->consumed_content += buffered;
+				*stored = buffered;
+			}
+
+			res = splice_body_to_file(conn,
+			                          fd,
+			                          conn->content_len - conn->consumed_content,
+			                          stored);
+			if (res != -3) {
+				return res;
+			}
+			/* splice not possible: continue with mg_read below */
+			res = 0;
+		}
+	}
+#endif
+
+	/* Use a large buffer, if available: for uploads of some GB the
+	 * number of read and write calls matters. */
+	buf_len = MG_STORE_BUF_LEN;
+	buf = (char *)mg_malloc_ctx(buf_len, conn->phys_ctx);
+	if (buf == NULL) {
+		buf = sbuf;
+		buf_len = sizeof(sbuf);
+	}
+
+	while ((n = mg_read(conn, buf, buf_len)) > 0) {
+		if (fwrite(buf, 1, (size_t)n, fp) != (size_t)n) {
+			res = -2;
+			break;
+		}
+		*stored += n;
+	}
+	if (n < 0) {
+		res = -1;
+	}
+
+	if (buf != sbuf) {
+		mg_free(buf);
+	}
+	return res;
+}
+
+
+/* The body is first stored in a temporary file in the same directory,
+ * which is renamed to path when complete. So other requests will either
+ * see the old or the new file, but never a partial upload. The file has
+ * a random name starting with UPLOAD_TMP_PREFIX: it is created only if it
+ * does not exist (like mkstemp, but with the default permissions), and it
+ * is neither listed nor served (must_hide_file).
+ * Returns 1 if the temporary file is open for writing, 0 otherwise. */
+static int
+store_body_open(const struct mg_connection *conn,
+                const char *path,
+                char *tmp,
+                size_t tmp_len,
+                struct mg_file *filep)
+{
+	const char *name = strrchr(path, '/');
+	size_t dir_len = (name != NULL) ? (size_t)(name - path + 1) : 0;
+	int truncated, tries, fd = -1;
+#if defined(_WIN32)
+	wchar_t wbuf[UTF16_PATH_MAX];
+#endif
+
+	memset(filep, 0, sizeof(*filep));
+	for (tries = 0; (fd < 0) && (tries < 10); tries++) {
+		truncated = 0;
+		mg_snprintf(conn,
+		            &truncated,
+		            tmp,
+		            tmp_len,
+		            "%.*s" UPLOAD_TMP_PREFIX "%" UINT64_FMT,
+		            (int)dir_len,
+		            path,
+		            get_random());
+		if (truncated || mg_path_suspicious(conn, tmp)) {
+			return 0;
+		}
+#if defined(_WIN32)
+		path_to_unicode(conn, tmp, wbuf, ARRAY_SIZE(wbuf));
+		fd = _wopen(wbuf,
+		            _O_WRONLY | _O_CREAT | _O_EXCL | _O_BINARY,
+		            _S_IREAD | _S_IWRITE);
+#else
+		fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL, 0666);
+#endif
+		if ((fd < 0) && (errno != EEXIST)) {
+			return 0;
+		}
+	}
+	if (fd < 0) {
+		return 0;
+	}
+#if defined(_WIN32)
+	filep->access.fp = _fdopen(fd, "wb");
+	if (filep->access.fp == NULL) {
+		(void)_close(fd);
+	}
+#else
+	filep->access.fp = fdopen(fd, "w");
+	if (filep->access.fp == NULL) {
+		(void)close(fd);
+	}
+#endif
+	if (filep->access.fp == NULL) {
+		(void)mg_remove(conn, tmp);
+		return 0;
+	}
+
+#if !defined(_WIN32)
+	{
+		/* A replaced file keeps its permissions */
+		struct stat st;
+		if (stat(path, &st) == 0) {
+			(void)fchmod(fileno(filep->access.fp), st.st_mode & 07777);
+		}
+	}
+#endif
+	return 1;
+}
+
+
+long long
+mg_store_body(struct mg_connection *conn, const char *path)
+{
+	char tmp[UTF8_PATH_MAX];
+	int64_t len = 0;
+	int ret;
+	struct mg_file fi;
+
+	if (conn->consumed_content != 0) {
+		mg_cry_internal(conn, "%s: Contents already consumed", __func__);
+		return -11;
+	}
+
+	ret = put_dir(conn, path);
+	if (ret < 0) {
+		/* -1 for path too long,
+		 * -2 for path can not be created. */
+		return ret;
+	}
+	if (ret != 1) {
+		/* Return 0 means, path itself is a directory. */
+		return 0;
+	}
+
+	if (!store_body_open(conn, path, tmp, sizeof(tmp), &fi)) {
+		return -12;
+	}
+
+	if (store_body_to_file(conn, fi.access.fp, &len) != 0) {
+		/* Write error (-2), or the body is incomplete (-1) */
+		(void)mg_fclose(
+		    &fi.access); /* File is bad and will be removed anyway. */
+		remove_bad_file(conn, tmp);
+		return -13;
+	}
+
+	/* File is open for writing. If fclose fails, there was probably an
+	 * error flushing the buffer to disk, so the file on disk might be
+	 * broken. Delete it and return an error to the caller. */
+	if (mg_fclose(&fi.access) != 0) {
+		remove_bad_file(conn, tmp);
+		return -14;
+	}
+
+	if (mg_rename(conn, tmp, path) != 0) {
+		remove_bad_file(conn, tmp);
+		return -14;
+	}
+	file_cache_remove(conn->phys_ctx, path);
+
+	return (long long)len;
+}
+#endif /* NO_FILESYSTEMS */
+
+
+/* Parse a buffer:
+ * Forward the string pointer till the end of a word, then
+ * terminate it and forward till the begin of the next word.
+ */
+static int
+skip_to_end_of_word_and_terminate(char **ppw, int eol)
+{
+	/* Forward until a space is found - use isgraph here */
+	/* See http://www.cplusplus.com/reference/cctype/ */
+	while (isgraph((unsigned char)**ppw)) {
+		(*ppw)++;
+	}
+
+	/* Check end of word */
+	if (eol) {
+		/* must be a end of line */
+		if ((**ppw != '\r') && (**ppw != '\n')) {
+			return -1;
+		}
+	} else {
+		/* must be a end of a word, but not a line */
+		if (**ppw != ' ') {
+			return -1;
+		}
+	}
+
+	/* Terminate and forward to the next word */
+	do {
+		**ppw = 0;
+		(*ppw)++;
+	} while (isspace((unsigned char)**ppw));
+
+	/* Check after term */
+	if (!eol) {
+		/* if it's not the end of line, there must be a next word */
+		if (!isgraph((unsigned char)**ppw)) {
+			return -1;
+		}
+	}
 
 	/* ok */
 	return 1;
@@ -10385,9 +12549,7 @@ parse_http_headers(char **buf, struct mg_header hdr[MG_MAX_HEADERS])
 		hdr[i].value = dp;
 
 		/* Find end of line */
-		while ((*dp != 0) && (*dp != '\r') && (*dp != '\n')) {
-			dp++;
-		};
+		dp += strcspn(dp, "\r\n");
 
 		/* eliminate \r */
 		if (*dp == '\r') {
@@ -10488,6 +12650,13 @@ static const struct mg_http_method_info http_methods[] = {
      * to be useful for REST in case a "GET request with body" is
      * required. */
 
+#if defined(USE_HTTP2)
+    /* PRI is not a method, but the start of the HTTP/2 connection preface
+     * (RFC 7540, Sec. 3.5). It is only accepted with HTTP version 2.0, as
+     * first request of a connection (see process_new_connection). */
+    {"PRI", 0, 0, 0, 0, 0},
+#endif
+
     {NULL, 0, 0, 0, 0, 0}
     /* end of list */
 };
@@ -10777,8 +12946,11 @@ read_message(FILE *fp,
 		clock_gettime(CLOCK_MONOTONIC, &last_action_time);
 
 		if (n > 0) {
+			/* Only the new data and the last 3 bytes that could start a
+			 * \r\n\r\n have to be scanned again */
+			int scanned = (*nread > 3) ? (*nread - 3) : 0;
 			*nread += n;
-			request_len = get_http_header_len(buf, *nread);
+			request_len = get_http_header_len_from(buf, *nread, scanned);
 		}
 
 		if ((request_len == 0) && (request_timeout >= 0)) {
@@ -10796,7 +12968,11 @@ read_message(FILE *fp,
 
 #if !defined(NO_CGI) || !defined(NO_FILES)
 static int
-forward_body_data(struct mg_connection *conn, FILE *fp, SOCKET sock, SSL *ssl)
+forward_body_data(struct mg_connection *conn,
+                  FILE *fp,
+                  SOCKET sock,
+                  SSL *ssl,
+                  int is_file)
 {
 	const char *expect;
 	char buf[MG_BUF_LEN];
@@ -10832,14 +13008,23 @@ forward_body_data(struct mg_connection *conn, FILE *fp, SOCKET sock, SSL *ssl)
 			return 0;
 		}
 
-		for (;;) {
-			int nread = mg_read(conn, buf, sizeof(buf));
-			if (nread <= 0) {
-				success = (nread == 0);
-				break;
-			}
-			if (push_all(conn->phys_ctx, fp, sock, ssl, buf, nread) != nread) {
-				break;
+		if (is_file) {
+#if !defined(NO_FILESYSTEMS)
+			/* Regular file: use the upload path of mg_store_body */
+			int64_t stored;
+			success = (store_body_to_file(conn, fp, &stored) == 0);
+#endif
+		} else {
+			for (;;) {
+				int nread = mg_read(conn, buf, sizeof(buf));
+				if (nread <= 0) {
+					success = (nread == 0);
+					break;
+				}
+				if (push_all(conn->phys_ctx, fp, sock, ssl, buf, nread)
+				    != nread) {
+					break;
+				}
 			}
 		}
 
@@ -10963,23 +13148,11 @@ addenv(struct cgi_environment *env, const char *fmt, ...)
 	env->varused++;
 }
 
-/* Return 0 on success, non-zero if an error occurs. */
-
+/* Allocate an empty environment.
+ * Return 0 on success, non-zero if an error occurs. */
 static int
-prepare_cgi_environment(struct mg_connection *conn,
-                        const char *prog,
-                        struct cgi_environment *env,
-                        unsigned char cgi_config_idx)
+init_cgi_environment(struct mg_connection *conn, struct cgi_environment *env)
 {
-	const char *s;
-	struct vec var_vec;
-	char *p, src_addr[IP_ADDR_STR_LEN], http_var_name[128];
-	int i, truncated, uri_len;
-
-	if ((conn == NULL) || (prog == NULL) || (env == NULL)) {
-		return -1;
-	}
-
 	env->conn = conn;
 	env->buflen = CGI_ENVIRONMENT_SIZE;
 	env->bufused = 0;
@@ -11002,6 +13175,30 @@ prepare_cgi_environment(struct mg_connection *conn,
 		return -1;
 	}
 
+	return 0;
+}
+
+/* Return 0 on success, non-zero if an error occurs. */
+
+static int
+prepare_cgi_environment(struct mg_connection *conn,
+                        const char *prog,
+                        struct cgi_environment *env,
+                        unsigned char cgi_config_idx)
+{
+	const char *s;
+	struct vec var_vec;
+	char *p, src_addr[IP_ADDR_STR_LEN], http_var_name[128];
+	int i, truncated, uri_len;
+
+	if ((conn == NULL) || (prog == NULL) || (env == NULL)) {
+		return -1;
+	}
+
+	if (init_cgi_environment(conn, env) != 0) {
+		return -1;
+	}
+
 	addenv(env, "SERVER_NAME=%s", conn->dom_ctx->config[AUTHENTICATION_DOMAIN]);
 	addenv(env, "SERVER_ROOT=%s", conn->dom_ctx->config[DOCUMENT_ROOT]);
 	addenv(env, "DOCUMENT_ROOT=%s", conn->dom_ctx->config[DOCUMENT_ROOT]);
@@ -11197,6 +13394,66 @@ abort_cgi_process(void *data)
 }
 
 
+/* Parse the HTTP headers a CGI program sent in the first headers_len
+ * bytes of buf, and send the status line and the headers to the client.
+ * Used for CGI and FastCGI programs. */
+static void
+send_cgi_response_headers(struct mg_connection *conn,
+                          char *buf,
+                          int headers_len)
+{
+	const char *status, *status_text, *connection_state;
+	struct mg_request_info ri;
+	char *pbuf = buf;
+	int i;
+
+	buf[headers_len - 1] = '\0';
+	ri.num_headers = parse_http_headers(&pbuf, ri.http_headers);
+
+	/* Make up and send the status line */
+	status_text = "OK";
+	if ((status = get_header(ri.http_headers, ri.num_headers, "Status"))
+	    != NULL) {
+		conn->status_code = atoi(status);
+		status_text = status;
+		while (isdigit((unsigned char)*status_text) || *status_text == ' ') {
+			status_text++;
+		}
+	} else if (get_header(ri.http_headers, ri.num_headers, "Location")
+	           != NULL) {
+		conn->status_code = 307;
+	} else {
+		conn->status_code = 200;
+	}
+	connection_state =
+	    get_header(ri.http_headers, ri.num_headers, "Connection");
+	if (!header_has_option(connection_state, "keep-alive")) {
+		conn->must_close = 1;
+	}
+
+	DEBUG_TRACE("CGI: response %u %s", conn->status_code, status_text);
+
+	(void)mg_printf(conn, "HTTP/1.1 %d %s\r\n", conn->status_code, status_text);
+
+	/* Send headers */
+	for (i = 0; i < ri.num_headers; i++) {
+		DEBUG_TRACE("CGI header: %s: %s",
+		            ri.http_headers[i].name,
+		            ri.http_headers[i].value);
+		mg_printf(conn,
+		          "%s: %s\r\n",
+		          ri.http_headers[i].name,
+		          ri.http_headers[i].value);
+	}
+	mg_write(conn, "\r\n", 2);
+}
+
+
+#if !defined(_WIN32)
+#include "mod_fastcgi.inl"
+#endif
+
+
 /* Local (static) function assumes all arguments are valid. */
 static void
 handle_cgi_request(struct mg_connection *conn,
@@ -11207,9 +13464,8 @@ handle_cgi_request(struct mg_connection *conn,
 	size_t buflen;
 	int headers_len, data_len, i, truncated;
 	int fdin[2] = {-1, -1}, fdout[2] = {-1, -1}, fderr[2] = {-1, -1};
-	const char *status, *status_text, *connection_state;
-	char *pbuf, dir[UTF8_PATH_MAX], *p;
-	struct mg_request_info ri;
+	const char *status;
+	char dir[UTF8_PATH_MAX], *p;
 	struct cgi_environment blk;
 	FILE *in = NULL, *out = NULL, *err = NULL;
 	struct mg_file fout = STRUCT_FILE_INITIALIZER;
@@ -11229,10 +13485,17 @@ handle_cgi_request(struct mg_connection *conn,
 
 #endif
 
-	buf = NULL;
-	buflen = conn->phys_ctx->max_request_size;
-	i = prepare_cgi_environment(conn, prog, &blk, cgi_config_idx);
-	if (i != 0) {
+#if !defined(_WIN32)
+	if (handle_fastcgi_request(conn, prog, cgi_config_idx)) {
+		/* Handled by a persistent FastCGI worker process */
+		return;
+	}
+#endif
+
+	buf = NULL;
+	buflen = conn->phys_ctx->max_request_size;
+	i = prepare_cgi_environment(conn, prog, &blk, cgi_config_idx);
+	if (i != 0) {
 		blk.buf = NULL;
 		blk.var = NULL;
 		goto done;
@@ -11349,7 +13612,7 @@ handle_cgi_request(struct mg_connection *conn,
 		            conn->content_len);
 
 		/* This is a POST/PUT request, or another request with body data. */
-		if (!forward_body_data(conn, in, INVALID_SOCKET, NULL)) {
+		if (!forward_body_data(conn, in, INVALID_SOCKET, NULL, 0)) {
 			/* Error sending the body data */
 			mg_cry_internal(
 			    conn,
@@ -11430,46 +13693,7 @@ handle_cgi_request(struct mg_connection *conn,
 		goto done;
 	}
 
-	pbuf = buf;
-	buf[headers_len - 1] = '\0';
-	ri.num_headers = parse_http_headers(&pbuf, ri.http_headers);
-
-	/* Make up and send the status line */
-	status_text = "OK";
-	if ((status = get_header(ri.http_headers, ri.num_headers, "Status"))
-	    != NULL) {
-		conn->status_code = atoi(status);
-		status_text = status;
-		while (isdigit((unsigned char)*status_text) || *status_text == ' ') {
-			status_text++;
-		}
-	} else if (get_header(ri.http_headers, ri.num_headers, "Location")
-	           != NULL) {
-		conn->status_code = 307;
-	} else {
-		conn->status_code = 200;
-	}
-	connection_state =
-	    get_header(ri.http_headers, ri.num_headers, "Connection");
-	if (!header_has_option(connection_state, "keep-alive")) {
-		conn->must_close = 1;
-	}
-
-	DEBUG_TRACE("CGI: response %u %s", conn->status_code, status_text);
-
-	(void)mg_printf(conn, "HTTP/1.1 %d %s\r\n", conn->status_code, status_text);
-
-	/* Send headers */
-	for (i = 0; i < ri.num_headers; i++) {
-		DEBUG_TRACE("CGI header: %s: %s",
-		            ri.http_headers[i].name,
-		            ri.http_headers[i].value);
-		mg_printf(conn,
-		          "%s: %s\r\n",
-		          ri.http_headers[i].name,
-		          ri.http_headers[i].value);
-	}
-	mg_write(conn, "\r\n", 2);
+	send_cgi_response_headers(conn, buf, headers_len);
 
 	/* Send chunk of data that may have been read after the headers */
 	mg_write(conn, buf + headers_len, (size_t)(data_len - headers_len));
@@ -11594,6 +13818,7 @@ static void
 put_file(struct mg_connection *conn, const char *path)
 {
 	struct mg_file file = STRUCT_FILE_INITIALIZER;
+	char tmp[UTF8_PATH_MAX];
 	const char *range;
 	int64_t r1, r2;
 	int rc;
@@ -11673,8 +13898,7 @@ put_file(struct mg_connection *conn, const char *path)
 
 	/* A file should be created or overwritten. */
 	/* Currently CivetWeb does not nead read+write access. */
-	if (!mg_fopen(conn, path, MG_FOPEN_MODE_WRITE, &file)
-	    || file.access.fp == NULL) {
+	if (!store_body_open(conn, path, tmp, sizeof(tmp), &file)) {
 		(void)mg_fclose(&file.access);
 		mg_send_http_error(conn,
 		                   500,
@@ -11692,11 +13916,12 @@ put_file(struct mg_connection *conn, const char *path)
 		fseeko(file.access.fp, r1, SEEK_SET);
 	}
 
-	if (!forward_body_data(conn, file.access.fp, INVALID_SOCKET, NULL)) {
+	if (!forward_body_data(conn, file.access.fp, INVALID_SOCKET, NULL, 1)) {
 		/* forward_body_data failed.
 		 * The error code has already been sent to the client,
 		 * and conn->status_code is already set. */
 		(void)mg_fclose(&file.access);
+		remove_bad_file(conn, tmp);
 		return;
 	}
 
@@ -11704,6 +13929,15 @@ put_file(struct mg_connection *conn, const char *path)
 		/* fclose failed. This might have different reasons, but a likely
 		 * one is "no space on disk", http 507. */
 		conn->status_code = 507;
+		remove_bad_file(conn, tmp);
+	} else if (mg_rename(conn, tmp, path) != 0) {
+		mg_send_http_error(conn,
+		                   500,
+		                   "Error: Can not replace file\nrename(%s): %s",
+		                   path,
+		                   strerror(ERRNO));
+		remove_bad_file(conn, tmp);
+		return;
 	}
 
 	/* Create response (status_code has been set before) */
@@ -11777,34 +14011,100 @@ delete_file(struct mg_connection *conn, const char *path)
 
 #if !defined(NO_FILESYSTEMS)
 static void
-send_ssi_file(struct mg_connection *, const char *, struct mg_file *, int);
+ssi_template_free(struct ssi_template *tpl)
+{
+	size_t i;
+
+	for (i = 0; i < tpl->num_segments; i++) {
+		mg_free(tpl->segments[i].arg);
+	}
+	mg_free(tpl->segments);
+	mg_free(tpl->text);
+	mg_free(tpl->path);
+	mg_free(tpl);
+}
 
 
 static void
-do_ssi_include(struct mg_connection *conn,
-               const char *ssi,
-               char *tag,
-               int include_level)
+ssi_template_release(struct mg_context *ctx, struct ssi_template *tpl)
 {
-	char file_name[MG_BUF_LEN], path[512], *p;
-	struct mg_file file = STRUCT_FILE_INITIALIZER;
-	size_t len;
-	int truncated = 0;
+	int unused;
 
-	if (conn == NULL) {
-		return;
+	pthread_mutex_lock(&ctx->ssi_cache_mutex);
+	unused = (--tpl->refcount == 0);
+	pthread_mutex_unlock(&ctx->ssi_cache_mutex);
+
+	if (unused) {
+		ssi_template_free(tpl);
+	}
+}
+
+
+/* Append a segment to a template. Takes ownership of arg.
+ * Returns 0 if out of memory. */
+static int
+ssi_add_segment(struct mg_context *ctx,
+                struct ssi_template *tpl,
+                int type,
+                size_t ofs,
+                size_t len,
+                char *arg)
+{
+	struct ssi_segment *segments;
+
+	(void)ctx; /* Only used if MEMORY_DEBUGGING is defined */
+
+	if ((type == SSI_LITERAL) && (len == 0)) {
+		return 1;
+	}
+	if ((type != SSI_LITERAL) && (arg == NULL)) {
+		return 0;
+	}
+
+	/* Grow in steps of 16 segments */
+	if ((tpl->num_segments % 16) == 0) {
+		segments = (struct ssi_segment *)mg_realloc_ctx(
+		    tpl->segments,
+		    (tpl->num_segments + 16) * sizeof(segments[0]),
+		    ctx);
+		if (segments == NULL) {
+			mg_free(arg);
+			return 0;
+		}
+		tpl->segments = segments;
 	}
 
-	/* sscanf() is safe here, since send_ssi_file() also uses buffer
-	 * of size MG_BUF_LEN to get the tag. So strlen(tag) is
-	 * always < MG_BUF_LEN. */
+	tpl->segments[tpl->num_segments].type = type;
+	tpl->segments[tpl->num_segments].ofs = ofs;
+	tpl->segments[tpl->num_segments].len = len;
+	tpl->segments[tpl->num_segments].arg = arg;
+	tpl->num_segments++;
+	return 1;
+}
+
+
+/* Get the path of the file included by an SSI #include tag in the SSI file
+ * ssi. Returns 0 if the tag is invalid. */
+static int
+ssi_include_path(struct mg_connection *conn,
+                 const char *ssi,
+                 const char *tag,
+                 char *path,
+                 size_t path_size)
+{
+	char file_name[MG_BUF_LEN], *p;
+	size_t len;
+	int truncated = 0;
+
+	/* sscanf() is safe here, since ssi_compile() also limits the tag
+	 * to MG_BUF_LEN. So strlen(tag) is always < MG_BUF_LEN. */
 	if (sscanf(tag, " virtual=\"%511[^\"]\"", file_name) == 1) {
 		/* File name is relative to the webserver root */
 		file_name[511] = 0;
 		(void)mg_snprintf(conn,
 		                  &truncated,
 		                  path,
-		                  sizeof(path),
+		                  path_size,
 		                  "%s/%s",
 		                  conn->dom_ctx->config[DOCUMENT_ROOT],
 		                  file_name);
@@ -11813,14 +14113,13 @@ do_ssi_include(struct mg_connection *conn,
 		/* File name is relative to the webserver working directory
 		 * or it is absolute system path */
 		file_name[511] = 0;
-		(void)
-		    mg_snprintf(conn, &truncated, path, sizeof(path), "%s", file_name);
+		(void)mg_snprintf(conn, &truncated, path, path_size, "%s", file_name);
 
 	} else if ((sscanf(tag, " file=\"%511[^\"]\"", file_name) == 1)
 	           || (sscanf(tag, " \"%511[^\"]\"", file_name) == 1)) {
 		/* File name is relative to the currect document */
 		file_name[511] = 0;
-		(void)mg_snprintf(conn, &truncated, path, sizeof(path), "%s", ssi);
+		(void)mg_snprintf(conn, &truncated, path, path_size, "%s", ssi);
 
 		if (!truncated) {
 			if ((p = strrchr(path, '/')) != NULL) {
@@ -11830,115 +14129,398 @@ do_ssi_include(struct mg_connection *conn,
 			(void)mg_snprintf(conn,
 			                  &truncated,
 			                  path + len,
-			                  sizeof(path) - len,
+			                  path_size - len,
 			                  "%s",
 			                  file_name);
 		}
 
 	} else {
 		mg_cry_internal(conn, "Bad SSI #include: [%s]", tag);
-		return;
+		return 0;
 	}
 
 	if (truncated) {
 		mg_cry_internal(conn, "SSI #include path length overflow: [%s]", tag);
-		return;
+		return 0;
+	}
+	return 1;
+}
+
+
+/* Split the text of an SSI file into literal byte ranges and directives.
+ * Errors in directives are reported here, once per compilation.
+ * Returns 0 if out of memory. */
+static int
+ssi_compile(struct mg_connection *conn, struct ssi_template *tpl)
+{
+	struct mg_context *ctx = conn->phys_ctx;
+	const char *text = tpl->text;
+	size_t size = (size_t)tpl->size;
+	size_t literal = 0; /* Start of the current literal */
+	size_t pos = 0, tag_len, max_len;
+	const char *p;
+	char tag[MG_BUF_LEN], path[512];
+#if !defined(NO_POPEN)
+	char cmd[1024];
+#endif
+
+	while ((p = (const char *)memchr(text + pos, '<', size - pos)) != NULL) {
+		pos = (size_t)(p - text);
+
+		/* Tags must fit into the tag buffer */
+		max_len = size - pos;
+		if (max_len > sizeof(tag) - 1) {
+			max_len = sizeof(tag) - 1;
+		}
+		p = (const char *)memchr(text + pos, '>', max_len);
+		if (p == NULL) {
+			if (max_len == sizeof(tag) - 1) {
+				/* Nothing after this tag is sent */
+				mg_cry_internal(conn, "%s: tag is too large", tpl->path);
+				size = pos;
+			}
+			/* else: Unterminated tag at the end of the file is text */
+			break;
+		}
+		tag_len = (size_t)(p - (text + pos)) + 1;
+
+		if ((tag_len <= 5) || memcmp(text + pos, "<!--#", 5)) {
+			/* Not an SSI tag, but text */
+			pos += tag_len;
+			continue;
+		}
+
+		/* SSI tag */
+		memcpy(tag, text + pos, tag_len);
+		tag[tag_len] = 0;
+		if (!ssi_add_segment(
+		        ctx, tpl, SSI_LITERAL, literal, pos - literal, NULL)) {
+			return 0;
+		}
+		pos += tag_len;
+		literal = pos;
+
+		if ((tag_len > 12) && !memcmp(tag + 5, "include", 7)) {
+			if (ssi_include_path(
+			        conn, tpl->path, tag + 12, path, sizeof(path))
+			    && !ssi_add_segment(ctx,
+			                        tpl,
+			                        SSI_INCLUDE,
+			                        0,
+			                        0,
+			                        mg_strdup_ctx(path, ctx))) {
+				return 0;
+			}
+#if !defined(NO_POPEN)
+		} else if ((tag_len > 9) && !memcmp(tag + 5, "exec", 4)) {
+			if (sscanf(tag + 9, " \"%1023[^\"]\"", cmd) != 1) {
+				mg_cry_internal(conn, "Bad SSI #exec: [%s]", tag + 9);
+			} else {
+				cmd[1023] = 0;
+				if (!ssi_add_segment(
+				        ctx, tpl, SSI_EXEC, 0, 0, mg_strdup_ctx(cmd, ctx))) {
+					return 0;
+				}
+			}
+#endif /* !NO_POPEN */
+		} else {
+			mg_cry_internal(conn,
+			                "%s: unknown SSI "
+			                "command: \"%s\"",
+			                tpl->path,
+			                tag);
+		}
 	}
 
+	return ssi_add_segment(
+	    ctx, tpl, SSI_LITERAL, literal, size - literal, NULL);
+}
+
+
+/* Find a compiled file in the cache, or read and compile it. A compiled
+ * file is valid as long as the modification time and size of the file did
+ * not change. If is_ssi is not set, the file is one literal segment.
+ * Files larger than SSI_CACHE_MAX_FILE_SIZE are not read.
+ * Returns a referenced template, or NULL if the file is too large or can
+ * not be read. */
+static struct ssi_template *
+ssi_template_get(struct mg_connection *conn,
+                 const char *path,
+                 const struct mg_file_stat *file_stat,
+                 int is_ssi)
+{
+	struct mg_context *ctx = conn->phys_ctx;
+	struct mg_file file = STRUCT_FILE_INITIALIZER;
+	struct mg_file_stat st;
+	struct ssi_template *tpl = NULL, *evicted;
+	time_t now = time(NULL);
+	size_t n;
+	int i, slot, ok;
+
+	if (file_stat == NULL) {
+		if (!mg_stat_cached(conn, path, &st)) {
+			return NULL;
+		}
+		file_stat = &st;
+	}
+	if (file_stat->is_directory
+	    || (file_stat->size > SSI_CACHE_MAX_FILE_SIZE)) {
+		return NULL;
+	}
+
+	pthread_mutex_lock(&ctx->ssi_cache_mutex);
+	for (i = 0; i < SSI_CACHE_SIZE; i++) {
+		struct ssi_template *t = ctx->ssi_cache[i];
+		if ((t != NULL) && (t->dom_ctx == conn->dom_ctx)
+		    && (t->is_ssi == is_ssi) && !strcmp(t->path, path)) {
+			/* A change in the same second as the compilation can not be
+			 * detected, so such a template is never valid. */
+			if ((t->mtime == file_stat->last_modified)
+			    && (t->size == file_stat->size)
+			    && (t->compile_time > t->mtime)) {
+				t->refcount++;
+				t->last_used = now;
+				tpl = t;
+			}
+			break;
+		}
+	}
+	pthread_mutex_unlock(&ctx->ssi_cache_mutex);
+	if (tpl != NULL) {
+		return tpl;
+	}
+
+	/* Read the whole file */
 	if (!mg_fopen(conn, path, MG_FOPEN_MODE_READ, &file)) {
-		mg_cry_internal(conn,
-		                "Cannot open SSI #include: [%s]: fopen(%s): %s",
-		                tag,
-		                path,
-		                strerror(ERRNO));
+		return NULL;
+	}
+	fclose_on_exec(&file.access, conn);
+	tpl = (struct ssi_template *)mg_calloc_ctx(1, sizeof(*tpl), ctx);
+	if ((tpl != NULL) && (file.stat.size < (uint64_t)SIZE_MAX)) {
+		tpl->path = mg_strdup_ctx(path, ctx);
+		tpl->text = (char *)mg_malloc_ctx((size_t)file.stat.size + 1, ctx);
+	}
+	if ((tpl == NULL) || (tpl->path == NULL) || (tpl->text == NULL)) {
+		(void)mg_fclose(&file.access);
+		if (tpl != NULL) {
+			ssi_template_free(tpl);
+		}
+		return NULL;
+	}
+	n = fread(tpl->text, 1, (size_t)file.stat.size, file.access.fp);
+	(void)mg_fclose(&file.access); /* Ignore errors for readonly files */
+
+	tpl->dom_ctx = conn->dom_ctx;
+	tpl->mtime = file.stat.last_modified;
+	tpl->size = (uint64_t)n; /* Compiled again if the file changed */
+	tpl->compile_time = now;
+	tpl->last_used = now;
+	tpl->is_ssi = is_ssi;
+	tpl->refcount = 1;
+	if (is_ssi) {
+		ok = ssi_compile(conn, tpl);
 	} else {
-		fclose_on_exec(&file.access, conn);
-		if (match_prefix_strlen(conn->dom_ctx->config[SSI_EXTENSIONS], path)
-		    > 0) {
-			send_ssi_file(conn, path, &file, include_level + 1);
-		} else {
-			send_file_data(conn, &file, 0, INT64_MAX);
+		ok = ssi_add_segment(ctx, tpl, SSI_LITERAL, 0, n, NULL);
+	}
+	if (!ok) {
+		ssi_template_free(tpl);
+		return NULL;
+	}
+
+	if (tpl->size > SSI_CACHE_MAX_FILE_SIZE) {
+		/* The file grew after it has been checked: only used by this
+		 * request */
+		return tpl;
+	}
+
+	pthread_mutex_lock(&ctx->ssi_cache_mutex);
+	/* Replace an older version of the same file, use a free slot or
+	 * evict the least recently used entry */
+	slot = -1;
+	for (i = 0; i < SSI_CACHE_SIZE; i++) {
+		struct ssi_template *t = ctx->ssi_cache[i];
+		if (t == NULL) {
+			if (slot < 0) {
+				slot = i;
+			}
+		} else if ((t->dom_ctx == tpl->dom_ctx) && (t->is_ssi == is_ssi)
+		           && !strcmp(t->path, tpl->path)) {
+			slot = i;
+			break;
 		}
-		(void)mg_fclose(&file.access); /* Ignore errors for readonly files */
 	}
+	if (slot < 0) {
+		slot = 0;
+		for (i = 1; i < SSI_CACHE_SIZE; i++) {
+			if (ctx->ssi_cache[i]->last_used
+			    < ctx->ssi_cache[slot]->last_used) {
+				slot = i;
+			}
+		}
+	}
+	evicted = ctx->ssi_cache[slot];
+	if ((evicted != NULL) && (--evicted->refcount > 0)) {
+		/* Still in use by another request */
+		evicted = NULL;
+	}
+	ctx->ssi_cache[slot] = tpl;
+	tpl->refcount++;
+	pthread_mutex_unlock(&ctx->ssi_cache_mutex);
+
+	if (evicted != NULL) {
+		ssi_template_free(evicted);
+	}
+	return tpl;
+}
+
+
+/* Literal text of an SSI response, collected to be sent with one call of
+ * mg_write_vec. Included templates are referenced until their text has
+ * been sent. */
+struct ssi_output {
+	struct mg_write_buf bufs[MG_WRITE_VEC_MAX];
+	int num_bufs;
+	struct ssi_template *templates[MG_WRITE_VEC_MAX];
+	int num_templates;
+};
+
+
+static void
+ssi_output_flush(struct mg_connection *conn, struct ssi_output *out)
+{
+	int i;
+
+	if (out->num_bufs > 0) {
+		(void)mg_write_vec(conn, out->bufs, out->num_bufs);
+		out->num_bufs = 0;
+	}
+	for (i = 0; i < out->num_templates; i++) {
+		ssi_template_release(conn->phys_ctx, out->templates[i]);
+	}
+	out->num_templates = 0;
 }
 
 
 #if !defined(NO_POPEN)
 static void
-do_ssi_exec(struct mg_connection *conn, char *tag)
+do_ssi_exec(struct mg_connection *conn, const char *cmd)
 {
-	char cmd[1024] = "";
 	struct mg_file file = STRUCT_FILE_INITIALIZER;
 
-	if (sscanf(tag, " \"%1023[^\"]\"", cmd) != 1) {
-		mg_cry_internal(conn, "Bad SSI #exec: [%s]", tag);
+	if ((file.access.fp = popen(cmd, "r")) == NULL) {
+		mg_cry_internal(conn,
+		                "Cannot SSI #exec: [%s]: %s",
+		                cmd,
+		                strerror(ERRNO));
 	} else {
-		cmd[1023] = 0;
-		if ((file.access.fp = popen(cmd, "r")) == NULL) {
-			mg_cry_internal(conn,
-			                "Cannot SSI #exec: [%s]: %s",
-			                cmd,
-			                strerror(ERRNO));
-		} else {
-			send_file_data(conn, &file, 0, INT64_MAX);
-			pclose(file.access.fp);
-		}
+		send_file_data(conn, &file, 0, INT64_MAX);
+		pclose(file.access.fp);
 	}
 }
 #endif /* !NO_POPEN */
 
 
-static int
-mg_fgetc(struct mg_file *filep)
+static void do_ssi_include(struct mg_connection *conn,
+                           struct ssi_output *out,
+                           const char *path,
+                           int include_level);
+
+
+/* Add the literals and the output of all directives of a template.
+ * The caller holds a reference to tpl until its text in out has been
+ * sent. */
+static void
+send_ssi_template(struct mg_connection *conn,
+                  struct ssi_output *out,
+                  struct ssi_template *tpl,
+                  int include_level)
 {
-	if (filep == NULL) {
-		return EOF;
+	const struct ssi_segment *seg;
+	size_t i;
+
+	/* Up to 5 nested SSI files, plain files are always sent */
+	if (tpl->is_ssi && (include_level > 5)) {
+		mg_cry_internal(conn, "SSI #include level is too deep (%s)", tpl->path);
+		return;
 	}
 
-	if (filep->access.fp != NULL) {
-		return fgetc(filep->access.fp);
-	} else {
-		return EOF;
+	for (i = 0; i < tpl->num_segments; i++) {
+		seg = tpl->segments + i;
+		switch (seg->type) {
+		case SSI_LITERAL:
+			if (out->num_bufs == MG_WRITE_VEC_MAX) {
+				ssi_output_flush(conn, out);
+			}
+			out->bufs[out->num_bufs].buf = tpl->text + seg->ofs;
+			out->bufs[out->num_bufs].len = seg->len;
+			out->num_bufs++;
+			break;
+		case SSI_INCLUDE:
+			do_ssi_include(conn, out, seg->arg, include_level + 1);
+			break;
+#if !defined(NO_POPEN)
+		case SSI_EXEC:
+			/* Keep the order of text and command output */
+			ssi_output_flush(conn, out);
+			do_ssi_exec(conn, seg->arg);
+			break;
+#endif /* !NO_POPEN */
+		}
 	}
 }
 
 
+/* Send an SSI file that is too large for the cache while it is read,
+ * byte by byte. */
 static void
-send_ssi_file(struct mg_connection *conn,
-              const char *path,
-              struct mg_file *filep,
-              int include_level)
+send_ssi_stream(struct mg_connection *conn,
+                struct ssi_output *out,
+                const char *path,
+                struct mg_file *filep,
+                int include_level)
 {
-	char buf[MG_BUF_LEN];
+	char buf[MG_BUF_LEN], inc[512];
+#if !defined(NO_POPEN)
+	char cmd[1024];
+#endif
 	int ch, len, in_tag, in_ssi_tag;
 
-	if (include_level > 10) {
+	if (include_level > 5) {
 		mg_cry_internal(conn, "SSI #include level is too deep (%s)", path);
 		return;
 	}
 
+	/* Text of the including files is sent first */
+	ssi_output_flush(conn, out);
 	in_tag = in_ssi_tag = len = 0;
 
-	/* Read file, byte by byte, and look for SSI include tags */
-	while ((ch = mg_fgetc(filep)) != EOF) {
+	while ((ch = fgetc(filep->access.fp)) != EOF) {
 
 		if (in_tag) {
 			/* We are in a tag, either SSI tag or html tag */
+			buf[len++] = (char)(ch & 0xff);
 
 			if (ch == '>') {
-				/* Tag is closing */
-				buf[len++] = '>';
-
 				if (in_ssi_tag) {
 					/* Handle SSI tag */
 					buf[len] = 0;
 
 					if ((len > 12) && !memcmp(buf + 5, "include", 7)) {
-						do_ssi_include(conn, path, buf + 12, include_level + 1);
+						if (ssi_include_path(
+						        conn, path, buf + 12, inc, sizeof(inc))) {
+							do_ssi_include(conn, out, inc, include_level + 1);
+							ssi_output_flush(conn, out);
+						}
 #if !defined(NO_POPEN)
 					} else if ((len > 9) && !memcmp(buf + 5, "exec", 4)) {
-						do_ssi_exec(conn, buf + 9);
+						if (sscanf(buf + 9, " \"%1023[^\"]\"", cmd) != 1) {
+							mg_cry_internal(conn,
+							                "Bad SSI #exec: [%s]",
+							                buf + 9);
+						} else {
+							cmd[1023] = 0;
+							do_ssi_exec(conn, cmd);
+						}
 #endif /* !NO_POPEN */
 					} else {
 						mg_cry_internal(conn,
@@ -11947,95 +14529,123 @@ send_ssi_file(struct mg_connection *conn,
 						                path,
 						                buf);
 					}
-					len = 0;
-					in_ssi_tag = in_tag = 0;
-
 				} else {
 					/* Not an SSI tag */
-					/* Flush buffer */
 					(void)mg_write(conn, buf, (size_t)len);
-					len = 0;
-					in_tag = 0;
 				}
+				len = 0;
+				in_ssi_tag = in_tag = 0;
 
 			} else {
-				/* Tag is still open */
-				buf[len++] = (char)(ch & 0xff);
-
 				if ((len == 5) && !memcmp(buf, "<!--#", 5)) {
 					/* All SSI tags start with <!--# */
 					in_ssi_tag = 1;
 				}
-
 				if ((len + 2) > (int)sizeof(buf)) {
-					/* Tag to long for buffer */
+					/* Nothing after this tag is sent */
 					mg_cry_internal(conn, "%s: tag is too large", path);
 					return;
 				}
 			}
 
-		} else {
-
-			/* We are not in a tag yet. */
-			if (ch == '<') {
-				/* Tag is opening */
-				in_tag = 1;
-
-				if (len > 0) {
-					/* Flush current buffer.
-					 * Buffer is filled with "len" bytes. */
-					(void)mg_write(conn, buf, (size_t)len);
-				}
-				/* Store the < */
-				len = 1;
-				buf[0] = '<';
+		} else if (ch == '<') {
+			/* Tag is opening */
+			if (len > 0) {
+				(void)mg_write(conn, buf, (size_t)len);
+			}
+			in_tag = 1;
+			len = 1;
+			buf[0] = '<';
 
-			} else {
-				/* No Tag */
-				/* Add data to buffer */
-				buf[len++] = (char)(ch & 0xff);
-				/* Flush if buffer is full */
-				if (len == (int)sizeof(buf)) {
-					mg_write(conn, buf, (size_t)len);
-					len = 0;
-				}
+		} else {
+			/* Text */
+			buf[len++] = (char)(ch & 0xff);
+			if (len == (int)sizeof(buf)) {
+				(void)mg_write(conn, buf, (size_t)len);
+				len = 0;
 			}
 		}
 	}
 
 	/* Send the rest of buffered data */
 	if (len > 0) {
-		mg_write(conn, buf, (size_t)len);
+		(void)mg_write(conn, buf, (size_t)len);
 	}
 }
 
 
 static void
-handle_ssi_file_request(struct mg_connection *conn,
-                        const char *path,
-                        struct mg_file *filep)
+do_ssi_include(struct mg_connection *conn,
+               struct ssi_output *out,
+               const char *path,
+               int include_level)
 {
-	char date[64];
-	time_t curtime = time(NULL);
-	const char *cors_orig_cfg;
-	const char *cors1, *cors2;
+	struct mg_file file = STRUCT_FILE_INITIALIZER;
+	struct ssi_template *tpl;
+	int is_ssi =
+	    (match_prefix_strlen(conn->dom_ctx->config[SSI_EXTENSIONS], path) > 0);
 
-	if ((conn == NULL) || (path == NULL) || (filep == NULL)) {
+	tpl = ssi_template_get(conn, path, NULL, is_ssi);
+	if (tpl != NULL) {
+		send_ssi_template(conn, out, tpl, include_level);
+
+		/* The template is referenced until its text has been sent */
+		if (out->num_templates == MG_WRITE_VEC_MAX) {
+			ssi_output_flush(conn, out);
+		}
+		out->templates[out->num_templates++] = tpl;
 		return;
 	}
 
-	cors_orig_cfg = conn->dom_ctx->config[ACCESS_CONTROL_ALLOW_ORIGIN];
-	if (cors_orig_cfg && *cors_orig_cfg && mg_get_header(conn, "Origin")) {
-		/* Cross-origin resource sharing (CORS). */
-		cors1 = "Access-Control-Allow-Origin";
-		cors2 = cors_orig_cfg;
-	} else {
-		cors1 = cors2 = "";
+	/* Large file, or the file can not be read */
+	ssi_output_flush(conn, out);
+	if (!mg_fopen(conn, path, MG_FOPEN_MODE_READ, &file)) {
+		mg_cry_internal(conn,
+		                "Cannot open SSI #include: fopen(%s): %s",
+		                path,
+		                strerror(ERRNO));
+	} else {
+		fclose_on_exec(&file.access, conn);
+		if (is_ssi) {
+			send_ssi_stream(conn, out, path, &file, include_level);
+		} else {
+			send_file_data(conn, &file, 0, INT64_MAX);
+		}
+		(void)mg_fclose(&file.access); /* Ignore errors for readonly files */
 	}
+}
 
-	if (!mg_fopen(conn, path, MG_FOPEN_MODE_READ, filep)) {
+
+static void
+handle_ssi_file_request(struct mg_connection *conn,
+                        const char *path,
+                        struct mg_file *filep)
+{
+	char date[64];
+	time_t curtime = time(NULL);
+	const char *cors_orig_cfg;
+	const char *cors1, *cors2;
+	struct ssi_template *tpl;
+	struct ssi_output out;
+
+	if ((conn == NULL) || (path == NULL) || (filep == NULL)) {
+		return;
+	}
+
+	cors_orig_cfg = conn->dom_ctx->config[ACCESS_CONTROL_ALLOW_ORIGIN];
+	if (cors_orig_cfg && *cors_orig_cfg && mg_get_header(conn, "Origin")) {
+		/* Cross-origin resource sharing (CORS). */
+		cors1 = "Access-Control-Allow-Origin";
+		cors2 = cors_orig_cfg;
+	} else {
+		cors1 = cors2 = "";
+	}
+
+	/* Large files are not cached, but sent while they are read */
+	tpl = ssi_template_get(conn, path, &filep->stat, 1);
+	if ((tpl == NULL) && !mg_fopen(conn, path, MG_FOPEN_MODE_READ, filep)) {
 		/* File exists (precondition for calling this function),
-		 * but can not be opened by the server. */
+		 * but can not be read by the server. */
 		mg_send_http_error(conn,
 		                   500,
 		                   "Error: Cannot read file\nfopen(%s): %s",
@@ -12046,7 +14656,6 @@ handle_ssi_file_request(struct mg_connection *conn,
 		 * content length */
 		conn->must_close = 1;
 		gmt_time_string(date, sizeof(date), &curtime);
-		fclose_on_exec(&filep->access, conn);
 
 		/* 200 OK response */
 		mg_response_header_start(conn, 200);
@@ -12059,8 +14668,19 @@ handle_ssi_file_request(struct mg_connection *conn,
 		mg_response_header_send(conn);
 
 		/* Header sent, now send body */
-		send_ssi_file(conn, path, filep, 0);
-		(void)mg_fclose(&filep->access); /* Ignore errors for readonly files */
+		out.num_bufs = 0;
+		out.num_templates = 0;
+		if (tpl != NULL) {
+			send_ssi_template(conn, &out, tpl, 0);
+			ssi_output_flush(conn, &out);
+			ssi_template_release(conn->phys_ctx, tpl);
+		} else {
+			fclose_on_exec(&filep->access, conn);
+			send_ssi_stream(conn, &out, path, filep, 0);
+			ssi_output_flush(conn, &out);
+			/* Ignore errors for readonly files */
+			(void)mg_fclose(&filep->access);
+		}
 	}
 }
 #endif /* NO_FILESYSTEMS */
@@ -12227,6 +14847,16 @@ mg_unlock_connection(struct mg_connection *conn)
 {
 	if (conn) {
 		(void)pthread_mutex_unlock(&conn->mutex);
+#if defined(USE_WEBSOCKET)
+		if (conn->ws_out_busy) {
+			/* Let the "wsout" thread send the queue now */
+			struct mg_context *ctx = conn->phys_ctx;
+			pthread_mutex_lock(&ctx->ws_mutex);
+			conn->ws_out_busy = 0;
+			pthread_cond_broadcast(&ctx->ws_cond);
+			pthread_mutex_unlock(&ctx->ws_mutex);
+		}
+#endif
 	}
 }
 
@@ -12685,26 +15315,773 @@ read_websocket(struct mg_connection *conn,
 						                         NULL,
 						                         0);
 
-						if (ret <= 0) {
-							/* Error: send failed */
-							DEBUG_TRACE("Send PING failed (%i)", ret);
-							break;
-						}
-						ping_count++;
-					}
-				}
-				/* Timeout: should retry */
-				/* TODO: get timeout def */
-			}
-		}
+						if (ret <= 0) {
+							/* Error: send failed */
+							DEBUG_TRACE("Send PING failed (%i)", ret);
+							break;
+						}
+						ping_count++;
+					}
+				}
+				/* Timeout: should retry */
+				/* TODO: get timeout def */
+			}
+		}
+	}
+
+	/* Leave data processing loop */
+	mg_set_thread_name("worker");
+	conn->in_websocket_handling = 0;
+	DEBUG_TRACE("Websocket connection %s:%u left data processing loop",
+	            conn->request_info.remote_addr,
+	            conn->request_info.remote_port);
+}
+
+
+/* Outbound queues of websocket clients (see mg_websocket_broadcast).
+ * A broadcast message is encoded into one reference counted frame, which
+ * is appended to the queue of every client of the websocket handler.
+ * Queues are sent without blocking, by the broadcasting thread and by the
+ * "wsout" thread, which waits until the sockets of slow clients are
+ * writable again. All queues are protected by phys_ctx->ws_mutex, sending
+ * requires the connection lock as well.
+ * If a queue grows above websocket_queue_high_watermark, the queue policy
+ * decides what happens to new frames. */
+enum {
+	WS_QUEUE_BLOCK,       /* Wait until the queue is below the low watermark,
+	                       * broadcasts drop the oldest frames instead */
+	WS_QUEUE_DROP_OLDEST, /* Drop unsent frames from the head of the queue */
+	WS_QUEUE_COALESCE,    /* Replace unsent frames with the same key, drop
+	                       * the oldest ones above the high watermark */
+	WS_QUEUE_DISCONNECT   /* Close the connection of the client */
+};
+
+struct ws_frame {
+	volatile ptrdiff_t refcount; /* One reference for every queue entry */
+	size_t len;                  /* Frame header and payload */
+	char *data;                  /* Allocated together with the struct */
+	const char *key;             /* Coalescing key or NULL */
+};
+
+struct ws_out_entry {
+	struct ws_frame *frame;
+	struct ws_out_entry *next;
+};
+
+
+static void
+ws_frame_release(struct ws_frame *frame)
+{
+	if (mg_atomic_dec(&frame->refcount) == 0) {
+		mg_free(frame);
+	}
+}
+
+
+/* Track the watermark state of a queue. ws_mutex must be held. */
+static void
+ws_out_set_high(struct mg_connection *conn, int above)
+{
+	struct mg_context *ctx = conn->phys_ctx;
+
+	conn->ws_out_high = above;
+	if (ctx->callbacks.websocket_queue_state != NULL) {
+		ctx->callbacks.websocket_queue_state(conn, above);
+	}
+	if (!above) {
+		/* Wake up writers blocked in ws_out_wait */
+		pthread_cond_broadcast(&ctx->ws_cond);
+	}
+}
+
+
+static void
+ws_out_check_low(struct mg_connection *conn)
+{
+	if (conn->ws_out_high
+	    && (conn->ws_out_bytes <= conn->phys_ctx->ws_queue_low_watermark)) {
+		ws_out_set_high(conn, 0);
+	}
+}
+
+
+/* Remove an unsent frame from the outbound queue. prev is the entry in
+ * front of it, or NULL. ws_mutex must be held. */
+static void
+ws_out_unlink(struct mg_connection *conn,
+              struct ws_out_entry *prev,
+              struct ws_out_entry *e)
+{
+	if (prev != NULL) {
+		prev->next = e->next;
+	} else {
+		conn->ws_out_head = e->next;
+	}
+	if (conn->ws_out_tail == e) {
+		conn->ws_out_tail = prev;
+	}
+	conn->ws_out_bytes -= e->frame->len;
+	conn->ws_out_frames--;
+	ws_frame_release(e->frame);
+	mg_free(e);
+}
+
+
+/* Remove all frames from the outbound queue. ws_mutex must be held. */
+static void
+ws_out_clear(struct mg_connection *conn)
+{
+	struct ws_out_entry *e;
+
+	while ((e = conn->ws_out_head) != NULL) {
+		conn->ws_out_head = e->next;
+		ws_frame_release(e->frame);
+		mg_free(e);
+	}
+	conn->ws_out_tail = NULL;
+	conn->ws_out_ofs = 0;
+	conn->ws_out_bytes = 0;
+	conn->ws_out_frames = 0;
+	if (conn->ws_out_high) {
+		conn->ws_out_high = 0;
+		pthread_cond_broadcast(&conn->phys_ctx->ws_cond);
+	}
+}
+
+
+/* Queue policy "drop_oldest": drop unsent frames until len more bytes fit
+ * below the high watermark. A partially sent frame must be completed. */
+static void
+ws_out_drop(struct mg_connection *conn, size_t len)
+{
+	struct ws_out_entry *prev, *e;
+	size_t high = conn->phys_ctx->ws_queue_high_watermark;
+
+	prev = (conn->ws_out_ofs > 0) ? conn->ws_out_head : NULL;
+	while (conn->ws_out_bytes + len > high) {
+		e = (prev != NULL) ? prev->next : conn->ws_out_head;
+		if (e == NULL) {
+			break;
+		}
+		ws_out_unlink(conn, prev, e);
+		conn->ws_out_dropped++;
+	}
+}
+
+
+/* Queue policy "coalesce": replace the last unsent frame with the same
+ * key, keeping its position in the queue. Returns 0 if there is none.
+ * Frames with a key are replaced as long as they are waiting in the queue,
+ * e.g., for a slow client or until websocket_max_flush_rate permits the
+ * next flush. */
+static int
+ws_out_replace(struct mg_connection *conn, struct ws_frame *frame)
+{
+	struct ws_out_entry *e, *found = NULL;
+
+	if (frame->key == NULL) {
+		return 0;
+	}
+	e = conn->ws_out_head;
+	if ((e != NULL) && (conn->ws_out_ofs > 0)) {
+		e = e->next;
+	}
+	for (; e != NULL; e = e->next) {
+		if ((e->frame->key != NULL) && !strcmp(e->frame->key, frame->key)) {
+			found = e;
+		}
+	}
+	if (found == NULL) {
+		return 0;
+	}
+	conn->ws_out_bytes -= found->frame->len;
+	conn->ws_out_bytes += frame->len;
+	if (conn->ws_out_bytes > conn->ws_out_peak) {
+		conn->ws_out_peak = conn->ws_out_bytes;
+	}
+	mg_atomic_inc(&frame->refcount);
+	ws_frame_release(found->frame);
+	found->frame = frame;
+	conn->ws_out_dropped++;
+	return 1;
+}
+
+
+/* Queue policy "disconnect": close the connection. The read loop of the
+ * worker thread returns, when the socket is shut down. */
+static void
+ws_out_disconnect(struct mg_connection *conn)
+{
+	conn->ws_out_dropped += conn->ws_out_frames;
+	ws_out_clear(conn);
+	conn->ws_out_closed = 1;
+	conn->must_close = 1;
+	shutdown(conn->client.sock, SHUTDOWN_BOTH);
+}
+
+
+/* Append a frame to the outbound queue of a client, applying the queue
+ * policy. fanout is set for broadcasts, which must not wait for a single
+ * slow client. ws_mutex must be held. Returns 0 if the frame was dropped.
+ */
+static int
+ws_out_enqueue(struct mg_connection *conn,
+               struct ws_frame *frame,
+               int fanout)
+{
+	struct mg_context *ctx = conn->phys_ctx;
+	size_t high = ctx->ws_queue_high_watermark;
+	struct ws_out_entry *e;
+
+	if (conn->ws_out_closed) {
+		return 0;
+	}
+	if ((ctx->ws_queue_policy == WS_QUEUE_COALESCE)
+	    && ws_out_replace(conn, frame)) {
+		return 1;
+	}
+
+	if ((high > 0) && (conn->ws_out_bytes + frame->len > high)) {
+		if (!conn->ws_out_high) {
+			ws_out_set_high(conn, 1);
+		}
+		switch (ctx->ws_queue_policy) {
+		case WS_QUEUE_COALESCE:
+		case WS_QUEUE_DROP_OLDEST:
+			ws_out_drop(conn, frame->len);
+			break;
+		case WS_QUEUE_DISCONNECT:
+			ws_out_disconnect(conn);
+			return 0;
+		default:
+			/* WS_QUEUE_BLOCK: mg_websocket_queue_write has waited already,
+			 * a broadcast continues with the other clients */
+			if (fanout) {
+				ws_out_drop(conn, frame->len);
+			}
+			break;
+		}
+	}
+
+	e = (struct ws_out_entry *)mg_malloc_ctx(sizeof(*e), ctx);
+	if (e == NULL) {
+		conn->ws_out_dropped++;
+		return 0;
+	}
+	mg_atomic_inc(&frame->refcount);
+	e->frame = frame;
+	e->next = NULL;
+	if (conn->ws_out_tail != NULL) {
+		conn->ws_out_tail->next = e;
+	} else {
+		conn->ws_out_head = e;
+	}
+	conn->ws_out_tail = e;
+	conn->ws_out_bytes += frame->len;
+	conn->ws_out_frames++;
+	if (conn->ws_out_bytes > conn->ws_out_peak) {
+		conn->ws_out_peak = conn->ws_out_bytes;
+	}
+	return 1;
+}
+
+
+/* Queue policy "block": wait until the queue of a client drained below
+ * the low watermark, but not longer than request_timeout_ms. The client
+ * is disconnected on timeout. ws_mutex must be held, it is released while
+ * waiting for ws_cond (see ws_out_set_high and ws_out_clear). */
+static void
+ws_out_wait(struct mg_connection *conn)
+{
+	struct mg_context *ctx = conn->phys_ctx;
+	int timeout_ms = atoi(ctx->dd.config[REQUEST_TIMEOUT]);
+	uint64_t deadline =
+	    mg_get_current_time_ns() + (uint64_t)timeout_ms * 1000000;
+	struct timespec abstime;
+#if defined(_WIN32)
+	/* The emulation of pthread_cond_timedwait uses an event of the waiting
+	 * thread. Threads not started by civetweb get a temporary one. */
+	struct mg_workerTLS tmp_tls;
+	struct mg_workerTLS *tls =
+	    (struct mg_workerTLS *)pthread_getspecific(sTlsKey);
+
+	if ((tls == NULL) || (tls->pthread_cond_helper_mutex == NULL)) {
+		memset(&tmp_tls, 0, sizeof(tmp_tls));
+		tmp_tls.pthread_cond_helper_mutex =
+		    CreateEvent(NULL, FALSE, FALSE, NULL);
+		if (tmp_tls.pthread_cond_helper_mutex == NULL) {
+			return;
+		}
+		pthread_setspecific(sTlsKey, &tmp_tls);
+	}
+#endif
+
+	abstime.tv_sec = (time_t)(deadline / 1000000000);
+	abstime.tv_nsec = (long)(deadline % 1000000000);
+	while (conn->ws_listed && conn->ws_out_high
+	       && STOP_FLAG_IS_ZERO(&ctx->stop_flag)) {
+		if (timeout_ms <= 0) {
+			pthread_cond_wait(&ctx->ws_cond, &ctx->ws_mutex);
+		} else if (mg_get_current_time_ns() < deadline) {
+			pthread_cond_timedwait(&ctx->ws_cond, &ctx->ws_mutex, &abstime);
+		} else {
+			ws_out_disconnect(conn);
+			break;
+		}
+	}
+
+#if defined(_WIN32)
+	if ((tls == NULL) || (tls->pthread_cond_helper_mutex == NULL)) {
+		pthread_setspecific(sTlsKey, tls);
+		CloseHandle(tmp_tls.pthread_cond_helper_mutex);
+	}
+#endif
+}
+
+
+/* Write without waiting for the socket. Returns the number of bytes
+ * written, 0 if the socket is not writable, or -1 on error. */
+static int
+ws_out_write_some(struct mg_connection *conn, const char *buf, size_t len)
+{
+	int n, err;
+	int chunk = (len > INT_MAX) ? INT_MAX : (int)len;
+
+#if defined(_WIN32)
+	typedef int len_t;
+#else
+	typedef size_t len_t;
+#endif
+
+#if defined(USE_MBEDTLS)
+	if (conn->ssl != NULL) {
+		n = mbed_ssl_write(conn->ssl, (const unsigned char *)buf, chunk);
+		if (n > 0) {
+			return n;
+		}
+		return ((n == MBEDTLS_ERR_SSL_WANT_READ)
+		        || (n == MBEDTLS_ERR_SSL_WANT_WRITE)
+		        || (n == MBEDTLS_ERR_SSL_ASYNC_IN_PROGRESS))
+		           ? 0
+		           : -1;
+	}
+#elif !defined(NO_SSL)
+	if (conn->ssl != NULL) {
+		ERR_clear_error();
+		n = SSL_write(conn->ssl, buf, chunk);
+		if (n > 0) {
+			return n;
+		}
+		err = SSL_get_error(conn->ssl, n);
+		ERR_clear_error();
+		return ((err == SSL_ERROR_WANT_READ) || (err == SSL_ERROR_WANT_WRITE))
+		           ? 0
+		           : -1;
+	}
+#endif
+
+	n = (int)send(conn->client.sock, buf, (len_t)chunk, MSG_NOSIGNAL);
+	if (n >= 0) {
+		return n;
+	}
+	err = ERRNO;
+#if defined(_WIN32)
+	return (err == WSAEWOULDBLOCK) ? 0 : -1;
+#else
+	return ERROR_TRY_AGAIN(err) ? 0 : -1;
+#endif
+}
+
+
+/* Send queued frames until the socket is not writable. ws_mutex and the
+ * connection lock must be held. */
+static void
+ws_out_send(struct mg_connection *conn)
+{
+	struct ws_out_entry *e;
+	uint64_t interval = conn->phys_ctx->ws_flush_interval_ns, now = 0;
+	int n, sent = 0;
+
+	if (interval > 0) {
+		/* websocket_max_flush_rate: send the queue at most once per
+		 * interval. Messages queued in the meantime may coalesce. */
+		now = mg_get_current_time_ns();
+		if (now < conn->ws_out_due_ns) {
+			return;
+		}
+	}
+
+	while ((e = conn->ws_out_head) != NULL) {
+		n = ws_out_write_some(conn,
+		                      e->frame->data + conn->ws_out_ofs,
+		                      e->frame->len - conn->ws_out_ofs);
+		if (n <= 0) {
+			if (n < 0) {
+				/* The read loop will notice the closed connection */
+				ws_out_clear(conn);
+				conn->ws_out_closed = 1;
+				conn->must_close = 1;
+			}
+			break;
+		}
+		sent = 1;
+		conn->num_bytes_sent += n;
+		conn->ws_out_ofs += (size_t)n;
+		conn->ws_out_bytes -= (size_t)n;
+		if (conn->ws_out_ofs == e->frame->len) {
+			conn->ws_out_head = e->next;
+			if (e->next == NULL) {
+				conn->ws_out_tail = NULL;
+			}
+			conn->ws_out_ofs = 0;
+			conn->ws_out_frames--;
+			ws_frame_release(e->frame);
+			mg_free(e);
+		}
+	}
+	if (sent && (interval > 0) && (conn->ws_out_head == NULL)) {
+		conn->ws_out_due_ns = now + interval;
+	}
+	ws_out_check_low(conn);
+}
+
+
+/* Send queued frames, unless another thread holds the connection lock.
+ * This thread will send the queue before writing anything else (see
+ * ws_out_flush_locked). ws_mutex must be held. Returns 0 if the
+ * connection is busy. */
+static int
+ws_out_flush(struct mg_connection *conn)
+{
+	if (pthread_mutex_trylock(&conn->mutex) != 0) {
+		return 0;
+	}
+	ws_out_send(conn);
+	pthread_mutex_unlock(&conn->mutex);
+	return 1;
+}
+
+
+/* Send all queued frames, before writing to the connection directly.
+ * The connection lock must be held. */
+static void
+ws_out_flush_locked(struct mg_connection *conn)
+{
+	struct mg_context *ctx = conn->phys_ctx;
+	struct ws_out_entry *e, *head;
+	size_t ofs;
+	int ok = 1;
+
+	if (conn->ws_out_head == NULL) {
+		/* Nothing queued: the common case, no need to lock ws_mutex */
+		return;
+	}
+
+	pthread_mutex_lock(&ctx->ws_mutex);
+	head = conn->ws_out_head;
+	ofs = conn->ws_out_ofs;
+	conn->ws_out_head = conn->ws_out_tail = NULL;
+	conn->ws_out_ofs = 0;
+	conn->ws_out_bytes = 0;
+	conn->ws_out_frames = 0;
+	ws_out_check_low(conn);
+	pthread_mutex_unlock(&ctx->ws_mutex);
+
+	while ((e = head) != NULL) {
+		if (ok) {
+			ok = (mg_write(conn, e->frame->data + ofs, e->frame->len - ofs)
+			      == (int)(e->frame->len - ofs));
+		}
+		ofs = 0;
+		head = e->next;
+		ws_frame_release(e->frame);
+		mg_free(e);
+	}
+}
+
+
+/* Add a client to the list of websocket handler clients, which receive
+ * broadcast messages. */
+static void
+websocket_client_add(struct mg_connection *conn)
+{
+	struct mg_context *ctx = conn->phys_ctx;
+
+	if (conn->ws_handler_uri == NULL) {
+		return;
+	}
+	pthread_mutex_lock(&ctx->ws_mutex);
+	conn->ws_out_peak = 0;
+	conn->ws_out_dropped = 0;
+	conn->ws_out_closed = 0;
+	conn->ws_out_due_ns = 0;
+	conn->ws_prev = NULL;
+	conn->ws_next = ctx->ws_clients;
+	if (ctx->ws_clients != NULL) {
+		ctx->ws_clients->ws_prev = conn;
+	}
+	ctx->ws_clients = conn;
+	conn->ws_listed = 1;
+	pthread_mutex_unlock(&ctx->ws_mutex);
+}
+
+
+static void
+websocket_client_remove(struct mg_connection *conn)
+{
+	struct mg_context *ctx = conn->phys_ctx;
+
+	pthread_mutex_lock(&ctx->ws_mutex);
+	if (conn->ws_listed) {
+		if (conn->ws_prev != NULL) {
+			conn->ws_prev->ws_next = conn->ws_next;
+		} else {
+			ctx->ws_clients = conn->ws_next;
+		}
+		if (conn->ws_next != NULL) {
+			conn->ws_next->ws_prev = conn->ws_prev;
+		}
+		conn->ws_prev = conn->ws_next = NULL;
+		conn->ws_listed = 0;
+	}
+	ws_out_clear(conn);
+	pthread_mutex_unlock(&ctx->ws_mutex);
+}
+
+
+/* Send the outbound queues of clients, which could not be sent by
+ * mg_websocket_broadcast, or not yet because of websocket_max_flush_rate. */
+static void
+websocket_out_thread_run(struct mg_context *ctx)
+{
+	struct mg_workerTLS tls;
+	struct mg_pollfd *pfd = NULL, *tmp;
+	struct mg_connection *c;
+	struct timespec abstime;
+	uint64_t now, due;
+	unsigned n, pfd_size = 0;
+	int busy, timeout_ms;
+
+	mg_set_thread_name("wsout");
+
+	/* pthread_cond_wait requires a TLS event on Windows */
+	memset(&tls, 0, sizeof(tls));
+	tls.thread_idx = (unsigned)mg_atomic_inc(&thread_idx_max);
+#if defined(_WIN32)
+	tls.pthread_cond_helper_mutex = CreateEvent(NULL, FALSE, FALSE, NULL);
+#endif
+	pthread_setspecific(sTlsKey, &tls);
+
+	pthread_mutex_lock(&ctx->ws_mutex);
+	while (STOP_FLAG_IS_ZERO(&ctx->stop_flag)) {
+		n = 0;
+		due = 0;
+		now = mg_get_current_time_ns();
+		for (c = ctx->ws_clients; c != NULL; c = c->ws_next) {
+			if (c->ws_out_head == NULL) {
+				continue;
+			}
+			if ((ctx->ws_flush_interval_ns > 0) && (now < c->ws_out_due_ns)) {
+				/* Not yet: wait for the earliest flush time */
+				if ((due == 0) || (c->ws_out_due_ns < due)) {
+					due = c->ws_out_due_ns;
+				}
+				continue;
+			}
+			if (n == pfd_size) {
+				tmp = (struct mg_pollfd *)
+				    mg_realloc_ctx(pfd,
+				                   (pfd_size + 16) * sizeof(struct mg_pollfd),
+				                   ctx);
+				if (tmp == NULL) {
+					break;
+				}
+				pfd = tmp;
+				pfd_size += 16;
+			}
+			pfd[n].fd = c->client.sock;
+			pfd[n].events = POLLOUT;
+			pfd[n].revents = 0;
+			n++;
+		}
+
+		if ((n == 0) && (due == 0)) {
+			pthread_cond_wait(&ctx->ws_cond, &ctx->ws_mutex);
+			continue;
+		}
+		if (n == 0) {
+			abstime.tv_sec = (time_t)(due / 1000000000);
+			abstime.tv_nsec = (long)(due % 1000000000);
+			pthread_cond_timedwait(&ctx->ws_cond, &ctx->ws_mutex, &abstime);
+			continue;
+		}
+
+		timeout_ms = 50;
+		if ((due != 0) && (due < now + 50000000)) {
+			timeout_ms = (int)((due - now) / 1000000) + 1;
+		}
+		pthread_mutex_unlock(&ctx->ws_mutex);
+		(void)mg_poll(pfd, n, timeout_ms, &ctx->stop_flag);
+		pthread_mutex_lock(&ctx->ws_mutex);
+
+		/* Clients may have been added or removed in the meantime */
+		busy = 0;
+		for (c = ctx->ws_clients; c != NULL; c = c->ws_next) {
+			if (c->ws_out_head == NULL) {
+				continue;
+			}
+			/* Set the flag before trying the lock: the thread holding it
+			 * checks the flag after unlocking (mg_unlock_connection). */
+			c->ws_out_busy = 1;
+			if (ws_out_flush(c)) {
+				c->ws_out_busy = 0;
+			} else {
+				busy = 1;
+			}
+		}
+		if (busy) {
+			/* Some thread is writing to a client: it sends the queue
+			 * as well. Do not poll a writable socket all the time, but
+			 * wait until the connection lock is released. The timeout
+			 * only limits the delay, if the wakeup was missed. */
+			now = mg_get_current_time_ns() + 50000000;
+			abstime.tv_sec = (time_t)(now / 1000000000);
+			abstime.tv_nsec = (long)(now % 1000000000);
+			pthread_cond_timedwait(&ctx->ws_cond, &ctx->ws_mutex, &abstime);
+		}
+	}
+	pthread_mutex_unlock(&ctx->ws_mutex);
+
+	mg_free(pfd);
+
+	pthread_setspecific(sTlsKey, NULL);
+#if defined(_WIN32)
+	CloseHandle(tls.pthread_cond_helper_mutex);
+#endif
+}
+
+
+#if defined(_WIN32)
+static unsigned __stdcall websocket_out_thread(void *thread_func_param)
+{
+	websocket_out_thread_run((struct mg_context *)thread_func_param);
+	return 0;
+}
+#else
+static void *
+websocket_out_thread(void *thread_func_param)
+{
+	struct sigaction sa;
+
+	/* Ignore SIGPIPE */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = SIG_IGN;
+	sigaction(SIGPIPE, &sa, NULL);
+
+	websocket_out_thread_run((struct mg_context *)thread_func_param);
+	return NULL;
+}
+#endif /* _WIN32 */
+
+
+/* Let the "wsout" thread send the remaining queues. ws_mutex must be
+ * held. ws_cond is shared with writers blocked in ws_out_wait, so all
+ * waiters are woken up. */
+static void
+ws_out_wakeup(struct mg_context *ctx)
+{
+	if ((ctx->ws_out_threadid == 0) && STOP_FLAG_IS_ZERO(&ctx->stop_flag)) {
+		if (mg_start_thread_with_id(websocket_out_thread,
+		                            ctx,
+		                            &ctx->ws_out_threadid)
+		    != 0) {
+			ctx->ws_out_threadid = 0;
+			mg_cry_ctx_internal(ctx,
+			                    "%s",
+			                    "Cannot start websocket output thread");
+		}
+	}
+	pthread_cond_broadcast(&ctx->ws_cond);
+}
+
+
+/* Complete a websocket frame header: header[0] must contain the FIN bit
+ * and the opcode. The header buffer must have 14 bytes. Returns the length
+ * of the header. */
+static size_t
+websocket_frame_header(unsigned char *header,
+                       size_t dataLen,
+                       uint32_t masking_key)
+{
+	size_t headerLen;
+
+	/* Frame format: http://tools.ietf.org/html/rfc6455#section-5.2 */
+	if (dataLen < 126) {
+		/* inline 7-bit length field */
+		header[1] = (unsigned char)dataLen;
+		headerLen = 2;
+	} else if (dataLen <= 0xFFFF) {
+		/* 16-bit length field */
+		uint16_t len = htons((uint16_t)dataLen);
+		header[1] = 126;
+		memcpy(header + 2, &len, 2);
+		headerLen = 4;
+	} else {
+		/* 64-bit length field */
+		uint32_t len1 = htonl((uint32_t)((uint64_t)dataLen >> 32));
+		uint32_t len2 = htonl((uint32_t)(dataLen & 0xFFFFFFFFu));
+		header[1] = 127;
+		memcpy(header + 2, &len1, 4);
+		memcpy(header + 6, &len2, 4);
+		headerLen = 10;
+	}
+
+	if (masking_key) {
+		/* add mask */
+		header[1] |= 0x80;
+		memcpy(header + headerLen, &masking_key, 4);
+		headerLen += 4;
 	}
+	return headerLen;
+}
 
-	/* Leave data processing loop */
-	mg_set_thread_name("worker");
-	conn->in_websocket_handling = 0;
-	DEBUG_TRACE("Websocket connection %s:%u left data processing loop",
-	            conn->request_info.remote_addr,
-	            conn->request_info.remote_port);
+
+/* Encode an unmasked frame for outbound queues, with a reference count of
+ * one. */
+static struct ws_frame *
+ws_frame_new(struct mg_context *ctx,
+             const char *key,
+             int opcode,
+             const char *data,
+             size_t data_len)
+{
+	unsigned char header[14];
+	struct ws_frame *frame;
+	size_t header_len, key_len = (key != NULL) ? (strlen(key) + 1) : 0;
+
+	(void)ctx; /* Used for memory statistics only */
+	header[0] = 0x80u | (unsigned char)((unsigned)opcode & 0xf);
+	header_len = websocket_frame_header(header, data_len, 0);
+	frame = (struct ws_frame *)mg_malloc_ctx(sizeof(struct ws_frame)
+	                                             + header_len + data_len
+	                                             + key_len,
+	                                         ctx);
+	if (frame == NULL) {
+		return NULL;
+	}
+	frame->refcount = 1;
+	frame->len = header_len + data_len;
+	frame->data = (char *)(frame + 1);
+	memcpy(frame->data, header, header_len);
+	if (data_len > 0) {
+		memcpy(frame->data + header_len, data, data_len);
+	}
+	frame->key = NULL;
+	if (key != NULL) {
+		memcpy(frame->data + frame->len, key, key_len);
+		frame->key = frame->data + frame->len;
+	}
+	return frame;
 }
 
 
@@ -12737,6 +16114,7 @@ mg_websocket_write_exec(struct mg_connection *conn,
 	 * conn read/written by more than one thread, no matter if
 	 * it is a websocket or regular connection. */
 	(void)mg_lock_connection(conn);
+	ws_out_flush_locked(conn);
 
 #if defined(USE_ZLIB) && defined(MG_EXPERIMENTAL_INTERFACES)
 	size_t deflated_size = 0;
@@ -12777,33 +16155,7 @@ mg_websocket_write_exec(struct mg_connection *conn,
 #pragma GCC diagnostic pop
 #endif
 
-	/* Frame format: http://tools.ietf.org/html/rfc6455#section-5.2 */
-	if (dataLen < 126) {
-		/* inline 7-bit length field */
-		header[1] = (unsigned char)dataLen;
-		headerLen = 2;
-	} else if (dataLen <= 0xFFFF) {
-		/* 16-bit length field */
-		uint16_t len = htons((uint16_t)dataLen);
-		header[1] = 126;
-		memcpy(header + 2, &len, 2);
-		headerLen = 4;
-	} else {
-		/* 64-bit length field */
-		uint32_t len1 = htonl((uint32_t)((uint64_t)dataLen >> 32));
-		uint32_t len2 = htonl((uint32_t)(dataLen & 0xFFFFFFFFu));
-		header[1] = 127;
-		memcpy(header + 2, &len1, 4);
-		memcpy(header + 6, &len2, 4);
-		headerLen = 10;
-	}
-
-	if (masking_key) {
-		/* add mask */
-		header[1] |= 0x80;
-		memcpy(header + headerLen, &masking_key, 4);
-		headerLen += 4;
-	}
+	headerLen = websocket_frame_header(header, dataLen, masking_key);
 
 	retval = mg_write(conn, header, headerLen);
 	if (retval != (int)headerLen) {
@@ -12899,6 +16251,278 @@ mg_websocket_client_write(struct mg_connection *conn,
 }
 
 
+/* Send several messages, each in its own frame, with one lock and as few
+ * system calls as possible. For client connections, masked[i] is the data
+ * of message i, masked with masking_keys[i]. */
+static int
+mg_websocket_write_batch_exec(struct mg_connection *conn,
+                              const struct mg_websocket_message *msgs,
+                              size_t num_msgs,
+                              const char *const *masked,
+                              const uint32_t *masking_keys)
+{
+	unsigned char headers[MG_WRITE_VEC_MAX][14];
+	struct mg_write_buf bufs[MG_WRITE_VEC_MAX];
+	int num_bufs = 0, num_headers = 0, expected = 0, total = 0, n;
+	uint32_t masking_key;
+	const char *data;
+	size_t i;
+
+	if (num_msgs == 0) {
+		return 0;
+	}
+
+	(void)mg_lock_connection(conn);
+	ws_out_flush_locked(conn);
+	for (i = 0; i < num_msgs; i++) {
+		masking_key = (masking_keys != NULL) ? masking_keys[i] : 0;
+		data = (masked != NULL) ? masked[i] : msgs[i].data;
+		if (msgs[i].data_len > (size_t)(INT_MAX - 14 - expected)) {
+			/* Not more than INT_MAX bytes per mg_write_vec call */
+			total = -1;
+			break;
+		}
+
+#if defined(USE_ZLIB) && defined(MG_EXPERIMENTAL_INTERFACES)
+		if ((msgs[i].data_len > 100 * 1024) && conn->accept_gzip) {
+			/* Compressed messages are sent one by one */
+			if (num_bufs > 0) {
+				n = mg_write_vec(conn, bufs, num_bufs);
+				if (n != expected) {
+					total = -1;
+					break;
+				}
+				total = ((total > INT_MAX - n) ? INT_MAX : (total + n));
+				num_bufs = num_headers = expected = 0;
+			}
+			n = mg_websocket_write_exec(
+			    conn, msgs[i].opcode, data, msgs[i].data_len, masking_key);
+			if (n <= 0) {
+				total = -1;
+				break;
+			}
+			total = ((total > INT_MAX - n) ? INT_MAX : (total + n));
+			continue;
+		}
+#endif
+
+		headers[num_headers][0] =
+		    0x80u | (unsigned char)((unsigned)msgs[i].opcode & 0xf);
+		bufs[num_bufs].buf = (const char *)headers[num_headers];
+		bufs[num_bufs].len = websocket_frame_header(headers[num_headers],
+		                                            msgs[i].data_len,
+		                                            masking_key);
+		expected += (int)bufs[num_bufs].len;
+		num_headers++;
+		num_bufs++;
+		if (msgs[i].data_len > 0) {
+			bufs[num_bufs].buf = data;
+			bufs[num_bufs].len = msgs[i].data_len;
+			expected += (int)msgs[i].data_len;
+			num_bufs++;
+		}
+
+		if ((num_bufs > MG_WRITE_VEC_MAX - 2) || (i == num_msgs - 1)) {
+			n = mg_write_vec(conn, bufs, num_bufs);
+			if (n != expected) {
+				total = -1;
+				break;
+			}
+			total = ((total > INT_MAX - n) ? INT_MAX : (total + n));
+			num_bufs = num_headers = expected = 0;
+		}
+	}
+	mg_unlock_connection(conn);
+
+	return total;
+}
+
+
+int
+mg_websocket_write_batch(struct mg_connection *conn,
+                         const struct mg_websocket_message *msgs,
+                         size_t num_msgs)
+{
+	if ((conn == NULL) || ((msgs == NULL) && (num_msgs > 0))) {
+		return -1;
+	}
+	return mg_websocket_write_batch_exec(conn, msgs, num_msgs, NULL, NULL);
+}
+
+
+int
+mg_websocket_client_write_batch(struct mg_connection *conn,
+                                const struct mg_websocket_message *msgs,
+                                size_t num_msgs)
+{
+	const char **data;
+	uint32_t *masking_keys;
+	char *masked_data;
+	size_t i, len = 0;
+	int retval;
+
+	if ((conn == NULL) || ((msgs == NULL) && (num_msgs > 0))) {
+		return -1;
+	}
+
+	/* Masked data of all messages, each starting 4 byte aligned */
+	for (i = 0; i < num_msgs; i++) {
+		len += ((msgs[i].data_len + 3) / 4) * 4;
+	}
+	data = (const char **)mg_malloc_ctx((num_msgs + 1) * sizeof(data[0]),
+	                                    conn->phys_ctx);
+	masking_keys = (uint32_t *)mg_malloc_ctx((num_msgs + 1) * sizeof(uint32_t),
+	                                         conn->phys_ctx);
+	masked_data = (char *)mg_malloc_ctx(len + 4, conn->phys_ctx);
+	if ((data == NULL) || (masking_keys == NULL) || (masked_data == NULL)) {
+		mg_cry_internal(conn,
+		                "%s",
+		                "Cannot allocate buffer for masked websocket response: "
+		                "Out of memory");
+		mg_free(data);
+		mg_free(masking_keys);
+		mg_free(masked_data);
+		return -1;
+	}
+
+	len = 0;
+	for (i = 0; i < num_msgs; i++) {
+		/* A new masking key for every frame, but not 0 */
+		do {
+			masking_keys[i] = (uint32_t)get_random();
+		} while (masking_keys[i] == 0);
+
+		mask_data(
+		    msgs[i].data, msgs[i].data_len, masking_keys[i], masked_data + len);
+		data[i] = masked_data + len;
+		len += ((msgs[i].data_len + 3) / 4) * 4;
+	}
+
+	retval = mg_websocket_write_batch_exec(
+	    conn, msgs, num_msgs, data, masking_keys);
+	mg_free(data);
+	mg_free(masking_keys);
+	mg_free(masked_data);
+
+	return retval;
+}
+
+
+static int
+websocket_broadcast(struct mg_context *ctx,
+                    const char *uri,
+                    const char *key,
+                    int opcode,
+                    const char *data,
+                    size_t data_len)
+{
+	struct ws_frame *frame;
+	struct mg_connection *c;
+	int count = 0, pending = 0;
+
+	if ((ctx == NULL) || (ctx->context_type != CONTEXT_SERVER)
+	    || (uri == NULL) || ((data == NULL) && (data_len > 0))
+	    || (data_len > (size_t)INT_MAX - 14)) {
+		return -1;
+	}
+
+	/* Encode the frame once, for all clients */
+	frame = ws_frame_new(ctx, key, opcode, data, data_len);
+	if (frame == NULL) {
+		return -1;
+	}
+
+	pthread_mutex_lock(&ctx->ws_mutex);
+	for (c = ctx->ws_clients; c != NULL; c = c->ws_next) {
+		if (strcmp(c->ws_handler_uri, uri) != 0) {
+			continue;
+		}
+		if (ws_out_enqueue(c, frame, 1)) {
+			count++;
+			/* Send what can be sent without waiting */
+			(void)ws_out_flush(c);
+			if (c->ws_out_head != NULL) {
+				pending = 1;
+			}
+		}
+	}
+	if (pending) {
+		/* Slow clients: the "wsout" thread sends the rest */
+		ws_out_wakeup(ctx);
+	}
+	pthread_mutex_unlock(&ctx->ws_mutex);
+
+	ws_frame_release(frame);
+	return count;
+}
+
+
+int
+mg_websocket_broadcast(struct mg_context *ctx,
+                       const char *uri,
+                       int opcode,
+                       const char *data,
+                       size_t data_len)
+{
+	return websocket_broadcast(ctx, uri, NULL, opcode, data, data_len);
+}
+
+
+int
+mg_websocket_broadcast_keyed(struct mg_context *ctx,
+                             const char *uri,
+                             const char *key,
+                             int opcode,
+                             const char *data,
+                             size_t data_len)
+{
+	return websocket_broadcast(ctx, uri, key, opcode, data, data_len);
+}
+
+
+int
+mg_websocket_queue_write(struct mg_connection *conn,
+                         const char *key,
+                         int opcode,
+                         const char *data,
+                         size_t data_len)
+{
+	struct mg_context *ctx;
+	struct ws_frame *frame;
+	int ret = -1;
+
+	if ((conn == NULL) || ((data == NULL) && (data_len > 0))
+	    || (data_len > (size_t)INT_MAX - 14)) {
+		return -1;
+	}
+	ctx = conn->phys_ctx;
+	if ((ctx == NULL) || (ctx->context_type != CONTEXT_SERVER)) {
+		return -1;
+	}
+
+	frame = ws_frame_new(ctx, key, opcode, data, data_len);
+	if (frame == NULL) {
+		return -1;
+	}
+
+	pthread_mutex_lock(&ctx->ws_mutex);
+	if ((ctx->ws_queue_policy == WS_QUEUE_BLOCK) && conn->ws_out_high) {
+		ws_out_wait(conn);
+	}
+	if (conn->ws_listed) {
+		ret = ws_out_enqueue(conn, frame, 0);
+		(void)ws_out_flush(conn);
+		if (conn->ws_out_head != NULL) {
+			ws_out_wakeup(ctx);
+		}
+	}
+	pthread_mutex_unlock(&ctx->ws_mutex);
+
+	ws_frame_release(frame);
+	return ret;
+}
+
+
 static void
 handle_websocket_request(struct mg_connection *conn,
                          const char *path,
@@ -13100,7 +16724,9 @@ handle_websocket_request(struct mg_connection *conn,
 
 	/* Step 7: Enter the read loop */
 	if (is_callback_resource) {
+		websocket_client_add(conn);
 		read_websocket(conn, ws_data_handler, cbData);
+		websocket_client_remove(conn);
 #if defined(USE_LUA)
 	} else if (lua_websock) {
 		read_websocket(conn, lua_websocket_data, conn->lua_websocket_state);
@@ -13820,6 +17446,12 @@ get_request_handler(struct mg_connection *conn,
 						*ready_handler = tmp_rh->ready_handler;
 						*data_handler = tmp_rh->data_handler;
 						*close_handler = tmp_rh->close_handler;
+#if defined(USE_WEBSOCKET)
+						/* Clients are grouped by handler for broadcasts */
+						mg_free(conn->ws_handler_uri);
+						conn->ws_handler_uri =
+						    mg_strdup_ctx(tmp_rh->uri, conn->phys_ctx);
+#endif
 					} else if (handler_type == REQUEST_HANDLER) {
 						if (tmp_rh->removing) {
 							/* Treat as none found */
@@ -14216,13 +17848,17 @@ handle_request(struct mg_connection *conn)
 
 	/* 7. check if there are request handlers for this uri */
 	if (is_callback_resource) {
-		HTTP1_only;
 		if (!is_websocket_request) {
 			i = callback_handler(conn, callback_data);
 
 			/* Callback handler will not be used anymore. Release it */
 			release_handler_ref(conn, handler_info);
 
+			if (conn->detached) {
+				/* Completed later by mg_finish_detached_request */
+				return;
+			}
+
 			if (i > 0) {
 				/* Do nothing, callback has served the request. Store
 				 * then return value as status code for the log and discard
@@ -14340,18 +17976,22 @@ handle_request(struct mg_connection *conn)
 	if (is_put_or_delete_request) {
 		HTTP1_only;
 		/* 11.1. PUT method */
+		/* Files are modified, cached file status becomes invalid. */
 		if (!strcmp(ri->request_method, "PUT")) {
 			put_file(conn, path);
+			file_cache_flush(conn->phys_ctx);
 			return;
 		}
 		/* 11.2. DELETE method */
 		if (!strcmp(ri->request_method, "DELETE")) {
 			delete_file(conn, path);
+			file_cache_flush(conn->phys_ctx);
 			return;
 		}
 		/* 11.3. MKCOL method */
 		if (!strcmp(ri->request_method, "MKCOL")) {
 			mkcol(conn, path);
+			file_cache_flush(conn->phys_ctx);
 			return;
 		}
 		/* 11.4. PATCH method
@@ -14530,7 +18170,7 @@ handle_file_based_request(struct mg_connection *conn,
 			    > 0) {
 				if (is_in_script_path(conn, path)) {
 					/* CGI scripts may support all HTTP methods */
-					handle_cgi_request(conn, path, 0);
+					handle_cgi_request(conn, path, cgi_config_idx);
 				} else {
 					/* Script was in an illegal path */
 					mg_send_http_error(conn, 403, "%s", "Forbidden");
@@ -16219,12 +19859,12 @@ ssl_servername_callback(SSL *ssl, int *ad, void *arg)
 #if defined(USE_ALPN)
 static const char alpn_proto_list[] = "\x02h2\x08http/1.1\x08http/1.0";
 static const char *alpn_proto_order_http1[] = {alpn_proto_list + 3,
-                                               alpn_proto_list + 3 + 8,
+                                               alpn_proto_list + 3 + 9,
                                                NULL};
 #if defined(USE_HTTP2)
 static const char *alpn_proto_order_http2[] = {alpn_proto_list,
                                                alpn_proto_list + 3,
-                                               alpn_proto_list + 3 + 8,
+                                               alpn_proto_list + 3 + 9,
                                                NULL};
 #endif
 
@@ -16261,9 +19901,12 @@ alpn_select_cb(SSL *ssl,
 	for (j = 0; alpn_proto_order[j] != NULL; j++) {
 		/* check all accepted protocols in this order */
 		const char *alpn_proto = alpn_proto_order[j];
-		/* search input for matching protocol */
-		for (i = 0; i < inlen; i++) {
-			if (!memcmp(in + i, alpn_proto, (unsigned char)alpn_proto[0])) {
+		unsigned int proto_len = (unsigned char)alpn_proto[0];
+		/* search input (list of length prefixed strings) for matching
+		 * protocol */
+		for (i = 0; i < inlen; i += (unsigned int)in[i] + 1) {
+			if ((in[i] == proto_len) && (i + 1 + proto_len <= inlen)
+			    && !memcmp(in + i + 1, alpn_proto + 1, proto_len)) {
 				*out = in + i + 1;
 				*outlen = in[i];
 				tls->alpn_proto = alpn_proto;
@@ -16825,7 +20468,157 @@ set_tcp_nodelay(const struct socket *so, int nodelay_on)
 }
 
 
-#if !defined(__ZEPHYR__)
+#if !defined(__ZEPHYR__)
+/* Hand over a socket to the linger thread. The FIN is sent here, waiting
+ * for the peer to close its side is done in the background, so the worker
+ * thread can serve the next connection. Returns 0 if the socket has not
+ * been taken (no linger thread, or too many sockets lingering already). */
+static int
+linger_socket_add(struct mg_context *ctx, SOCKET sock, int linger_timeout)
+{
+	int taken = 0;
+
+	pthread_mutex_lock(&ctx->linger_mutex);
+	if (ctx->linger_count < ctx->linger_max) {
+		set_non_blocking_mode(sock);
+		shutdown(sock, SHUTDOWN_WR);
+		ctx->linger_socks[ctx->linger_count].sock = sock;
+		ctx->linger_socks[ctx->linger_count].deadline_ns =
+		    mg_get_current_time_ns() + (uint64_t)linger_timeout * 1000000;
+		ctx->linger_count++;
+		taken = 1;
+		if (ctx->linger_count == 1) {
+			/* The linger thread waits for the first socket */
+			pthread_cond_signal(&ctx->linger_cond);
+		}
+	}
+	pthread_mutex_unlock(&ctx->linger_mutex);
+
+	return taken;
+}
+
+
+static void
+linger_thread_run(struct mg_context *ctx)
+{
+	struct mg_workerTLS tls;
+	struct mg_pollfd *pfd;
+	char buf[MG_BUF_LEN];
+	uint64_t now;
+	unsigned i, n;
+	int r, err, done;
+
+	mg_set_thread_name("linger");
+
+	pfd = (struct mg_pollfd *)mg_calloc_ctx(ctx->linger_max,
+	                                        sizeof(struct mg_pollfd),
+	                                        ctx);
+	if (pfd == NULL) {
+		pthread_mutex_lock(&ctx->linger_mutex);
+		ctx->linger_max = 0;
+		pthread_mutex_unlock(&ctx->linger_mutex);
+		return;
+	}
+
+	/* pthread_cond_wait requires a TLS event on Windows */
+	memset(&tls, 0, sizeof(tls));
+	tls.thread_idx = (unsigned)mg_atomic_inc(&thread_idx_max);
+#if defined(_WIN32)
+	tls.pthread_cond_helper_mutex = CreateEvent(NULL, FALSE, FALSE, NULL);
+#endif
+	pthread_setspecific(sTlsKey, &tls);
+
+	while (STOP_FLAG_IS_ZERO(&ctx->stop_flag)) {
+		/* Worker threads only append sockets, so the first n elements
+		 * remain unchanged until this thread removes them. */
+		pthread_mutex_lock(&ctx->linger_mutex);
+		while ((ctx->linger_count == 0)
+		       && STOP_FLAG_IS_ZERO(&ctx->stop_flag)) {
+			/* Nothing to do until a socket is added, or the server
+			 * stops (master_thread_run) */
+			pthread_cond_wait(&ctx->linger_cond, &ctx->linger_mutex);
+		}
+		n = ctx->linger_count;
+		for (i = 0; i < n; i++) {
+			pfd[i].fd = ctx->linger_socks[i].sock;
+			pfd[i].events = POLLIN;
+			pfd[i].revents = 0;
+		}
+		pthread_mutex_unlock(&ctx->linger_mutex);
+
+		if (n == 0) {
+			continue;
+		}
+
+		if (mg_poll(pfd, n, 50, &ctx->stop_flag) < 0) {
+			continue;
+		}
+
+		now = mg_get_current_time_ns();
+		pthread_mutex_lock(&ctx->linger_mutex);
+		for (i = n; i-- > 0;) {
+			done = (now >= ctx->linger_socks[i].deadline_ns);
+			if (!done && (pfd[i].revents != 0)) {
+				/* Read and discard pending data. The peer closed its
+				 * side, if there is nothing left to read. */
+				r = (int)recv(pfd[i].fd, buf, sizeof(buf), 0);
+				err = (r < 0) ? ERRNO : 0;
+#if defined(_WIN32)
+				done = ((r == 0) || ((r < 0) && (err != WSAEWOULDBLOCK)));
+#else
+				done = ((r == 0) || ((r < 0) && !ERROR_TRY_AGAIN(err)));
+#endif
+			}
+			if (done) {
+				closesocket(pfd[i].fd);
+				ctx->linger_count--;
+				ctx->linger_socks[i] = ctx->linger_socks[ctx->linger_count];
+			}
+		}
+		pthread_mutex_unlock(&ctx->linger_mutex);
+	}
+
+	/* Do not accept new sockets, close the remaining ones */
+	pthread_mutex_lock(&ctx->linger_mutex);
+	ctx->linger_max = 0;
+	for (i = 0; i < ctx->linger_count; i++) {
+		closesocket(ctx->linger_socks[i].sock);
+	}
+	ctx->linger_count = 0;
+	pthread_mutex_unlock(&ctx->linger_mutex);
+
+	mg_free(pfd);
+
+	pthread_setspecific(sTlsKey, NULL);
+#if defined(_WIN32)
+	CloseHandle(tls.pthread_cond_helper_mutex);
+#endif
+}
+
+
+#if defined(_WIN32)
+static unsigned __stdcall linger_thread(void *thread_func_param)
+{
+	linger_thread_run((struct mg_context *)thread_func_param);
+	return 0;
+}
+#else
+static void *
+linger_thread(void *thread_func_param)
+{
+	struct sigaction sa;
+
+	/* Ignore SIGPIPE */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = SIG_IGN;
+	sigaction(SIGPIPE, &sa, NULL);
+
+	linger_thread_run((struct mg_context *)thread_func_param);
+	return NULL;
+}
+#endif /* _WIN32 */
+
+
 static void
 close_socket_gracefully(struct mg_connection *conn)
 {
@@ -16842,6 +20635,20 @@ close_socket_gracefully(struct mg_connection *conn)
 		return;
 	}
 
+	if (conn->dom_ctx->config[LINGER_TIMEOUT]) {
+		linger_timeout = atoi(conn->dom_ctx->config[LINGER_TIMEOUT]);
+	}
+
+	/* Let the linger thread wait for the peer, if possible */
+	if ((linger_timeout > 0)
+	    && (conn->phys_ctx->context_type == CONTEXT_SERVER)
+	    && linger_socket_add(conn->phys_ctx,
+	                         conn->client.sock,
+	                         linger_timeout)) {
+		conn->client.sock = INVALID_SOCKET;
+		return;
+	}
+
 	/* http://msdn.microsoft.com/en-us/library/ms739165(v=vs.85).aspx:
 	 * "Note that enabling a nonzero timeout on a nonblocking socket
 	 * is not recommended.", so set it to blocking now */
@@ -16863,10 +20670,6 @@ close_socket_gracefully(struct mg_connection *conn)
 	} while (n > 0);
 #endif
 
-	if (conn->dom_ctx->config[LINGER_TIMEOUT]) {
-		linger_timeout = atoi(conn->dom_ctx->config[LINGER_TIMEOUT]);
-	}
-
 	/* Set linger option according to configuration */
 	if (linger_timeout >= 0) {
 		/* Set linger option to avoid socket hanging out after close. This
@@ -16970,6 +20773,11 @@ close_connection(struct mg_connection *conn)
 	/* Set close flag, so keep-alive loops will stop */
 	conn->must_close = 1;
 
+#if defined(USE_WEBSOCKET)
+	mg_free(conn->ws_handler_uri);
+	conn->ws_handler_uri = NULL;
+#endif
+
 	/* call the connection_close callback if assigned */
 	if (conn->phys_ctx->callbacks.connection_close != NULL) {
 		if (conn->phys_ctx->context_type == CONTEXT_SERVER) {
@@ -16984,48 +20792,603 @@ close_connection(struct mg_connection *conn)
 
 
 #if defined(USE_SERVER_STATS)
-	conn->conn_state = 7; /* closing */
+	conn->conn_state = 7; /* closing */
+#endif
+
+#if defined(USE_MBEDTLS)
+	if (conn->ssl != NULL) {
+		mbed_ssl_close(conn->ssl);
+		conn->ssl = NULL;
+	}
+#elif !defined(NO_SSL)
+	if (conn->ssl != NULL) {
+		/* Run SSL_shutdown twice to ensure completely close SSL connection
+		 */
+		SSL_shutdown(conn->ssl);
+		SSL_free(conn->ssl);
+		OPENSSL_REMOVE_THREAD_STATE();
+		conn->ssl = NULL;
+	}
+#endif
+	if (conn->client.sock != INVALID_SOCKET) {
+#if defined(__ZEPHYR__)
+		closesocket(conn->client.sock);
+#else
+		close_socket_gracefully(conn);
+#endif
+		conn->client.sock = INVALID_SOCKET;
+	}
+
+	/* call the connection_closed callback if assigned */
+	if (conn->phys_ctx->callbacks.connection_closed != NULL) {
+		if (conn->phys_ctx->context_type == CONTEXT_SERVER) {
+			conn->phys_ctx->callbacks.connection_closed(conn);
+		}
+	}
+
+	mg_unlock_connection(conn);
+
+#if defined(USE_SERVER_STATS)
+	conn->conn_state = 8; /* closed */
+#endif
+}
+
+
+/* Run a callback of mg_async_wait on an idle worker thread, or in the
+ * calling thread if there is none. */
+static void
+async_dispatch(struct mg_context *ctx,
+               mg_async_callback callback,
+               void *cbdata,
+               int result)
+{
+#if !defined(ALTERNATIVE_QUEUE)
+	struct mg_async_task *task;
+	int idle, queued = 0;
+
+	task = (struct mg_async_task *)mg_malloc_ctx(sizeof(*task), ctx);
+	if (task != NULL) {
+		task->next = NULL;
+		task->callback = callback;
+		task->cbdata = cbdata;
+		task->result = result;
+
+		pthread_mutex_lock(&ctx->thread_mutex);
+		idle = ctx->sq_idle - ctx->async_queue_len;
+#if defined(USE_HTTP2)
+		idle -= ctx->h2_queue_len;
+#endif
+		if ((idle > 0) && STOP_FLAG_IS_ZERO(&ctx->stop_flag)) {
+			if (ctx->async_queue_tail != NULL) {
+				ctx->async_queue_tail->next = task;
+			} else {
+				ctx->async_queue_head = task;
+			}
+			ctx->async_queue_tail = task;
+			ctx->async_queue_len++;
+			queued = 1;
+			pthread_cond_signal(&ctx->sq_full);
+		}
+		pthread_mutex_unlock(&ctx->thread_mutex);
+		if (queued) {
+			return;
+		}
+		mg_free(task);
+	}
+#else
+	(void)ctx;
+#endif
+
+	callback(cbdata, result);
+}
+
+
+#if !defined(ALTERNATIVE_QUEUE)
+/* Called by consume_socket with ctx->thread_mutex locked. */
+static void
+async_run_queued_task(struct mg_context *ctx)
+{
+	struct mg_async_task *task = ctx->async_queue_head;
+
+	ctx->async_queue_head = task->next;
+	if (ctx->async_queue_head == NULL) {
+		ctx->async_queue_tail = NULL;
+	}
+	ctx->async_queue_len--;
+
+	pthread_mutex_unlock(&ctx->thread_mutex);
+	task->callback(task->cbdata, task->result);
+	mg_free(task);
+	pthread_mutex_lock(&ctx->thread_mutex);
+}
+#endif
+
+
+/* Poll the sockets of mg_async_wait, and dispatch the callbacks of ready
+ * sockets and expired timeouts. */
+static void
+async_thread_run(struct mg_context *ctx)
+{
+	struct mg_workerTLS tls;
+	struct mg_pollfd *pfd = NULL;
+	struct mg_async_task *fired = NULL;
+	struct mg_async_waiter *w, *waits;
+	struct timespec abstime;
+	void *tmp;
+	uint64_t now, due;
+	unsigned i, n, nfired, pfd_size = 0, fired_size = 0;
+	int timeout_ms, result;
+
+	mg_set_thread_name("async");
+
+	/* Callbacks may call any function of the server */
+	memset(&tls, 0, sizeof(tls));
+	tls.thread_idx = (unsigned)mg_atomic_inc(&thread_idx_max);
+#if defined(_WIN32)
+	tls.pthread_cond_helper_mutex = CreateEvent(NULL, FALSE, FALSE, NULL);
+#endif
+	pthread_setspecific(sTlsKey, &tls);
+
+	pthread_mutex_lock(&ctx->async_mutex);
+	while (STOP_FLAG_IS_ZERO(&ctx->stop_flag)) {
+		/* Sockets to poll, and the earliest deadline */
+		n = 0;
+		due = 0;
+		for (i = 0; i < ctx->async_count; i++) {
+			w = ctx->async_waits + i;
+			w->pfd_index = -1;
+			if ((w->deadline_ns != 0)
+			    && ((due == 0) || (w->deadline_ns < due))) {
+				due = w->deadline_ns;
+			}
+			if (w->sock == INVALID_SOCKET) {
+				continue;
+			}
+			if (n == pfd_size) {
+				tmp = mg_realloc_ctx(pfd,
+				                     (pfd_size + 16) * sizeof(struct mg_pollfd),
+				                     ctx);
+				if (tmp == NULL) {
+					/* Try again in the next round */
+					continue;
+				}
+				pfd = (struct mg_pollfd *)tmp;
+				pfd_size += 16;
+			}
+			pfd[n].fd = w->sock;
+			pfd[n].events = w->events;
+			pfd[n].revents = 0;
+			w->pfd_index = (int)n;
+			n++;
+		}
+
+		now = mg_get_current_time_ns();
+		if ((n == 0) && (due == 0)) {
+			pthread_cond_wait(&ctx->async_cond, &ctx->async_mutex);
+			continue;
+		}
+		if (n == 0) {
+			if (due > now) {
+				abstime.tv_sec = (time_t)(due / 1000000000);
+				abstime.tv_nsec = (long)(due % 1000000000);
+				pthread_cond_timedwait(&ctx->async_cond,
+				                       &ctx->async_mutex,
+				                       &abstime);
+				continue;
+			}
+		} else {
+			/* Sockets added in the meantime are polled in the next round,
+			 * so do not poll for long. */
+			timeout_ms = 10;
+			if ((due != 0) && (due <= now)) {
+				timeout_ms = 0;
+			} else if ((due != 0) && (due < now + 10000000)) {
+				timeout_ms = (int)((due - now) / 1000000) + 1;
+			}
+			pthread_mutex_unlock(&ctx->async_mutex);
+			(void)mg_poll(pfd, n, timeout_ms, &ctx->stop_flag);
+			pthread_mutex_lock(&ctx->async_mutex);
+			now = mg_get_current_time_ns();
+		}
+
+		/* Remove the waits that are done. Waits added while polling are
+		 * not polled yet (pfd_index is -1). */
+		nfired = 0;
+		for (i = ctx->async_count; i-- > 0;) {
+			w = ctx->async_waits + i;
+			if ((w->pfd_index >= 0) && (pfd[w->pfd_index].revents != 0)) {
+				result = 1;
+			} else if ((w->deadline_ns != 0) && (now >= w->deadline_ns)) {
+				result = w->deadline_result;
+			} else {
+				continue;
+			}
+			if (nfired == fired_size) {
+				tmp = mg_realloc_ctx(fired,
+				                     (fired_size + 16)
+				                         * sizeof(struct mg_async_task),
+				                     ctx);
+				if (tmp == NULL) {
+					continue;
+				}
+				fired = (struct mg_async_task *)tmp;
+				fired_size += 16;
+			}
+			fired[nfired].callback = w->callback;
+			fired[nfired].cbdata = w->cbdata;
+			fired[nfired].result = result;
+			nfired++;
+			ctx->async_count--;
+			*w = ctx->async_waits[ctx->async_count];
+		}
+
+		if (nfired > 0) {
+			pthread_mutex_unlock(&ctx->async_mutex);
+			for (i = 0; i < nfired; i++) {
+				async_dispatch(ctx,
+				               fired[i].callback,
+				               fired[i].cbdata,
+				               fired[i].result);
+			}
+			pthread_mutex_lock(&ctx->async_mutex);
+		}
+	}
+
+	/* Stopping: mg_async_wait does not accept new waits any more. Cancel
+	 * the remaining ones. */
+	waits = ctx->async_waits;
+	n = ctx->async_count;
+	ctx->async_waits = NULL;
+	ctx->async_count = 0;
+	ctx->async_size = 0;
+	pthread_mutex_unlock(&ctx->async_mutex);
+
+	for (i = 0; i < n; i++) {
+		waits[i].callback(waits[i].cbdata, -1);
+	}
+
+	mg_free(waits);
+	mg_free(fired);
+	mg_free(pfd);
+
+	pthread_setspecific(sTlsKey, NULL);
+#if defined(_WIN32)
+	CloseHandle(tls.pthread_cond_helper_mutex);
+#endif
+}
+
+
+#if defined(_WIN32)
+static unsigned __stdcall async_thread(void *thread_func_param)
+{
+	async_thread_run((struct mg_context *)thread_func_param);
+	return 0;
+}
+#else
+static void *
+async_thread(void *thread_func_param)
+{
+	struct sigaction sa;
+
+	/* Ignore SIGPIPE */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = SIG_IGN;
+	sigaction(SIGPIPE, &sa, NULL);
+
+	async_thread_run((struct mg_context *)thread_func_param);
+	return NULL;
+}
+#endif /* _WIN32 */
+
+
+/* Add a wait for the "async" thread, start the thread if required.
+ * Return: 0 if ok, -2 if the server is stopping or out of memory. */
+static int
+async_add_waiter(struct mg_context *ctx, const struct mg_async_waiter *w)
+{
+	void *tmp;
+	int ret = 0;
+
+	pthread_mutex_lock(&ctx->async_mutex);
+	if (!STOP_FLAG_IS_ZERO(&ctx->stop_flag)) {
+		ret = -2;
+	} else if (ctx->async_count == ctx->async_size) {
+		tmp = mg_realloc_ctx(ctx->async_waits,
+		                     (ctx->async_size + 16)
+		                         * sizeof(struct mg_async_waiter),
+		                     ctx);
+		if (tmp != NULL) {
+			ctx->async_waits = (struct mg_async_waiter *)tmp;
+			ctx->async_size += 16;
+		} else {
+			ret = -2;
+		}
+	}
+	if ((ret == 0) && (ctx->async_threadid == 0)) {
+		if (mg_start_thread_with_id(async_thread, ctx, &ctx->async_threadid)
+		    != 0) {
+			ctx->async_threadid = 0;
+			mg_cry_ctx_internal(ctx, "%s", "Cannot start async thread");
+			ret = -2;
+		}
+	}
+	if (ret == 0) {
+		ctx->async_waits[ctx->async_count] = *w;
+		ctx->async_count++;
+		pthread_cond_signal(&ctx->async_cond);
+	}
+	pthread_mutex_unlock(&ctx->async_mutex);
+
+	return ret;
+}
+
+
+int
+mg_async_wait(struct mg_context *ctx,
+              const struct mg_connection *conn,
+              int events,
+              int timeout_ms,
+              mg_async_callback callback,
+              void *cbdata)
+{
+	struct mg_async_waiter w;
+
+	if ((ctx == NULL) || (callback == NULL)
+	    || ((events & ~(MG_ASYNC_READABLE | MG_ASYNC_WRITABLE)) != 0)
+	    || ((conn == NULL) != (events == 0))
+	    || ((conn == NULL) && (timeout_ms < 0))) {
+		return -1;
+	}
+	if ((conn != NULL)
+	    && ((conn->phys_ctx != ctx) || (conn->client.sock == INVALID_SOCKET))) {
+		return -1;
+	}
+
+	memset(&w, 0, sizeof(w));
+	w.sock = (conn != NULL) ? conn->client.sock : INVALID_SOCKET;
+	w.events = (short)(((events & MG_ASYNC_READABLE) ? POLLIN : 0)
+	                   | ((events & MG_ASYNC_WRITABLE) ? POLLOUT : 0));
+	w.pfd_index = -1;
+	if (timeout_ms >= 0) {
+		w.deadline_ns =
+		    mg_get_current_time_ns() + (uint64_t)timeout_ms * 1000000;
+	}
+	w.deadline_result = 0;
+	w.callback = callback;
+	w.cbdata = cbdata;
+
+	if ((events & MG_ASYNC_READABLE)
+	    && ((conn->data_len - conn->request_len - conn->consumed_content > 0)
+#if defined(USE_MBEDTLS)
+	        || ((conn->ssl != NULL)
+	            && (mbedtls_ssl_get_bytes_avail(conn->ssl) > 0))
+#elif !defined(NO_SSL)
+	        || ((conn->ssl != NULL) && (SSL_pending(conn->ssl) > 0))
+#endif
+	            )) {
+		/* Data has been read from the socket already, poll would not
+		 * report it: call back as soon as possible. */
+		w.sock = INVALID_SOCKET;
+		w.deadline_ns = mg_get_current_time_ns();
+		w.deadline_result = 1;
+	}
+
+	return async_add_waiter(ctx, &w);
+}
+
+
+int
+mg_async_wait_event(struct mg_context *ctx,
+                    const void *event,
+                    int timeout_ms,
+                    mg_async_callback callback,
+                    void *cbdata)
+{
+	struct mg_async_waiter w;
+
+	if ((ctx == NULL) || (event == NULL) || (callback == NULL)) {
+		return -1;
+	}
+
+	memset(&w, 0, sizeof(w));
+	w.sock = INVALID_SOCKET;
+	w.pfd_index = -1;
+	if (timeout_ms >= 0) {
+		w.deadline_ns =
+		    mg_get_current_time_ns() + (uint64_t)timeout_ms * 1000000;
+	}
+	w.deadline_result = 0;
+	w.event = event;
+	w.callback = callback;
+	w.cbdata = cbdata;
+
+	return async_add_waiter(ctx, &w);
+}
+
+
+int
+mg_async_notify(struct mg_context *ctx, const void *event)
+{
+	struct mg_async_waiter *w;
+	uint64_t now;
+	unsigned i;
+	int count = 0;
+
+	if ((ctx == NULL) || (event == NULL)) {
+		return -1;
+	}
+
+	/* The "async" thread dispatches the callbacks like expired timeouts */
+	now = mg_get_current_time_ns();
+	pthread_mutex_lock(&ctx->async_mutex);
+	for (i = 0; i < ctx->async_count; i++) {
+		w = ctx->async_waits + i;
+		if (w->event == event) {
+			w->event = NULL;
+			w->deadline_ns = now;
+			w->deadline_result = 1;
+			count++;
+		}
+	}
+	if (count > 0) {
+		pthread_cond_signal(&ctx->async_cond);
+	}
+	pthread_mutex_unlock(&ctx->async_mutex);
+
+	return count;
+}
+
+
+struct mg_connection *
+mg_detach_request(struct mg_connection *conn)
+{
+	struct mg_context *ctx;
+	struct mg_connection *dconn;
+	char *buf;
+
+	if ((conn == NULL) || (conn->phys_ctx == NULL)) {
+		return NULL;
+	}
+	ctx = conn->phys_ctx;
+
+	/* Only a HTTP/1 request, served by a worker thread, can be detached
+	 * from the thread */
+	if ((ctx->context_type != CONTEXT_SERVER)
+	    || (conn < ctx->worker_connections)
+	    || (conn >= ctx->worker_connections + ctx->cfg_worker_threads)
+	    || (conn->connection_type != CONNECTION_TYPE_REQUEST)
+	    || (conn->protocol_type != PROTOCOL_TYPE_HTTP1) || conn->detached
+	    || (conn->client.sock == INVALID_SOCKET)) {
+		return NULL;
+	}
+
+	dconn = (struct mg_connection *)mg_malloc_ctx(sizeof(*dconn), ctx);
+	buf = (char *)mg_malloc_ctx((size_t)conn->buf_size, ctx);
+	if ((dconn == NULL) || (buf == NULL)) {
+		mg_free(dconn);
+		mg_free(buf);
+		return NULL;
+	}
+	memcpy(dconn, conn, sizeof(*dconn));
+	if (0 != pthread_mutex_init(&dconn->mutex, &pthread_mutex_attr)) {
+		mg_free(dconn);
+		mg_free(buf);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&ctx->async_mutex);
+	if (!STOP_FLAG_IS_ZERO(&ctx->stop_flag)) {
+		pthread_mutex_unlock(&ctx->async_mutex);
+		pthread_mutex_destroy(&dconn->mutex);
+		mg_free(dconn);
+		mg_free(buf);
+		return NULL;
+	}
+	ctx->detached_requests++;
+	pthread_mutex_unlock(&ctx->async_mutex);
+
+#if defined(USE_SERVER_STATS)
+	mg_atomic_inc(&(ctx->active_connections));
+#endif
+
+	/* The socket, the request buffer and everything allocated for the
+	 * request belong to dconn now. The client certificate information is
+	 * on the stack of the worker thread. */
+	dconn->must_close = 1;
+	dconn->path_info = NULL;
+	dconn->request_info.client_cert = NULL;
+#if defined(USE_LUA)
+	dconn->lua_worker_state[0] = NULL;
+	dconn->lua_worker_state[1] = NULL;
+#endif
+#if defined(USE_DUKTAPE)
+	dconn->duk_worker_heap = NULL;
+#endif
+
+	/* The worker thread continues with the next connection */
+	conn->buf = buf;
+	conn->data_len = 0;
+	conn->request_len = 0;
+	conn->client.sock = INVALID_SOCKET;
+	conn->ssl = NULL;
+	conn->request_info.local_uri = NULL;
+	conn->request_info.local_uri_raw = NULL;
+	conn->request_info.remote_user = NULL;
+	conn->request_info.conn_data = NULL;
+	conn->request_info.num_headers = 0;
+	conn->response_info.num_headers = 0;
+	conn->must_close = 1;
+	conn->detached = 1;
+
+	return dconn;
+}
+
+
+void
+mg_finish_detached_request(struct mg_connection *conn)
+{
+	struct mg_context *ctx;
+#if defined(USE_SERVER_STATS)
+	struct timespec tnow;
 #endif
 
-#if defined(USE_MBEDTLS)
-	if (conn->ssl != NULL) {
-		mbed_ssl_close(conn->ssl);
-		conn->ssl = NULL;
+	if ((conn == NULL) || (conn->phys_ctx == NULL)) {
+		return;
 	}
-#elif !defined(NO_SSL)
-	if (conn->ssl != NULL) {
-		/* Run SSL_shutdown twice to ensure completely close SSL connection
-		 */
-		SSL_shutdown(conn->ssl);
-		SSL_free(conn->ssl);
-		OPENSSL_REMOVE_THREAD_STATE();
-		conn->ssl = NULL;
+	ctx = conn->phys_ctx;
+	if ((conn >= ctx->worker_connections)
+	    && (conn < ctx->worker_connections + ctx->cfg_worker_threads)) {
+		/* Not detached */
+		return;
 	}
+
+	/* See handle_request_stat_log */
+#if defined(USE_SERVER_STATS)
+	conn->conn_state = 5; /* processed */
+
+	clock_gettime(CLOCK_MONOTONIC, &tnow);
+	conn->processing_time = mg_difftimespec(&tnow, &(conn->req_time));
+
+	mg_atomic_add64(&(ctx->total_data_read), conn->consumed_content);
+	mg_atomic_add64(&(ctx->total_data_written), conn->num_bytes_sent);
 #endif
-	if (conn->client.sock != INVALID_SOCKET) {
-#if defined(__ZEPHYR__)
-		closesocket(conn->client.sock);
-#else
-		close_socket_gracefully(conn);
-#endif
-		conn->client.sock = INVALID_SOCKET;
-	}
 
-	/* call the connection_closed callback if assigned */
-	if (conn->phys_ctx->callbacks.connection_closed != NULL) {
-		if (conn->phys_ctx->context_type == CONTEXT_SERVER) {
-			conn->phys_ctx->callbacks.connection_closed(conn);
-		}
+	if (ctx->callbacks.end_request != NULL) {
+		ctx->callbacks.end_request(conn, conn->status_code);
 	}
+	log_access(conn);
 
-	mg_unlock_connection(conn);
+	/* See process_new_connection */
+	free_buffered_response_header_list(conn);
+	close_connection(conn);
 
 #if defined(USE_SERVER_STATS)
-	conn->conn_state = 8; /* closed */
+	mg_atomic_add(&(ctx->total_requests), 1);
+	mg_atomic_dec(&(ctx->active_connections));
 #endif
+
+	if (conn->request_info.local_uri != conn->request_info.local_uri_raw) {
+		mg_free((void *)conn->request_info.local_uri);
+	}
+	mg_free((void *)conn->request_info.remote_user);
+	pthread_mutex_destroy(&conn->mutex);
+	mg_free(conn->buf);
+	mg_free(conn);
+
+	pthread_mutex_lock(&ctx->async_mutex);
+	ctx->detached_requests--;
+	if ((ctx->detached_requests == 0)
+	    && !STOP_FLAG_IS_ZERO(&ctx->stop_flag)) {
+		/* The master thread waits for the last one */
+		pthread_cond_broadcast(&ctx->async_cond);
+	}
+	pthread_mutex_unlock(&ctx->async_mutex);
 }
 
 
+static void client_pool_drop(struct mg_connection *conn);
+
+
 void
 mg_close_connection(struct mg_connection *conn)
 {
@@ -17033,6 +21396,11 @@ mg_close_connection(struct mg_connection *conn)
 		return;
 	}
 
+	if (conn->pool_host != NULL) {
+		/* Pooled connection closed instead of released */
+		client_pool_drop(conn);
+	}
+
 #if defined(USE_WEBSOCKET)
 	if (conn->phys_ctx->context_type == CONTEXT_SERVER) {
 		if (conn->in_websocket_handling) {
@@ -17866,101 +22234,491 @@ mg_get_response(struct mg_connection *conn,
 		ebuf[0] = '\0';
 	}
 
-	if (!conn) {
-		mg_snprintf(conn,
+	if (!conn) {
+		mg_snprintf(conn,
+		            NULL, /* No truncation check for ebuf */
+		            ebuf,
+		            ebuf_len,
+		            "%s",
+		            "Parameter error");
+		return -1;
+	}
+
+	/* Reset the previous responses */
+	conn->data_len = 0;
+
+	/* Implementation of API function for HTTP clients */
+	save_timeout = conn->dom_ctx->config[REQUEST_TIMEOUT];
+
+	if (timeout >= 0) {
+		mg_snprintf(conn, NULL, txt, sizeof(txt), "%i", timeout);
+		new_timeout = txt;
+	} else {
+		new_timeout = NULL;
+	}
+
+	conn->dom_ctx->config[REQUEST_TIMEOUT] = new_timeout;
+	ret = get_response(conn, ebuf, ebuf_len, &err);
+	conn->dom_ctx->config[REQUEST_TIMEOUT] = save_timeout;
+
+#if defined(MG_LEGACY_INTERFACE)
+	/* TODO: 1) uri is deprecated;
+	 *       2) here, ri.uri is the http response code */
+	conn->request_info.uri = conn->request_info.request_uri;
+#endif
+	conn->request_info.local_uri_raw = conn->request_info.request_uri;
+	conn->request_info.local_uri = conn->request_info.local_uri_raw;
+
+	/* TODO (mid): Define proper return values - maybe return length?
+	 * For the first test use <0 for error and >0 for OK */
+	return (ret == 0) ? -1 : +1;
+}
+
+
+struct mg_connection *
+mg_download(const char *host,
+            int port,
+            int use_ssl,
+            char *ebuf,
+            size_t ebuf_len,
+            const char *fmt,
+            ...)
+{
+	struct mg_connection *conn;
+	va_list ap;
+	int i;
+	int reqerr;
+
+	if (ebuf_len > 0) {
+		ebuf[0] = '\0';
+	}
+
+	va_start(ap, fmt);
+
+	/* open a connection */
+	conn = mg_connect_client(host, port, use_ssl, ebuf, ebuf_len);
+
+	if (conn != NULL) {
+		i = mg_vprintf(conn, fmt, ap);
+		if (i <= 0) {
+			mg_snprintf(conn,
+			            NULL, /* No truncation check for ebuf */
+			            ebuf,
+			            ebuf_len,
+			            "%s",
+			            "Error sending request");
+		} else {
+			/* make sure the buffer is clear */
+			conn->data_len = 0;
+			get_response(conn, ebuf, ebuf_len, &reqerr);
+
+#if defined(MG_LEGACY_INTERFACE)
+			/* TODO: 1) uri is deprecated;
+			 *       2) here, ri.uri is the http response code */
+			conn->request_info.uri = conn->request_info.request_uri;
+#endif
+			conn->request_info.local_uri = conn->request_info.request_uri;
+		}
+	}
+
+	/* if an error occurred, close the connection */
+	if ((ebuf[0] != '\0') && (conn != NULL)) {
+		mg_close_connection(conn);
+		conn = NULL;
+	}
+
+	va_end(ap);
+	return conn;
+}
+
+
+/* Pool of HTTP client connections, reused with keep-alive.
+ * Connections are grouped by host, port and SSL. Idle connections are
+ * evicted lazily, whenever the pool is used. */
+struct mg_client_pool_idle {
+	struct mg_connection *conn;
+	uint64_t idle_since; /* mg_get_current_time_ns() */
+	struct mg_client_pool_idle *next;
+};
+
+struct mg_client_pool_host {
+	struct mg_client_pool *pool;
+	char *host;
+	int port;
+	int use_ssl;
+	unsigned num_conns; /* In use and idle */
+	struct mg_client_pool_idle *idle;
+	struct mg_client_pool_host *next;
+};
+
+struct mg_client_pool {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond; /* Signalled when a connection becomes available */
+	unsigned max_conns_per_host;
+	uint64_t idle_timeout_ns;
+	struct mg_client_pool_host *hosts;
+};
+
+
+struct mg_client_pool *
+mg_client_pool_create(unsigned max_conns_per_host, int idle_timeout_ms)
+{
+	struct mg_client_pool *pool =
+	    (struct mg_client_pool *)mg_calloc(1, sizeof(struct mg_client_pool));
+	if (pool == NULL) {
+		return NULL;
+	}
+	/* Not recursive: mg_client_pool_get waits for cond */
+	if (0 != pthread_mutex_init(&pool->mutex, NULL)) {
+		mg_free(pool);
+		return NULL;
+	}
+	if (0 != pthread_cond_init(&pool->cond, NULL)) {
+		(void)pthread_mutex_destroy(&pool->mutex);
+		mg_free(pool);
+		return NULL;
+	}
+	pool->max_conns_per_host = max_conns_per_host;
+	pool->idle_timeout_ns =
+	    (uint64_t)((idle_timeout_ms > 0) ? idle_timeout_ms : 0) * 1000000;
+	return pool;
+}
+
+
+/* Remove idle connections older than the idle timeout from all hosts and
+ * link them into *evicted. Must be called with the pool mutex held. */
+static void
+client_pool_evict(struct mg_client_pool *pool,
+                  uint64_t now,
+                  struct mg_client_pool_idle **evicted)
+{
+	struct mg_client_pool_host *h;
+	struct mg_client_pool_idle **pi, *e;
+
+	for (h = pool->hosts; h != NULL; h = h->next) {
+		pi = &h->idle;
+		while ((e = *pi) != NULL) {
+			if (now - e->idle_since >= pool->idle_timeout_ns) {
+				*pi = e->next;
+				e->next = *evicted;
+				*evicted = e;
+				h->num_conns--;
+			} else {
+				pi = &e->next;
+			}
+		}
+	}
+}
+
+
+/* Close connections unlinked from the pool. Called without the mutex,
+ * since closing a socket may block. */
+static void
+client_pool_close_list(struct mg_client_pool_idle *list)
+{
+	while (list != NULL) {
+		struct mg_client_pool_idle *next = list->next;
+		list->conn->pool_host = NULL;
+		mg_close_connection(list->conn);
+		mg_free(list);
+		list = next;
+	}
+}
+
+
+/* Check if an idle connection is still usable: nothing must be readable,
+ * otherwise the server closed it or sent unexpected data. */
+static int
+client_pool_conn_alive(struct mg_connection *conn)
+{
+	struct mg_pollfd pfd;
+
+	pfd.fd = conn->client.sock;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	return (0 == mg_poll(&pfd, 1, 0, &(conn->phys_ctx->stop_flag)));
+}
+
+
+struct mg_connection *
+mg_client_pool_get(struct mg_client_pool *pool,
+                   const char *host,
+                   int port,
+                   int use_ssl,
+                   int timeout_ms,
+                   char *ebuf,
+                   size_t ebuf_len)
+{
+	struct mg_client_pool_host *h;
+	struct mg_client_pool_idle *evicted = NULL, *e;
+	struct mg_connection *conn = NULL;
+	uint64_t deadline = 0;
+	struct timespec abstime;
+	int timed_out = 0;
+#if defined(_WIN32)
+	/* The emulation of pthread_cond_timedwait uses an event of the waiting
+	 * thread. Threads not started by civetweb get a temporary one. */
+	struct mg_workerTLS tmp_tls;
+	struct mg_workerTLS *tls =
+	    (struct mg_workerTLS *)pthread_getspecific(sTlsKey);
+	int tmp_tls_set = 0;
+#endif
+
+	if (ebuf_len > 0) {
+		ebuf[0] = '\0';
+	}
+	if ((pool == NULL) || (host == NULL)) {
+		mg_snprintf(NULL,
+		            NULL, /* No truncation check for ebuf */
+		            ebuf,
+		            ebuf_len,
+		            "%s",
+		            "Parameter error");
+		return NULL;
+	}
+
+	if (timeout_ms >= 0) {
+		deadline = mg_get_current_time_ns() + (uint64_t)timeout_ms * 1000000;
+		abstime.tv_sec = (time_t)(deadline / 1000000000);
+		abstime.tv_nsec = (long)(deadline % 1000000000);
+	}
+
+	pthread_mutex_lock(&pool->mutex);
+
+	for (h = pool->hosts; h != NULL; h = h->next) {
+		if ((h->port == port) && (h->use_ssl == use_ssl)
+		    && !mg_strcasecmp(h->host, host)) {
+			break;
+		}
+	}
+	if (h == NULL) {
+		h = (struct mg_client_pool_host *)mg_calloc(1, sizeof(*h));
+		if ((h == NULL) || ((h->host = mg_strdup(host)) == NULL)) {
+			pthread_mutex_unlock(&pool->mutex);
+			mg_free(h);
+			mg_snprintf(NULL,
+			            NULL, /* No truncation check for ebuf */
+			            ebuf,
+			            ebuf_len,
+			            "%s",
+			            "Out of memory");
+			return NULL;
+		}
+		h->pool = pool;
+		h->port = port;
+		h->use_ssl = use_ssl;
+		h->next = pool->hosts;
+		pool->hosts = h;
+	}
+
+	for (;;) {
+		client_pool_evict(pool, mg_get_current_time_ns(), &evicted);
+
+		/* Most recently used idle connection first */
+		while ((e = h->idle) != NULL) {
+			h->idle = e->next;
+			if (client_pool_conn_alive(e->conn)) {
+				conn = e->conn;
+				mg_free(e);
+				break;
+			}
+			h->num_conns--;
+			e->next = evicted;
+			evicted = e;
+		}
+		if (conn != NULL) {
+			break;
+		}
+
+		if ((pool->max_conns_per_host == 0)
+		    || (h->num_conns < pool->max_conns_per_host)) {
+			/* Reserve a slot and connect without holding the lock */
+			h->num_conns++;
+			break;
+		}
+
+		if (evicted != NULL) {
+			/* Slots of other hosts may have been freed */
+			pthread_cond_broadcast(&pool->cond);
+			pthread_mutex_unlock(&pool->mutex);
+			client_pool_close_list(evicted);
+			evicted = NULL;
+			pthread_mutex_lock(&pool->mutex);
+			continue;
+		}
+
+		/* All connections to this host are in use: wait for a release */
+#if defined(_WIN32)
+		if (!tmp_tls_set
+		    && ((tls == NULL) || (tls->pthread_cond_helper_mutex == NULL))) {
+			memset(&tmp_tls, 0, sizeof(tmp_tls));
+			tmp_tls.pthread_cond_helper_mutex =
+			    CreateEvent(NULL, FALSE, FALSE, NULL);
+			if (tmp_tls.pthread_cond_helper_mutex == NULL) {
+				timed_out = 1;
+				break;
+			}
+			pthread_setspecific(sTlsKey, &tmp_tls);
+			tmp_tls_set = 1;
+		}
+#endif
+		if (timeout_ms < 0) {
+			pthread_cond_wait(&pool->cond, &pool->mutex);
+		} else if (mg_get_current_time_ns() < deadline) {
+			pthread_cond_timedwait(&pool->cond, &pool->mutex, &abstime);
+		} else {
+			timed_out = 1;
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&pool->mutex);
+#if defined(_WIN32)
+	if (tmp_tls_set) {
+		pthread_setspecific(sTlsKey, tls);
+		CloseHandle(tmp_tls.pthread_cond_helper_mutex);
+	}
+#endif
+	if (timed_out) {
+		mg_snprintf(NULL,
 		            NULL, /* No truncation check for ebuf */
 		            ebuf,
 		            ebuf_len,
 		            "%s",
-		            "Parameter error");
-		return -1;
+		            "Timeout waiting for a connection");
+		return NULL;
 	}
+	client_pool_close_list(evicted);
 
-	/* Reset the previous responses */
-	conn->data_len = 0;
+	if (conn == NULL) {
+		conn = mg_connect_client(host, port, use_ssl, ebuf, ebuf_len);
+		if (conn == NULL) {
+			pthread_mutex_lock(&pool->mutex);
+			h->num_conns--;
+			pthread_cond_broadcast(&pool->cond);
+			pthread_mutex_unlock(&pool->mutex);
+			return NULL;
+		}
+	} else {
+		/* Prepare a reused connection for the next request */
+		conn->data_len = 0;
+		conn->request_len = 0;
+		conn->consumed_content = 0;
+		conn->num_bytes_sent = 0;
+		conn->content_len = -1;
+		conn->is_chunked = 0;
+		conn->request_state = 0;
+		conn->response_info.num_headers = 0;
+		conn->response_info.status_code = 0;
+	}
+	conn->pool_host = h;
+	return conn;
+}
 
-	/* Implementation of API function for HTTP clients */
-	save_timeout = conn->dom_ctx->config[REQUEST_TIMEOUT];
 
-	if (timeout >= 0) {
-		mg_snprintf(conn, NULL, txt, sizeof(txt), "%i", timeout);
-		new_timeout = txt;
-	} else {
-		new_timeout = NULL;
+void
+mg_client_pool_release(struct mg_connection *conn)
+{
+	struct mg_client_pool_host *h;
+	struct mg_client_pool *pool;
+	struct mg_client_pool_idle *evicted = NULL, *e;
+	const char *header;
+	const char *http_version;
+	int keep = 1;
+
+	if ((conn == NULL) || ((h = conn->pool_host) == NULL)) {
+		mg_close_connection(conn);
+		return;
+	}
+	pool = h->pool;
+
+	/* The response must be read completely, and no other data must
+	 * follow it. */
+	if (conn->must_close || (conn->response_info.status_code == 0)) {
+		keep = 0;
+	} else if (conn->is_chunked) {
+		keep = (conn->is_chunked == 4);
+	} else if ((conn->content_len < 0)
+	           || (conn->consumed_content < conn->content_len)) {
+		keep = 0;
+	}
+	if (keep
+	    && ((int64_t)conn->data_len
+	        > ((int64_t)conn->request_len + conn->consumed_content))) {
+		keep = 0;
+	}
+
+	/* The server must allow keep-alive */
+	if (keep) {
+		header = get_header(conn->response_info.http_headers,
+		                    conn->response_info.num_headers,
+		                    "Connection");
+		http_version = conn->response_info.http_version;
+		if (header != NULL) {
+			keep = header_has_option(header, "keep-alive");
+		} else {
+			keep = (http_version != NULL) && !strcmp(http_version, "1.1");
+		}
 	}
 
-	conn->dom_ctx->config[REQUEST_TIMEOUT] = new_timeout;
-	ret = get_response(conn, ebuf, ebuf_len, &err);
-	conn->dom_ctx->config[REQUEST_TIMEOUT] = save_timeout;
+	if (keep) {
+		e = (struct mg_client_pool_idle *)mg_malloc(sizeof(*e));
+		keep = (e != NULL);
+	}
 
-#if defined(MG_LEGACY_INTERFACE)
-	/* TODO: 1) uri is deprecated;
-	 *       2) here, ri.uri is the http response code */
-	conn->request_info.uri = conn->request_info.request_uri;
-#endif
-	conn->request_info.local_uri_raw = conn->request_info.request_uri;
-	conn->request_info.local_uri = conn->request_info.local_uri_raw;
+	pthread_mutex_lock(&pool->mutex);
+	if (keep) {
+		e->conn = conn;
+		e->idle_since = mg_get_current_time_ns();
+		e->next = h->idle;
+		h->idle = e;
+	} else {
+		h->num_conns--;
+	}
+	client_pool_evict(pool, mg_get_current_time_ns(), &evicted);
+	/* Waiters may be interested in different hosts */
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->mutex);
 
-	/* TODO (mid): Define proper return values - maybe return length?
-	 * For the first test use <0 for error and >0 for OK */
-	return (ret == 0) ? -1 : +1;
+	client_pool_close_list(evicted);
+	if (!keep) {
+		conn->pool_host = NULL;
+		mg_close_connection(conn);
+	}
 }
 
 
-struct mg_connection *
-mg_download(const char *host,
-            int port,
-            int use_ssl,
-            char *ebuf,
-            size_t ebuf_len,
-            const char *fmt,
-            ...)
+/* Give up the pool slot of a connection that is closed by the user */
+static void
+client_pool_drop(struct mg_connection *conn)
 {
-	struct mg_connection *conn;
-	va_list ap;
-	int i;
-	int reqerr;
-
-	if (ebuf_len > 0) {
-		ebuf[0] = '\0';
-	}
+	struct mg_client_pool_host *h = conn->pool_host;
 
-	va_start(ap, fmt);
+	pthread_mutex_lock(&h->pool->mutex);
+	h->num_conns--;
+	pthread_cond_broadcast(&h->pool->cond);
+	pthread_mutex_unlock(&h->pool->mutex);
+	conn->pool_host = NULL;
+}
 
-	/* open a connection */
-	conn = mg_connect_client(host, port, use_ssl, ebuf, ebuf_len);
 
-	if (conn != NULL) {
-		i = mg_vprintf(conn, fmt, ap);
-		if (i <= 0) {
-			mg_snprintf(conn,
-			            NULL, /* No truncation check for ebuf */
-			            ebuf,
-			            ebuf_len,
-			            "%s",
-			            "Error sending request");
-		} else {
-			/* make sure the buffer is clear */
-			conn->data_len = 0;
-			get_response(conn, ebuf, ebuf_len, &reqerr);
+void
+mg_client_pool_destroy(struct mg_client_pool *pool)
+{
+	struct mg_client_pool_host *h;
 
-#if defined(MG_LEGACY_INTERFACE)
-			/* TODO: 1) uri is deprecated;
-			 *       2) here, ri.uri is the http response code */
-			conn->request_info.uri = conn->request_info.request_uri;
-#endif
-			conn->request_info.local_uri = conn->request_info.request_uri;
-		}
+	if (pool == NULL) {
+		return;
 	}
-
-	/* if an error occurred, close the connection */
-	if ((ebuf[0] != '\0') && (conn != NULL)) {
-		mg_close_connection(conn);
-		conn = NULL;
+	while ((h = pool->hosts) != NULL) {
+		pool->hosts = h->next;
+		client_pool_close_list(h->idle);
+		mg_free(h->host);
+		mg_free(h);
 	}
-
-	va_end(ap);
-	return conn;
+	(void)pthread_cond_destroy(&pool->cond);
+	(void)pthread_mutex_destroy(&pool->mutex);
+	mg_free(pool);
 }
 
 
@@ -18433,6 +23191,15 @@ process_new_connection(struct mg_connection *conn)
 				mg_send_http_error(conn, reqerr, "%s", ebuf);
 			}
 
+#if defined(USE_HTTP2)
+		} else if ((conn->handled_requests == 0)
+		           && is_http2_prior_knowledge(conn)) {
+			/* Cleartext HTTP/2 (h2c): The client started with the
+			 * connection preface instead of a HTTP/1 request. */
+			process_new_h2c_connection(conn);
+			break;
+#endif
+
 		} else if (strcmp(ri->http_version, "1.0")
 		           && strcmp(ri->http_version, "1.1")) {
 			/* HTTP/2 is not allowed here */
@@ -18515,6 +23282,11 @@ process_new_connection(struct mg_connection *conn)
 
 				/* handle request to local server */
 				handle_request_stat_log(conn);
+				if (conn->detached) {
+					/* The request and the socket have been moved to
+					 * another connection structure */
+					break;
+				}
 
 			} else {
 				/* TODO: handle non-local request (PROXY) */
@@ -18582,7 +23354,11 @@ process_new_connection(struct mg_connection *conn)
 	            conn->request_info.remote_addr,
 	            difftime(time(NULL), conn->conn_birth_time));
 
-	close_connection(conn);
+	if (conn->detached) {
+		conn->detached = 0;
+	} else {
+		close_connection(conn);
+	}
 
 #if defined(USE_SERVER_STATS)
 	mg_atomic_add(&(conn->phys_ctx->total_requests), conn->handled_requests);
@@ -18666,9 +23442,27 @@ consume_socket(struct mg_context *ctx, struct socket *sp, int thread_index)
 	DEBUG_TRACE("%s", "going idle");
 
 	/* If the queue is empty, wait. We're idle at this point. */
-	while ((ctx->sq_head == ctx->sq_tail)
-	       && (STOP_FLAG_IS_ZERO(&ctx->stop_flag))) {
+	/* Requests of HTTP/2 connections read by another worker thread, and
+	 * callbacks of mg_async_wait, are handled before new sockets: they
+	 * were queued because this thread was counted in sq_idle, and they
+	 * are not taken back. */
+	while (STOP_FLAG_IS_ZERO(&ctx->stop_flag)) {
+#if defined(USE_HTTP2)
+		if (ctx->h2_queue_head != NULL) {
+			http2_run_queued_stream(ctx);
+			continue;
+		}
+#endif
+		if (ctx->async_queue_head != NULL) {
+			async_run_queued_task(ctx);
+			continue;
+		}
+		if (ctx->sq_head != ctx->sq_tail) {
+			break;
+		}
+		ctx->sq_idle++;
 		pthread_cond_wait(&ctx->sq_full, &ctx->thread_mutex);
+		ctx->sq_idle--;
 	}
 
 	/* If we're stopping, sq_head may be equal to sq_tail. */
@@ -18747,6 +23541,7 @@ worker_thread_run(struct mg_connection *conn)
 	mg_set_thread_name("worker");
 
 	tls.is_master = 0;
+	tls.date_cache_valid = 0;
 	tls.thread_idx = (unsigned)mg_atomic_inc(&thread_idx_max);
 #if defined(_WIN32)
 	tls.pthread_cond_helper_mutex = CreateEvent(NULL, FALSE, FALSE, NULL);
@@ -18882,6 +23677,7 @@ worker_thread_run(struct mg_connection *conn)
 					    -1;               /* content length is not predefined */
 					conn->is_chunked = 0; /* HTTP2 is never chunked */
 					process_new_http2_connection(conn);
+					close_connection(conn);
 				} else
 #endif
 				{
@@ -18931,6 +23727,15 @@ worker_thread_run(struct mg_connection *conn)
 #endif
 	}
 
+#if defined(USE_LUA)
+	/* Close Lua states kept for reuse (calls exit_lua) */
+	lua_worker_states_close(conn);
+#endif
+#if defined(USE_DUKTAPE)
+	/* Destroy the Duktape heap kept for reuse */
+	mg_duk_worker_heap_close(conn);
+#endif
+
 	/* Call exit thread user callback */
 	if (ctx->callbacks.exit_thread) {
 		ctx->callbacks.exit_thread(ctx, 1, tls.user_ptr);
@@ -19084,6 +23889,7 @@ master_thread_run(struct mg_context *ctx)
 	struct mg_pollfd *pfd;
 	unsigned int i;
 	unsigned int workerthreadcount;
+	pthread_t async_threadid;
 
 	if (!ctx) {
 		return;
@@ -19111,6 +23917,7 @@ master_thread_run(struct mg_context *ctx)
 	tls.pthread_cond_helper_mutex = CreateEvent(NULL, FALSE, FALSE, NULL);
 #endif
 	tls.is_master = 1;
+	tls.date_cache_valid = 0;
 	pthread_setspecific(sTlsKey, &tls);
 
 	if (ctx->callbacks.init_thread) {
@@ -19196,6 +24003,13 @@ master_thread_run(struct mg_context *ctx)
 	(void)pthread_mutex_unlock(&ctx->thread_mutex);
 #endif
 
+#if defined(USE_WEBSOCKET)
+	/* Wakeup workers waiting for a websocket queue (see ws_out_wait). */
+	pthread_mutex_lock(&ctx->ws_mutex);
+	pthread_cond_broadcast(&ctx->ws_cond);
+	pthread_mutex_unlock(&ctx->ws_mutex);
+#endif
+
 	/* Join all worker threads to avoid leaking threads. */
 	workerthreadcount = ctx->cfg_worker_threads;
 	for (i = 0; i < workerthreadcount; i++) {
@@ -19204,6 +24018,50 @@ master_thread_run(struct mg_context *ctx)
 		}
 	}
 
+	/* Cancel all waits of mg_async_wait, and run the callbacks still
+	 * queued for a worker thread. Then wait until all detached requests
+	 * have been finished by the application. */
+	pthread_mutex_lock(&ctx->async_mutex);
+	pthread_cond_signal(&ctx->async_cond);
+	async_threadid = ctx->async_threadid;
+	pthread_mutex_unlock(&ctx->async_mutex);
+	if (async_threadid != 0) {
+		mg_join_thread(async_threadid);
+	}
+#if !defined(ALTERNATIVE_QUEUE)
+	(void)pthread_mutex_lock(&ctx->thread_mutex);
+	while (ctx->async_queue_head != NULL) {
+		async_run_queued_task(ctx);
+	}
+	(void)pthread_mutex_unlock(&ctx->thread_mutex);
+#endif
+	pthread_mutex_lock(&ctx->async_mutex);
+	while (ctx->detached_requests > 0) {
+		pthread_cond_wait(&ctx->async_cond, &ctx->async_mutex);
+	}
+	pthread_mutex_unlock(&ctx->async_mutex);
+
+#if !defined(__ZEPHYR__)
+	/* Join the linger thread, it closes all remaining sockets */
+	pthread_mutex_lock(&ctx->linger_mutex);
+	pthread_cond_signal(&ctx->linger_cond);
+	pthread_mutex_unlock(&ctx->linger_mutex);
+	if (ctx->linger_threadid != 0) {
+		mg_join_thread(ctx->linger_threadid);
+	}
+#endif
+
+#if defined(USE_WEBSOCKET)
+	/* Join the websocket outbound queue thread. All clients have been
+	 * removed by the worker threads. */
+	pthread_mutex_lock(&ctx->ws_mutex);
+	pthread_cond_broadcast(&ctx->ws_cond);
+	pthread_mutex_unlock(&ctx->ws_mutex);
+	if (ctx->ws_out_threadid != 0) {
+		mg_join_thread(ctx->ws_out_threadid);
+	}
+#endif
+
 #if defined(USE_LUA)
 	/* Free Lua state of lua background task */
 	if (ctx->lua_background_state) {
@@ -19314,10 +24172,66 @@ free_context(struct mg_context *ctx)
 	/* Destroy other context global data structures mutex */
 	(void)pthread_mutex_destroy(&ctx->nonce_mutex);
 
+#if !defined(__ZEPHYR__)
+	(void)pthread_mutex_destroy(&ctx->linger_mutex);
+	(void)pthread_cond_destroy(&ctx->linger_cond);
+	mg_free(ctx->linger_socks);
+#endif
+
+#if !defined(NO_FILESYSTEMS)
+	/* Deallocate directory listing cache */
+	for (i = 0; i < DIRECTORY_CACHE_SIZE; i++) {
+		if (ctx->dir_cache[i] != NULL) {
+			dir_cache_entry_free(ctx->dir_cache[i]);
+		}
+	}
+	(void)pthread_mutex_destroy(&ctx->dir_cache_mutex);
+
+	/* Deallocate compiled SSI files */
+	for (i = 0; i < SSI_CACHE_SIZE; i++) {
+		if (ctx->ssi_cache[i] != NULL) {
+			ssi_template_free(ctx->ssi_cache[i]);
+		}
+	}
+	(void)pthread_mutex_destroy(&ctx->ssi_cache_mutex);
+
+	/* Close all cached files */
+	file_cache_flush(ctx);
+	(void)pthread_mutex_destroy(&ctx->file_cache_mutex);
+#endif
+
+#if defined(USE_DUKTAPE)
+	/* Deallocate bytecode of server side JavaScript files */
+	for (i = 0; i < DUKTAPE_CACHE_SIZE; i++) {
+		if (ctx->duk_cache[i] != NULL) {
+			mg_duk_bytecode_free(ctx->duk_cache[i]);
+		}
+	}
+	(void)pthread_mutex_destroy(&ctx->duk_cache_mutex);
+#endif
+
+#if !defined(NO_CGI) && !defined(_WIN32)
+	/* Stop all FastCGI worker processes */
+	fastcgi_stop_all(ctx);
+	(void)pthread_mutex_destroy(&ctx->fastcgi_mutex);
+#endif
+
 #if defined(USE_LUA)
 	(void)pthread_mutex_destroy(&ctx->lua_bg_mutex);
 #endif
 
+#if defined(USE_WEBSOCKET)
+	(void)pthread_cond_destroy(&ctx->ws_cond);
+	(void)pthread_mutex_destroy(&ctx->ws_mutex);
+#endif
+
+	(void)pthread_cond_destroy(&ctx->async_cond);
+	(void)pthread_mutex_destroy(&ctx->async_mutex);
+	mg_free(ctx->async_waits);
+
+	/* Deallocate parsed mime types, they point into the config */
+	mime_index_free(ctx->dd.extra_mime_types);
+
 	/* Deallocate config parameters */
 	for (i = 0; i < NUM_OPTIONS; i++) {
 		if (ctx->dd.config[i] != NULL) {
@@ -19557,6 +24471,7 @@ static
 	 * can be considered as single external thread */
 	ctx->starter_thread_idx = (unsigned)mg_atomic_inc(&thread_idx_max);
 	tls.is_master = -1; /* Thread calling mg_start */
+	tls.date_cache_valid = 0;
 	tls.thread_idx = ctx->starter_thread_idx;
 #if defined(_WIN32)
 	tls.pthread_cond_helper_mutex = NULL;
@@ -19570,9 +24485,34 @@ static
 	ctx->sq_blocked = 0;
 #endif
 	ok &= (0 == pthread_mutex_init(&ctx->nonce_mutex, &pthread_mutex_attr));
+#if !defined(__ZEPHYR__)
+	/* Not recursive: the linger thread waits for linger_cond */
+	ok &= (0 == pthread_mutex_init(&ctx->linger_mutex, NULL));
+	ok &= (0 == pthread_cond_init(&ctx->linger_cond, NULL));
+#endif
+#if !defined(NO_FILESYSTEMS)
+	ok &= (0 == pthread_mutex_init(&ctx->dir_cache_mutex, &pthread_mutex_attr));
+	ok &= (0 == pthread_mutex_init(&ctx->ssi_cache_mutex, &pthread_mutex_attr));
+	ok &= (0 == pthread_mutex_init(&ctx->file_cache_mutex, &pthread_mutex_attr));
+#endif
+#if !defined(NO_CGI) && !defined(_WIN32)
+	/* Not recursive: fastcgi_connect waits for app->conn_cond */
+	ok &= (0 == pthread_mutex_init(&ctx->fastcgi_mutex, NULL));
+#endif
 #if defined(USE_LUA)
 	ok &= (0 == pthread_mutex_init(&ctx->lua_bg_mutex, &pthread_mutex_attr));
 #endif
+#if defined(USE_DUKTAPE)
+	ok &= (0 == pthread_mutex_init(&ctx->duk_cache_mutex, &pthread_mutex_attr));
+#endif
+#if defined(USE_WEBSOCKET)
+	/* Not recursive: ws_out_wait and the "wsout" thread wait for ws_cond */
+	ok &= (0 == pthread_mutex_init(&ctx->ws_mutex, NULL));
+	ok &= (0 == pthread_cond_init(&ctx->ws_cond, NULL));
+#endif
+	/* Not recursive: the async thread waits for async_cond */
+	ok &= (0 == pthread_mutex_init(&ctx->async_mutex, NULL));
+	ok &= (0 == pthread_cond_init(&ctx->async_cond, NULL));
 	if (!ok) {
 		const char *err_msg =
 		    "Cannot initialize thread synchronization objects";
@@ -19678,6 +24618,57 @@ static
 	}
 	ctx->max_request_size = (unsigned)itmp;
 
+#if defined(USE_WEBSOCKET)
+	/* Outbound queues of websocket clients */
+	if (!mg_strcasecmp(ctx->dd.config[WEBSOCKET_QUEUE_POLICY], "block")) {
+		ctx->ws_queue_policy = WS_QUEUE_BLOCK;
+	} else if (!mg_strcasecmp(ctx->dd.config[WEBSOCKET_QUEUE_POLICY],
+	                          "drop_oldest")) {
+		ctx->ws_queue_policy = WS_QUEUE_DROP_OLDEST;
+	} else if (!mg_strcasecmp(ctx->dd.config[WEBSOCKET_QUEUE_POLICY],
+	                          "coalesce")) {
+		ctx->ws_queue_policy = WS_QUEUE_COALESCE;
+	} else if (!mg_strcasecmp(ctx->dd.config[WEBSOCKET_QUEUE_POLICY],
+	                          "disconnect")) {
+		ctx->ws_queue_policy = WS_QUEUE_DISCONNECT;
+	} else {
+		mg_cry_ctx_internal(ctx,
+		                    "%s must be block, drop_oldest, coalesce or "
+		                    "disconnect",
+		                    config_options[WEBSOCKET_QUEUE_POLICY].name);
+		if ((error != NULL) && (error->text_buffer_size > 0)) {
+			mg_snprintf(NULL,
+			            NULL, /* No truncation check for error buffers */
+			            error->text,
+			            error->text_buffer_size,
+			            "Invalid configuration option value: %s",
+			            config_options[WEBSOCKET_QUEUE_POLICY].name);
+		}
+		free_context(ctx);
+		pthread_setspecific(sTlsKey, NULL);
+		return NULL;
+	}
+	itmp = atoi(ctx->dd.config[WEBSOCKET_QUEUE_HIGH_WATERMARK]);
+	ctx->ws_queue_high_watermark = (itmp > 0) ? (size_t)itmp : 0;
+	itmp = atoi(ctx->dd.config[WEBSOCKET_QUEUE_LOW_WATERMARK]);
+	ctx->ws_queue_low_watermark = (itmp > 0) ? (size_t)itmp : 0;
+	if (ctx->ws_queue_low_watermark > ctx->ws_queue_high_watermark) {
+		ctx->ws_queue_low_watermark = ctx->ws_queue_high_watermark;
+	}
+	itmp = atoi(ctx->dd.config[WEBSOCKET_MAX_FLUSH_RATE]);
+	ctx->ws_flush_interval_ns = (itmp > 0) ? (1000000000 / (uint64_t)itmp) : 0;
+#endif
+
+#if !defined(NO_FILESYSTEMS)
+	/* Stat and file cache option */
+	itmp = atoi(ctx->dd.config[STAT_CACHE_TTL]);
+	ctx->file_cache_ttl_ns = (itmp > 0) ? ((uint64_t)itmp * 1000000) : 0;
+#endif
+
+	/* Parse user defined mime types once */
+	ctx->dd.extra_mime_types =
+	    mime_index_create(ctx, ctx->dd.config[EXTRA_MIME_TYPES]);
+
 	/* Queue length */
 #if !defined(ALTERNATIVE_QUEUE)
 	itmp = atoi(ctx->dd.config[CONNECTION_QUEUE_SIZE]);
@@ -20160,6 +25151,29 @@ static
 		}
 	}
 
+#if !defined(__ZEPHYR__)
+	/* Start the linger thread, if closing sockets may linger.
+	 * Connections are accepted by the master thread started below,
+	 * so no worker closes a socket before this point. */
+	itmp = atoi(ctx->dd.config[LINGER_MAX_SOCKETS]);
+	if ((itmp > 0) && (ctx->dd.config[LINGER_TIMEOUT] != NULL)
+	    && (atoi(ctx->dd.config[LINGER_TIMEOUT]) > 0)) {
+		ctx->linger_socks = (struct mg_linger_socket *)mg_calloc_ctx(
+		    (size_t)itmp, sizeof(struct mg_linger_socket), ctx);
+		if (ctx->linger_socks != NULL) {
+			ctx->linger_max = (unsigned)itmp;
+			if (mg_start_thread_with_id(linger_thread,
+			                            ctx,
+			                            &ctx->linger_threadid)
+			    != 0) {
+				/* Linger in the worker threads instead */
+				ctx->linger_max = 0;
+				ctx->linger_threadid = 0;
+			}
+		}
+	}
+#endif
+
 	/* Start master (listening) thread */
 	mg_start_thread_with_id(master_thread, ctx, &ctx->masterthreadid);
 
@@ -20330,6 +25344,9 @@ mg_start_domain2(struct mg_context *ctx,
 	}
 #endif
 
+	new_dom->extra_mime_types =
+	    mime_index_create(ctx, new_dom->config[EXTRA_MIME_TYPES]);
+
 	/* Add element to linked list. */
 	mg_lock_context(ctx);
 
@@ -20351,6 +25368,7 @@ mg_start_domain2(struct mg_context *ctx,
 				            new_dom->config[AUTHENTICATION_DOMAIN],
 				            config_options[AUTHENTICATION_DOMAIN].name);
 			}
+			mime_index_free(new_dom->extra_mime_types);
 			mg_free(new_dom);
 			mg_unlock_context(ctx);
 			return -5;
@@ -20932,6 +25950,44 @@ mg_get_context_info(const struct mg_context *ctx, char *buffer, int buflen)
 		            eol);
 		context_info_length += mg_str_append(&buffer, end, block);
 
+#if defined(USE_LUA)
+		/* Lua state information */
+		mg_snprintf(NULL,
+		            NULL,
+		            block,
+		            sizeof(block),
+		            ",%s\"lua_states\" : {%s"
+		            "\"created\" : %lu,%s"
+		            "\"reused\" : %lu%s"
+		            "}",
+		            eol,
+		            eol,
+		            (unsigned long)ctx->lua_states_created,
+		            eol,
+		            (unsigned long)ctx->lua_states_reused,
+		            eol);
+		context_info_length += mg_str_append(&buffer, end, block);
+#endif
+
+#if defined(USE_DUKTAPE)
+		/* Duktape heap information */
+		mg_snprintf(NULL,
+		            NULL,
+		            block,
+		            sizeof(block),
+		            ",%s\"duktape_heaps\" : {%s"
+		            "\"created\" : %lu,%s"
+		            "\"reused\" : %lu%s"
+		            "}",
+		            eol,
+		            eol,
+		            (unsigned long)ctx->duk_heaps_created,
+		            eol,
+		            (unsigned long)ctx->duk_heaps_reused,
+		            eol);
+		context_info_length += mg_str_append(&buffer, end, block);
+#endif
+
 		/* Data information */
 		total_data_read =
 		    mg_atomic_add64((volatile int64_t *)&ctx->total_data_read, 0);
@@ -21236,6 +26292,37 @@ mg_get_connection_info(const struct mg_context *ctx,
 		connection_info_length += mg_str_append(&buffer, end, block);
 	}
 
+#if defined(USE_WEBSOCKET)
+	/* Outbound queue of a websocket client */
+	if (conn->ws_listed) {
+		mg_snprintf(NULL,
+		            NULL,
+		            block,
+		            sizeof(block),
+		            "%s%s\"websocket_queue\" : {%s"
+		            "\"frames\" : %lu,%s"
+		            "\"bytes\" : %lu,%s"
+		            "\"peak_bytes\" : %lu,%s"
+		            "\"dropped\" : %" UINT64_FMT ",%s"
+		            "\"above_high_watermark\" : %s%s"
+		            "}",
+		            (connection_info_length > 1 ? "," : ""),
+		            eol,
+		            eol,
+		            (unsigned long)conn->ws_out_frames,
+		            eol,
+		            (unsigned long)conn->ws_out_bytes,
+		            eol,
+		            (unsigned long)conn->ws_out_peak,
+		            eol,
+		            conn->ws_out_dropped,
+		            eol,
+		            conn->ws_out_high ? "true" : "false",
+		            eol);
+		connection_info_length += mg_str_append(&buffer, end, block);
+	}
+#endif
+
 	/* State */
 	mg_snprintf(NULL,
 	            NULL,
@@ -21327,6 +26414,10 @@ mg_init_library(unsigned features)
 
 #if defined(USE_LUA)
 		lua_init_optional_libraries();
+#endif
+		builtin_mime_hash_init();
+#if defined(USE_HTTP2)
+		hpack_huff_fsm_init();
 #endif
 	}
 
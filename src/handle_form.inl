@@ -155,20 +155,34 @@ search_boundary(const char *buf,
                 size_t boundary_len)
 {
 	/* We must do a binary search here, not a string search, since the buffer
-	 * may contain '\x00' bytes, if binary data is transferred. */
-	int clen = (int)buf_len - (int)boundary_len - 4;
-	int i;
-
-	for (i = 0; i <= clen; i++) {
-		if (!memcmp(buf + i, "\r\n--", 4)) {
-			if (!memcmp(buf + i + 4, boundary, boundary_len)) {
-				return buf + i;
-			}
+	 * may contain '\x00' bytes, if binary data is transferred.
+	 * Every delimiter starts with '\r', so use memchr to jump from one
+	 * '\r' to the next and compare only there. File data rarely contains
+	 * '\r', so most of the buffer is skipped in bulk. */
+	const char *p = buf;
+	const char *last;
+
+	if (buf_len < boundary_len + 4) {
+		return NULL;
+	}
+	/* Last position where a complete delimiter fits into the buffer */
+	last = buf + (buf_len - boundary_len - 4);
+
+	while (p <= last) {
+		p = (const char *)memchr(p, '\r', (size_t)(last - p) + 1);
+		if (!p) {
+			break;
 		}
+		if (!memcmp(p, "\r\n--", 4)
+		    && !memcmp(p + 4, boundary, boundary_len)) {
+			return p;
+		}
+		p++;
 	}
 	return NULL;
 }
 
+
 int
 mg_handle_form_request(struct mg_connection *conn,
                        struct mg_form_data_handler *fdh)
@@ -1042,8 +1056,12 @@ mg_handle_form_request(struct mg_connection *conn,
 
 			/* Remove from the buffer */
 			if (next) {
+				/* Only the unprocessed data has to be moved, not the
+				 * entire buffer */
 				used = next - buf + 2;
-				memmove(buf, buf + (size_t)used, sizeof(buf) - (size_t)used);
+				memmove(buf,
+				        buf + (size_t)used,
+				        (size_t)buf_fill - (size_t)used + 1);
 				buf_fill -= (int)used;
 			} else {
 				buf_fill = 0;
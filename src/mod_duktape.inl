@@ -56,14 +56,13 @@ mg_duk_fatal_handler(duk_context *duk_ctx, duk_errcode_t code, const char *msg)
 }
 
 #if DUK_VERSION >= 20000L
-/* Dropped from interface */
-duk_int_t duk_peval_file(duk_context *duk_ctx, const char *script);
-
 static void
 mg_duk_v2_fatal(void *udata, const char *msg)
 {
 	; /* TODO: How to get "conn" without duk_ctx */
 }
+#endif
+
 
 static void
 push_file_as_string(duk_context *ctx, const char *filename)
@@ -84,8 +83,8 @@ push_file_as_string(duk_context *ctx, const char *filename)
 		return;
 	}
 
-	buf = mg_malloc(fst.st_size);
-	if (!f) {
+	buf = mg_malloc(fst.st_size + 1);
+	if (!buf) {
 		fclose(f);
 		duk_push_undefined(ctx);
 		return;
@@ -98,13 +97,6 @@ push_file_as_string(duk_context *ctx, const char *filename)
 	mg_free(buf);
 }
 
-duk_int_t
-duk_peval_file(duk_context *duk_ctx, const char *script)
-{
-	push_file_as_string(duk_ctx, script);
-	return duk_peval(duk_ctx);
-}
-#endif
 
 static duk_ret_t
 duk_itf_write(duk_context *duk_ctx)
@@ -198,30 +190,291 @@ duk_itf_getoption(duk_context *duk_ctx)
 }
 
 
+/* Compiled scripts:
+ * Compiling a script takes more time than running a typical script.
+ * Therefore the bytecode of compiled scripts (duk_dump_function) is kept
+ * in a cache shared by all heaps, and loaded with duk_load_function. An
+ * entry is valid as long as modification time and size of the file do not
+ * change. */
+struct mg_duk_bytecode {
+	char *path;
+	time_t mtime;
+	uint64_t size;
+	time_t last_used;
+	int refcount; /* Cache and requests using the bytecode */
+	duk_size_t len;
+	void *data;
+};
+
+
+/* Script to load by mg_duk_load_script */
+struct mg_duk_script {
+	struct mg_connection *conn;
+	const char *path;
+	struct mg_file_stat st;
+	int has_stat;
+	struct mg_duk_bytecode *bytecode; /* From the cache, or NULL */
+};
+
+
 static void
-mg_exec_duktape_script(struct mg_connection *conn, const char *script_name)
+mg_duk_bytecode_free(struct mg_duk_bytecode *bc)
 {
+	mg_free(bc->data);
+	mg_free(bc->path);
+	mg_free(bc);
+}
+
+
+static void
+mg_duk_bytecode_release(struct mg_context *ctx, struct mg_duk_bytecode *bc)
+{
+	int unused;
+
+	pthread_mutex_lock(&ctx->duk_cache_mutex);
+	unused = (--bc->refcount == 0);
+	pthread_mutex_unlock(&ctx->duk_cache_mutex);
+
+	if (unused) {
+		mg_duk_bytecode_free(bc);
+	}
+}
+
+
+/* Get the cached bytecode of a file, if it is still valid */
+static struct mg_duk_bytecode *
+mg_duk_bytecode_get(struct mg_connection *conn,
+                    const char *path,
+                    const struct mg_file_stat *st)
+{
+	struct mg_context *ctx = conn->phys_ctx;
+	struct mg_duk_bytecode *bc = NULL;
 	int i;
-	duk_context *duk_ctx = NULL;
 
-	conn->must_close = 1;
+	pthread_mutex_lock(&ctx->duk_cache_mutex);
+	for (i = 0; i < DUKTAPE_CACHE_SIZE; i++) {
+		struct mg_duk_bytecode *b = ctx->duk_cache[i];
+		if ((b != NULL) && !strcmp(b->path, path)) {
+			if ((b->mtime == st->last_modified) && (b->size == st->size)) {
+				b->refcount++;
+				b->last_used = time(NULL);
+				bc = b;
+			}
+			break;
+		}
+	}
+	pthread_mutex_unlock(&ctx->duk_cache_mutex);
+	return bc;
+}
 
-	/* Create Duktape interpreter state */
-	duk_ctx = duk_create_heap(mg_duk_mem_alloc,
-	                          mg_duk_mem_realloc,
-	                          mg_duk_mem_free,
-	                          (void *)conn->phys_ctx,
-#if DUK_VERSION >= 20000L
-	                          mg_duk_v2_fatal
-#else
-	                          mg_duk_fatal_handler
-#endif
-	);
-	if (!duk_ctx) {
-		mg_cry_internal(conn, "%s", "Failed to create a Duktape heap.");
-		goto exec_duktape_finished;
+
+/* Store a copy of the bytecode of a file in the cache */
+static void
+mg_duk_bytecode_put(struct mg_connection *conn,
+                    const char *path,
+                    const struct mg_file_stat *st,
+                    const void *data,
+                    duk_size_t len)
+{
+	struct mg_context *ctx = conn->phys_ctx;
+	struct mg_duk_bytecode *bc, *evicted;
+	int i, slot;
+
+	bc = (struct mg_duk_bytecode *)mg_calloc_ctx(1, sizeof(*bc), ctx);
+	if (bc == NULL) {
+		return;
+	}
+	bc->path = mg_strdup_ctx(path, ctx);
+	bc->data = mg_malloc_ctx(len, ctx);
+	if ((bc->path == NULL) || (bc->data == NULL)) {
+		mg_duk_bytecode_free(bc);
+		return;
+	}
+	memcpy(bc->data, data, len);
+	bc->len = len;
+	bc->mtime = st->last_modified;
+	bc->size = st->size;
+	bc->last_used = time(NULL);
+	bc->refcount = 1;
+
+	pthread_mutex_lock(&ctx->duk_cache_mutex);
+	/* Replace an older version of the same file, use a free slot or
+	 * evict the least recently used entry */
+	slot = -1;
+	for (i = 0; i < DUKTAPE_CACHE_SIZE; i++) {
+		struct mg_duk_bytecode *b = ctx->duk_cache[i];
+		if (b == NULL) {
+			if (slot < 0) {
+				slot = i;
+			}
+		} else if (!strcmp(b->path, path)) {
+			slot = i;
+			break;
+		}
+	}
+	if (slot < 0) {
+		slot = 0;
+		for (i = 1; i < DUKTAPE_CACHE_SIZE; i++) {
+			if (ctx->duk_cache[i]->last_used
+			    < ctx->duk_cache[slot]->last_used) {
+				slot = i;
+			}
+		}
 	}
+	evicted = ctx->duk_cache[slot];
+	if ((evicted != NULL) && (--evicted->refcount > 0)) {
+		/* Still in use by another request */
+		evicted = NULL;
+	}
+	ctx->duk_cache[slot] = bc;
+	pthread_mutex_unlock(&ctx->duk_cache_mutex);
+
+	if (evicted != NULL) {
+		mg_duk_bytecode_free(evicted);
+	}
+}
+
+
+/* Push the compiled script: [ struct mg_duk_script * ] -> [ function ].
+ * Called protected (duk_pcall), since compiling may throw an error. */
+static duk_ret_t
+mg_duk_load_script(duk_context *duk_ctx)
+{
+	struct mg_duk_script *script =
+	    (struct mg_duk_script *)duk_require_pointer(duk_ctx, 0);
+	void *data;
+	duk_size_t len = 0;
+
+	if (script->bytecode != NULL) {
+		/* duk_load_function copies the bytecode to new objects */
+		duk_push_external_buffer(duk_ctx);
+		duk_config_buffer(duk_ctx,
+		                  -1,
+		                  script->bytecode->data,
+		                  script->bytecode->len);
+		duk_load_function(duk_ctx);
+		return 1;
+	}
+
+	push_file_as_string(duk_ctx, script->path);
+	if (duk_is_undefined(duk_ctx, -1)) {
+		duk_error(duk_ctx,
+		          DUK_ERR_ERROR,
+		          "cannot read script file %s",
+		          script->path);
+	}
+	duk_push_string(duk_ctx, script->path);
+	/* Eval code, like duk_peval_file */
+	duk_compile(duk_ctx, DUK_COMPILE_EVAL);
+
+	/* A change in the same second as the stat call can not be detected,
+	 * so such a file is compiled again for the next request. */
+	if (script->has_stat && (script->st.last_modified < time(NULL))) {
+		duk_dup(duk_ctx, -1);
+		duk_dump_function(duk_ctx);
+		data = duk_get_buffer(duk_ctx, -1, &len);
+		if (data != NULL) {
+			mg_duk_bytecode_put(
+			    script->conn, script->path, &script->st, data, len);
+		}
+		duk_pop(duk_ctx);
+	}
+	return 1;
+}
+
+
+/* Reusing heaps (duktape_reuse_heaps = yes):
+ * Creating a heap and adding the "conn" and "civetweb" objects takes more
+ * time than running a typical script. Therefore every worker thread may
+ * keep one prepared heap. The C functions are bound to the connection
+ * object of the worker thread, which does not change. After every request,
+ * globals created by the script are removed and globals replaced by the
+ * script are restored. Contents of objects (e.g., "Math" or "conn") are
+ * not restored. */
+static const char *const civetweb_globals_id = "\xFF"
+                                               "civetweb_globals";
+static const char *const civetweb_domain_id = "\xFF"
+                                              "civetweb_domain";
+
+
+static int
+mg_duk_heap_reusable(const struct mg_connection *conn)
+{
+	const struct mg_context *ctx = conn->phys_ctx;
+
+	if ((ctx->context_type != CONTEXT_SERVER) || (conn->dom_ctx == NULL)
+	    || (conn < ctx->worker_connections)
+	    || (conn >= ctx->worker_connections + ctx->cfg_worker_threads)) {
+		/* Not the connection object of a worker thread */
+		return 0;
+	}
+	return !mg_strcasecmp(conn->dom_ctx->config[DUKTAPE_REUSE_HEAPS], "yes");
+}
+
+
+/* Copy all globals into an object stored in the global stash */
+static void
+mg_duk_globals_snapshot(duk_context *duk_ctx)
+{
+	duk_set_top(duk_ctx, 0);
+	duk_push_global_stash(duk_ctx);  /* 0: stash */
+	duk_push_object(duk_ctx);        /* 1: snapshot */
+	duk_push_global_object(duk_ctx); /* 2: globals */
+	duk_enum(duk_ctx,
+	         2,
+	         DUK_ENUM_OWN_PROPERTIES_ONLY | DUK_ENUM_INCLUDE_NONENUMERABLE);
+	while (duk_next(duk_ctx, -1, 1)) {
+		duk_put_prop(duk_ctx, 1); /* snapshot[key] = value */
+	}
+	duk_pop_2(duk_ctx); /* enum, globals */
+	duk_put_prop_string(duk_ctx, 0, civetweb_globals_id);
+	duk_set_top(duk_ctx, 0);
+}
+
+
+/* Remove globals not in the snapshot, restore globals from the snapshot.
+ * Called protected (duk_pcall): if the script made a global non
+ * configurable or read-only, an error is thrown and the heap is not
+ * reused. */
+static duk_ret_t
+mg_duk_globals_restore(duk_context *duk_ctx)
+{
+	duk_push_global_stash(duk_ctx);                          /* 0: stash */
+	duk_get_prop_string(duk_ctx, 0, civetweb_globals_id); /* 1: snapshot */
+	duk_push_global_object(duk_ctx);                       /* 2: globals */
+
+	duk_enum(duk_ctx,
+	         2,
+	         DUK_ENUM_OWN_PROPERTIES_ONLY | DUK_ENUM_INCLUDE_NONENUMERABLE);
+	while (duk_next(duk_ctx, -1, 0)) {
+		duk_dup(duk_ctx, -1);
+		if (duk_has_prop(duk_ctx, 1)) {
+			duk_pop(duk_ctx);
+		} else {
+			/* New global: the enumerator is not affected */
+			duk_del_prop(duk_ctx, 2);
+		}
+	}
+	duk_pop(duk_ctx); /* enum */
+
+	duk_enum(duk_ctx, 1, DUK_ENUM_OWN_PROPERTIES_ONLY);
+	while (duk_next(duk_ctx, -1, 1)) {
+		duk_dup(duk_ctx, -2); /* key, value, key */
+		if (duk_has_prop(duk_ctx, 2)) {
+			/* Keep the attributes, e.g., of "undefined" */
+			duk_def_prop(duk_ctx, 2, DUK_DEFPROP_HAVE_VALUE);
+		} else {
+			duk_put_prop(duk_ctx, 2);
+		}
+	}
+	return 0;
+}
+
 
+/* Add the "conn" and "civetweb" objects with their functions */
+static void
+mg_duk_prepare_heap(struct mg_connection *conn, duk_context *duk_ctx)
+{
 	/* Add "conn" object */
 	duk_push_global_object(duk_ctx);
 	duk_push_object(duk_ctx); /* create a new table/object ("conn") */
@@ -238,6 +491,46 @@ mg_exec_duktape_script(struct mg_connection *conn, const char *script_name)
 	duk_put_prop_string(duk_ctx, -2, civetweb_conn_id);
 	duk_put_prop_string(duk_ctx, -2, "read");
 
+	duk_put_prop_string(duk_ctx, -2, "conn"); /* call the table "conn" */
+
+	/* Add "civetweb" object */
+	duk_push_object(duk_ctx); /* create a new table/object ("civetweb") */
+
+	duk_push_string(duk_ctx, CIVETWEB_VERSION);
+	duk_put_prop_string(duk_ctx, -2, "version");
+
+	/* add function civetweb.getoption */
+	duk_push_c_function(duk_ctx, duk_itf_getoption, 1 /* 1 = nargs */);
+	duk_push_pointer(duk_ctx, (void *)conn);
+	duk_put_prop_string(duk_ctx, -2, civetweb_conn_id);
+	duk_put_prop_string(duk_ctx, -2, "getoption");
+
+	if (conn->phys_ctx != NULL) {
+		/* add system name */
+		if (conn->phys_ctx->systemName != NULL) {
+			duk_push_string(duk_ctx, conn->phys_ctx->systemName);
+			duk_put_prop_string(duk_ctx, -2, "system");
+		}
+	}
+
+	duk_put_prop_string(duk_ctx,
+	                    -2,
+	                    "civetweb"); /* call the table "civetweb" */
+	duk_pop(duk_ctx);                /* global object */
+}
+
+
+/* Add the request specific parts to the "conn" and "civetweb" objects */
+static void
+mg_duk_prepare_request(struct mg_connection *conn,
+                       duk_context *duk_ctx,
+                       const char *script_name)
+{
+	int i;
+
+	duk_push_global_object(duk_ctx);
+	duk_get_prop_string(duk_ctx, -1, "conn");
+
 	/* add request_method object */
 	duk_push_string(duk_ctx, conn->request_info.request_method);
 	duk_put_prop_string(duk_ctx,
@@ -273,49 +566,146 @@ mg_exec_duktape_script(struct mg_connection *conn, const char *script_name)
 		                    conn->request_info.http_headers[i].name);
 	}
 	duk_put_prop_string(duk_ctx, -2, "http_headers");
+	duk_pop(duk_ctx); /* conn */
 
-	duk_put_prop_string(duk_ctx, -2, "conn"); /* call the table "conn" */
-
-	/* Add "civetweb" object */
-	duk_push_global_object(duk_ctx);
-	duk_push_object(duk_ctx); /* create a new table/object ("conn") */
-
-	duk_push_string(duk_ctx, CIVETWEB_VERSION);
-	duk_put_prop_string(duk_ctx, -2, "version");
-
+	duk_get_prop_string(duk_ctx, -1, "civetweb");
 	duk_push_string(duk_ctx, script_name);
 	duk_put_prop_string(duk_ctx, -2, "script_name");
+	duk_pop_2(duk_ctx); /* civetweb, global object */
 
-	/* add function civetweb.getoption */
-	duk_push_c_function(duk_ctx, duk_itf_getoption, 1 /* 1 = nargs */);
+	duk_push_global_stash(duk_ctx);
 	duk_push_pointer(duk_ctx, (void *)conn);
 	duk_put_prop_string(duk_ctx, -2, civetweb_conn_id);
-	duk_put_prop_string(duk_ctx, -2, "getoption");
+	duk_pop(duk_ctx);
+}
 
-	if (conn->phys_ctx != NULL) {
-		/* add system name */
-		if (conn->phys_ctx->systemName != NULL) {
-			duk_push_string(duk_ctx, conn->phys_ctx->systemName);
-			duk_put_prop_string(duk_ctx, -2, "system");
+
+/* Get a prepared Duktape heap */
+static duk_context *
+mg_duk_heap_get(struct mg_connection *conn)
+{
+	int reusable = mg_duk_heap_reusable(conn);
+	duk_context *duk_ctx = NULL;
+	void *dom;
+
+	if (reusable) {
+		duk_ctx = (duk_context *)conn->duk_worker_heap;
+		conn->duk_worker_heap = NULL;
+	}
+	if (duk_ctx != NULL) {
+		/* Domain specific settings are used by the heap */
+		duk_push_global_stash(duk_ctx);
+		duk_get_prop_string(duk_ctx, -1, civetweb_domain_id);
+		dom = duk_get_pointer(duk_ctx, -1);
+		duk_pop_2(duk_ctx);
+		if (dom == (void *)conn->dom_ctx) {
+#if defined(USE_SERVER_STATS)
+			mg_atomic_inc(&(conn->phys_ctx->duk_heaps_reused));
+#endif
+			return duk_ctx;
 		}
+		duk_destroy_heap(duk_ctx);
 	}
 
-	duk_put_prop_string(duk_ctx,
-	                    -2,
-	                    "civetweb"); /* call the table "civetweb" */
+	/* Create Duktape interpreter state */
+	duk_ctx = duk_create_heap(mg_duk_mem_alloc,
+	                          mg_duk_mem_realloc,
+	                          mg_duk_mem_free,
+	                          (void *)conn->phys_ctx,
+#if DUK_VERSION >= 20000L
+	                          mg_duk_v2_fatal
+#else
+	                          mg_duk_fatal_handler
+#endif
+	);
+	if (!duk_ctx) {
+		return NULL;
+	}
+	mg_duk_prepare_heap(conn, duk_ctx);
+#if defined(USE_SERVER_STATS)
+	mg_atomic_inc(&(conn->phys_ctx->duk_heaps_created));
+#endif
 
-	duk_push_global_stash(duk_ctx);
-	duk_push_pointer(duk_ctx, (void *)conn);
-	duk_put_prop_string(duk_ctx, -2, civetweb_conn_id);
+	if (reusable) {
+		duk_push_global_stash(duk_ctx);
+		duk_push_pointer(duk_ctx, (void *)conn->dom_ctx);
+		duk_put_prop_string(duk_ctx, -2, civetweb_domain_id);
+		duk_pop(duk_ctx);
+		mg_duk_globals_snapshot(duk_ctx);
+	}
+	return duk_ctx;
+}
+
+
+/* Return a heap obtained by mg_duk_heap_get */
+static void
+mg_duk_heap_release(struct mg_connection *conn, duk_context *duk_ctx)
+{
+	if (mg_duk_heap_reusable(conn) && (conn->duk_worker_heap == NULL)) {
+		duk_set_top(duk_ctx, 0);
+		duk_push_c_function(duk_ctx, mg_duk_globals_restore, 0);
+		if (duk_pcall(duk_ctx, 0) == 0) {
+			duk_set_top(duk_ctx, 0);
+			conn->duk_worker_heap = (void *)duk_ctx;
+			return;
+		}
+	}
+	duk_destroy_heap(duk_ctx);
+}
+
+
+/* Destroy the heap kept by a worker thread */
+static void
+mg_duk_worker_heap_close(struct mg_connection *conn)
+{
+	if (conn->duk_worker_heap != NULL) {
+		duk_destroy_heap((duk_context *)conn->duk_worker_heap);
+		conn->duk_worker_heap = NULL;
+	}
+}
+
+
+static void
+mg_exec_duktape_script(struct mg_connection *conn, const char *script_name)
+{
+	duk_context *duk_ctx = NULL;
+	struct mg_duk_script script;
+
+	conn->must_close = 1;
 
-	if (duk_peval_file(duk_ctx, script_name) != 0) {
+	duk_ctx = mg_duk_heap_get(conn);
+	if (!duk_ctx) {
+		mg_cry_internal(conn, "%s", "Failed to create a Duktape heap.");
+		return;
+	}
+	mg_duk_prepare_request(conn, duk_ctx, script_name);
+
+	script.conn = conn;
+	script.path = script_name;
+	script.has_stat = mg_stat(conn, script_name, &script.st);
+	script.bytecode = script.has_stat
+	                      ? mg_duk_bytecode_get(conn, script_name, &script.st)
+	                      : NULL;
+
+	duk_push_c_function(duk_ctx, mg_duk_load_script, 1 /* 1 = nargs */);
+	duk_push_pointer(duk_ctx, (void *)&script);
+	if (duk_pcall(duk_ctx, 1) != 0) {
+		mg_cry_internal(conn, "%s", duk_safe_to_string(duk_ctx, -1));
+		goto exec_duktape_finished;
+	}
+	/* Call the compiled script like duk_peval does: this = global */
+	duk_push_global_object(duk_ctx);
+	if (duk_pcall_method(duk_ctx, 0) != 0) {
 		mg_cry_internal(conn, "%s", duk_safe_to_string(duk_ctx, -1));
 		goto exec_duktape_finished;
 	}
 	duk_pop(duk_ctx); /* ignore result */
 
 exec_duktape_finished:
-	duk_destroy_heap(duk_ctx);
+	if (script.bytecode != NULL) {
+		mg_duk_bytecode_release(conn->phys_ctx, script.bytecode);
+	}
+	mg_duk_heap_release(conn, duk_ctx);
 }
 
 
@@ -0,0 +1,991 @@
+/* Persistent FastCGI workers for CGI programs.
+ *
+ * If cgi_fastcgi_workers (cgi2_fastcgi_workers, ...) is set, a CGI program
+ * is not started for every request. Instead, it is started this number of
+ * times as FastCGI application when it is requested first, and all
+ * further requests are sent to these worker processes. The workers share
+ * one listening Unix domain socket, which is passed as file descriptor 0
+ * (FCGI_LISTENSOCK_FILENO), as all FastCGI process managers do.
+ *
+ * Requests are sent with FCGI_KEEP_CONN, so connections are reused. Most
+ * FastCGI applications serve one connection at a time and do not accept
+ * multiplexed requests (FCGI_MPXS_CONNS), so there is at most one
+ * connection per worker, with one request at a time. Requests wait for a
+ * free connection, so concurrent requests are distributed to all workers.
+ *
+ * If the workers can not be started or connected, the request is handled
+ * by a new CGI process, as without cgi_fastcgi_workers.
+ */
+#if defined(NO_CGI) || defined(_WIN32)
+#error "This file must only be included, if CGI is used on a POSIX system"
+#endif
+
+/* See the FastCGI Specification, Version 1.0 */
+#define FCGI_VERSION_1 (1)
+#define FCGI_HEADER_LEN (8)
+#define FCGI_MAX_CONTENT_LEN (65535)
+
+#define FCGI_BEGIN_REQUEST (1)
+#define FCGI_END_REQUEST (3)
+#define FCGI_PARAMS (4)
+#define FCGI_STDIN (5)
+#define FCGI_STDOUT (6)
+#define FCGI_STDERR (7)
+
+#define FCGI_RESPONDER (1)
+#define FCGI_KEEP_CONN (1)
+#define FCGI_REQUEST_COMPLETE (0)
+
+/* Connections are not multiplexed, all requests use the same id */
+#define FCGI_REQUEST_ID (1)
+
+/* Upper limit for cgi_fastcgi_workers */
+#if !defined(FASTCGI_MAX_WORKERS)
+#define FASTCGI_MAX_WORKERS (64)
+#endif
+
+/* Time without kept connections, after a worker closed one */
+#if !defined(FASTCGI_NO_KEEP_SECONDS)
+#define FASTCGI_NO_KEEP_SECONDS (60)
+#endif
+
+
+/* Worker processes of one CGI program. All fields are protected by
+ * ctx->fastcgi_mutex. */
+struct fastcgi_app {
+	struct fastcgi_app *next;
+	struct mg_domain_context *dom_ctx;
+	char *prog;
+	char sock_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+	unsigned generation; /* Incremented every time the workers are started */
+	pid_t pids[FASTCGI_MAX_WORKERS];
+	int num_workers; /* Running worker processes */
+	int max_conns;   /* Configured number of worker processes */
+	int num_conns;   /* Open connections, idle or in use */
+	SOCKET idle[FASTCGI_MAX_WORKERS]; /* Connections kept for reuse */
+	int num_idle;
+	uint64_t no_keep_until; /* Workers closed a connection despite
+	                         * FCGI_KEEP_CONN: do not keep connections
+	                         * until this mg_get_current_time_ns() */
+	pthread_cond_t conn_cond; /* Signaled when a connection is released */
+};
+
+
+/* Buffered reading of FastCGI records */
+struct fastcgi_reader {
+	struct mg_connection *conn;
+	SOCKET sock;
+	int timeout_ms; /* Maximum time to wait for data */
+	int pos, len;   /* Unread data in buf */
+	char buf[MG_BUF_LEN];
+};
+
+
+/* Send SIGTERM to all worker processes of an application and remove its
+ * socket. The process ids are appended to stopped, the caller has to
+ * reap them with fastcgi_reap_workers after releasing fastcgi_mutex. */
+static void
+fastcgi_stop_workers(struct fastcgi_app *app,
+                     pid_t *stopped,
+                     int *num_stopped)
+{
+	int i;
+
+	for (i = 0; i < app->num_workers; i++) {
+		kill(app->pids[i], SIGTERM);
+		stopped[(*num_stopped)++] = app->pids[i];
+	}
+	app->num_workers = 0;
+
+	/* Connections to the old workers can not be reused */
+	for (i = 0; i < app->num_idle; i++) {
+		closesocket(app->idle[i]);
+	}
+	app->num_conns -= app->num_idle;
+	app->num_idle = 0;
+
+	if (app->sock_path[0] != 0) {
+		(void)remove(app->sock_path);
+		*strrchr(app->sock_path, '/') = '\0';
+		(void)rmdir(app->sock_path);
+		app->sock_path[0] = 0;
+	}
+}
+
+
+/* Wait for stopped worker processes. Workers get one second to exit
+ * after SIGTERM, before they are killed. Must be called without holding
+ * fastcgi_mutex. */
+static void
+fastcgi_reap_workers(pid_t *pids, int num)
+{
+	int i, n, running, status;
+
+	for (n = 0; n < 100; n++) {
+		running = 0;
+		for (i = 0; i < num; i++) {
+			if (pids[i] != 0) {
+				if (waitpid(pids[i], &status, WNOHANG) != 0) {
+					pids[i] = 0;
+				} else {
+					running = 1;
+				}
+			}
+		}
+		if (!running) {
+			return;
+		}
+		mg_sleep(10);
+	}
+	for (i = 0; i < num; i++) {
+		if (pids[i] != 0) {
+			kill(pids[i], SIGKILL);
+			(void)waitpid(pids[i], &status, 0);
+		}
+	}
+}
+
+
+/* Start the worker processes of an application, listening on a new
+ * socket in a new private directory in the temporary directory. Returns 0
+ * on error, workers started before the error keep running and must be
+ * stopped by the caller. */
+static int
+fastcgi_start_workers(struct mg_connection *conn,
+                      struct fastcgi_app *app,
+                      unsigned char cgi_config_idx)
+{
+	struct sockaddr_un sun;
+	struct cgi_environment blk;
+	struct vec var_vec;
+	char dir[UTF8_PATH_MAX], *p;
+	const char *s, *tmp;
+	int fdin[2], fdout[2], fderr[2];
+	int truncated, ok = 0;
+	SOCKET lsock;
+	int nul;
+	pid_t pid;
+
+	/* The workers are executed in the directory of the program, like CGI
+	 * programs */
+	(void)mg_snprintf(conn, &truncated, dir, sizeof(dir), "%s", app->prog);
+	if (truncated) {
+		mg_cry_internal(conn,
+		                "Error: CGI program \"%s\": Path too long",
+		                app->prog);
+		return 0;
+	}
+	if ((p = strrchr(dir, '/')) != NULL) {
+		*p++ = '\0';
+	} else {
+		dir[0] = '.';
+		dir[1] = '\0';
+		p = app->prog;
+	}
+
+	/* The socket is bound in a directory only accessible by this user,
+	 * so no other user can connect to it. mkdtemp creates it with mode
+	 * 0700. */
+	tmp = getenv("TMPDIR");
+	if ((tmp == NULL) || (tmp[0] == 0)) {
+		tmp = "/tmp";
+	}
+	(void)mg_snprintf(conn,
+	                  &truncated,
+	                  app->sock_path,
+	                  sizeof(app->sock_path),
+	                  "%s/civetweb-fcgi-XXXXXX/socket",
+	                  tmp);
+	if (truncated) {
+		mg_cry_internal(conn,
+		                "Error: FastCGI socket path too long in %s",
+		                tmp);
+		app->sock_path[0] = 0;
+		return 0;
+	}
+	*strrchr(app->sock_path, '/') = '\0';
+	if (mkdtemp(app->sock_path) == NULL) {
+		mg_cry_internal(conn,
+		                "Error: FastCGI program \"%s\": Can not create "
+		                "%s: %s",
+		                app->prog,
+		                app->sock_path,
+		                strerror(ERRNO));
+		app->sock_path[0] = 0;
+		return 0;
+	}
+	app->sock_path[strlen(app->sock_path)] = '/';
+
+	lsock = socket(AF_UNIX, SOCK_STREAM, 0);
+	nul = open("/dev/null", O_RDWR);
+	if ((lsock == INVALID_SOCKET) || (nul < 0)) {
+		mg_cry_internal(conn,
+		                "Error: FastCGI program \"%s\": %s",
+		                app->prog,
+		                strerror(ERRNO));
+		goto done;
+	}
+	set_close_on_exec(lsock, conn, NULL);
+	set_close_on_exec(nul, conn, NULL);
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	memcpy(sun.sun_path, app->sock_path, strlen(app->sock_path) + 1);
+	if ((bind(lsock, (struct sockaddr *)&sun, sizeof(sun)) != 0)
+	    || (listen(lsock, SOMAXCONN) != 0)) {
+		mg_cry_internal(conn,
+		                "Error: FastCGI program \"%s\": Can not listen on "
+		                "%s: %s",
+		                app->prog,
+		                app->sock_path,
+		                strerror(ERRNO));
+		goto done;
+	}
+
+	/* Request specific variables are sent with every request. The
+	 * workers get only the server wide ones. */
+	if (init_cgi_environment(conn, &blk) != 0) {
+		goto done;
+	}
+	addenv(&blk, "SERVER_SOFTWARE=CivetWeb/%s", mg_version());
+	addenv(&blk, "DOCUMENT_ROOT=%s", conn->dom_ctx->config[DOCUMENT_ROOT]);
+	if ((s = getenv("PATH")) != NULL) {
+		addenv(&blk, "PATH=%s", s);
+	}
+	if ((s = getenv("LD_LIBRARY_PATH")) != NULL) {
+		addenv(&blk, "LD_LIBRARY_PATH=%s", s);
+	}
+	if ((s = getenv("PERLLIB")) != NULL) {
+		addenv(&blk, "PERLLIB=%s", s);
+	}
+	s = conn->dom_ctx->config[CGI_ENVIRONMENT + cgi_config_idx];
+	while ((s = next_option(s, &var_vec, NULL)) != NULL) {
+		addenv(&blk, "%.*s", (int)var_vec.len, var_vec.ptr);
+	}
+	blk.var[blk.varused] = NULL;
+	blk.buf[blk.bufused] = '\0';
+
+	/* The listening socket is stdin of the workers, stdout and stderr
+	 * are not used. Output and errors are sent in FastCGI records. */
+	fdin[0] = fdin[1] = lsock;
+	fdout[0] = fdout[1] = fderr[0] = fderr[1] = nul;
+	ok = 1;
+	while (app->num_workers < app->max_conns) {
+		DEBUG_TRACE("FastCGI: spawn %s %s\n", dir, p);
+		pid = spawn_process(
+		    conn, p, blk.buf, blk.var, fdin, fdout, fderr, dir, cgi_config_idx);
+		if (pid == (pid_t)-1) {
+			mg_cry_internal(conn,
+			                "Error: FastCGI program \"%s\": Can not spawn "
+			                "process: %s",
+			                app->prog,
+			                strerror(ERRNO));
+			ok = 0;
+			break;
+		}
+		app->pids[app->num_workers++] = pid;
+	}
+	mg_free(blk.var);
+	mg_free(blk.buf);
+
+	/* New workers may support FCGI_KEEP_CONN */
+	app->no_keep_until = 0;
+
+done:
+	if (lsock != INVALID_SOCKET) {
+		closesocket(lsock);
+	}
+	if (nul >= 0) {
+		close(nul);
+	}
+	app->generation++;
+	return ok;
+}
+
+
+/* Find the workers of a CGI program and start them if they are not
+ * running. Returns NULL if they can not be started. */
+static struct fastcgi_app *
+fastcgi_get_app(struct mg_connection *conn,
+                const char *prog,
+                unsigned char cgi_config_idx,
+                int workers)
+{
+	struct mg_context *ctx = conn->phys_ctx;
+	struct fastcgi_app *app;
+	pid_t stopped[FASTCGI_MAX_WORKERS];
+	int num_stopped = 0;
+
+	pthread_mutex_lock(&ctx->fastcgi_mutex);
+	for (app = ctx->fastcgi_apps; app != NULL; app = app->next) {
+		if ((app->dom_ctx == conn->dom_ctx) && !strcmp(app->prog, prog)) {
+			break;
+		}
+	}
+
+	if (app == NULL) {
+		app = (struct fastcgi_app *)mg_calloc_ctx(1, sizeof(*app), ctx);
+		if (app != NULL) {
+			app->prog = mg_strdup_ctx(prog, ctx);
+		}
+		if ((app == NULL) || (app->prog == NULL)
+		    || (pthread_cond_init(&app->conn_cond, NULL) != 0)) {
+			pthread_mutex_unlock(&ctx->fastcgi_mutex);
+			if (app != NULL) {
+				mg_free(app->prog);
+				mg_free(app);
+			}
+			return NULL;
+		}
+		app->dom_ctx = conn->dom_ctx;
+		app->max_conns = workers;
+		app->next = ctx->fastcgi_apps;
+		ctx->fastcgi_apps = app;
+	}
+
+	if ((app->num_workers == 0)
+	    && !fastcgi_start_workers(conn, app, cgi_config_idx)) {
+		fastcgi_stop_workers(app, stopped, &num_stopped);
+		app = NULL;
+	}
+	pthread_mutex_unlock(&ctx->fastcgi_mutex);
+	fastcgi_reap_workers(stopped, num_stopped);
+
+	return app;
+}
+
+
+/* Get a connection to a worker: a kept connection, or a new one if not
+ * all workers have one. Otherwise, wait until a connection is released.
+ * If no worker accepts a new connection, the workers are started again.
+ * Returns INVALID_SOCKET on error. */
+static SOCKET
+fastcgi_connect(struct mg_connection *conn,
+                struct fastcgi_app *app,
+                unsigned char cgi_config_idx,
+                int *reused)
+{
+	struct mg_context *ctx = conn->phys_ctx;
+	struct sockaddr_un sun;
+	struct pollfd pfd;
+	unsigned generation;
+	int restarted = 0;
+	SOCKET sock;
+	pid_t stopped[2 * FASTCGI_MAX_WORKERS]; /* Old and failed new workers */
+	int num_stopped = 0;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+
+	pthread_mutex_lock(&ctx->fastcgi_mutex);
+	for (;;) {
+		while (app->num_idle > 0) {
+			sock = app->idle[--app->num_idle];
+
+			/* A kept connection is readable, if the worker closed it */
+			pfd.fd = sock;
+			pfd.events = POLLIN;
+			pfd.revents = 0;
+			if (poll(&pfd, 1, 0) == 0) {
+				pthread_mutex_unlock(&ctx->fastcgi_mutex);
+				fastcgi_reap_workers(stopped, num_stopped);
+				*reused = 1;
+				return sock;
+			}
+			closesocket(sock);
+			app->num_conns--;
+		}
+
+		if ((app->num_conns < app->max_conns) && (app->num_workers > 0)) {
+			app->num_conns++;
+			generation = app->generation;
+			memcpy(sun.sun_path, app->sock_path, sizeof(sun.sun_path));
+			pthread_mutex_unlock(&ctx->fastcgi_mutex);
+
+			sock = socket(AF_UNIX, SOCK_STREAM, 0);
+			if (sock != INVALID_SOCKET) {
+				set_close_on_exec(sock, conn, NULL);
+				if (connect(sock, (struct sockaddr *)&sun, sizeof(sun)) == 0) {
+					set_non_blocking_mode(sock);
+					fastcgi_reap_workers(stopped, num_stopped);
+					*reused = 0;
+					return sock;
+				}
+				closesocket(sock);
+			}
+
+			pthread_mutex_lock(&ctx->fastcgi_mutex);
+			app->num_conns--;
+			pthread_cond_signal(&app->conn_cond);
+			if (restarted) {
+				break;
+			}
+			if (generation == app->generation) {
+				/* All workers exited */
+				mg_cry_internal(conn,
+				                "FastCGI program \"%s\" is not running, "
+				                "starting it again",
+				                app->prog);
+				fastcgi_stop_workers(app, stopped, &num_stopped);
+				if (!fastcgi_start_workers(conn, app, cgi_config_idx)) {
+					fastcgi_stop_workers(app, stopped, &num_stopped);
+					break;
+				}
+			}
+			restarted = 1;
+			continue;
+		}
+
+		if ((app->num_workers == 0)
+		    || !STOP_FLAG_IS_ZERO(&ctx->stop_flag)) {
+			/* Let the next waiting request see this as well */
+			pthread_cond_signal(&app->conn_cond);
+			break;
+		}
+		pthread_cond_wait(&app->conn_cond, &ctx->fastcgi_mutex);
+	}
+	pthread_mutex_unlock(&ctx->fastcgi_mutex);
+	fastcgi_reap_workers(stopped, num_stopped);
+
+	return INVALID_SOCKET;
+}
+
+
+/* Return a connection to the pool, or close it if it can not be reused
+ * for the next request. */
+static void
+fastcgi_release(struct mg_context *ctx,
+                struct fastcgi_app *app,
+                SOCKET sock,
+                int keep)
+{
+	pthread_mutex_lock(&ctx->fastcgi_mutex);
+	if (keep && (app->num_workers > 0)
+	    && (mg_get_current_time_ns() >= app->no_keep_until)
+	    && (app->num_idle < FASTCGI_MAX_WORKERS)) {
+		app->idle[app->num_idle++] = sock;
+	} else {
+		closesocket(sock);
+		app->num_conns--;
+	}
+	pthread_cond_signal(&app->conn_cond);
+	pthread_mutex_unlock(&ctx->fastcgi_mutex);
+}
+
+
+/* Stop the workers of all applications, when the server is stopped. */
+static void
+fastcgi_stop_all(struct mg_context *ctx)
+{
+	struct fastcgi_app *app;
+	pid_t stopped[FASTCGI_MAX_WORKERS];
+	int num_stopped;
+
+	while ((app = ctx->fastcgi_apps) != NULL) {
+		ctx->fastcgi_apps = app->next;
+		num_stopped = 0;
+		fastcgi_stop_workers(app, stopped, &num_stopped);
+		fastcgi_reap_workers(stopped, num_stopped);
+		(void)pthread_cond_destroy(&app->conn_cond);
+		mg_free(app->prog);
+		mg_free(app);
+	}
+}
+
+
+/* Make unread data available in the buffer of the reader.
+ * Returns 0 on timeout, error or if the worker closed the connection. */
+static int
+fastcgi_fill(struct fastcgi_reader *r)
+{
+	struct mg_pollfd pfd;
+	int n;
+
+	if (r->pos < r->len) {
+		return 1;
+	}
+	for (;;) {
+		n = (int)recv(r->sock, r->buf, sizeof(r->buf), 0);
+		if (n > 0) {
+			r->pos = 0;
+			r->len = n;
+			return 1;
+		}
+		if ((n == 0) || !ERROR_TRY_AGAIN(ERRNO)) {
+			return 0;
+		}
+		pfd.fd = r->sock;
+		pfd.events = POLLIN;
+		if (mg_poll(&pfd, 1, r->timeout_ms, &r->conn->phys_ctx->stop_flag)
+		    <= 0) {
+			return 0;
+		}
+	}
+}
+
+
+/* Read len bytes into dst, or skip them if dst is NULL.
+ * Returns 0 on error. */
+static int
+fastcgi_read(struct fastcgi_reader *r, unsigned char *dst, size_t len)
+{
+	size_t n;
+
+	while (len > 0) {
+		if (!fastcgi_fill(r)) {
+			return 0;
+		}
+		n = (size_t)(r->len - r->pos);
+		if (n > len) {
+			n = len;
+		}
+		if (dst != NULL) {
+			memcpy(dst, r->buf + r->pos, n);
+			dst += n;
+		}
+		r->pos += (int)n;
+		len -= n;
+	}
+	return 1;
+}
+
+
+static void
+fastcgi_put_header(unsigned char *p, int type, size_t content_len)
+{
+	p[0] = FCGI_VERSION_1;
+	p[1] = (unsigned char)type;
+	p[2] = (unsigned char)(FCGI_REQUEST_ID >> 8);
+	p[3] = (unsigned char)(FCGI_REQUEST_ID & 0xff);
+	p[4] = (unsigned char)(content_len >> 8);
+	p[5] = (unsigned char)(content_len & 0xff);
+	p[6] = 0; /* No padding */
+	p[7] = 0;
+}
+
+
+/* Length of a name or value in a name-value pair of FCGI_PARAMS */
+static unsigned char *
+fastcgi_put_length(unsigned char *p, size_t len)
+{
+	if (len < 128) {
+		*p++ = (unsigned char)len;
+	} else {
+		*p++ = (unsigned char)(((len >> 24) & 0x7f) | 0x80);
+		*p++ = (unsigned char)((len >> 16) & 0xff);
+		*p++ = (unsigned char)((len >> 8) & 0xff);
+		*p++ = (unsigned char)(len & 0xff);
+	}
+	return p;
+}
+
+
+/* Send FCGI_BEGIN_REQUEST and the CGI environment as FCGI_PARAMS stream.
+ * For requests without body, the empty FCGI_STDIN stream is sent as well.
+ * Returns 0 on error. */
+static int
+fastcgi_send_params(struct mg_connection *conn,
+                    SOCKET sock,
+                    const struct cgi_environment *env,
+                    int end_stdin)
+{
+	unsigned char *params, *msg, *p;
+	size_t i, name_len, value_len, params_len, msg_len, ofs, n;
+	const char *eq;
+	int ok;
+
+	/* Encode all name-value pairs as one stream */
+	params_len = 0;
+	for (i = 0; i < env->varused; i++) {
+		params_len += strlen(env->var[i]) + 8;
+	}
+	params = (unsigned char *)mg_malloc_ctx(params_len + 1, conn->phys_ctx);
+	if (params == NULL) {
+		return 0;
+	}
+	p = params;
+	for (i = 0; i < env->varused; i++) {
+		if ((eq = strchr(env->var[i], '=')) == NULL) {
+			continue;
+		}
+		name_len = (size_t)(eq - env->var[i]);
+		value_len = strlen(eq + 1);
+		p = fastcgi_put_length(p, name_len);
+		p = fastcgi_put_length(p, value_len);
+		memcpy(p, env->var[i], name_len);
+		p += name_len;
+		memcpy(p, eq + 1, value_len);
+		p += value_len;
+	}
+	params_len = (size_t)(p - params);
+
+	/* FCGI_BEGIN_REQUEST, the stream split into records, and an empty
+	 * record as end of the stream, maybe followed by an empty FCGI_STDIN */
+	msg_len = 2 * FCGI_HEADER_LEN + params_len
+	          + (params_len / FCGI_MAX_CONTENT_LEN + 3) * FCGI_HEADER_LEN;
+	msg = (unsigned char *)mg_malloc_ctx(msg_len, conn->phys_ctx);
+	if (msg == NULL) {
+		mg_free(params);
+		return 0;
+	}
+	p = msg;
+	fastcgi_put_header(p, FCGI_BEGIN_REQUEST, 8);
+	p += FCGI_HEADER_LEN;
+	memset(p, 0, 8);
+	p[1] = FCGI_RESPONDER;
+	p[2] = FCGI_KEEP_CONN;
+	p += 8;
+	for (ofs = 0; ofs < params_len; ofs += n) {
+		n = params_len - ofs;
+		if (n > FCGI_MAX_CONTENT_LEN) {
+			n = FCGI_MAX_CONTENT_LEN;
+		}
+		fastcgi_put_header(p, FCGI_PARAMS, n);
+		memcpy(p + FCGI_HEADER_LEN, params + ofs, n);
+		p += FCGI_HEADER_LEN + n;
+	}
+	fastcgi_put_header(p, FCGI_PARAMS, 0);
+	p += FCGI_HEADER_LEN;
+	if (end_stdin) {
+		fastcgi_put_header(p, FCGI_STDIN, 0);
+		p += FCGI_HEADER_LEN;
+	}
+
+	msg_len = (size_t)(p - msg);
+	ok = (push_all(conn->phys_ctx, NULL, sock, NULL, (char *)msg, (int)msg_len)
+	      == (int)msg_len);
+	mg_free(msg);
+	mg_free(params);
+	return ok;
+}
+
+
+/* Send the request body as FCGI_STDIN stream, like forward_body_data.
+ * Returns 0 on error, after an error response has been sent. */
+static int
+fastcgi_send_body(struct mg_connection *conn, SOCKET sock)
+{
+	char buf[MG_BUF_LEN];
+	const char *expect;
+	int nread;
+
+	expect = mg_get_header(conn, "Expect");
+	if ((expect != NULL) && (mg_strcasecmp(expect, "100-continue") != 0)) {
+		mg_send_http_error(conn, 417, "Error: Can not fulfill expectation");
+		return 0;
+	}
+	if (expect != NULL) {
+		(void)mg_printf(conn, "%s", "HTTP/1.1 100 Continue\r\n\r\n");
+	}
+
+	for (;;) {
+		nread =
+		    mg_read(conn, buf + FCGI_HEADER_LEN, sizeof(buf) - FCGI_HEADER_LEN);
+		if (nread < 0) {
+			mg_send_http_error(conn, 500, "%s", "");
+			return 0;
+		}
+
+		/* The last, empty record is the end of the stream */
+		fastcgi_put_header((unsigned char *)buf, FCGI_STDIN, (size_t)nread);
+		if (push_all(
+		        conn->phys_ctx, NULL, sock, NULL, buf, nread + FCGI_HEADER_LEN)
+		    != nread + FCGI_HEADER_LEN) {
+			mg_send_http_error(conn, 500, "%s", "");
+			return 0;
+		}
+		if (nread == 0) {
+			return 1;
+		}
+	}
+}
+
+
+/* Send a request and read the header of the first record of the
+ * response. Returns 1 on success, 0 if the worker did not respond, and
+ * -1 if the request body could not be sent (an error response has been
+ * sent then). */
+static int
+fastcgi_send_request(struct mg_connection *conn,
+                     struct fastcgi_reader *r,
+                     const struct cgi_environment *env,
+                     unsigned char *head)
+{
+	int has_body = ((conn->content_len != 0) || conn->is_chunked);
+
+	DEBUG_TRACE("FastCGI: send request, body: %d", has_body);
+	if (!fastcgi_send_params(conn, r->sock, env, !has_body)) {
+		return 0;
+	}
+	if (has_body && !fastcgi_send_body(conn, r->sock)) {
+		return -1;
+	}
+
+	DEBUG_TRACE("FastCGI: %s", "wait for response");
+	r->pos = r->len = 0;
+	if (!fastcgi_read(r, head, FCGI_HEADER_LEN)
+	    || (head[0] != FCGI_VERSION_1)) {
+		return 0;
+	}
+	return 1;
+}
+
+
+/* Handle a CGI request with the persistent workers of the CGI program, if
+ * cgi_fastcgi_workers is set for it. Returns 0 if the request has not been
+ * handled and must be handled by a new CGI process. */
+static int
+handle_fastcgi_request(struct mg_connection *conn,
+                       const char *prog,
+                       unsigned char cgi_config_idx)
+{
+	struct fastcgi_app *app;
+	struct fastcgi_reader *r = NULL;
+	struct cgi_environment blk;
+	unsigned char head[FCGI_HEADER_LEN], end_body[8];
+	const char *s;
+	char *buf = NULL;
+	size_t content_len, n;
+	int workers, buflen, data_len = 0, headers_len = 0;
+	int done = 0; /* 1: FCGI_END_REQUEST received, -1: error */
+	int malformed = 0, keep = 0, reused, res = 0;
+	SOCKET sock;
+
+	s = conn->dom_ctx->config[CGI_FASTCGI_WORKERS + cgi_config_idx];
+	workers = (s != NULL) ? atoi(s) : 0;
+	if (workers <= 0) {
+		return 0;
+	}
+	if (workers > FASTCGI_MAX_WORKERS) {
+		workers = FASTCGI_MAX_WORKERS;
+	}
+
+	app = fastcgi_get_app(conn, prog, cgi_config_idx, workers);
+	if (app == NULL) {
+		return 0;
+	}
+	sock = fastcgi_connect(conn, app, cgi_config_idx, &reused);
+	if (sock == INVALID_SOCKET) {
+		return 0;
+	}
+
+	/* From here on, the request is handled by the workers */
+	blk.buf = NULL;
+	blk.var = NULL;
+	buflen = conn->phys_ctx->max_request_size;
+	buf = (char *)mg_malloc_ctx((size_t)buflen, conn->phys_ctx);
+	r = (struct fastcgi_reader *)mg_malloc_ctx(sizeof(*r), conn->phys_ctx);
+	if ((buf == NULL) || (r == NULL)
+	    || (prepare_cgi_environment(conn, prog, &blk, cgi_config_idx) != 0)) {
+		mg_send_http_error(conn, 500, "Error: Out of memory [%s]", prog);
+		keep = 1; /* Nothing has been sent */
+		goto done;
+	}
+
+	/* The CGI timeout is the maximum time without any data from the
+	 * worker, not the maximum time for the whole request. */
+	s = conn->dom_ctx->config[REQUEST_TIMEOUT];
+#if defined(USE_TIMERS)
+	if (conn->dom_ctx->config[CGI_TIMEOUT + cgi_config_idx] != NULL) {
+		s = conn->dom_ctx->config[CGI_TIMEOUT + cgi_config_idx];
+	}
+#endif
+	r->conn = conn;
+	r->timeout_ms = atoi(s ? s : config_options[REQUEST_TIMEOUT].default_value);
+	if (r->timeout_ms <= 0) {
+		r->timeout_ms = atoi(config_options[REQUEST_TIMEOUT].default_value);
+	}
+
+	for (;;) {
+		r->sock = sock;
+		res = fastcgi_send_request(conn, r, &blk, head);
+		if ((res != 0) || !reused || conn->content_len != 0
+		    || conn->is_chunked) {
+			break;
+		}
+
+		/* The worker closed the kept connection after the previous
+		 * request, so it may not support FCGI_KEEP_CONN, or it exits
+		 * after some requests. Do not keep connections for a while.
+		 * Requests without body can be sent again. */
+		pthread_mutex_lock(&conn->phys_ctx->fastcgi_mutex);
+		app->no_keep_until =
+		    mg_get_current_time_ns()
+		    + (uint64_t)FASTCGI_NO_KEEP_SECONDS * 1000000000;
+		pthread_mutex_unlock(&conn->phys_ctx->fastcgi_mutex);
+		fastcgi_release(conn->phys_ctx, app, sock, 0);
+
+		sock = fastcgi_connect(conn, app, cgi_config_idx, &reused);
+		if (sock == INVALID_SOCKET) {
+			break;
+		}
+	}
+
+	if (sock == INVALID_SOCKET) {
+		mg_send_http_error(conn,
+		                   500,
+		                   "Error: CGI program \"%s\" failed.",
+		                   prog);
+		goto cleanup;
+	}
+	if (res < 0) {
+		mg_cry_internal(
+		    conn,
+		    "Error: FastCGI program \"%s\": Forward body data failed",
+		    prog);
+		goto done;
+	}
+
+	/* Read records until FCGI_END_REQUEST. The response headers are
+	 * collected in buf, like for CGI programs. */
+	while (res > 0) {
+		content_len = ((size_t)head[4] << 8) | head[5];
+
+		switch ((((unsigned)head[2] << 8) | head[3]) == FCGI_REQUEST_ID
+		            ? head[1]
+		            : 0 /* Management record */) {
+		case FCGI_STDOUT:
+			while (content_len > 0) {
+				if (!fastcgi_fill(r)) {
+					break;
+				}
+				n = (size_t)(r->len - r->pos);
+				if (n > content_len) {
+					n = content_len;
+				}
+				if (headers_len > 0) {
+					/* Response body */
+					if (mg_write(conn, r->buf + r->pos, n) != (int)n) {
+						/* Client closed the connection */
+						break;
+					}
+				} else {
+					if (n > (size_t)(buflen - data_len)) {
+						n = (size_t)(buflen - data_len);
+					}
+					memcpy(buf + data_len, r->buf + r->pos, n);
+					data_len += (int)n;
+					headers_len = get_http_header_len(buf, data_len);
+					if ((headers_len < 0)
+					    || ((headers_len == 0) && (data_len == buflen))) {
+						/* Malformed or too big */
+						headers_len = 0;
+						malformed = 1;
+						break;
+					}
+					if (headers_len > 0) {
+						send_cgi_response_headers(conn, buf, headers_len);
+						mg_write(conn,
+						         buf + headers_len,
+						         (size_t)(data_len - headers_len));
+					}
+				}
+				r->pos += (int)n;
+				content_len -= n;
+			}
+			if ((content_len > 0) || !fastcgi_read(r, NULL, head[6])) {
+				done = -1;
+			}
+			break;
+
+		case FCGI_STDERR:
+			/* Write error messages to the internal log */
+			while (content_len > 0) {
+				if (!fastcgi_fill(r)) {
+					break;
+				}
+				n = (size_t)(r->len - r->pos);
+				if (n > content_len) {
+					n = content_len;
+				}
+				mg_cry_internal(conn,
+				                "Error: FastCGI program \"%s\" sent error "
+				                "message: [%.*s]",
+				                prog,
+				                (int)n,
+				                r->buf + r->pos);
+				r->pos += (int)n;
+				content_len -= n;
+			}
+			if ((content_len > 0) || !fastcgi_read(r, NULL, head[6])) {
+				done = -1;
+			}
+			break;
+
+		case FCGI_END_REQUEST:
+			if ((content_len != 8) || !fastcgi_read(r, end_body, 8)
+			    || !fastcgi_read(r, NULL, head[6])) {
+				done = -1;
+			} else if (end_body[4] != FCGI_REQUEST_COMPLETE) {
+				mg_cry_internal(conn,
+				                "Error: FastCGI program \"%s\" rejected "
+				                "request: status %u",
+				                prog,
+				                (unsigned)end_body[4]);
+				done = -1;
+			} else {
+				/* Reuse the connection, if nothing else has been sent */
+				done = 1;
+				keep = (r->pos == r->len);
+			}
+			break;
+
+		default:
+			if (!fastcgi_read(r, NULL, content_len + head[6])) {
+				done = -1;
+			}
+			break;
+		}
+
+		if (done) {
+			break;
+		}
+		if (!fastcgi_read(r, head, FCGI_HEADER_LEN)
+		    || (head[0] != FCGI_VERSION_1)) {
+			res = 0;
+		}
+	}
+	DEBUG_TRACE("FastCGI: %s", "all data sent");
+
+	if (res == 0) {
+		mg_cry_internal(conn,
+		                "Error: FastCGI program \"%s\": No response",
+		                prog);
+	}
+
+	if (headers_len == 0) {
+		if ((done == 1) || malformed) {
+			mg_cry_internal(conn,
+			                "Error: CGI program sent malformed or too big "
+			                "(>%u bytes) HTTP headers: [%.*s]",
+			                (unsigned)buflen,
+			                data_len,
+			                buf);
+			mg_send_http_error(conn,
+			                   500,
+			                   "Error: CGI program sent malformed or too big "
+			                   "(>%u bytes) HTTP headers: [%.*s]",
+			                   (unsigned)buflen,
+			                   data_len,
+			                   buf);
+		} else {
+			mg_send_http_error(conn,
+			                   500,
+			                   "Error: CGI program \"%s\" failed.",
+			                   prog);
+		}
+	} else if (done != 1) {
+		/* The response is incomplete */
+		conn->must_close = 1;
+	}
+
+done:
+	fastcgi_release(conn->phys_ctx, app, sock, keep);
+
+cleanup:
+	mg_free(blk.var);
+	mg_free(blk.buf);
+	mg_free(r);
+	mg_free(buf);
+	return 1;
+}
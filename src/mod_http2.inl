@@ -616,6 +616,115 @@ uint8_t hpack_huff_start_index[] = {0,   10,  36,  68,  0,   74,  79, 82,  84,
                                     145, 174, 186, 190, 205, 224, 0,  253, 0};
 
 
+/* Huffman decoder state machine.
+ * Every state is an inner node of the Huffman code tree (there are exactly
+ * 256 of them, state 0 is the root). For every state and every 4 bit input
+ * nibble, the table holds the follow-up state and, if a code was completed
+ * within the nibble, the decoded symbol. Since the shortest code has 5 bits,
+ * one nibble completes at most one symbol. Input can be decoded one byte
+ * (two table lookups) at a time, instead of bit by bit.
+ * Built once by mg_init_library. */
+#define HPACK_HUFF_SYM (1)    /* a symbol has been decoded */
+#define HPACK_HUFF_ACCEPT (2) /* the input may end in the next state */
+#define HPACK_HUFF_FAIL (4)   /* EOS symbol or invalid code */
+
+struct hpack_huff_fsm_entry {
+	uint8_t state;
+	uint8_t flags;
+	uint8_t sym;
+};
+
+static struct hpack_huff_fsm_entry hpack_huff_fsm[256][16];
+static int hpack_huff_fsm_ready = 0;
+
+/* Huffman code of every symbol, indexed by symbol (the encoder direction
+ * of hpack_huff_dec). Built once by hpack_huff_fsm_init. */
+static uint32_t hpack_huff_enc_code[256];
+static uint8_t hpack_huff_enc_bits[256];
+
+
+static void
+hpack_huff_fsm_init(void)
+{
+	/* Huffman tree: a child >= 0 is an inner node, a child < 0 is the leaf
+	 * for symbol (-child - 1). 0 is never a child (root). */
+	int16_t child[256][2];
+	uint8_t accept[256];
+	int nodes = 1;
+	int n, s, v, b;
+
+	if (hpack_huff_fsm_ready) {
+		return;
+	}
+
+	memset(child, 0, sizeof(child));
+	memset(accept, 0, sizeof(accept));
+
+	for (n = 0; n < 257; n++) {
+		/* hpack_huff_dec[256] is EOS, its "decoded" value is truncated */
+		int sym = (n == 256) ? 256 : hpack_huff_dec[n].decoded;
+		int node = 0;
+		if (n < 256) {
+			hpack_huff_enc_code[sym] = hpack_huff_dec[n].encoded;
+			hpack_huff_enc_bits[sym] = hpack_huff_dec[n].bitcount;
+		}
+		for (b = hpack_huff_dec[n].bitcount - 1; b >= 0; b--) {
+			int bit = (int)((hpack_huff_dec[n].encoded >> b) & 1u);
+			if (b == 0) {
+				child[node][bit] = (int16_t)(-sym - 1);
+			} else {
+				if (child[node][bit] == 0) {
+					if (nodes >= 256) {
+						/* Not a valid Huffman code table */
+						return;
+					}
+					child[node][bit] = (int16_t)nodes++;
+				}
+				node = child[node][bit];
+			}
+		}
+	}
+
+	/* Padding must be a prefix of the EOS code (all 1 bits) and shorter
+	 * than 8 bits. See https://tools.ietf.org/html/rfc7541#section-5.2 */
+	accept[0] = 1;
+	for (n = 0, s = 0; n < 7; n++) {
+		s = child[s][1];
+		accept[s] = 1;
+	}
+
+	for (s = 0; s < 256; s++) {
+		for (v = 0; v < 16; v++) {
+			struct hpack_huff_fsm_entry *e = &hpack_huff_fsm[s][v];
+			int node = s;
+			e->flags = 0;
+			e->sym = 0;
+			for (b = 3; b >= 0; b--) {
+				int c = child[node][(v >> b) & 1];
+				if ((c == 0) || (c == -257)) {
+					e->flags = HPACK_HUFF_FAIL;
+					node = 0;
+					break;
+				}
+				if (c < 0) {
+					e->sym = (uint8_t)(-c - 1);
+					e->flags |= HPACK_HUFF_SYM;
+					node = 0;
+				} else {
+					node = c;
+				}
+			}
+			e->state = (uint8_t)node;
+			if (accept[node] && !(e->flags & HPACK_HUFF_FAIL)) {
+				e->flags |= HPACK_HUFF_ACCEPT;
+			}
+		}
+	}
+
+	hpack_huff_fsm_ready = 1;
+}
+
+
 /* Function to decode an integer from a HPACK encoded block */
 /* Integers have a variable size encoding, according to the RFC.
  * The integer starts at index *i, idx_mask masks the available bits in
@@ -651,24 +760,25 @@ hpack_getnum(const uint8_t *buf,
 /* Strings have a variable size and can be either encoded directly (8 bits
  * per char), or using huffman encoding (variable bits per char).
  * The string starts at index *i. This index is advanced until the end of
- * the encoded string.
+ * the encoded string. The string must end before buf_len. In case of an
+ * error, the function returns NULL.
  */
 static char *
-hpack_decode(const uint8_t *buf, int *i, struct mg_context *ctx)
+hpack_decode(const uint8_t *buf, int *i, int buf_len, struct mg_context *ctx)
 {
 	uint64_t byte_len64;
 	int byte_len;
-	int bit_len;
 	uint8_t is_huff = ((buf[*i] & 0x80) == 0x80);
 
 	/* Get length of string in bytes */
 	byte_len64 = hpack_getnum(buf, i, 0x7f, ctx);
-	if (byte_len64 > 1024) {
-		/* TODO */
+	if ((*i > buf_len) || (byte_len64 > (uint64_t)(buf_len - *i))) {
+		/* String exceeds the header block */
+		*i = buf_len;
 		return NULL;
 	}
+	/* byte_len is bounded by the header block (HTTP2_MAX_HEADER_BLOCK) */
 	byte_len = (int)byte_len64;
-	bit_len = byte_len * 8;
 
 	/* Now read the string */
 	if (!is_huff) {
@@ -682,135 +792,149 @@ hpack_decode(const uint8_t *buf, int *i, struct mg_context *ctx)
 		return result;
 
 	} else {
-		/* Huffman encoded: need to decode bitwise */
-		const uint8_t *pData =
-		    buf + (*i);           /* begin pointer of bit input string */
-		int bitRead = 0;          /* number of encoded bits read */
-		uint32_t bytesStored = 0; /* number of decoded bytes stored */
-		uint8_t str[2048];        /* storage buffer for decoded string */
-
-		for (;;) {
-			uint32_t accu = 0; /* accu register: collect bits */
-			uint8_t bc = 0;    /* number of bits collected */
-			int n;
-
-			/* Collect bits in this loop, until we have a valid huff code in
-			 * accu */
-			do {
-				accu <<= 1;
-				accu |= (pData[bitRead / 8] >> (7 - (bitRead & 7))) & 1;
-				bitRead++;
-				bc++;
-				if (bitRead > bit_len) {
-					/* We used all bits. Return the decoded string. */
-					str[bytesStored] = 0; /* Terminate string */
-					(*i) += byte_len;     /* Advance parsing index */
-					return mg_strdup_ctx((char *)str,
-					                     ctx); /* Return a string copy */
-				}
-			} while ((bc < 5) || (accu > hpack_huff_end_code[bc - 5]));
+		/* Huffman encoded: decode a nibble at a time using the state
+		 * machine. Every code has at least 5 bits, so the decoded
+		 * string has at most byte_len * 8 / 5 characters. */
+		const uint8_t *pData = buf + (*i);
+		char *result;
+		char *out;
+		uint8_t state = 0;
+		uint8_t flags = HPACK_HUFF_ACCEPT;
+		int n;
+
+		(*i) += byte_len; /* Advance parsing index */
+
+		if (!hpack_huff_fsm_ready) {
+			return NULL;
+		}
+		result = (char *)mg_malloc_ctx((byte_len * 8) / 5 + 1, ctx);
+		if (!result) {
+			return NULL;
+		}
+		out = result;
 
-			/* Find matching code in huffman encoding table */
-			for (n = hpack_huff_start_index[bc - 5]; n < 256; n++) {
-				if (accu == hpack_huff_dec[n].encoded) {
-					str[bytesStored] = hpack_huff_dec[n].decoded;
-					bytesStored++;
-					break;
+		for (n = 0; n < byte_len; n++) {
+			const struct hpack_huff_fsm_entry *e;
+
+			e = &hpack_huff_fsm[state][pData[n] >> 4];
+			if (!(e->flags & HPACK_HUFF_FAIL)) {
+				if (e->flags & HPACK_HUFF_SYM) {
+					*out++ = (char)e->sym;
 				}
+				e = &hpack_huff_fsm[e->state][pData[n] & 0x0f];
+				if (e->flags & HPACK_HUFF_SYM) {
+					*out++ = (char)e->sym;
+				}
+			}
+			flags = e->flags;
+			if (flags & HPACK_HUFF_FAIL) {
+				break;
 			}
+			state = e->state;
+		}
+
+		if (!(flags & HPACK_HUFF_ACCEPT)) {
+			/* EOS symbol, or padding is not a prefix of EOS */
+			mg_free(result);
+			return NULL;
 		}
+		*out = 0;
+		return result;
 	}
 }
 
 
-static void
-append_bits(uint8_t *target,
-            uint32_t offset,
-            uint32_t value,
-            uint8_t value_bits)
+/* Function to encode an integer for a HPACK encoded block */
+/* The integer uses the lowest prefix_bits bits of the first byte, the
+ * higher bits of this byte are set to flags. See
+ * https://tools.ietf.org/html/rfc7541#section-5.1
+ * Return: number of bytes written (at most 6).
+ */
+static size_t
+hpack_putnum(uint8_t *buf, uint8_t flags, uint8_t prefix_bits, uint32_t num)
 {
-	uint32_t offset_bytes = offset / 8;
-	uint32_t offset_bits = offset % 8;
-	uint32_t remaining_bits, ac;
-
-	value &= ~(0xFFFFFFFF << value_bits);
-
-	remaining_bits = 8 - offset_bits;
+	uint32_t max_prefix = (1u << prefix_bits) - 1u;
+	size_t len = 1;
 
-	if (value_bits <= remaining_bits) {
-		ac = value << (remaining_bits - value_bits);
-		target[offset_bytes] |= ac;
-		return;
+	if (num < max_prefix) {
+		buf[0] = (uint8_t)(flags | num);
+		return 1;
 	}
-
-	ac = value >> (value_bits - remaining_bits);
-	target[offset_bytes] |= ac;
-	append_bits(target,
-	            offset + remaining_bits,
-	            value,
-	            value_bits - remaining_bits);
+	buf[0] = (uint8_t)(flags | max_prefix);
+	num -= max_prefix;
+	while (num >= 0x80u) {
+		buf[len++] = (uint8_t)((num & 0x7Fu) | 0x80u);
+		num >>= 7;
+	}
+	buf[len++] = (uint8_t)num;
+	return len;
 }
 
 
-static int
-hpack_encode(uint8_t *store, const char *load, int lower)
+/* Function to encode a string for a HPACK encoded block */
+/* The string is Huffman encoded, if this is shorter than sending it
+ * directly. Header names must be sent in lower case (lower = 1).
+ * buf must have room for strlen(str) + 6 bytes.
+ * Return: number of bytes written.
+ */
+static size_t
+hpack_putstr(uint8_t *buf, const char *str, int lower)
 {
-	uint32_t nohuff_len = strlen(load);
-
-	uint32_t len_bits = 0;
-	uint32_t len_bytes;
-	uint32_t spare_bits;
-	uint32_t i;
-
-	memset(store, 0, nohuff_len + 1);
+	size_t str_len = strlen(str);
+	uint64_t huff_bits = 0;
+	size_t huff_len, len, i;
 
-	for (i = 0; i < nohuff_len; i++) {
-		uint8_t b = (uint8_t)((char)(lower ? tolower(load[i]) : load[i]));
-		int idx;
-
-		for (idx = 0; idx <= 255; idx++) {
-			if (hpack_huff_dec[idx].decoded == b) {
-				append_bits((uint8_t *)store + 1,
-				            len_bits,
-				            hpack_huff_dec[idx].encoded,
-				            hpack_huff_dec[idx].bitcount);
-				len_bits += hpack_huff_dec[idx].bitcount;
-				break;
-			}
+	for (i = 0; i < str_len; i++) {
+		uint8_t c = (uint8_t)str[i];
+		if (lower) {
+			c = (uint8_t)tolower(c);
 		}
+		huff_bits += hpack_huff_enc_bits[c];
 	}
-
-	len_bytes = (len_bits + 7) / 8;
-	spare_bits = len_bytes * 8 - len_bits;
-	if (spare_bits) {
-		append_bits((uint8_t *)store + 1, len_bits, 0xFFFFFFFF, spare_bits);
-	}
-
-	if (len_bytes >= 127) {
-		// TODO: Shift string and encode len in more bytes
-		return 0;
+	huff_len = (size_t)((huff_bits + 7) / 8);
+
+	if (huff_len >= str_len) {
+		/* Send as it is */
+		len = hpack_putnum(buf, 0x00, 7, (uint32_t)str_len);
+		for (i = 0; i < str_len; i++) {
+			buf[len++] =
+			    (uint8_t)(lower ? tolower((uint8_t)str[i]) : str[i]);
+		}
+		return len;
 	}
-	*store = 0x80 + (uint8_t)len_bytes;
 
-	if ((len_bytes >= nohuff_len) && (0)) {
-		*store = (uint8_t)nohuff_len;
-		if (lower) {
-			for (i = 1; i <= nohuff_len; i++) {
-				store[i] = tolower(load[i]);
+	len = hpack_putnum(buf, 0x80, 7, (uint32_t)huff_len);
+	{
+		/* Collect codes (up to 30 bits) in a bit accumulator */
+		uint64_t acc = 0;
+		unsigned acc_bits = 0;
+		for (i = 0; i < str_len; i++) {
+			uint8_t c = (uint8_t)str[i];
+			if (lower) {
+				c = (uint8_t)tolower(c);
+			}
+			acc = (acc << hpack_huff_enc_bits[c]) | hpack_huff_enc_code[c];
+			acc_bits += hpack_huff_enc_bits[c];
+			while (acc_bits >= 8) {
+				acc_bits -= 8;
+				buf[len++] = (uint8_t)(acc >> acc_bits);
 			}
-		} else {
-			memcpy(store + 1, load, nohuff_len);
 		}
-		return nohuff_len + 1;
-	} else {
-		/*
-		int i = 0;
-		char *test = hpack_decode(store, &i, NULL);
-		i = i; // breakpoint for debugging / testing
-		*/
+		if (acc_bits > 0) {
+			/* Pad with the most significant bits of EOS (all 1) */
+			buf[len++] =
+			    (uint8_t)((acc << (8 - acc_bits)) | (0xFFu >> acc_bits));
+		}
 	}
+	return len;
+}
+
 
-	return len_bytes + 1;
+/* Size of a dynamic header table entry, according to RFC 7541, 4.1 */
+static uint32_t
+hpack_entry_octets(const char *name, const char *value)
+{
+	return (uint32_t)(strlen(name) + strlen(value) + 32);
 }
 
 
@@ -823,6 +947,15 @@ static const char http2_pri[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
 static unsigned char http2_pri_len = 24; /* = strlen(http2_pri) */
 
 
+/* Forward declarations */
+static void close_connection(struct mg_connection *conn);
+static int
+parse_http_response(char *buf, int len, struct mg_response_info *ri);
+#if defined(USE_LUA)
+static void lua_worker_states_close(struct mg_connection *conn);
+#endif
+
+
 /* Read and check the HTTP/2 primer/preface:
  * See https://tools.ietf.org/html/rfc7540#section-3.5 */
 static int
@@ -844,22 +977,166 @@ is_valid_http2_primer(struct mg_connection *conn)
 }
 
 
-#define mg_xwrite(conn, data, len)                                             \
-	push_all((conn)->phys_ctx,                                                 \
-	         NULL,                                                             \
-	         (conn)->client.sock,                                              \
-	         (conn)->ssl,                                                      \
-	         (const char *)(data),                                             \
-	         (int)(len));
+/* Multiplexing:
+ * The worker thread accepting a HTTP/2 connection reads all frames of this
+ * connection. Every complete request (HEADERS, CONTINUATION and DATA frames
+ * up to END_STREAM) becomes a stream with a connection structure of its
+ * own. Streams are handed over to idle worker threads (see consume_socket),
+ * or handled by the reading thread if no worker thread is idle.
+ * All frames are written while holding the session mutex. DATA frames are
+ * sent as the flow control windows of the peer allow. If several streams
+ * wait for the window of the connection, the stream with the least data
+ * sent in relation to its priority weight may send first.
+ */
+enum {
+	HTTP2_STREAM_FREE = 0,
+	HTTP2_STREAM_OPEN,    /* Headers received, waiting for the body */
+	HTTP2_STREAM_QUEUED,  /* Waiting for a worker thread */
+	HTTP2_STREAM_RUNNING, /* Request is handled */
+};
+
+/* Max. size of a request body, which is collected before the request is
+ * handled */
+#if !defined(HTTP2_MAX_REQUEST_BODY)
+#define HTTP2_MAX_REQUEST_BODY (1024 * 1024)
+#endif
+
+/* Max. size of a header block (HEADERS and CONTINUATION frames) */
+#define HTTP2_MAX_HEADER_BLOCK (65535)
+
+/* Frame size and receive window announced by this server */
+#define HTTP2_MAX_FRAME_SIZE (16384)
+#define HTTP2_INITIAL_WINDOW (65535)
+
+
+struct mg_http2_stream {
+	struct mg_http2_session *session;
+	struct mg_connection *conn; /* Connection structure of this stream */
+	uint32_t id;
+	int state;           /* HTTP2_STREAM_* */
+	int reset;           /* Stream has been reset by the peer */
+	int blocked;         /* Waiting for the flow control window */
+	int too_large;       /* Request body exceeds HTTP2_MAX_REQUEST_BODY */
+	int headers_sent;    /* HEADERS frame of the response sent */
+	char *http1_head;    /* Response header written in HTTP/1 format */
+	size_t http1_head_len;
+	int64_t send_window; /* Flow control window of the peer */
+	uint32_t weight;     /* Priority weight, 1 to 256 */
+	uint64_t vtime;      /* Data sent, divided by the weight */
+	char *body;          /* Request body */
+	size_t body_len;
+	size_t body_size;
+	struct mg_http2_stream *next; /* Next stream in a queue */
+};
+
+
+struct mg_http2_session {
+	struct mg_connection *conn; /* Connection of the reading thread */
+	pthread_mutex_t mutex; /* Protects streams, windows and socket writes */
+	pthread_cond_t cond;   /* Signaled if a stream may be able to send */
+	int64_t send_window;   /* Flow control window of the connection */
+	uint32_t initial_window_size; /* SETTINGS_INITIAL_WINDOW_SIZE of peer */
+	uint32_t max_frame_size;      /* SETTINGS_MAX_FRAME_SIZE of peer */
+	uint64_t vtime;               /* vtime of the last DATA frame sent */
+	int timeout_ms;               /* request_timeout_ms */
+	int closing;                  /* Connection is closing */
+	int goaway;                   /* Peer sent GOAWAY */
+	int active;                   /* Streams queued or running */
+	uint32_t last_stream_id;      /* Highest stream id opened by the peer */
+	struct mg_http2_stream *inline_stream; /* Handled by the reader */
+	struct mg_http2_stream *pending; /* To be handled by the reader */
+	uint8_t *frame_buf;              /* Payload of the current frame */
+	uint8_t *send_buf;               /* Frame to send */
+	uint8_t *hdr_block;              /* Collected HEADERS + CONTINUATION */
+	uint32_t hdr_len;
+	uint32_t hdr_stream_id; /* Stream id of the header block, or 0 */
+	int hdr_end_stream;     /* HEADERS frame had END_STREAM set */
+	uint32_t hdr_weight;    /* Priority weight from the HEADERS frame */
+	struct mg_http2_stream streams[HTTP2_MAX_STREAMS];
+
+	/* HPACK encoder: copy of the dynamic header table of the peer's
+	 * decoder, newest entry first. Names are stored in lower case. */
+	struct mg_header enc_table[HTTP2_DYN_TABLE_SIZE];
+	uint32_t enc_table_size;       /* Number of entries */
+	uint32_t enc_table_octets;     /* Size according to RFC 7541, 4.1 */
+	uint32_t enc_table_max_octets; /* Max. size used by the encoder */
+	int enc_table_update;          /* Size update must be signaled */
+};
 
 
-static void
-http2_settings_acknowledge(struct mg_connection *conn)
+/* Write a frame. The session mutex must be locked. */
+static int
+http2_push_frame(struct mg_http2_session *session,
+                 uint8_t type,
+                 uint8_t flags,
+                 uint32_t stream_id,
+                 const void *payload,
+                 uint32_t len)
+{
+	struct mg_connection *conn = session->conn;
+	unsigned char *head = session->send_buf;
+
+	if (len > HTTP2_MAX_FRAME_SIZE) {
+		/* Never sent by this server */
+		return -1;
+	}
+
+	head[0] = (unsigned char)((len & 0xFF0000u) >> 16);
+	head[1] = (unsigned char)((len & 0xFF00u) >> 8);
+	head[2] = (unsigned char)(len & 0xFFu);
+	head[3] = type;
+	head[4] = flags;
+	head[5] = (unsigned char)((stream_id & 0x7F000000u) >> 24);
+	head[6] = (unsigned char)((stream_id & 0xFF0000u) >> 16);
+	head[7] = (unsigned char)((stream_id & 0xFF00u) >> 8);
+	head[8] = (unsigned char)(stream_id & 0xFFu);
+
+	if (session->closing) {
+		return -1;
+	}
+	/* Send frame header and payload with one call: two small writes would
+	 * be delayed by the Nagle algorithm. */
+	if (len > 0) {
+		memcpy(head + 9, payload, len);
+	}
+	if (push_all(conn->phys_ctx,
+	             NULL,
+	             conn->client.sock,
+	             conn->ssl,
+	             (const char *)head,
+	             (int)len + 9)
+	    != (int)len + 9) {
+		/* The connection is broken */
+		session->closing = 1;
+		pthread_cond_broadcast(&session->cond);
+		return -1;
+	}
+	return 0;
+}
+
+
+/* Write a frame from any thread. */
+static int
+http2_send_frame(struct mg_http2_session *session,
+                 uint8_t type,
+                 uint8_t flags,
+                 uint32_t stream_id,
+                 const void *payload,
+                 uint32_t len)
 {
-	unsigned char http2_set_ackn_frame[9] = {0, 0, 0, 4, 1, 0, 0, 0, 0};
+	int ret;
+	pthread_mutex_lock(&session->mutex);
+	ret = http2_push_frame(session, type, flags, stream_id, payload, len);
+	pthread_mutex_unlock(&session->mutex);
+	return ret;
+}
+
 
+static void
+http2_settings_acknowledge(struct mg_http2_session *session)
+{
 	DEBUG_TRACE("%s", "Sending settings frame");
-	mg_xwrite(conn, http2_set_ackn_frame, 9);
+	http2_send_frame(session, 4, 1, 0, NULL, 0);
 }
 
 
@@ -876,8 +1153,13 @@ struct http2_settings {
 const struct http2_settings http2_default_settings =
     {4096, 1, UINT32_MAX, 65535, 16384, UINT32_MAX};
 
-const struct http2_settings http2_civetweb_server_settings =
-    {4096, 0, 100, 65535, 16384, 65535};
+const struct http2_settings http2_civetweb_server_settings = {
+    4096,
+    0,
+    HTTP2_MAX_STREAMS,
+    HTTP2_INITIAL_WINDOW,
+    HTTP2_MAX_FRAME_SIZE,
+    HTTP2_MAX_HEADER_BLOCK};
 
 
 enum {
@@ -899,266 +1181,675 @@ enum {
 
 
 static void
-http2_send_settings(struct mg_connection *conn,
+http2_send_settings(struct mg_http2_session *session,
                     const struct http2_settings *set)
 {
-	uint16_t id;
-	uint32_t data;
-	uint8_t http2_settings_frame[9] = {0, 0, 36, 4, 0, 0, 0, 0, 0};
-	mg_xwrite(conn, http2_settings_frame, 9);
-
-	id = htons(1);
-	data = htonl(set->settings_header_table_size);
-	mg_xwrite(conn, &id, 2);
-	mg_xwrite(conn, &data, 4);
-
-	id = htons(1);
-	data = htonl(set->settings_enable_push);
-	mg_xwrite(conn, &id, 2);
-	mg_xwrite(conn, &data, 4);
-
-	id = htons(1);
-	data = htonl(set->settings_max_concurrent_streams);
-	mg_xwrite(conn, &id, 2);
-	mg_xwrite(conn, &data, 4);
-
-	id = htons(1);
-	data = htonl(set->settings_initial_window_size);
-	mg_xwrite(conn, &id, 2);
-	mg_xwrite(conn, &data, 4);
-
-	id = htons(1);
-	data = htonl(set->settings_max_frame_size);
-	mg_xwrite(conn, &id, 2);
-	mg_xwrite(conn, &data, 4);
-
-	id = htons(1);
-	data = htonl(set->settings_max_header_list_size);
-	mg_xwrite(conn, &id, 2);
-	mg_xwrite(conn, &data, 4);
+	uint32_t val[6];
+	uint8_t payload[36];
+	int i;
+
+	val[0] = set->settings_header_table_size;
+	val[1] = set->settings_enable_push;
+	val[2] = set->settings_max_concurrent_streams;
+	val[3] = set->settings_initial_window_size;
+	val[4] = set->settings_max_frame_size;
+	val[5] = set->settings_max_header_list_size;
+
+	/* Settings identifiers 1 to 6, see
+	 * https://tools.ietf.org/html/rfc7540#section-6.5.2 */
+	for (i = 0; i < 6; i++) {
+		payload[i * 6 + 0] = 0;
+		payload[i * 6 + 1] = (uint8_t)(i + 1);
+		payload[i * 6 + 2] = (uint8_t)(val[i] >> 24);
+		payload[i * 6 + 3] = (uint8_t)(val[i] >> 16);
+		payload[i * 6 + 4] = (uint8_t)(val[i] >> 8);
+		payload[i * 6 + 5] = (uint8_t)(val[i]);
+	}
+	http2_send_frame(session, 4, 0, 0, payload, sizeof(payload));
 
 	DEBUG_TRACE("%s", "HTTP2 settings sent");
 }
 
 
-static int
-http2_send_response_headers(struct mg_connection *conn)
-{
-	unsigned char http2_header_frame[9] = {0, 0, 0, 1, 4, 0, 0, 0, 0};
-	uint8_t header_bin[1024];
-	uint16_t header_len = 0;
-	int has_date = 0;
-	int has_connection_header = 0;
-	int i;
+/* Max. size of the encoder dynamic header table. The peer may allow more,
+ * using SETTINGS_HEADER_TABLE_SIZE. */
+#if !defined(HTTP2_ENC_TABLE_OCTETS)
+#define HTTP2_ENC_TABLE_OCTETS (4096)
+#endif
 
-	if ((conn->status_code < 100) || (conn->status_code > 999)) {
-		/* Invalid status: Set status to "Internal Server Error" */
-		conn->status_code = 500;
+
+/* Remove the oldest entries of the encoder dynamic header table, until the
+ * table fits into maxOctets. The session mutex must be locked. */
+static void
+hpack_enc_table_purge(struct mg_http2_session *session, uint32_t maxOctets)
+{
+	while ((session->enc_table_size > 0)
+	       && (session->enc_table_octets > maxOctets)) {
+		uint32_t last = --session->enc_table_size;
+		struct mg_header *e = &(session->enc_table[last]);
+
+		session->enc_table_octets -= hpack_entry_octets(e->name, e->value);
+		mg_free((void *)e->name);
+		mg_free((void *)e->value);
+		e->name = NULL;
+		e->value = NULL;
+	}
+	if (session->enc_table_size == 0) {
+		session->enc_table_octets = 0;
 	}
+}
 
-	switch (conn->status_code) {
-	case 200:
-		header_bin[header_len++] = 0x88;
-		break;
-	case 204:
-		header_bin[header_len++] = 0x89;
-		break;
-	case 206:
-		header_bin[header_len++] = 0x8A;
-		break;
-	case 304:
-		header_bin[header_len++] = 0x8B;
-		break;
-	case 400:
-		header_bin[header_len++] = 0x8C;
-		break;
-	case 404:
-		header_bin[header_len++] = 0x8D;
-		break;
-	case 500:
-		header_bin[header_len++] = 0x8E;
-		break;
-	default:
-		header_bin[header_len++] = 0x48;
-		header_bin[header_len++] = 0x03;
-		header_bin[header_len++] = 0x30 + (conn->status_code / 100);
-		header_bin[header_len++] = 0x30 + ((conn->status_code / 10) % 10);
-		header_bin[header_len++] = 0x30 + (conn->status_code % 10);
-		break;
+
+/* Add an entry to the encoder dynamic header table, the same way the
+ * decoder of the peer does (see add_dynamic_header_table).
+ * The session mutex must be locked. */
+static void
+hpack_enc_table_add(struct mg_http2_session *session,
+                    const char *name,
+                    const char *value)
+{
+	struct mg_context *ctx = session->conn->phys_ctx;
+	uint32_t octets = hpack_entry_octets(name, value);
+	char *n, *v;
+	size_t i;
+
+	if (octets > session->enc_table_max_octets) {
+		/* The peer empties its table */
+		hpack_enc_table_purge(session, 0);
+		return;
+	}
+	hpack_enc_table_purge(session, session->enc_table_max_octets - octets);
+
+	n = mg_strdup_ctx(name, ctx);
+	v = mg_strdup_ctx(value, ctx);
+	if ((n == NULL) || (v == NULL)) {
+		/* Out of memory: The peer adds the entry anyway. Forget all
+		 * entries: the (empty) table is still a prefix of the peer's
+		 * table, so all indices used later are valid. */
+		mg_free(n);
+		mg_free(v);
+		hpack_enc_table_purge(session, 0);
+		return;
+	}
+	for (i = 0; n[i]; i++) {
+		n[i] = (char)tolower((unsigned char)n[i]);
 	}
 
-	/* Add all headers */
-	for (i = 0; i < conn->response_info.num_headers; i++) {
-		uint16_t predef = 0;
-		uint16_t j;
+	memmove(&(session->enc_table[1]),
+	        &(session->enc_table[0]),
+	        session->enc_table_size * sizeof(session->enc_table[0]));
+	session->enc_table[0].name = n;
+	session->enc_table[0].value = v;
+	session->enc_table_size++;
+	session->enc_table_octets += octets;
+}
 
-		/* Filter headers not valid in HTTP/2 */
-		if (!mg_strcasecmp("Connection",
-		                   conn->response_info.http_headers[i].name)) {
-			has_connection_header = 1;
-			continue; /* do not send */
+
+/* Representation of a response header field that is not found in a
+ * table. See https://tools.ietf.org/html/rfc7541#section-6.2 */
+static uint8_t
+http2_header_representation(const char *name)
+{
+	/* Values changing with every response would only push other
+	 * entries out of the table. */
+	static const char *no_index[] = {"date",
+	                                 "content-length",
+	                                 "last-modified",
+	                                 "etag",
+	                                 "content-range",
+	                                 "expires",
+	                                 "location",
+	                                 NULL};
+	int i;
+
+	if (!mg_strcasecmp(name, "set-cookie")) {
+		/* Never indexed: Sensitive value */
+		return 0x10;
+	}
+	for (i = 0; no_index[i] != NULL; i++) {
+		if (!mg_strcasecmp(name, no_index[i])) {
+			/* Without indexing */
+			return 0x00;
 		}
+	}
+	/* With incremental indexing */
+	return 0x40;
+}
 
-		/* Check if this header is known in HPACK (static table index 15 to 61)
-		 * see https://tools.ietf.org/html/rfc7541#appendix-A */
-		for (j = 15; j <= 61; j++) {
-			if (!mg_strcasecmp(hpack_predefined[j].name,
-			                   conn->response_info.http_headers[i].name)) {
-				predef = j;
-				break;
+
+/* Encode one response header field. Repeated header fields are sent as
+ * index of the static or the dynamic table.
+ * buf must have room for strlen(name) + strlen(value) + 18 bytes.
+ * The session mutex must be locked.
+ * Return: number of bytes written. */
+static size_t
+http2_encode_header(struct mg_http2_session *session,
+                    uint8_t *buf,
+                    const char *name,
+                    const char *value)
+{
+	uint32_t name_idx = 0;
+	uint32_t i;
+	uint8_t rep;
+	size_t len;
+
+	/* Search the static table (RFC 7541, Appendix A) */
+	for (i = 1; i <= 61; i++) {
+		if (!mg_strcasecmp(hpack_predefined[i].name, name)) {
+			if (hpack_predefined[i].value
+			    && !strcmp(hpack_predefined[i].value, value)) {
+				/* Indexed header field */
+				return hpack_putnum(buf, 0x80, 7, i);
+			}
+			if (name_idx == 0) {
+				name_idx = i;
 			}
 		}
+	}
 
-		if (predef) {
-			/* Predefined header found */
-			header_bin[header_len++] = 0x40 + predef;
-		} else {
-			/* Rare header, do not index */
-			header_bin[header_len++] = 0x10;
-			j = hpack_encode(header_bin + header_len,
-			                 conn->response_info.http_headers[i].name,
-			                 1);
-			header_len += j;
+	/* Search the dynamic table */
+	for (i = 0; i < session->enc_table_size; i++) {
+		if (!mg_strcasecmp(session->enc_table[i].name, name)) {
+			if (!strcmp(session->enc_table[i].value, value)) {
+				return hpack_putnum(buf, 0x80, 7, i + 62);
+			}
+			if (name_idx == 0) {
+				name_idx = i + 62;
+			}
 		}
+	}
+
+	/* Literal header field */
+	rep = http2_header_representation(name);
+	len = hpack_putnum(buf, rep, (uint8_t)((rep == 0x40) ? 6 : 4), name_idx);
+	if (name_idx == 0) {
+		len += hpack_putstr(buf + len, name, 1);
+	}
+	len += hpack_putstr(buf + len, value, 0);
+
+	if (rep == 0x40) {
+		hpack_enc_table_add(session, name, value);
+	}
+	return len;
+}
+
+
+static int
+http2_send_response_headers(struct mg_connection *conn)
+{
+	struct mg_http2_session *session = conn->http2.session;
+	uint8_t *header_bin;
+	size_t header_size = 64;
+	size_t header_len = 0;
+	size_t sent = 0;
+	char status[8];
+	char date[64];
+	int has_date = 0;
+	int ret = 0;
+	int i;
 
-		j = hpack_encode(header_bin + header_len,
-		                 conn->response_info.http_headers[i].value,
-		                 0);
-		header_len += j;
+	if ((conn->status_code < 100) || (conn->status_code > 999)) {
+		/* Invalid status: Set status to "Internal Server Error" */
+		conn->status_code = 500;
+	}
+	sprintf(status, "%i", conn->status_code);
 
-		/* Mark required headers as sent */
+	/* Max. size of the header block */
+	for (i = 0; i < conn->response_info.num_headers; i++) {
+		header_size += strlen(conn->response_info.http_headers[i].name)
+		               + strlen(conn->response_info.http_headers[i].value)
+		               + 18;
 		if (!mg_strcasecmp("Date", conn->response_info.http_headers[i].name)) {
 			has_date = 1;
 		}
 	}
-
-	/* Add required headers, if they have not been sent yet */
 	if (!has_date) {
-		/* Create header frame */
-		char date[64];
-		uint8_t date_len;
+		/* Add required headers, if they have not been set */
 		time_t curtime = time(NULL);
-
 		gmt_time_string(date, sizeof(date), &curtime);
-		date_len = (uint8_t)strlen(date);
+		header_size += strlen(date) + 32;
+	}
+	header_bin = (uint8_t *)mg_malloc_ctx(header_size, conn->phys_ctx);
+	if (header_bin == NULL) {
+		return -1;
+	}
 
-		header_bin[header_len++] =
-		    0x61; /* "Date" predefined HPACK index 33 (0x21) + 0x40 */
-		header_bin[header_len++] = date_len;
-		memcpy(header_bin + header_len, date, date_len);
-		header_len += date_len;
+	/* Encoding the header changes the dynamic header table: Header blocks
+	 * must be sent in the same order as they are encoded. */
+	pthread_mutex_lock(&session->mutex);
+
+	if (session->enc_table_update) {
+		/* Dynamic table size update, see RFC 7541, 6.3 */
+		header_len +=
+		    hpack_putnum(header_bin, 0x20, 5, session->enc_table_max_octets);
+		session->enc_table_update = 0;
 	}
 
-	http2_header_frame[1] = (header_len & 0xFF00) >> 8;
-	http2_header_frame[2] = (header_len & 0xFF);
+	header_len += http2_encode_header(session,
+	                                  header_bin + header_len,
+	                                  ":status",
+	                                  status);
 
-	http2_header_frame[5] = (conn->http2.stream_id & 0xFF000000u) >> 24;
-	http2_header_frame[6] = (conn->http2.stream_id & 0xFF0000u) >> 16;
-	http2_header_frame[7] = (conn->http2.stream_id & 0xFF00u) >> 8;
-	http2_header_frame[8] = (conn->http2.stream_id & 0xFFu);
+	for (i = 0; i < conn->response_info.num_headers; i++) {
+		const char *name = conn->response_info.http_headers[i].name;
+
+		/* Filter connection specific headers, they are not valid in
+		 * HTTP/2. See https://tools.ietf.org/html/rfc7540#section-8.1.2.2
+		 */
+		if (!mg_strcasecmp("Connection", name)
+		    || !mg_strcasecmp("Keep-Alive", name)
+		    || !mg_strcasecmp("Proxy-Connection", name)
+		    || !mg_strcasecmp("Transfer-Encoding", name)
+		    || !mg_strcasecmp("Upgrade", name)) {
+			continue; /* do not send */
+		}
 
-	/* Send header frame */
-	mg_xwrite(conn, http2_header_frame, 9);
-	mg_xwrite(conn, header_bin, header_len);
+		header_len +=
+		    http2_encode_header(session,
+		                        header_bin + header_len,
+		                        name,
+		                        conn->response_info.http_headers[i].value);
+	}
+	if (!has_date) {
+		header_len +=
+		    http2_encode_header(session, header_bin + header_len, "date", date);
+	}
 
-	DEBUG_TRACE("HTTP2 response header sent: stream %u", conn->http2.stream_id);
+	/* Send HEADERS frame, and CONTINUATION frames for large header blocks
+	 * (END_HEADERS flag in the last frame). */
+	do {
+		size_t frame_len = header_len - sent;
+		uint8_t type = (sent == 0) ? 1 : 9;
+		if (frame_len > session->max_frame_size) {
+			frame_len = session->max_frame_size;
+		}
+		if (frame_len > HTTP2_MAX_FRAME_SIZE) {
+			frame_len = HTTP2_MAX_FRAME_SIZE;
+		}
+		if (http2_push_frame(session,
+		                     type,
+		                     (sent + frame_len == header_len) ? 4 : 0,
+		                     conn->http2.stream_id,
+		                     header_bin + sent,
+		                     (uint32_t)frame_len)
+		    != 0) {
+			ret = -1;
+			break;
+		}
+		sent += frame_len;
+	} while (sent < header_len);
 
+	pthread_mutex_unlock(&session->mutex);
+	mg_free(header_bin);
 
-	(void)has_connection_header; /* ignore for the moment */
+	if (ret == 0) {
+		if (conn->http2.stream != NULL) {
+			conn->http2.stream->headers_sent = 1;
+		}
+		DEBUG_TRACE("HTTP2 response header sent: stream %u (%u bytes)",
+		            conn->http2.stream_id,
+		            (unsigned)header_len);
+	}
+	return ret;
+}
 
 
-	return 42; /* TODO */
+/* Time to wait for flow control window updates */
+static int
+http2_timeout_ms(struct mg_connection *conn)
+{
+	int timeout = 0;
+	if (conn->dom_ctx->config[REQUEST_TIMEOUT]) {
+		timeout = atoi(conn->dom_ctx->config[REQUEST_TIMEOUT]);
+	}
+	if (timeout <= 0) {
+		timeout = atoi(config_options[REQUEST_TIMEOUT].default_value);
+	}
+	return timeout;
 }
 
 
-static void
-http2_data_frame_head(struct mg_connection *conn,
-                      uint32_t frame_size,
-                      int is_final)
+/* Number of bytes mg_read can return without reading from the socket. */
+static int64_t
+http2_buffered(struct mg_connection *conn)
 {
-	unsigned char http2_data_frame[9];
-	uint32_t stream_id = conn->http2.stream_id;
+	/* Data buffered in conn->buf (h2c) */
+	int64_t n = conn->data_len - conn->request_len - conn->consumed_content;
+
+	if (n < 0) {
+		n = 0;
+	}
 
-	http2_data_frame[0] = (frame_size & 0xFF0000) >> 16;
-	http2_data_frame[1] = (frame_size & 0xFF00) >> 8;
-	http2_data_frame[2] = (frame_size & 0xFF);
+#if defined(USE_MBEDTLS)
+	if (conn->ssl != NULL) {
+		n += (int64_t)mbedtls_ssl_get_bytes_avail(conn->ssl);
+	}
+#elif !defined(NO_SSL)
+	if (conn->ssl != NULL) {
+		n += SSL_pending(conn->ssl);
+	}
+#endif
+	return n;
+}
 
-	http2_data_frame[3] = 0; /* frame type "DATA" */
-	http2_data_frame[4] = (is_final ? 1 : 0);
 
-	http2_data_frame[5] = (stream_id & 0xFF000000u) >> 24;
-	http2_data_frame[6] = (stream_id & 0xFF0000u) >> 16;
-	http2_data_frame[7] = (stream_id & 0xFF00u) >> 8;
-	http2_data_frame[8] = (stream_id & 0xFFu);
+/* Wait until data from the peer can be read.
+ * Return: 1 if data is available, 0 for a timeout, -1 for an error. */
+static int
+http2_wait_readable(struct mg_connection *conn, int ms)
+{
+	struct mg_pollfd pfd[1];
+	int pollres;
 
-	DEBUG_TRACE("HTTP2 begin data frame: stream %u, frame_size %u (final: %i)",
-	            stream_id,
-	            frame_size,
-	            is_final);
+	if (http2_buffered(conn) > 0) {
+		return 1;
+	}
 
-	mg_xwrite(conn, http2_data_frame, 9);
+	pfd[0].fd = conn->client.sock;
+	pfd[0].events = POLLIN;
+	pollres = mg_poll(pfd, 1, ms, &(conn->phys_ctx->stop_flag));
+	if (!STOP_FLAG_IS_ZERO(&conn->phys_ctx->stop_flag)) {
+		return -1;
+	}
+	return (pollres > 0) ? 1 : ((pollres == 0) ? 0 : -1);
 }
 
 
-static void
-http2_send_window(struct mg_connection *conn,
-                  uint32_t stream_id,
-                  uint32_t window_size)
+static int http2_read_frame(struct mg_http2_session *session);
+
+
+/* Amount of data a stream may send now: limited by the flow control windows
+ * and by the frame size. Streams waiting for the connection window are
+ * served according to their weight. */
+static int64_t
+http2_send_allowance(struct mg_http2_session *session,
+                     struct mg_http2_stream *stream,
+                     size_t remaining)
 {
-	unsigned char http2_window_frame[9] = {0, 0, 4, 8, 0, 0, 0, 0, 0};
-	uint32_t data = htonl(window_size);
-
-	DEBUG_TRACE("HTTP2 send window_size: stream %u, error %u",
-	            stream_id,
-	            window_size);
-
-	http2_window_frame[5] = (stream_id & 0xFF000000u) >> 24;
-	http2_window_frame[6] = (stream_id & 0xFF0000u) >> 16;
-	http2_window_frame[7] = (stream_id & 0xFF00u) >> 8;
-	http2_window_frame[8] = (stream_id & 0xFFu);
-	mg_xwrite(conn, http2_window_frame, 9);
-	mg_xwrite(conn, &data, 4);
+	int64_t avail = (int64_t)remaining;
+	int i;
+
+	if (avail > stream->send_window) {
+		avail = stream->send_window;
+	}
+	if (avail > session->send_window) {
+		avail = session->send_window;
+	}
+	if (avail > (int64_t)session->max_frame_size) {
+		avail = (int64_t)session->max_frame_size;
+	}
+	if (avail > HTTP2_MAX_FRAME_SIZE) {
+		/* Size of send_buf */
+		avail = HTTP2_MAX_FRAME_SIZE;
+	}
+	if (avail <= 0) {
+		return 0;
+	}
+	if (stream == session->inline_stream) {
+		/* The reading thread does not wait for other streams */
+		return avail;
+	}
+	for (i = 0; i < HTTP2_MAX_STREAMS; i++) {
+		struct mg_http2_stream *s = &(session->streams[i]);
+		if ((s != stream) && (s->state == HTTP2_STREAM_RUNNING) && s->blocked
+		    && (s->send_window > 0) && (s->vtime < stream->vtime)) {
+			/* Let the other stream send first */
+			return 0;
+		}
+	}
+	return avail;
 }
 
 
-static void
-http2_reset_stream(struct mg_connection *conn,
-                   uint32_t stream_id,
-                   uint32_t error_id)
+/* Callback handlers may write a HTTP/1 response header ("HTTP/1.1 200 OK"
+ * ...) using mg_printf, instead of using mg_response_header_start. Collect
+ * this header, and send it as HEADERS frame.
+ * Return: number of bytes of data used for the header, or -1 on error. */
+static int
+http2_convert_http1_head(struct mg_connection *conn,
+                         const char *data,
+                         size_t len)
 {
-	unsigned char http2_reset_frame[9] = {0, 0, 4, 3, 0, 0, 0, 0, 0};
-	uint32_t val = htonl(error_id);
+	struct mg_http2_stream *stream = conn->http2.stream;
+	struct mg_response_info ri;
+	size_t old_len = stream->http1_head_len;
+	int head_len, i;
+	char *tmp;
+
+	if ((stream->http1_head == NULL)
+	    && ((len < 5) || (0 != memcmp(data, "HTTP/", 5)))) {
+		/* Body data without a response header */
+		conn->status_code = 200;
+		return (http2_send_response_headers(conn) == 0) ? 0 : -1;
+	}
 
-	DEBUG_TRACE("HTTP2 send reset: stream %u, error %u", stream_id, error_id);
+	if (old_len + len > MG_BUF_LEN) {
+		len = MG_BUF_LEN - old_len;
+	}
+	tmp = (char *)mg_realloc_ctx(stream->http1_head,
+	                             old_len + len + 1,
+	                             conn->phys_ctx);
+	if (tmp == NULL) {
+		return -1;
+	}
+	memcpy(tmp + old_len, data, len);
+	tmp[old_len + len] = 0;
+	stream->http1_head = tmp;
+	stream->http1_head_len = old_len + len;
+
+	head_len = parse_http_response(tmp, (int)stream->http1_head_len, &ri);
+	if (head_len == 0) {
+		if (stream->http1_head_len >= MG_BUF_LEN) {
+			/* Header too large */
+			return -1;
+		}
+		/* Incomplete: wait for more data */
+		return (int)len;
+	}
+	if (head_len < 0) {
+		return -1;
+	}
 
-	http2_reset_frame[5] = (stream_id & 0xFF000000u) >> 24;
-	http2_reset_frame[6] = (stream_id & 0xFF0000u) >> 16;
-	http2_reset_frame[7] = (stream_id & 0xFF00u) >> 8;
-	http2_reset_frame[8] = (stream_id & 0xFFu);
-	mg_xwrite(conn, http2_reset_frame, 9);
-	mg_xwrite(conn, &val, 4);
+	free_buffered_response_header_list(conn);
+	conn->status_code = ri.status_code;
+	conn->request_state = 1;
+	for (i = 0; i < ri.num_headers; i++) {
+		mg_response_header_add(conn,
+		                       ri.http_headers[i].name,
+		                       ri.http_headers[i].value,
+		                       -1);
+	}
+	conn->request_state = 10;
+
+	mg_free(stream->http1_head);
+	stream->http1_head = NULL;
+	stream->http1_head_len = 0;
+
+	if (http2_send_response_headers(conn) != 0) {
+		return -1;
+	}
+	/* Data following the header belongs to the body */
+	return (int)((size_t)head_len - old_len);
 }
 
 
-static void
-http2_must_use_http1(struct mg_connection *conn)
+/* Send response data of a stream (called by mg_write). */
+static int
+http2_write(struct mg_connection *conn, const char *data, size_t len)
 {
-	DEBUG_TRACE("HTTP2 not available for this URL (%s)", conn->path_info);
-	http2_reset_stream(conn, conn->http2.stream_id, 0xd);
-}
+	struct mg_http2_session *session = conn->http2.session;
+	struct mg_http2_stream *stream = conn->http2.stream;
+	uint64_t wait_start = 0;
+	size_t sent = 0;
+	size_t head_used = 0;
+
+	if ((session == NULL) || (stream == NULL)) {
+		return -1;
+	}
 
+	if (!stream->headers_sent) {
+		int used = http2_convert_http1_head(conn, data, len);
+		if (used < 0) {
+			return -1;
+		}
+		head_used = (size_t)used;
+		data += head_used;
+		len -= head_used;
+		if (len == 0) {
+			return (int)head_used;
+		}
+	}
 
-/* The HTTP2 implementation collects request headers as array of dynamically
- * allocated string values. This array must be freed once the request is
- * handled.
- * This is different to the HTTP/1.x implementation: For HTTP/1.x, the header
- * list is implemented as pointers into an existing buffer, so free must not
- * be called for HTTP/1.x.
- * Thus free_buffered_request_header_list is in mod_http2.inl.
- */
-#if defined(DEBUG)
-static int mem_h_count = 0;
-static int mem_d_count = 0;
+	pthread_mutex_lock(&session->mutex);
+	while ((sent < len) && !session->closing && !stream->reset) {
+		int64_t chunk = http2_send_allowance(session, stream, len - sent);
+		uint64_t now;
+
+		if (chunk > 0) {
+			int i, others_blocked = 0;
+
+			stream->blocked = 0;
+			wait_start = 0;
+			if (http2_push_frame(session,
+			                     0, /* DATA */
+			                     0,
+			                     stream->id,
+			                     data + sent,
+			                     (uint32_t)chunk)
+			    != 0) {
+				break;
+			}
+			sent += (size_t)chunk;
+			stream->send_window -= chunk;
+			session->send_window -= chunk;
+			stream->vtime += ((uint64_t)chunk * 256u) / stream->weight;
+			session->vtime = stream->vtime;
+
+			for (i = 0; i < HTTP2_MAX_STREAMS; i++) {
+				if (session->streams[i].blocked) {
+					others_blocked = 1;
+					break;
+				}
+			}
+			if (others_blocked) {
+				pthread_cond_broadcast(&session->cond);
+			}
+			continue;
+		}
+
+		/* Wait for a window update, or for other streams */
+		now = mg_get_current_time_ns();
+		if (wait_start == 0) {
+			wait_start = now;
+		} else if ((now - wait_start)
+		           > ((uint64_t)session->timeout_ms * 1000000u)) {
+			DEBUG_TRACE("HTTP2 stream %u: flow control timeout", stream->id);
+			break;
+		}
+		stream->blocked = 1;
+
+		if (stream == session->inline_stream) {
+			/* This thread is the only one reading from the connection */
+			int r;
+			pthread_mutex_unlock(&session->mutex);
+			r = http2_wait_readable(session->conn, 100);
+			if (r > 0) {
+				r = http2_read_frame(session);
+			}
+			pthread_mutex_lock(&session->mutex);
+			if (r < 0) {
+				session->closing = 1;
+			}
+		} else {
+			struct timespec abstime;
+			clock_gettime(CLOCK_REALTIME, &abstime);
+			abstime.tv_sec += 1;
+			pthread_cond_timedwait(&session->cond, &session->mutex, &abstime);
+		}
+	}
+	stream->blocked = 0;
+	pthread_mutex_unlock(&session->mutex);
+
+	if ((sent == 0) && (len > 0)) {
+		return -1;
+	}
+	return (int)(head_used + sent);
+}
+
+
+static void
+http2_reset_stream(struct mg_http2_session *session,
+                   uint32_t stream_id,
+                   uint32_t error_id)
+{
+	uint8_t payload[4];
+
+	DEBUG_TRACE("HTTP2 send reset: stream %u, error %u", stream_id, error_id);
+
+	payload[0] = (uint8_t)(error_id >> 24);
+	payload[1] = (uint8_t)(error_id >> 16);
+	payload[2] = (uint8_t)(error_id >> 8);
+	payload[3] = (uint8_t)(error_id);
+	http2_send_frame(session, 3, 0, stream_id, payload, 4);
+}
+
+
+static void
+http2_send_window_update(struct mg_http2_session *session,
+                         uint32_t stream_id,
+                         uint32_t increment)
+{
+	uint8_t payload[4];
+
+	payload[0] = (uint8_t)((increment >> 24) & 0x7Fu);
+	payload[1] = (uint8_t)(increment >> 16);
+	payload[2] = (uint8_t)(increment >> 8);
+	payload[3] = (uint8_t)(increment);
+	http2_send_frame(session, 8, 0, stream_id, payload, 4);
+}
+
+
+static void
+http2_send_goaway(struct mg_http2_session *session, uint32_t error_id)
+{
+	uint8_t payload[8];
+	uint32_t last = session->last_stream_id;
+
+	DEBUG_TRACE("HTTP2 send goaway: last stream %u, error %u", last, error_id);
+
+	payload[0] = (uint8_t)((last >> 24) & 0x7Fu);
+	payload[1] = (uint8_t)(last >> 16);
+	payload[2] = (uint8_t)(last >> 8);
+	payload[3] = (uint8_t)(last);
+	payload[4] = (uint8_t)(error_id >> 24);
+	payload[5] = (uint8_t)(error_id >> 16);
+	payload[6] = (uint8_t)(error_id >> 8);
+	payload[7] = (uint8_t)(error_id);
+	http2_send_frame(session, 7, 0, 0, payload, 8);
+}
+
+
+static void
+http2_must_use_http1(struct mg_connection *conn)
+{
+	DEBUG_TRACE("HTTP2 not available for this URL (%s)", conn->path_info);
+	http2_reset_stream(conn->http2.session,
+	                   conn->http2.stream_id,
+	                   HTTP2_ERR_HTTP_1_1_REQUIRED);
+}
+
+
+/* The HTTP2 implementation collects request headers as array of dynamically
+ * allocated string values. This array must be freed once the request is
+ * handled.
+ * This is different to the HTTP/1.x implementation: For HTTP/1.x, the header
+ * list is implemented as pointers into an existing buffer, so free must not
+ * be called for HTTP/1.x.
+ * Thus free_buffered_request_header_list is in mod_http2.inl.
+ */
+#if defined(DEBUG)
+static int mem_h_count = 0;
+static int mem_d_count = 0;
 #define CHECK_LEAK_HDR_ALLOC(ptr)                                              \
 	DEBUG_TRACE("H NEW %p (%i): %s", ptr, ++mem_h_count, (const char *)ptr)
 #define CHECK_LEAK_HDR_FREE(ptr)                                               \
@@ -1176,29 +1867,87 @@ static int mem_d_count = 0;
 
 
 /* The dynamic header table may be resized on a HTTP2 client request.
- * A tablesize=0 will free all memory.
+ * Remove the oldest entries, until the table fits into maxOctets.
+ * maxOctets=0 will free all memory.
  */
 static void
-purge_dynamic_header_table(struct mg_connection *conn, uint32_t tableSize)
+purge_dynamic_header_table(struct mg_connection *conn, uint32_t maxOctets)
 {
-	DEBUG_TRACE("HTTP2 dynamic header table set to %u", tableSize);
-	while (conn->http2.dyn_table_size > tableSize) {
+	DEBUG_TRACE("HTTP2 dynamic header table set to %u", maxOctets);
+	while ((conn->http2.dyn_table_size > 0)
+	       && (conn->http2.dyn_table_octets > maxOctets)) {
+		uint32_t last = conn->http2.dyn_table_size - 1;
+
+		conn->http2.dyn_table_octets -=
+		    hpack_entry_octets(conn->http2.dyn_table[last].name,
+		                       conn->http2.dyn_table[last].value);
 		conn->http2.dyn_table_size--;
 
-		CHECK_LEAK_DYN_FREE(
-		    conn->http2.dyn_table[conn->http2.dyn_table_size].name);
-		CHECK_LEAK_DYN_FREE(
-		    conn->http2.dyn_table[conn->http2.dyn_table_size].value);
+		CHECK_LEAK_DYN_FREE(conn->http2.dyn_table[last].name);
+		CHECK_LEAK_DYN_FREE(conn->http2.dyn_table[last].value);
 
-		mg_free((void *)conn->http2.dyn_table[conn->http2.dyn_table_size].name);
-		conn->http2.dyn_table[conn->http2.dyn_table_size].name = 0;
-		mg_free(
-		    (void *)conn->http2.dyn_table[conn->http2.dyn_table_size].value);
-		conn->http2.dyn_table[conn->http2.dyn_table_size].value = 0;
+		mg_free((void *)conn->http2.dyn_table[last].name);
+		conn->http2.dyn_table[last].name = 0;
+		mg_free((void *)conn->http2.dyn_table[last].value);
+		conn->http2.dyn_table[last].value = 0;
+	}
+	if (conn->http2.dyn_table_size == 0) {
+		conn->http2.dyn_table_octets = 0;
 	}
 }
 
 
+/* Add an entry to the dynamic header table. The new entry gets index 62,
+ * older entries move up, see https://tools.ietf.org/html/rfc7541#section-4.4
+ */
+static void
+add_dynamic_header_table(struct mg_connection *conn,
+                         const char *key,
+                         const char *val)
+{
+	uint32_t octets = hpack_entry_octets(key, val);
+	char *name, *value;
+
+	if (octets > conn->http2.dyn_table_max_octets) {
+		/* Entry does not fit: the table is emptied */
+		purge_dynamic_header_table(conn, 0);
+		return;
+	}
+	purge_dynamic_header_table(conn,
+	                           conn->http2.dyn_table_max_octets - octets);
+	if (conn->http2.dyn_table_size >= HTTP2_DYN_TABLE_SIZE) {
+		/* Cannot happen for max_octets <= 32 * HTTP2_DYN_TABLE_SIZE */
+		purge_dynamic_header_table(conn, conn->http2.dyn_table_octets - 1);
+	}
+
+	name = mg_strdup_ctx(key, conn->phys_ctx);
+	value = mg_strdup_ctx(val, conn->phys_ctx);
+	if (!name || !value) {
+		/* Out of memory: The decoder can not stay in sync */
+		mg_free(name);
+		mg_free(value);
+		purge_dynamic_header_table(conn, 0);
+		return;
+	}
+	CHECK_LEAK_DYN_ALLOC(name);
+	CHECK_LEAK_DYN_ALLOC(value);
+
+	memmove(&(conn->http2.dyn_table[1]),
+	        &(conn->http2.dyn_table[0]),
+	        conn->http2.dyn_table_size * sizeof(conn->http2.dyn_table[0]));
+	conn->http2.dyn_table[0].name = name;
+	conn->http2.dyn_table[0].value = value;
+	conn->http2.dyn_table_size++;
+	conn->http2.dyn_table_octets += octets;
+
+	DEBUG_TRACE("HTTP2 new dynamic header table entry %i "
+	            "(key: %s, value: %s)",
+	            (int)conn->http2.dyn_table_size,
+	            key,
+	            val);
+}
+
+
 /* Internal function to free request header list.
  * Not to be confused with the response header list.
  */
@@ -1229,512 +1978,1290 @@ free_buffered_request_header_list(struct mg_connection *conn)
 }
 
 
-/* HTTP2 requires a different handling loop */
+/* Decode a complete header block (HEADERS and CONTINUATION frames).
+ * The headers are added to the request of sconn. If sconn is NULL,
+ * the block is decoded only to keep the dynamic header table in sync.
+ * Return: 0 if ok, -1 for a compression error (connection error).
+ */
+static int
+http2_decode_header_block(struct mg_connection *conn,
+                          struct mg_connection *sconn,
+                          const uint8_t *buf,
+                          int len)
+{
+	int i = 0;
+
+	while (i < len) {
+		const char *key = 0;
+		const char *val = 0;
+		uint8_t idx_mask = 0;
+		uint8_t value_known = 0;
+		uint8_t indexing = 0;
+		uint64_t idx = 0;
+
+		/* Classify next entry by checking the bit mask */
+		if ((buf[i] & 0x80u) == 0x80u) {
+			/* Indexed Header Field Representation:
+			 * https://tools.ietf.org/html/rfc7541#section-6.1 */
+			idx_mask = 0x7fu;
+			value_known = 1;
+
+		} else if ((buf[i] & 0xC0u) == 0x40u) {
+			/* Literal Header Field with Incremental Indexing:
+			 * https://tools.ietf.org/html/rfc7541#section-6.2.1 */
+			idx_mask = 0x3fu;
+			indexing = 1;
+
+		} else if ((buf[i] & 0xF0u) == 0x00u) {
+			/* Literal Header Field without Indexing:
+			 * https://tools.ietf.org/html/rfc7541#section-6.2.2 */
+			idx_mask = 0x0fu;
+
+		} else if ((buf[i] & 0xF0u) == 0x10u) {
+			/* Literal Header Field Never Indexed:
+			 * https://tools.ietf.org/html/rfc7541#section-6.2.3 */
+			idx_mask = 0x0fu;
+
+		} else {
+			uint64_t tableSize;
+			/* Dynamic Table Size Update:
+			 * https://tools.ietf.org/html/rfc7541#section-6.3 */
+			idx_mask = 0x1fu;
+			tableSize = hpack_getnum(buf, &i, idx_mask, conn->phys_ctx);
+			if (tableSize
+			    > http2_civetweb_server_settings.settings_header_table_size) {
+				DEBUG_TRACE("HTTP2 invalid table size %lu",
+				            (unsigned long)tableSize);
+				return -1;
+			}
+
+			/* Purge additional table entries */
+			conn->http2.dyn_table_max_octets = (uint32_t)tableSize;
+			purge_dynamic_header_table(conn, (uint32_t)tableSize);
+
+			/* Process next entry */
+			continue;
+		}
+
+		/* Get the header name table index */
+		idx = hpack_getnum(buf, &i, idx_mask, conn->phys_ctx);
+
+		/* Get Header name "key" */
+		if (idx == 0) {
+			/* Index 0: Header name encoded in following bytes */
+			key = hpack_decode(buf, &i, len, conn->phys_ctx);
+			CHECK_LEAK_HDR_ALLOC(key);
+		} else if (/*(idx >= 15) &&*/ (idx <= 61)) {
+			/* Take key name from predefined header table */
+			key = mg_strdup_ctx(hpack_predefined[idx].name,
+			                    conn->phys_ctx); /* leak? */
+			CHECK_LEAK_HDR_ALLOC(key);
+		} else if ((idx >= 62) && ((idx - 61) <= conn->http2.dyn_table_size)) {
+			/* Take from dynamic header table */
+			uint32_t local_table_idx = (uint32_t)idx - 62;
+			key = mg_strdup_ctx(conn->http2.dyn_table[local_table_idx].name,
+			                    conn->phys_ctx);
+			CHECK_LEAK_HDR_ALLOC(key);
+		} else {
+			/* protocol violation */
+			DEBUG_TRACE("HTTP2 invalid index %lu", (unsigned long)idx);
+			return -1;
+		}
+		/* key is allocated now and must be freed later */
+
+		/* Get header value */
+		if (value_known) {
+			/* Server must already know the value */
+			if (idx <= 61) {
+				if (hpack_predefined[idx].value) {
+					val = mg_strdup_ctx(hpack_predefined[idx].value,
+					                    conn->phys_ctx); /* leak? */
+					CHECK_LEAK_HDR_ALLOC(val);
+				} else {
+					/* protocol violation */
+					DEBUG_TRACE("HTTP2 indexed header %lu has no value "
+					            "(key: %s)",
+					            (unsigned long)idx,
+					            key);
+					CHECK_LEAK_HDR_FREE(key);
+					mg_free((void *)key);
+					return -1;
+				}
+			} else {
+				uint32_t local_table_idx = (uint32_t)idx - 62;
+				val = mg_strdup_ctx(
+				    conn->http2.dyn_table[local_table_idx].value,
+				    conn->phys_ctx);
+				CHECK_LEAK_HDR_ALLOC(val);
+			}
+
+		} else {
+			/* Read value from HTTP2 stream */
+			val = hpack_decode(buf, &i, len, conn->phys_ctx); /* leak? */
+			CHECK_LEAK_HDR_ALLOC(val);
+
+			if ((key == NULL) || (val == NULL)) {
+				/* Invalid string, or out of memory. In both cases, the
+				 * dynamic table can not be kept in sync. */
+				CHECK_LEAK_HDR_FREE(key);
+				CHECK_LEAK_HDR_FREE(val);
+				mg_free((void *)key);
+				mg_free((void *)val);
+				return -1;
+			}
+
+			if (indexing) {
+				/* Add to table of dynamic headers */
+				add_dynamic_header_table(conn, key, val);
+			}
+		}
+		/* val and key are allocated now and must be freed later */
+		/* Store these pointers in sconn->request_info[].http_headers,
+		 * free_buffered_header_list(sconn) will clean up later. */
+
+		/* Add header for this request */
+		if ((sconn != NULL) && (key != NULL) && (val != NULL)
+		    && (sconn->request_info.num_headers < MG_MAX_HEADERS)) {
+			sconn->request_info.http_headers[sconn->request_info.num_headers]
+			    .name = key;
+			sconn->request_info.http_headers[sconn->request_info.num_headers]
+			    .value = val;
+			sconn->request_info.num_headers++;
+
+			/* Some headers need to be stored in the request structure */
+			if (!strcmp(":method", key)) {
+				sconn->request_info.request_method = val;
+			} else if (!strcmp(":path", key)) {
+				sconn->request_info.request_uri = val;
+				sconn->request_info.local_uri_raw = val;
+				sconn->request_info.local_uri = val;
+			}
+
+			DEBUG_TRACE("HTTP2 request header (key: %s, value: %s)",
+			            key,
+			            val);
+
+		} else {
+			/* - either key or value are NULL (out of memory)
+			 * - or the max. number of headers is reached
+			 * - or the headers are not used (trailers, refused stream)
+			 * in all cases free all memory
+			 */
+			DEBUG_TRACE("%s", "HTTP2 cannot add header");
+			CHECK_LEAK_HDR_FREE(key);
+			CHECK_LEAK_HDR_FREE(val);
+
+			mg_free((void *)key);
+			key = NULL;
+			mg_free((void *)val);
+			val = NULL;
+		}
+	}
+
+	return 0;
+}
+
+
+static struct mg_http2_stream *
+http2_find_stream(struct mg_http2_session *session, uint32_t stream_id)
+{
+	int i;
+	for (i = 0; i < HTTP2_MAX_STREAMS; i++) {
+		if ((session->streams[i].state != HTTP2_STREAM_FREE)
+		    && (session->streams[i].id == stream_id)) {
+			return &(session->streams[i]);
+		}
+	}
+	return NULL;
+}
+
+
+/* Create the connection structure of a new stream, as a copy of the
+ * connection reading the frames. */
+static struct mg_connection *
+http2_new_stream_connection(struct mg_http2_session *session,
+                            struct mg_http2_stream *stream)
+{
+	struct mg_connection *conn = session->conn;
+	struct mg_connection *sconn;
+
+	sconn = (struct mg_connection *)mg_malloc_ctx(sizeof(*sconn),
+	                                              conn->phys_ctx);
+	if (sconn == NULL) {
+		return NULL;
+	}
+	memcpy(sconn, conn, sizeof(*sconn));
+	if (0 != pthread_mutex_init(&sconn->mutex, &pthread_mutex_attr)) {
+		mg_free(sconn);
+		return NULL;
+	}
+
+	/* The dynamic header table belongs to the reading connection */
+	sconn->http2.dyn_table_size = 0;
+	sconn->http2.dyn_table_octets = 0;
+	sconn->http2.stream_id = stream->id;
+	sconn->http2.stream = stream;
+
+	sconn->request_info.request_method = NULL;
+	sconn->request_info.request_uri = NULL;
+	sconn->request_info.local_uri_raw = NULL;
+	sconn->request_info.local_uri = NULL;
+#if defined(MG_LEGACY_INTERFACE)
+	sconn->request_info.uri = NULL;
+#endif
+	sconn->request_info.http_version = "2.0";
+	sconn->request_info.query_string = NULL;
+	sconn->request_info.remote_user = NULL;
+	sconn->request_info.content_length = -1;
+	sconn->request_info.num_headers = 0;
+	sconn->request_info.acceptedWebSocketSubprotocol = NULL;
+
+	sconn->response_info.status_code = 0;
+	sconn->response_info.status_text = NULL;
+	sconn->response_info.http_version = NULL;
+	sconn->response_info.content_length = -1;
+	sconn->response_info.num_headers = 0;
+
+	/* The request body is collected in buf, before the request is
+	 * handled. */
+	sconn->buf = NULL;
+	sconn->buf_size = 0;
+	sconn->data_len = 0;
+	sconn->request_len = 0;
+	sconn->content_len = 0;
+	sconn->consumed_content = 0;
+	sconn->is_chunked = 0;
+
+	sconn->request_state = 0;
+	sconn->status_code = 0;
+	sconn->num_bytes_sent = 0;
+	sconn->path_info = NULL;
+	sconn->must_close = 0;
+	sconn->in_error_handler = 0;
+	sconn->handled_requests = 0;
+#if defined(USE_LUA) && defined(USE_WEBSOCKET)
+	sconn->lua_websocket_state = NULL;
+#endif
+#if defined(USE_LUA)
+	sconn->lua_worker_state[0] = NULL;
+	sconn->lua_worker_state[1] = NULL;
+#endif
+	clock_gettime(CLOCK_MONOTONIC, &(sconn->req_time));
+
+	return sconn;
+}
+
+
+/* Free a stream. Must be called without holding the session mutex. */
 static void
-handle_http2(struct mg_connection *conn)
+http2_free_stream(struct mg_http2_stream *stream)
 {
-	unsigned char http2_frame_head[9];
-	uint32_t http2_frame_size;
-	uint8_t http2_frame_type;
-	uint8_t http2_frame_flags;
-	uint32_t http2_frame_stream_id;
-	uint32_t http_window_length = 0;
-	int bytes_read;
-	uint8_t *buf;
-	int my_settings_accepted = 0;
-	const char *my_hpack_headers[128];
+	struct mg_http2_session *session = stream->session;
+	struct mg_connection *sconn = stream->conn;
+	int was_active = 0;
+
+	if (sconn != NULL) {
+		free_buffered_response_header_list(sconn);
+		free_buffered_request_header_list(sconn);
+		if (sconn->request_info.local_uri
+		    != sconn->request_info.local_uri_raw) {
+			mg_free((void *)sconn->request_info.local_uri);
+		}
+		if (sconn->request_info.remote_user != NULL) {
+			mg_free((void *)sconn->request_info.remote_user);
+		}
+#if defined(USE_LUA)
+		lua_worker_states_close(sconn);
+#endif
+		pthread_mutex_destroy(&sconn->mutex);
+		mg_free(sconn->buf);
+		mg_free(sconn);
+	}
+	mg_free(stream->body);
+	mg_free(stream->http1_head);
+	stream->http1_head = NULL;
+
+	pthread_mutex_lock(&session->mutex);
+	was_active = (stream->state == HTTP2_STREAM_QUEUED)
+	             || (stream->state == HTTP2_STREAM_RUNNING);
+	stream->conn = NULL;
+	stream->body = NULL;
+	stream->state = HTTP2_STREAM_FREE;
+	stream->blocked = 0;
+	if (was_active) {
+		session->active--;
+	}
+	pthread_cond_broadcast(&session->cond);
+	pthread_mutex_unlock(&session->mutex);
+}
 
-	struct http2_settings client_settings = http2_default_settings;
-	struct http2_settings server_settings = http2_default_settings;
 
-	/* Send own settings */
-	http2_send_settings(conn, &http2_civetweb_server_settings);
-	// http2_send_window(conn, 0, /* 0x3fff0001 */ 1024*1024);
-
-	/* initialize hpack header table with predefined header fields */
-	memset((void *)my_hpack_headers, 0, sizeof(my_hpack_headers));
-	memcpy((void *)my_hpack_headers,
-	       hpack_predefined,
-	       sizeof(hpack_predefined));
-
-	buf = (uint8_t *)mg_malloc_ctx(server_settings.settings_max_frame_size,
-	                               conn->phys_ctx);
-	if (!buf) {
-		/* Out of memory */
-		DEBUG_TRACE("%s", "Out of memory for HTTP2 frame");
+/* Handle the request of a stream. Called by a worker thread, or by the
+ * thread reading the connection. */
+static void
+http2_stream_run(struct mg_http2_stream *stream)
+{
+	struct mg_http2_session *session = stream->session;
+	struct mg_connection *sconn = stream->conn;
+	struct mg_workerTLS *tls =
+	    (struct mg_workerTLS *)pthread_getspecific(sTlsKey);
+	int skip;
+
+	pthread_mutex_lock(&session->mutex);
+	stream->state = HTTP2_STREAM_RUNNING;
+	stream->vtime = session->vtime;
+	skip = session->closing || stream->reset;
+	pthread_mutex_unlock(&session->mutex);
+
+	if (tls != NULL) {
+		sconn->tls_user_ptr = tls->user_ptr;
+	}
+
+	if (!skip) {
+		DEBUG_TRACE("HTTP2 handle_request (stream %u)", stream->id);
+		if (stream->too_large) {
+			mg_send_http_error(sconn, 413, "%s", "Request body too large");
+		} else {
+			handle_request_stat_log(sconn);
+		}
+		DEBUG_TRACE("HTTP2 handle_request done (stream %u)", stream->id);
+
+		if (stream->reset) {
+			/* The peer does not want the response anymore */
+		} else if (!stream->headers_sent) {
+			/* No response header sent: there is no valid response */
+			http2_reset_stream(session,
+			                   stream->id,
+			                   HTTP2_ERR_INTERNAL_ERROR);
+		} else {
+			/* Send "final" frame: empty DATA with END_STREAM */
+			http2_send_frame(session, 0, 1, stream->id, NULL, 0);
+		}
+	}
+
+	http2_free_stream(stream);
+}
+
+
+#if !defined(ALTERNATIVE_QUEUE)
+/* Called by consume_socket with ctx->thread_mutex locked. */
+static void
+http2_run_queued_stream(struct mg_context *ctx)
+{
+	struct mg_http2_stream *stream = ctx->h2_queue_head;
+
+	ctx->h2_queue_head = stream->next;
+	if (ctx->h2_queue_head == NULL) {
+		ctx->h2_queue_tail = NULL;
+	}
+	ctx->h2_queue_len--;
+	stream->next = NULL;
+
+	pthread_mutex_unlock(&ctx->thread_mutex);
+	http2_stream_run(stream);
+	pthread_mutex_lock(&ctx->thread_mutex);
+}
+#endif
+
+
+/* A request is complete: hand it over to an idle worker thread, or let
+ * the reading thread handle it. */
+static void
+http2_dispatch_stream(struct mg_http2_stream *stream)
+{
+	struct mg_http2_session *session = stream->session;
+	struct mg_connection *sconn = stream->conn;
+#if !defined(ALTERNATIVE_QUEUE)
+	struct mg_context *ctx = session->conn->phys_ctx;
+	int queued = 0;
+#endif
+
+	/* The request body is read from buf */
+	sconn->buf = stream->body;
+	sconn->buf_size = (int)stream->body_len;
+	sconn->data_len = (int)stream->body_len;
+	sconn->content_len = (int64_t)stream->body_len;
+	if (stream->body_len > 0) {
+		sconn->request_info.content_length = (long long)stream->body_len;
+	}
+	stream->body = NULL;
+
+	pthread_mutex_lock(&session->mutex);
+	stream->state = HTTP2_STREAM_QUEUED;
+	session->active++;
+	pthread_mutex_unlock(&session->mutex);
+
+#if !defined(ALTERNATIVE_QUEUE)
+	pthread_mutex_lock(&ctx->thread_mutex);
+	if ((ctx->sq_idle > ctx->h2_queue_len + ctx->async_queue_len)
+	    && STOP_FLAG_IS_ZERO(&ctx->stop_flag)) {
+		if (ctx->h2_queue_tail != NULL) {
+			ctx->h2_queue_tail->next = stream;
+		} else {
+			ctx->h2_queue_head = stream;
+		}
+		ctx->h2_queue_tail = stream;
+		ctx->h2_queue_len++;
+		queued = 1;
+		pthread_cond_broadcast(&ctx->sq_full);
+	}
+	pthread_mutex_unlock(&ctx->thread_mutex);
+	if (queued) {
 		return;
 	}
+#endif
 
-	for (;;) {
-		/* HTTP/2 is handled frame by frame */
-		int frame_is_end_stream = 0;
-		int frame_is_end_headers = 0;
-		int frame_is_padded = 0;
-		int frame_is_priority = 0;
-
-#if defined(USE_SERVER_STATS)
-		conn->conn_state = 3; /* HTTP/2 ready */
+	/* No idle worker thread: the reading thread handles it later */
+	pthread_mutex_lock(&session->mutex);
+	{
+		struct mg_http2_stream **pp = &(session->pending);
+		while (*pp != NULL) {
+			pp = &((*pp)->next);
+		}
+		stream->next = NULL;
+		*pp = stream;
+	}
+	pthread_mutex_unlock(&session->mutex);
+}
+
+
+/* Add data to the request body of a stream */
+static void
+http2_stream_add_body(struct mg_http2_stream *stream,
+                      const uint8_t *data,
+                      size_t len)
+{
+	if (stream->too_large || (len == 0)) {
+		return;
+	}
+	if (stream->body_len + len > HTTP2_MAX_REQUEST_BODY) {
+		stream->too_large = 1;
+		mg_free(stream->body);
+		stream->body = NULL;
+		stream->body_len = 0;
+		stream->body_size = 0;
+		return;
+	}
+	if (stream->body_len + len > stream->body_size) {
+		size_t new_size = stream->body_size ? stream->body_size : 4096;
+		char *new_body;
+		while (new_size < stream->body_len + len) {
+			new_size *= 2;
+		}
+		new_body = (char *)mg_realloc_ctx(stream->body,
+		                                  new_size,
+		                                  stream->session->conn->phys_ctx);
+		if (new_body == NULL) {
+			stream->too_large = 1;
+			mg_free(stream->body);
+			stream->body = NULL;
+			stream->body_len = 0;
+			stream->body_size = 0;
+			return;
+		}
+		stream->body = new_body;
+		stream->body_size = new_size;
+	}
+	memcpy(stream->body + stream->body_len, data, len);
+	stream->body_len += len;
+}
+
+
+/* A header block is complete: open a new stream, or process trailers.
+ * Return: 0 if ok, -1 for a connection error. */
+static int
+http2_process_header_block(struct mg_http2_session *session,
+                           uint32_t stream_id,
+                           uint32_t weight,
+                           int end_stream)
+{
+	struct mg_connection *conn = session->conn;
+	struct mg_http2_stream *stream = http2_find_stream(session, stream_id);
+	struct mg_connection *sconn = NULL;
+	const char *authority = NULL;
+	int i;
+
+	if (stream != NULL) {
+		/* Trailers of a request. Decode them to keep the dynamic header
+		 * table in sync, but ignore them. */
+		if (http2_decode_header_block(
+		        conn, NULL, session->hdr_block, (int)session->hdr_len)
+		    != 0) {
+			return -1;
+		}
+		if ((stream->state == HTTP2_STREAM_OPEN) && end_stream) {
+			http2_dispatch_stream(stream);
+		}
+		return 0;
+	}
+
+	if (((stream_id & 1u) == 0) || (stream_id <= session->last_stream_id)) {
+		/* Streams initiated by the client must have new, odd ids */
+		DEBUG_TRACE("HTTP2 invalid stream id %u", stream_id);
+		return -1;
+	}
+	session->last_stream_id = stream_id;
+
+	/* Find a free stream */
+	for (i = 0; i < HTTP2_MAX_STREAMS; i++) {
+		if (session->streams[i].state == HTTP2_STREAM_FREE) {
+			stream = &(session->streams[i]);
+			break;
+		}
+	}
+	if ((stream != NULL) && !session->goaway) {
+		memset(stream, 0, sizeof(*stream));
+		stream->session = session;
+		stream->id = stream_id;
+		stream->weight = weight;
+		stream->send_window = session->initial_window_size;
+		sconn = http2_new_stream_connection(session, stream);
+	}
+
+	if (http2_decode_header_block(
+	        conn, sconn, session->hdr_block, (int)session->hdr_len)
+	    != 0) {
+		if (sconn != NULL) {
+			stream->conn = sconn;
+			http2_free_stream(stream);
+		}
+		return -1;
+	}
+
+	if (sconn == NULL) {
+		/* Too many streams, or out of memory */
+		DEBUG_TRACE("HTTP2 refused stream %u", stream_id);
+		http2_reset_stream(session, stream_id, HTTP2_ERR_REFUSED_STREAM);
+		return 0;
+	}
+	stream->conn = sconn;
+
+	pthread_mutex_lock(&session->mutex);
+	stream->state = HTTP2_STREAM_OPEN;
+	pthread_mutex_unlock(&session->mutex);
+
+	if ((sconn->request_info.request_method == NULL)
+	    || (sconn->request_info.request_uri == NULL)) {
+		/* Mandatory pseudo header fields missing */
+		http2_reset_stream(session, stream_id, HTTP2_ERR_PROTOCOL_ERROR);
+		http2_free_stream(stream);
+		return 0;
+	}
+
+	/* Make the :authority pseudo header available as Host header */
+	for (i = 0; i < sconn->request_info.num_headers; i++) {
+		const char *name = sconn->request_info.http_headers[i].name;
+		if (!strcmp(name, ":authority")) {
+			authority = sconn->request_info.http_headers[i].value;
+		} else if (!mg_strcasecmp(name, "host")) {
+			authority = NULL;
+			break;
+		}
+	}
+	if ((authority != NULL)
+	    && (sconn->request_info.num_headers < MG_MAX_HEADERS)) {
+		char *name = mg_strdup_ctx("Host", conn->phys_ctx);
+		char *value = mg_strdup_ctx(authority, conn->phys_ctx);
+		if (name && value) {
+			i = sconn->request_info.num_headers++;
+			sconn->request_info.http_headers[i].name = name;
+			sconn->request_info.http_headers[i].value = value;
+		} else {
+			mg_free(name);
+			mg_free(value);
+		}
+	}
+
+#if defined(USE_ZLIB)
+	{
+		const char *ae = get_header(sconn->request_info.http_headers,
+		                            sconn->request_info.num_headers,
+		                            "accept-encoding");
+		sconn->accept_gzip = ((ae != NULL) && (strstr(ae, "gzip") != NULL));
+	}
 #endif
 
-		bytes_read = mg_read(conn, http2_frame_head, sizeof(http2_frame_head));
-		if (bytes_read != sizeof(http2_frame_head)) {
-			/* TODO: errormsg */
-			goto clean_http2;
+	if (end_stream) {
+		http2_dispatch_stream(stream);
+	}
+	return 0;
+}
+
+
+/* Read len bytes from the peer.
+ * Reading and writing a TLS connection at the same time is not possible,
+ * so reads take the session mutex that protects socket writes. The mutex
+ * is held only while decrypting data that has already arrived (at most the
+ * rest of one TLS record), never while waiting for the peer: otherwise a
+ * slow client would block all streams writing to the connection.
+ * Return: len if ok, -1 for an error or timeout. */
+static int
+http2_read_all(struct mg_http2_session *session, void *buf, uint32_t len)
+{
+	struct mg_connection *conn = session->conn;
+	uint32_t got = 0;
+	int waited_ms = 0;
+
+	if (conn->ssl == NULL) {
+		return mg_read(conn, buf, len);
+	}
+
+	while (got < len) {
+		int64_t avail;
+		int n;
+
+		if (http2_buffered(conn) <= 0) {
+			int r = http2_wait_readable(conn, 200);
+			if (r < 0) {
+				return -1;
+			}
+			if (r == 0) {
+				waited_ms += 200;
+				if (waited_ms > session->timeout_ms) {
+					return -1;
+				}
+				continue;
+			}
+		}
+
+		pthread_mutex_lock(&session->mutex);
+		avail = http2_buffered(conn);
+		if (avail <= 0) {
+			/* Socket readable: read one byte, this decrypts one record and
+			 * makes the rest of it pending. */
+			avail = 1;
+		}
+		if (avail > (int64_t)(len - got)) {
+			avail = (int64_t)(len - got);
 		}
+		n = mg_read(conn, (char *)buf + got, (size_t)avail);
+		pthread_mutex_unlock(&session->mutex);
+
+		if (n <= 0) {
+			return -1;
+		}
+		got += (uint32_t)n;
+		waited_ms = 0;
+	}
+	return (int)got;
+}
+
 
-		/* Extract data from frame header */
+/* Read and process one frame.
+ * Return: 0 if ok, -1 if the connection should be closed. */
+static int
+http2_read_frame(struct mg_http2_session *session)
+{
+	unsigned char http2_frame_head[9];
+	uint32_t http2_frame_size;
+	uint8_t http2_frame_type;
+	uint8_t http2_frame_flags;
+	uint32_t http2_frame_stream_id;
+	uint8_t *buf = session->frame_buf;
+	int bytes_read;
+	int frame_is_end_stream = 0;
+	int frame_is_end_headers = 0;
+	int frame_is_padded = 0;
+	int frame_is_priority = 0;
+
+	bytes_read = http2_read_all(session,
+	                            http2_frame_head,
+	                            sizeof(http2_frame_head));
+	if (bytes_read == sizeof(http2_frame_head)) {
 		http2_frame_size = ((uint32_t)http2_frame_head[0] * 0x10000u)
 		                   + ((uint32_t)http2_frame_head[1] * 0x100u)
 		                   + ((uint32_t)http2_frame_head[2]);
-		http2_frame_type = http2_frame_head[3];
-		http2_frame_flags = http2_frame_head[4];
-		http2_frame_stream_id = ((uint32_t)http2_frame_head[5] * 0x1000000u)
-		                        + ((uint32_t)http2_frame_head[6] * 0x10000u)
-		                        + ((uint32_t)http2_frame_head[7] * 0x100u)
-		                        + ((uint32_t)http2_frame_head[8]);
-
-		frame_is_end_stream = (0 != (http2_frame_flags & 0x01));
-		frame_is_end_headers = (0 != (http2_frame_flags & 0x04));
-		frame_is_padded = (0 != (http2_frame_flags & 0x08));
-		frame_is_priority = (0 != (http2_frame_flags & 0x20));
-
-		if (http2_frame_size > server_settings.settings_max_frame_size) {
-			/* TODO: Error Message */
-			DEBUG_TRACE("HTTP2 frame too large (%lu)",
-			            (unsigned long)http2_frame_size);
-			goto clean_http2;
-		}
-		bytes_read = mg_read(conn, buf, http2_frame_size);
-		if (bytes_read != (int)http2_frame_size) {
-			/* TODO: Error Message - or read again? */
-			DEBUG_TRACE("HTTP2 read error (%li != %li)",
-			            (signed long int)bytes_read,
-			            (signed long int)http2_frame_size);
-			goto clean_http2;
-		}
-
-		DEBUG_TRACE("HTTP2 frame type %u, size %u, stream %u, flags %02x",
-		            http2_frame_type,
-		            http2_frame_size,
-		            http2_frame_stream_id,
-		            http2_frame_flags);
-
-		/* Further processing according to frame type. See definition: */
-		/* https://tools.ietf.org/html/rfc7540#section-6 */
-		switch (http2_frame_type) {
-
-		case 0: /* DATA */
-		{
-			/* TODO */
-			DEBUG_TRACE("%s", "HTTP2 DATA frame?");
-		} break;
-
-		case 1: /* HEADERS */
-		{
-			int i = 0;
-			uint8_t padding = 0;
-			uint32_t dependency = 0;
-			uint8_t weight = 0;
-			uint8_t exclusive = 0;
-
-			/* Request start time */
-			clock_gettime(CLOCK_MONOTONIC, &(conn->req_time));
-
-			if (frame_is_padded) {
-				padding = buf[i];
-				i++;
-				DEBUG_TRACE("HTTP2 frame padded by %u bytes", padding);
+		if (http2_frame_size > HTTP2_MAX_FRAME_SIZE) {
+			bytes_read = -1;
+		} else {
+			bytes_read = http2_read_all(session, buf, http2_frame_size);
+			if (bytes_read != (int)http2_frame_size) {
+				bytes_read = -1;
 			}
-			if (frame_is_priority) {
-				uint32_t val = ((uint32_t)buf[0 + i] * 0x1000000u)
-				               + ((uint32_t)buf[1 + i] * 0x10000u)
-				               + ((uint32_t)buf[2 + i] * 0x100u)
-				               + ((uint32_t)buf[3 + i]);
-				dependency = (val & 0x7FFFFFFFu);
-				exclusive = ((val & 0x80000000u) != 0);
-				weight = buf[4 + i];
-				i += 5;
-				DEBUG_TRACE(
-				    "HTTP2 frame weight %u, dependency %u (exclusive: %i)",
-				    weight,
-				    dependency,
-				    exclusive);
+		}
+	} else {
+		http2_frame_size = 0;
+		bytes_read = -1;
+	}
+
+	if (bytes_read < 0) {
+		DEBUG_TRACE("HTTP2 read error (frame size %lu)",
+		            (unsigned long)http2_frame_size);
+		if (http2_frame_size > HTTP2_MAX_FRAME_SIZE) {
+			http2_send_goaway(session, HTTP2_ERR_FRAME_SIZE_ERROR);
+		}
+		return -1;
+	}
+
+	/* Extract data from frame header */
+	http2_frame_type = http2_frame_head[3];
+	http2_frame_flags = http2_frame_head[4];
+	http2_frame_stream_id = ((uint32_t)(http2_frame_head[5] & 0x7Fu)
+	                         * 0x1000000u)
+	                        + ((uint32_t)http2_frame_head[6] * 0x10000u)
+	                        + ((uint32_t)http2_frame_head[7] * 0x100u)
+	                        + ((uint32_t)http2_frame_head[8]);
+
+	frame_is_end_stream = (0 != (http2_frame_flags & 0x01));
+	frame_is_end_headers = (0 != (http2_frame_flags & 0x04));
+	frame_is_padded = (0 != (http2_frame_flags & 0x08));
+	frame_is_priority = (0 != (http2_frame_flags & 0x20));
+
+	DEBUG_TRACE("HTTP2 frame type %u, size %u, stream %u, flags %02x",
+	            http2_frame_type,
+	            http2_frame_size,
+	            http2_frame_stream_id,
+	            http2_frame_flags);
+
+	if ((session->hdr_stream_id != 0)
+	    && ((http2_frame_type != 9)
+	        || (http2_frame_stream_id != session->hdr_stream_id))) {
+		/* A header block must be continued by CONTINUATION frames */
+		http2_send_goaway(session, HTTP2_ERR_PROTOCOL_ERROR);
+		return -1;
+	}
+
+	/* Further processing according to frame type. See definition: */
+	/* https://tools.ietf.org/html/rfc7540#section-6 */
+	switch (http2_frame_type) {
+
+	case 0: /* DATA */
+	{
+		struct mg_http2_stream *stream;
+		uint32_t data_start = 0;
+		uint32_t data_len = http2_frame_size;
+
+		if (http2_frame_stream_id == 0) {
+			http2_send_goaway(session, HTTP2_ERR_PROTOCOL_ERROR);
+			return -1;
+		}
+		if (frame_is_padded) {
+			if ((http2_frame_size < 1) || (buf[0] >= http2_frame_size)) {
+				http2_send_goaway(session, HTTP2_ERR_PROTOCOL_ERROR);
+				return -1;
 			}
+			data_start = 1;
+			data_len = http2_frame_size - 1 - buf[0];
+		}
 
-			conn->request_info.num_headers = 0;
-
-			while (i < (int)http2_frame_size - (int)padding) {
-				const char *key = 0;
-				const char *val = 0;
-				uint8_t idx_mask = 0;
-				uint8_t value_known = 0;
-				uint8_t indexing = 0;
-				uint64_t idx = 0;
-
-				/* Classify next entry by checking the bit mask */
-				if ((buf[i] & 0x80u) == 0x80u) {
-					/* Indexed Header Field Representation:
-					 * https://tools.ietf.org/html/rfc7541#section-6.1 */
-					idx_mask = 0x7fu;
-					value_known = 1;
-
-				} else if ((buf[i] & 0xC0u) == 0x40u) {
-					/* Literal Header Field with Incremental Indexing:
-					 * https://tools.ietf.org/html/rfc7541#section-6.2.1 */
-					idx_mask = 0x3fu;
-					indexing = 1;
-
-				} else if ((buf[i] & 0xF0u) == 0x00u) {
-					/* Literal Header Field without Indexing:
-					 * https://tools.ietf.org/html/rfc7541#section-6.2.2 */
-					idx_mask = 0x0fu;
-
-				} else if ((buf[i] & 0xF0u) == 0x10u) {
-					/* Literal Header Field Never Indexed:
-					 * https://tools.ietf.org/html/rfc7541#section-6.2.3 */
-					idx_mask = 0x0fu;
-
-				} else if ((buf[i] & 0xE0u) == 0x20u) {
-					uint64_t tableSize;
-					/* Dynamic Table Size Update:
-					 * https://tools.ietf.org/html/rfc7541#section-6.3 */
-					idx_mask = 0x1fu;
-					tableSize = hpack_getnum(buf, &i, idx_mask, conn->phys_ctx);
-
-					/* TODO: check if tablesize > allowed table size */
-
-					/* Purge additional table entries */
-					purge_dynamic_header_table(conn, (uint32_t)tableSize);
-
-					/* Process next frame */
-					continue;
+		/* The data is consumed immediately, so the receive window can be
+		 * restored at once. */
+		stream = http2_find_stream(session, http2_frame_stream_id);
+		if (http2_frame_size > 0) {
+			http2_send_window_update(session, 0, http2_frame_size);
+			if ((stream != NULL) && !frame_is_end_stream) {
+				http2_send_window_update(session,
+				                         http2_frame_stream_id,
+				                         http2_frame_size);
+			}
+		}
+		if ((stream != NULL) && (stream->state == HTTP2_STREAM_OPEN)) {
+			http2_stream_add_body(stream, buf + data_start, data_len);
+			if (frame_is_end_stream) {
+				http2_dispatch_stream(stream);
+			}
+		} else {
+			DEBUG_TRACE("HTTP2 DATA for closed stream %u",
+			            http2_frame_stream_id);
+		}
+	} break;
 
-				} else {
-					DEBUG_TRACE("HTTP2 unknown start pattern %02x", buf[i]);
-					goto clean_http2;
-				}
+	case 1: /* HEADERS */
+	{
+		uint32_t i = 0;
+		uint32_t padding = 0;
+		uint32_t weight = 16; /* default, see RFC 7540, 5.3.5 */
 
-				/* Get the header name table index */
-				idx = hpack_getnum(buf, &i, idx_mask, conn->phys_ctx);
-
-				/* Get Header name "key" */
-				if (idx == 0) {
-					/* Index 0: Header name encoded in following bytes */
-					key = hpack_decode(buf, &i, conn->phys_ctx);
-					CHECK_LEAK_HDR_ALLOC(key);
-				} else if (/*(idx >= 15) &&*/ (idx <= 61)) {
-					/* Take key name from predefined header table */
-					key = mg_strdup_ctx(hpack_predefined[idx].name,
-					                    conn->phys_ctx); /* leak? */
-					CHECK_LEAK_HDR_ALLOC(key);
-				} else if ((idx >= 62)
-				           && ((idx - 61) <= conn->http2.dyn_table_size)) {
-					/* Take from dynamic header table */
-					uint32_t local_table_idx = (uint32_t)idx - 62;
-					key = mg_strdup_ctx(
-					    conn->http2.dyn_table[local_table_idx].name,
-					    conn->phys_ctx);
-					CHECK_LEAK_HDR_ALLOC(key);
-				} else {
-					/* protocol violation */
-					DEBUG_TRACE("HTTP2 invalid index %lu", (unsigned long)idx);
-					goto clean_http2;
-				}
-				/* key is allocated now and must be freed later */
-
-				/* Get header value */
-				if (value_known) {
-					/* Server must already know the value */
-					if (idx <= 61) {
-						if (hpack_predefined[idx].value) {
-							val = mg_strdup_ctx(hpack_predefined[idx].value,
-							                    conn->phys_ctx); /* leak? */
-							CHECK_LEAK_HDR_ALLOC(val);
-						} else {
-							/* protocol violation */
-							DEBUG_TRACE("HTTP2 indexed header %lu has no value "
-							            "(key: %s)",
-							            (unsigned long)idx,
-							            key);
-							CHECK_LEAK_HDR_FREE(key);
-							mg_free((void *)key);
-							goto clean_http2;
-						}
-					} else if ((idx >= 62)
-					           && ((idx - 61) <= conn->http2.dyn_table_size)) {
-						uint32_t local_table_idx = (uint32_t)idx - 62;
-						val = mg_strdup_ctx(
-						    conn->http2.dyn_table[local_table_idx].value,
-						    conn->phys_ctx);
-						CHECK_LEAK_HDR_ALLOC(val);
-					} else {
-						/* protocol violation */
-						DEBUG_TRACE(
-						    "HTTP2 indexed header %lu out of range (key: %s)",
-						    (unsigned long)idx,
-						    key);
-						CHECK_LEAK_HDR_FREE(key);
-						mg_free((void *)key);
-						goto clean_http2;
-					}
+		if (http2_frame_stream_id == 0) {
+			http2_send_goaway(session, HTTP2_ERR_PROTOCOL_ERROR);
+			return -1;
+		}
+		if (frame_is_padded) {
+			if (http2_frame_size < 1) {
+				http2_send_goaway(session, HTTP2_ERR_PROTOCOL_ERROR);
+				return -1;
+			}
+			padding = buf[i];
+			i++;
+			DEBUG_TRACE("HTTP2 frame padded by %u bytes", padding);
+		}
+		if (frame_is_priority) {
+			if (i + 5 > http2_frame_size) {
+				http2_send_goaway(session, HTTP2_ERR_PROTOCOL_ERROR);
+				return -1;
+			}
+			weight = (uint32_t)buf[4 + i] + 1;
+			DEBUG_TRACE("HTTP2 frame weight %u", weight);
+			i += 5;
+		}
+		if (i + padding > http2_frame_size) {
+			http2_send_goaway(session, HTTP2_ERR_PROTOCOL_ERROR);
+			return -1;
+		}
 
-				} else {
-					/* Read value from HTTP2 stream */
-					val = hpack_decode(buf, &i, conn->phys_ctx); /* leak? */
-					CHECK_LEAK_HDR_ALLOC(val);
+		memcpy(session->hdr_block, buf + i, http2_frame_size - i - padding);
+		session->hdr_len = http2_frame_size - i - padding;
 
-					if (indexing) {
-						/* Add to index */
-						if (conn->http2.dyn_table_size
-						    >= HTTP2_DYN_TABLE_SIZE) {
-							/* Too many elements */
-							DEBUG_TRACE("HTTP2 index table is full (key: %s, "
-							            "value: %s)",
-							            key,
-							            val);
-
-							CHECK_LEAK_HDR_FREE(key);
-							CHECK_LEAK_HDR_FREE(val);
-
-							mg_free((void *)key);
-							mg_free((void *)val);
-							goto clean_http2;
-						}
-
-						/* Add to table of dynamic headers */
-						conn->http2.dyn_table[conn->http2.dyn_table_size].name =
-						    mg_strdup_ctx(key, conn->phys_ctx); /* leak */
-						conn->http2.dyn_table[conn->http2.dyn_table_size]
-						    .value =
-						    mg_strdup_ctx(val, conn->phys_ctx); /* leak */
-
-						CHECK_LEAK_DYN_ALLOC(
-						    conn->http2.dyn_table[conn->http2.dyn_table_size]
-						        .name);
-						CHECK_LEAK_DYN_ALLOC(
-						    conn->http2.dyn_table[conn->http2.dyn_table_size]
-						        .value);
-
-						conn->http2.dyn_table_size++;
-
-						DEBUG_TRACE("HTTP2 new dynamic header table entry %i "
-						            "(key: %s, value: %s)",
-						            (int)conn->http2.dyn_table_size,
-						            key,
-						            val);
+		if (!frame_is_end_headers) {
+			/* Wait for CONTINUATION frames */
+			session->hdr_stream_id = http2_frame_stream_id;
+			session->hdr_end_stream = frame_is_end_stream;
+			session->hdr_weight = weight;
+			break;
+		}
+		if (http2_process_header_block(session,
+		                               http2_frame_stream_id,
+		                               weight,
+		                               frame_is_end_stream)
+		    != 0) {
+			http2_send_goaway(session, HTTP2_ERR_COMPRESSION_ERROR);
+			return -1;
+		}
+	} break;
+
+	case 2: /* PRIORITY */
+	{
+		struct mg_http2_stream *stream;
+		if (http2_frame_size != 5) {
+			http2_send_goaway(session, HTTP2_ERR_FRAME_SIZE_ERROR);
+			return -1;
+		}
+		stream = http2_find_stream(session, http2_frame_stream_id);
+		if (stream != NULL) {
+			pthread_mutex_lock(&session->mutex);
+			stream->weight = (uint32_t)buf[4] + 1;
+			pthread_mutex_unlock(&session->mutex);
+		}
+		DEBUG_TRACE("HTTP2 priority %u for stream %u",
+		            (unsigned)buf[4] + 1,
+		            http2_frame_stream_id);
+	} break;
+
+	case 3: /* RST_STREAM */
+	{
+		struct mg_http2_stream *stream =
+		    http2_find_stream(session, http2_frame_stream_id);
+		DEBUG_TRACE("HTTP2 reset stream %u", http2_frame_stream_id);
+		if (stream != NULL) {
+			int is_open;
+			pthread_mutex_lock(&session->mutex);
+			stream->reset = 1;
+			is_open = (stream->state == HTTP2_STREAM_OPEN);
+			pthread_cond_broadcast(&session->cond);
+			pthread_mutex_unlock(&session->mutex);
+			if (is_open) {
+				/* Not dispatched yet */
+				http2_free_stream(stream);
+			}
+		}
+	} break;
+
+	case 4: /* SETTINGS */
+		if (http2_frame_stream_id != 0) {
+			/* Send protocol error */
+			DEBUG_TRACE("%s", "HTTP2 received invalid settings frame");
+			http2_send_goaway(session, HTTP2_ERR_PROTOCOL_ERROR);
+			return -1;
+		} else if (http2_frame_flags) {
+			/* ACK frame. Do not reply. */
+			DEBUG_TRACE("%s", "CivetWeb settings confirmed by peer");
+		} else {
+			uint32_t i;
+			pthread_mutex_lock(&session->mutex);
+			for (i = 0; i + 6 <= http2_frame_size; i += 6) {
+				uint16_t id =
+				    ((uint16_t)buf[i] * 0x100u) + ((uint16_t)buf[i + 1]);
+				uint32_t val = ((uint32_t)buf[i + 2] * 0x1000000u)
+				               + ((uint32_t)buf[i + 3] * 0x10000u)
+				               + ((uint32_t)buf[i + 4] * 0x100u)
+				               + ((uint32_t)buf[i + 5]);
+				DEBUG_TRACE("Received settings id=%u: %u", id, val);
+				if (id == 1) {
+					/* SETTINGS_HEADER_TABLE_SIZE: max. size of the dynamic
+					 * header table of the peer's decoder */
+					uint32_t max_octets = (val < HTTP2_ENC_TABLE_OCTETS)
+					                          ? val
+					                          : HTTP2_ENC_TABLE_OCTETS;
+					if (max_octets != session->enc_table_max_octets) {
+						session->enc_table_max_octets = max_octets;
+						session->enc_table_update = 1;
+						hpack_enc_table_purge(session, max_octets);
 					}
-				}
-				/* val and key are allocated now and must be freed later */
-				/* Store these pointers in conn->request_info[].http_headers,
-				 * free_buffered_header_list(conn) will clean up later. */
-
-				/* Add header for this request */
-				if ((key != NULL) && (val != NULL)
-				    && (conn->request_info.num_headers < MG_MAX_HEADERS)) {
-					conn->request_info
-					    .http_headers[conn->request_info.num_headers]
-					    .name = key;
-					conn->request_info
-					    .http_headers[conn->request_info.num_headers]
-					    .value = val;
-					conn->request_info.num_headers++;
-
-					/* Some headers need to be stored in the request structure
-					 */
-					if (!strcmp(":method", key)) {
-						conn->request_info.request_method = val;
-					} else if (!strcmp(":path", key)) {
-						conn->request_info.local_uri = val;
-						conn->request_info.request_uri = val;
-					} else if (!strcmp(":status", key)) {
-						conn->status_code = atoi(val);
+				} else if ((id == 4) && (val <= 0x7FFFFFFFu)) {
+					/* SETTINGS_INITIAL_WINDOW_SIZE: adjust the windows of
+					 * all open streams, see RFC 7540, 6.9.2 */
+					int64_t delta =
+					    (int64_t)val - (int64_t)session->initial_window_size;
+					int s;
+					for (s = 0; s < HTTP2_MAX_STREAMS; s++) {
+						session->streams[s].send_window += delta;
 					}
+					session->initial_window_size = val;
+				} else if ((id == 5) && (val >= 16384)
+				           && (val <= 16777215)) {
+					/* SETTINGS_MAX_FRAME_SIZE */
+					session->max_frame_size = val;
+				}
+				/* Other settings do not affect this server */
+			}
+			pthread_cond_broadcast(&session->cond);
+			pthread_mutex_unlock(&session->mutex);
 
-					DEBUG_TRACE("HTTP2 request header (key: %s, value: %s)",
-					            key,
-					            val);
+			/* Every settings frame must be acknowledged */
+			http2_settings_acknowledge(session);
+		}
+		break;
 
-				} else {
-					/* - either key or value are NULL (out of memory)
-					 * - or the max. number of headers is reached
-					 * in both cases free all memory
-					 */
-					DEBUG_TRACE("%s", "HTTP2 cannot add header");
-					CHECK_LEAK_HDR_FREE(key);
-					CHECK_LEAK_HDR_FREE(val);
+	case 5: /* PUSH_PROMISE */
+		DEBUG_TRACE("%s", "Push promise not supported");
+		http2_send_goaway(session, HTTP2_ERR_PROTOCOL_ERROR);
+		return -1;
 
-					mg_free((void *)key);
-					key = NULL;
-					mg_free((void *)val);
-					val = NULL;
-				}
-			}
+	case 6: /* PING */
+		if (http2_frame_size != 8) {
+			http2_send_goaway(session, HTTP2_ERR_FRAME_SIZE_ERROR);
+			return -1;
+		}
+		if (http2_frame_flags == 0) {
+			/* Set "reply" flag, and send same data back */
+			DEBUG_TRACE("%s", "Replying to ping");
+			http2_send_frame(session, 6, 1, 0, buf, 8);
+		}
+		break;
 
-			/* stream id */
-			conn->http2.stream_id = http2_frame_stream_id;
+	case 7: /* GOAWAY */
+		DEBUG_TRACE("%s", "HTTP2 goaway");
+		pthread_mutex_lock(&session->mutex);
+		session->goaway = 1;
+		pthread_mutex_unlock(&session->mutex);
+		break;
 
-			/* header parsed */
-			DEBUG_TRACE("HTTP2 handle_request (stream %u)",
-			            http2_frame_stream_id);
-			handle_request_stat_log(conn);
+	case 8: /* WINDOW_UPDATE */
+	{
+		struct mg_http2_stream *stream = NULL;
+		uint32_t val;
+		uint32_t err = 0;
+		int is_open = 0;
+		if (http2_frame_size != 4) {
+			http2_send_goaway(session, HTTP2_ERR_FRAME_SIZE_ERROR);
+			return -1;
+		}
+		val = ((uint32_t)(buf[0] & 0x7Fu) * 0x1000000u)
+		      + ((uint32_t)buf[1] * 0x10000u) + ((uint32_t)buf[2] * 0x100u)
+		      + ((uint32_t)buf[3]);
 
-			/* Send "final" frame */
-			DEBUG_TRACE("HTTP2 handle_request done (stream %u)",
-			            http2_frame_stream_id);
-			http2_data_frame_head(conn, 0, 1);
-			free_buffered_response_header_list(conn);
-			free_buffered_request_header_list(conn);
-		} break;
-
-		case 2: /* PRIORITY */
-		{
-			uint32_t dependStream =
-			    ((uint32_t)buf[0] * 0x1000000u) + ((uint32_t)buf[1] * 0x10000u)
-			    + ((uint32_t)buf[2] * 0x100u) + ((uint32_t)buf[3]);
-			uint8_t weight = buf[4];
-			DEBUG_TRACE("HTTP2 priority %u dependent stream %u",
-			            weight,
-			            dependStream);
-		} break;
-
-		case 3: /* RST_STREAM */
-		{
-			uint32_t errorId =
-			    ((uint32_t)buf[0] * 0x1000000u) + ((uint32_t)buf[1] * 0x10000u)
-			    + ((uint32_t)buf[2] * 0x100u) + ((uint32_t)buf[3]);
-			DEBUG_TRACE("HTTP2 reset with error %u", errorId);
-		} break;
-
-		case 4: /* SETTINGS */
-			if (http2_frame_stream_id != 0) {
-				/* Send protocol error */
-				http2_reset_stream(conn,
-				                   http2_frame_stream_id,
-				                   HTTP2_ERR_PROTOCOL_ERROR);
-				DEBUG_TRACE("%s", "HTTP2 received invalid settings frame");
-			} else if (http2_frame_flags) {
-				/* ACK frame. Do not reply. */
-				my_settings_accepted++;
-				DEBUG_TRACE("%s", "CivetWeb settings confirmed by peer");
+		DEBUG_TRACE("HTTP2 window update stream %u, length %u",
+		            http2_frame_stream_id,
+		            val);
+
+		/* A zero increment is a PROTOCOL_ERROR, a window larger than 2^31-1
+		 * a FLOW_CONTROL_ERROR, see RFC 7540, 6.9 */
+		pthread_mutex_lock(&session->mutex);
+		if (http2_frame_stream_id == 0) {
+			if (val == 0) {
+				err = HTTP2_ERR_PROTOCOL_ERROR;
+			} else if (session->send_window + val > 0x7FFFFFFF) {
+				err = HTTP2_ERR_FLOW_CONTROL_ERROR;
 			} else {
-				int i;
-				for (i = 0; i < (int)http2_frame_size; i += 6) {
-					uint16_t id =
-					    ((uint16_t)buf[i] * 0x100u) + ((uint16_t)buf[i + 1]);
-					uint32_t val = ((uint32_t)buf[i + 2] * 0x1000000u)
-					               + ((uint32_t)buf[i + 3] * 0x10000u)
-					               + ((uint32_t)buf[i + 4] * 0x100u)
-					               + ((uint32_t)buf[i + 5]);
-					switch (id) {
-					case 1:
-						client_settings.settings_header_table_size = val;
-						DEBUG_TRACE("Received settings header_table_size: %u",
-						            val);
-						break;
-					case 2:
-						client_settings.settings_enable_push = (val != 0);
-						DEBUG_TRACE("Received settings enable_push: %u", val);
-						break;
-					case 3:
-						client_settings.settings_max_concurrent_streams = val;
-						DEBUG_TRACE(
-						    "Received settings max_concurrent_streams: %u",
-						    val);
-						break;
-					case 4:
-						client_settings.settings_initial_window_size = val;
-						DEBUG_TRACE("Received settings initial_window_size: %u",
-						            val);
-						break;
-					case 5:
-						client_settings.settings_max_frame_size = val;
-						DEBUG_TRACE("Received settings max_frame_size: %u",
-						            val);
-						break;
-					case 6:
-						client_settings.settings_max_header_list_size = val;
-						DEBUG_TRACE(
-						    "Received settings max_header_list_size: %u", val);
-						break;
-					default:
-						/* Unknown setting. Ignore it. */
-						DEBUG_TRACE("Received unknown settings id=%u: %u",
-						            id,
-						            val);
-						break;
-					}
-				}
+				session->send_window += val;
+			}
+		} else {
+			stream = http2_find_stream(session, http2_frame_stream_id);
+			if (stream == NULL) {
+				/* Stream already closed */
+			} else if (val == 0) {
+				err = HTTP2_ERR_PROTOCOL_ERROR;
+			} else if (stream->send_window + val > 0x7FFFFFFF) {
+				err = HTTP2_ERR_FLOW_CONTROL_ERROR;
+			} else {
+				stream->send_window += val;
+			}
+			if (err != 0) {
+				stream->reset = 1;
+				is_open = (stream->state == HTTP2_STREAM_OPEN);
+			}
+		}
+		pthread_cond_broadcast(&session->cond);
+		pthread_mutex_unlock(&session->mutex);
 
-				/* Every settings frame must be acknowledged */
-				http2_settings_acknowledge(conn);
+		if (err != 0) {
+			if (http2_frame_stream_id == 0) {
+				http2_send_goaway(session, err);
+				return -1;
 			}
-			break;
+			http2_reset_stream(session, http2_frame_stream_id, err);
+			if (is_open) {
+				/* Not dispatched yet */
+				http2_free_stream(stream);
+			}
+		}
+	} break;
+
+	case 9: /* CONTINUATION */
+		if ((session->hdr_stream_id == 0)
+		    || (session->hdr_len + http2_frame_size
+		        > HTTP2_MAX_HEADER_BLOCK)) {
+			http2_send_goaway(session, HTTP2_ERR_PROTOCOL_ERROR);
+			return -1;
+		}
+		memcpy(session->hdr_block + session->hdr_len, buf, http2_frame_size);
+		session->hdr_len += http2_frame_size;
+		if (frame_is_end_headers) {
+			uint32_t stream_id = session->hdr_stream_id;
+			session->hdr_stream_id = 0;
+			if (http2_process_header_block(session,
+			                               stream_id,
+			                               session->hdr_weight,
+			                               session->hdr_end_stream)
+			    != 0) {
+				http2_send_goaway(session, HTTP2_ERR_COMPRESSION_ERROR);
+				return -1;
+			}
+		}
+		break;
+
+	default:
+		/* Unknown frame types must be ignored */
+		DEBUG_TRACE("%s", "Unknown frame type");
+		break;
+	}
+
+	return 0;
+}
+
+
+/* Run a HTTP/2 session, after the connection preface has been received.
+ * This function returns once the connection can be closed. */
+static void
+handle_http2(struct mg_connection *conn)
+{
+	struct mg_http2_session *session;
+	uint64_t idle_start;
+	int i;
+
+	session = (struct mg_http2_session *)mg_calloc_ctx(1,
+	                                                    sizeof(*session),
+	                                                    conn->phys_ctx);
+	if (session == NULL) {
+		return;
+	}
+	session->frame_buf =
+	    (uint8_t *)mg_malloc_ctx(HTTP2_MAX_FRAME_SIZE + 1, conn->phys_ctx);
+	session->hdr_block =
+	    (uint8_t *)mg_malloc_ctx(HTTP2_MAX_HEADER_BLOCK + 1, conn->phys_ctx);
+	session->send_buf =
+	    (uint8_t *)mg_malloc_ctx(HTTP2_MAX_FRAME_SIZE + 9, conn->phys_ctx);
+	if ((session->frame_buf == NULL) || (session->hdr_block == NULL)
+	    || (session->send_buf == NULL)) {
+		mg_free(session->frame_buf);
+		mg_free(session->hdr_block);
+		mg_free(session->send_buf);
+		mg_free(session);
+		return;
+	}
+	/* Do not use the recursive mutex attribute: the mutex is used with
+	 * condition variables. */
+	pthread_mutex_init(&session->mutex, NULL);
+	pthread_cond_init(&session->cond, NULL);
+
+	session->conn = conn;
+	session->send_window = 65535;
+	session->initial_window_size =
+	    http2_default_settings.settings_initial_window_size;
+	session->max_frame_size = http2_default_settings.settings_max_frame_size;
+	session->timeout_ms = http2_timeout_ms(conn);
+	session->enc_table_max_octets =
+	    http2_default_settings.settings_header_table_size;
+
+	conn->http2.session = session;
+	conn->http2.stream = NULL;
+	conn->http2.stream_id = 0;
+	conn->http2.dyn_table_size = 0;
+	conn->http2.dyn_table_octets = 0;
+	conn->http2.dyn_table_max_octets =
+	    http2_civetweb_server_settings.settings_header_table_size;
+
+	/* Send own settings */
+	http2_send_settings(session, &http2_civetweb_server_settings);
+
+	idle_start = mg_get_current_time_ns();
+	for (;;) {
+		int r;
+		int active, closing, goaway;
+		struct mg_http2_stream *stream;
+
+		pthread_mutex_lock(&session->mutex);
+		active = session->active;
+		closing = session->closing;
+		goaway = session->goaway;
+		stream = session->pending;
+		if (stream != NULL) {
+			session->pending = stream->next;
+			stream->next = NULL;
+		}
+		pthread_mutex_unlock(&session->mutex);
+
+		if (stream != NULL) {
+			/* No idle worker thread was available for this stream */
+			session->inline_stream = stream;
+			http2_stream_run(stream);
+			session->inline_stream = NULL;
+			idle_start = mg_get_current_time_ns();
+			continue;
+		}
 
-		case 5: /* PUSH_PROMISE */
-			DEBUG_TRACE("%s", "Push promise not supported");
+		if (closing) {
 			break;
+		}
+		if (goaway && (active == 0)) {
+			/* All requests the peer is interested in are done */
+			break;
+		}
 
-		case 6: /* PING */
-			if (http2_frame_flags == 0) {
-				/* Set "reply" flag, and send same data back */
-				DEBUG_TRACE("%s", "Replying to ping");
-				http2_frame_head[4] = 1;
-				mg_xwrite(conn, http2_frame_head, sizeof(http2_frame_head));
-				mg_xwrite(conn, buf, http2_frame_size);
-			}
+		r = http2_wait_readable(conn, 200);
+		if (r < 0) {
 			break;
+		}
+		if (r == 0) {
+			/* Close idle connections after request_timeout_ms */
+			uint64_t now = mg_get_current_time_ns();
+			if (active > 0) {
+				idle_start = now;
+			} else if ((now - idle_start)
+			           > ((uint64_t)session->timeout_ms * 1000000u)) {
+				DEBUG_TRACE("%s", "HTTP2 idle timeout");
+				http2_send_goaway(session, HTTP2_ERR_NO_ERROR);
+				break;
+			}
+			continue;
+		}
 
-		case 7: /* GOAWAY */
-		{
-			uint32_t lastStream =
-			    ((uint32_t)buf[0] * 0x1000000u) + ((uint32_t)buf[1] * 0x10000u)
-			    + ((uint32_t)buf[2] * 0x100u) + ((uint32_t)buf[3]);
-			uint32_t errorId =
-			    ((uint32_t)buf[4] * 0x1000000u) + ((uint32_t)buf[5] * 0x10000u)
-			    + ((uint32_t)buf[6] * 0x100u) + ((uint32_t)buf[7]);
-			; /* followed by debug data */
-			uint32_t debugDataLen = http2_frame_size - 8;
-			char *debugData = (char *)buf + 8;
-
-			DEBUG_TRACE("HTTP2 goaway stream %u, error %u (%.*s)",
-			            lastStream,
-			            errorId,
-			            debugDataLen,
-			            debugData);
-
-		} break;
-
-		case 8: /* WINDOW_UPDATE */
-		{
-			uint32_t val = ((uint32_t)buf[0] * 0x1000000u)
-			               + ((uint32_t)buf[1] * 0x10000u)
-			               + ((uint32_t)buf[2] * 0x100u) + ((uint32_t)buf[3]);
-			http_window_length = (val & 0x7FFFFFFFu);
-
-			DEBUG_TRACE("HTTP2 window update stream %u, length %u",
-			            http2_frame_stream_id,
-			            http_window_length);
-		} break;
-
-		case 9: /* CONTINUATION */
-			DEBUG_TRACE("%s", "HTTP2 Continue");
+		if (http2_read_frame(session) != 0) {
 			break;
+		}
+		idle_start = mg_get_current_time_ns();
+	}
 
-		default:
-			/* TODO: Error Message */
-			DEBUG_TRACE("%s", "Unknown frame type");
-			goto clean_http2;
+	/* Stop all streams */
+	pthread_mutex_lock(&session->mutex);
+	session->closing = 1;
+	pthread_cond_broadcast(&session->cond);
+	pthread_mutex_unlock(&session->mutex);
+
+#if !defined(ALTERNATIVE_QUEUE)
+	/* Remove streams of this connection not taken by a worker thread */
+	{
+		struct mg_context *ctx = conn->phys_ctx;
+		struct mg_http2_stream **pp = &(ctx->h2_queue_head);
+
+		pthread_mutex_lock(&ctx->thread_mutex);
+		ctx->h2_queue_tail = NULL;
+		while (*pp != NULL) {
+			if ((*pp)->session == session) {
+				struct mg_http2_stream *s = *pp;
+				*pp = s->next;
+				s->next = session->pending;
+				session->pending = s;
+				ctx->h2_queue_len--;
+			} else {
+				ctx->h2_queue_tail = *pp;
+				pp = &((*pp)->next);
+			}
 		}
+		pthread_mutex_unlock(&ctx->thread_mutex);
+	}
+#endif
 
-		/* not used in the moment */
-		(void)frame_is_end_stream;
-		(void)frame_is_end_headers;
-		(void)client_settings;
+	while (session->pending != NULL) {
+		struct mg_http2_stream *s = session->pending;
+		session->pending = s->next;
+		s->next = NULL;
+		http2_free_stream(s);
+	}
+	for (i = 0; i < HTTP2_MAX_STREAMS; i++) {
+		if (session->streams[i].state == HTTP2_STREAM_OPEN) {
+			http2_free_stream(&(session->streams[i]));
+		}
 	}
 
-clean_http2:
-	DEBUG_TRACE("%s", "HTTP2 free buffer, connection handler finished");
-	mg_free(buf);
+	/* Wait for streams handled by other worker threads */
+	pthread_mutex_lock(&session->mutex);
+	while (session->active > 0) {
+		pthread_cond_wait(&session->cond, &session->mutex);
+	}
+	pthread_mutex_unlock(&session->mutex);
+
+	DEBUG_TRACE("%s", "HTTP2 session finished");
+
+	conn->http2.session = NULL;
+	purge_dynamic_header_table(conn, 0);
+	hpack_enc_table_purge(session, 0);
+	pthread_cond_destroy(&session->cond);
+	pthread_mutex_destroy(&session->mutex);
+	mg_free(session->frame_buf);
+	mg_free(session->hdr_block);
+	mg_free(session->send_buf);
+	mg_free(session);
+}
+
+
+static void
+process_new_http2_connection(struct mg_connection *conn)
+{
+	if (!is_valid_http2_primer(conn)) {
+		/* Primer does not match expectation from RFC.
+		 * See https://tools.ietf.org/html/rfc7540#section-3.5 */
+		DEBUG_TRACE("%s", "No valid HTTP2 primer");
+		mg_send_http_error(conn, 400, "%s", "Invalid HTTP/2 primer");
+
+	} else {
+		/* Valid HTTP/2 primer received */
+		DEBUG_TRACE("%s", "Start handling HTTP2");
+		handle_http2(conn);
+	}
+}
+
+
+/* Check if a HTTP/1 request is the start of the HTTP/2 connection preface
+ * ("PRI * HTTP/2.0"), sent by a client with prior knowledge that the server
+ * supports cleartext HTTP/2 (h2c), see RFC 7540, Sec. 3.4. */
+static int
+is_http2_prior_knowledge(const struct mg_connection *conn)
+{
+	const struct mg_request_info *ri = &(conn->request_info);
+
+	if ((conn->ssl != NULL)
+	    || mg_strcasecmp(conn->dom_ctx->config[ENABLE_HTTP2], "yes")) {
+		return 0;
+	}
+	return (ri->request_method != NULL) && !strcmp(ri->request_method, "PRI")
+	       && (ri->request_uri != NULL) && !strcmp(ri->request_uri, "*")
+	       && (ri->http_version != NULL) && !strcmp(ri->http_version, "2.0");
+}
+
+
+static void
+process_new_h2c_connection(struct mg_connection *conn)
+{
+	char buf[8];
+	size_t tail_len = http2_pri_len - 18; /* "SM\r\n\r\n" */
+
+	/* The HTTP/1 header pointers point into conn->buf, they are not
+	 * allocated like HTTP/2 headers. */
+	conn->request_info.num_headers = 0;
+	conn->protocol_type = PROTOCOL_TYPE_HTTP2;
+	conn->content_len = -1; /* read frames until the connection closes */
+	conn->consumed_content = 0;
+	conn->is_chunked = 0;
+
+	if ((mg_read(conn, buf, tail_len) != (int)tail_len)
+	    || (0 != memcmp(buf, http2_pri + 18, tail_len))) {
+		DEBUG_TRACE("%s", "No valid HTTP2 primer");
+		return;
+	}
+
+	DEBUG_TRACE("%s", "Start handling HTTP2 (h2c)");
+	handle_http2(conn);
 }
 
 
@@ -1752,9 +3279,9 @@ HPACK_TEST()
 		int l;
 
 		memcpy(in, &test, sizeof(test));
-		l = hpack_encode(out, in, 0);
+		l = (int)hpack_putstr(out, in, 0);
 		i = 0;
-		check = hpack_decode(out, &i, NULL);
+		check = hpack_decode(out, &i, l, NULL);
 
 		if (strcmp(in, check)) {
 			printf("Error\n");
@@ -1828,26 +3355,3 @@ HPACK_TABLE_TEST()
 
 }
 #endif
-
-
-static void
-process_new_http2_connection(struct mg_connection *conn)
-{
-	if (!is_valid_http2_primer(conn)) {
-		/* Primer does not match expectation from RFC.
-		 * See https://tools.ietf.org/html/rfc7540#section-3.5 */
-		DEBUG_TRACE("%s", "No valid HTTP2 primer");
-		mg_send_http_error(conn, 400, "%s", "Invalid HTTP/2 primer");
-
-	} else {
-		/* Valid HTTP/2 primer received */
-		DEBUG_TRACE("%s", "Start handling HTTP2");
-		handle_http2(conn);
-
-		/* Free memory allocated for headers, if not done yet */
-		DEBUG_TRACE("%s", "Free remaining HTTP2 header memory");
-		free_buffered_response_header_list(conn);
-		free_buffered_request_header_list(conn);
-		purge_dynamic_header_table(conn, 0);
-	}
-}
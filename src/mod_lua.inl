@@ -57,6 +57,9 @@ static const char lua_regkey_connlist = 2;
 static const char lua_regkey_lsp_include_history = 3;
 static const char lua_regkey_environment_type = 4;
 static const char lua_regkey_dtor = 5;
+static const char lua_regkey_globals = 6;
+static const char lua_regkey_chunks = 7;
+static const char lua_regkey_domain = 8;
 
 
 /* Limit nesting depth of mg.include.
@@ -368,8 +371,8 @@ lsp_connect(lua_State *L)
 	    && lua_isnumber(L, 3)) {
 
 		const char *host = lua_tostring(L, 1);
-		const int port = lua_tostring(L, 2);
-		const int is_ssl = lua_tostring(L, 3);
+		const int port = (int)lua_tointeger(L, 2);
+		const int is_ssl = (int)lua_tointeger(L, 3);
 
 		ok = connect_socket(
 		    NULL, host, port, is_ssl, ebuf, sizeof(ebuf), &sock, &sa);
@@ -2997,6 +3000,263 @@ prepare_lua_environment(struct mg_context *ctx,
 }
 
 
+/* Reusing Lua states (lua_reuse_states = yes):
+ * Creating a Lua state and preparing the "mg" library takes more time than
+ * running a typical script. Therefore every worker thread may keep one
+ * prepared state for Lua scripts and one for Lua server pages. The "mg"
+ * functions are bound to the connection object of the worker thread, which
+ * does not change. After every request, globals created by the script are
+ * removed and globals replaced by the script are restored. Contents of
+ * tables (e.g., "string" or "mg") are not restored. The init_lua and
+ * exit_lua callbacks are called once per state, not once per request. */
+static int
+lua_state_reusable(const struct mg_connection *conn)
+{
+	const struct mg_context *ctx = conn->phys_ctx;
+
+	if ((ctx->context_type != CONTEXT_SERVER) || (conn->dom_ctx == NULL)
+	    || (conn < ctx->worker_connections)
+	    || (conn >= ctx->worker_connections + ctx->cfg_worker_threads)) {
+		/* Not the connection object of a worker thread */
+		return 0;
+	}
+	return !mg_strcasecmp(conn->dom_ctx->config[LUA_REUSE_STATES], "yes");
+}
+
+
+static void
+lua_push_globals(lua_State *L)
+{
+#if LUA_VERSION_NUM > 501
+	lua_pushglobaltable(L);
+#else
+	lua_pushvalue(L, LUA_GLOBALSINDEX);
+#endif
+}
+
+
+/* Copy all globals into a table stored in the registry */
+static void
+lua_globals_snapshot(lua_State *L)
+{
+	lua_pushlightuserdata(L, (void *)&lua_regkey_globals);
+	lua_newtable(L);
+	lua_push_globals(L);
+	lua_pushnil(L);
+	while (lua_next(L, -2) != 0) {
+		lua_pushvalue(L, -2); /* key */
+		lua_insert(L, -2);    /* key, key, value */
+		lua_rawset(L, -5);    /* snapshot[key] = value */
+	}
+	lua_pop(L, 1); /* globals */
+	lua_settable(L, LUA_REGISTRYINDEX);
+}
+
+
+/* Remove globals not in the snapshot, restore globals from the snapshot */
+static void
+lua_globals_restore(lua_State *L)
+{
+	lua_settop(L, 0);
+	lua_pushlightuserdata(L, (void *)&lua_regkey_globals);
+	lua_gettable(L, LUA_REGISTRYINDEX); /* 1: snapshot */
+	lua_push_globals(L);                /* 2: globals */
+
+	lua_pushnil(L);
+	while (lua_next(L, 2) != 0) {
+		lua_pop(L, 1); /* value */
+		lua_pushvalue(L, -1);
+		lua_rawget(L, 1);
+		if (lua_isnil(L, -1)) {
+			/* New global: clearing existing fields is allowed in lua_next */
+			lua_pop(L, 1);
+			lua_pushvalue(L, -1);
+			lua_pushnil(L);
+			lua_rawset(L, 2);
+		} else {
+			lua_pop(L, 1);
+		}
+	}
+
+	lua_pushnil(L);
+	while (lua_next(L, 1) != 0) {
+		lua_pushvalue(L, -2); /* key */
+		lua_insert(L, -2);    /* key, key, value */
+		lua_rawset(L, 2);     /* globals[key] = value */
+	}
+	lua_settop(L, 0);
+}
+
+
+/* Update the request specific parts of the "mg" table in a reused state */
+static void
+lua_state_refresh(struct mg_connection *conn,
+                  lua_State *L,
+                  const char *script_name,
+                  int lua_env_type)
+{
+	lua_getglobal(L, "mg");
+	if (lua_istable(L, -1)) {
+		reg_string(L, "script_name", script_name);
+		prepare_lua_request_info(conn, L);
+		if (lua_env_type == LUA_ENV_TYPE_PLAIN_LUA_PAGE) {
+			prepare_lua_response_table(conn, L);
+		}
+	}
+	lua_pop(L, 1);
+
+	if (lua_env_type == LUA_ENV_TYPE_LUA_SERVER_PAGE) {
+		struct lsp_include_history *h;
+		lua_pushlightuserdata(L, (void *)&lua_regkey_lsp_include_history);
+		lua_gettable(L, LUA_REGISTRYINDEX);
+		h = (struct lsp_include_history *)lua_touserdata(L, -1);
+		if (h != NULL) {
+			memset(h, 0, sizeof(struct lsp_include_history));
+		}
+		lua_pop(L, 1);
+	}
+}
+
+
+/* Get a prepared Lua state for a server page or plain Lua script */
+static lua_State *
+lua_state_get(struct mg_connection *conn,
+              const char *script_name,
+              int lua_env_type)
+{
+	int idx = (lua_env_type == LUA_ENV_TYPE_LUA_SERVER_PAGE) ? 1 : 0;
+	int reusable = lua_state_reusable(conn);
+	lua_State *L = NULL;
+
+	if (reusable) {
+		L = (lua_State *)conn->lua_worker_state[idx];
+		conn->lua_worker_state[idx] = NULL;
+	}
+	if (L != NULL) {
+		/* Domain specific settings are stored in the state */
+		lua_pushlightuserdata(L, (void *)&lua_regkey_domain);
+		lua_gettable(L, LUA_REGISTRYINDEX);
+		if (lua_touserdata(L, -1) == (void *)conn->dom_ctx) {
+			lua_pop(L, 1);
+			lua_state_refresh(conn, L, script_name, lua_env_type);
+#if defined(USE_SERVER_STATS)
+			mg_atomic_inc(&(conn->phys_ctx->lua_states_reused));
+#endif
+			return L;
+		}
+		lua_close(L);
+	}
+
+	L = lua_newstate(lua_allocator, (void *)(conn->phys_ctx));
+	if (L == NULL) {
+		return NULL;
+	}
+	prepare_lua_environment(
+	    conn->phys_ctx, conn, NULL, L, script_name, lua_env_type);
+#if defined(USE_SERVER_STATS)
+	mg_atomic_inc(&(conn->phys_ctx->lua_states_created));
+#endif
+
+	if (reusable) {
+		lua_pushlightuserdata(L, (void *)&lua_regkey_domain);
+		lua_pushlightuserdata(L, (void *)conn->dom_ctx);
+		lua_settable(L, LUA_REGISTRYINDEX);
+		lua_pushlightuserdata(L, (void *)&lua_regkey_chunks);
+		lua_newtable(L);
+		lua_settable(L, LUA_REGISTRYINDEX);
+		lua_settop(L, 0);
+		lua_globals_snapshot(L);
+	}
+	return L;
+}
+
+
+/* Return a Lua state obtained by lua_state_get */
+static void
+lua_state_release(struct mg_connection *conn, lua_State *L, int lua_env_type)
+{
+	int idx = (lua_env_type == LUA_ENV_TYPE_LUA_SERVER_PAGE) ? 1 : 0;
+
+	if (!lua_state_reusable(conn) || (conn->lua_worker_state[idx] != NULL)) {
+		lua_close(L);
+		return;
+	}
+	lua_globals_restore(L);
+	conn->lua_worker_state[idx] = L;
+}
+
+
+/* Close the Lua states kept by a worker thread */
+static void
+lua_worker_states_close(struct mg_connection *conn)
+{
+	int i;
+	for (i = 0; i < 2; i++) {
+		if (conn->lua_worker_state[i] != NULL) {
+			lua_close((lua_State *)conn->lua_worker_state[i]);
+			conn->lua_worker_state[i] = NULL;
+		}
+	}
+}
+
+
+/* Load a Lua script file. Reused states keep the compiled script, as long
+ * as modification time and size of the file do not change. */
+static int
+lua_load_script(struct mg_connection *conn, lua_State *L, const char *path)
+{
+	struct mg_file_stat st;
+	char key[32];
+	int ret;
+
+	lua_pushlightuserdata(L, (void *)&lua_regkey_chunks);
+	lua_gettable(L, LUA_REGISTRYINDEX);
+	if (!lua_istable(L, -1) || !mg_stat(conn, path, &st)
+	    || (st.last_modified >= time(NULL))) {
+		/* Not a reused state, or file not found (report the error below).
+		 * A change in the same second as the stat call can not be detected,
+		 * so such a file is not cached. */
+		lua_pop(L, 1);
+		return luaL_loadfile(L, path);
+	}
+
+	mg_snprintf(conn,
+	            NULL, /* key buffer is big enough */
+	            key,
+	            sizeof(key),
+	            "%lx.%" UINT64_FMT,
+	            (unsigned long)st.last_modified,
+	            st.size);
+
+	/* chunks[path] = {version key, function} */
+	lua_getfield(L, -1, path);
+	if (lua_istable(L, -1)) {
+		lua_rawgeti(L, -1, 1);
+		if (lua_isstring(L, -1) && !strcmp(lua_tostring(L, -1), key)) {
+			lua_pop(L, 1);
+			lua_rawgeti(L, -1, 2);
+			lua_replace(L, -3); /* function, entry */
+			lua_pop(L, 1);
+			return 0;
+		}
+		lua_pop(L, 1);
+	}
+	lua_pop(L, 1);
+
+	ret = luaL_loadfile(L, path);
+	if (ret == 0) {
+		lua_newtable(L);
+		lua_pushstring(L, key);
+		lua_rawseti(L, -2, 1);
+		lua_pushvalue(L, -2);
+		lua_rawseti(L, -2, 2);
+		lua_setfield(L, -3, path); /* chunks, function */
+	}
+	lua_remove(L, -2); /* chunks */
+	return ret;
+}
+
+
 static void
 mg_exec_lua_script(struct mg_connection *conn,
                    const char *path,
@@ -3011,10 +3271,8 @@ mg_exec_lua_script(struct mg_connection *conn,
 
 	/* Execute a plain Lua script. */
 	if (path != NULL
-	    && (L = lua_newstate(lua_allocator, (void *)(conn->phys_ctx)))
+	    && (L = lua_state_get(conn, path, LUA_ENV_TYPE_PLAIN_LUA_PAGE))
 	           != NULL) {
-		prepare_lua_environment(
-		    conn->phys_ctx, conn, NULL, L, path, LUA_ENV_TYPE_PLAIN_LUA_PAGE);
 		lua_pushcclosure(L, &lua_error_handler, 0);
 
 		if (exports != NULL) {
@@ -3037,12 +3295,12 @@ mg_exec_lua_script(struct mg_connection *conn,
 #endif
 		}
 
-		if (luaL_loadfile(L, path) != 0) {
+		if (lua_load_script(conn, L, path) != 0) {
 			lua_error_handler(L);
 		} else {
 			lua_pcall(L, 0, 0, -2);
 		}
-		lua_close(L);
+		lua_state_release(conn, L, LUA_ENV_TYPE_PLAIN_LUA_PAGE);
 	}
 }
 
@@ -3120,8 +3378,9 @@ handle_lsp_request(struct mg_connection *conn,
 		/* We got a Lua state as argument. Use it! */
 		L = ls;
 	} else {
-		/* We need to create a Lua state. */
-		L = lua_newstate(lua_allocator, (void *)(conn->phys_ctx));
+		/* We need a Lua state with CivetWeb functions (e.g., the "mg"
+		 * library). */
+		L = lua_state_get(conn, path, LUA_ENV_TYPE_LUA_SERVER_PAGE);
 		if (L == NULL) {
 			/* We neither got a Lua state from the command line,
 			 * nor did we succeed in creating our own state.
@@ -3134,10 +3393,6 @@ handle_lsp_request(struct mg_connection *conn,
 
 			goto cleanup_handle_lsp_request;
 		}
-
-		/* New Lua state needs CivetWeb functions (e.g., the "mg" library). */
-		prepare_lua_environment(
-		    conn->phys_ctx, conn, NULL, L, path, LUA_ENV_TYPE_LUA_SERVER_PAGE);
 	}
 
 	/* Get LSP include history table */
@@ -3202,7 +3457,7 @@ handle_lsp_request(struct mg_connection *conn,
 cleanup_handle_lsp_request:
 
 	if (L != NULL && ls == NULL)
-		lua_close(L);
+		lua_state_release(conn, L, LUA_ENV_TYPE_LUA_SERVER_PAGE);
 	if (p != NULL)
 		munmap(p, filep->stat.size);
 	(void)mg_fclose(&filep->access);